@@ -0,0 +1,70 @@
+// android/app/src/main/cpp/lb_cpu.cpp
+#include "lb_cpu.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+uint32_t read_u32(const char * fmt, int cpu) {
+    char path[128];
+    std::snprintf(path, sizeof(path), fmt, cpu);
+    FILE * f = std::fopen(path, "r");
+    if (!f) return 0;
+    unsigned v = 0;
+    if (std::fscanf(f, "%u", &v) != 1) v = 0;
+    std::fclose(f);
+    return v;
+}
+
+} // namespace
+
+LbCpuTopology lb_cpu_topology() {
+    LbCpuTopology t;
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+    if (n <= 0) n = (long)std::thread::hardware_concurrency();
+    t.n_cpus = (int)std::clamp(n, 1L, 64L);  // masks are 64-bit
+    t.perf.assign((size_t)t.n_cpus, 0);
+
+    for (int c = 0; c < t.n_cpus; ++c) {
+        uint32_t v = read_u32("/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", c);
+        if (!v) v = read_u32("/sys/devices/system/cpu/cpu%d/cpu_capacity", c);
+        t.perf[(size_t)c] = v;
+    }
+
+    // group by performance value, fastest first
+    std::map<uint32_t, uint64_t, std::greater<uint32_t>> groups;
+    for (int c = 0; c < t.n_cpus; ++c) groups[t.perf[(size_t)c]] |= 1ULL << c;
+    if (groups.count(0) && groups.size() > 1) {
+        // unknown cores (offline, hidden) cannot be ranked: fold into the slowest
+        const uint64_t unknown = groups[0];
+        groups.erase(0);
+        groups.rbegin()->second |= unknown;
+    }
+    for (const auto & g : groups) t.clusters.push_back(g.second);
+    return t;
+}
+
+uint64_t lb_cpu_signature(const LbCpuTopology & topo) {
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    auto mix = [&](uint64_t v) {
+        for (int i = 0; i < 8; ++i) { h ^= (v >> (8 * i)) & 0xFF; h *= 0x100000001b3ULL; }
+    };
+    mix((uint64_t)topo.n_cpus);
+    for (uint32_t p : topo.perf) mix(p);
+    return h;
+}
+
+std::vector<uint64_t> lb_cpu_candidate_masks(const LbCpuTopology & topo) {
+    std::vector<uint64_t> out;
+    uint64_t acc = 0;
+    for (uint64_t c : topo.clusters) {
+        acc |= c;
+        out.push_back(acc);
+    }
+    if (out.empty()) out.push_back(topo.n_cpus >= 64 ? ~0ULL : ((1ULL << topo.n_cpus) - 1));
+    return out;
+}
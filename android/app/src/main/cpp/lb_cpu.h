@@ -0,0 +1,28 @@
+// android/app/src/main/cpp/lb_cpu.h
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// CPU topology as seen through sysfs. Phones are heterogeneous
+// (prime / big / LITTLE clusters); cores are grouped by their maximum
+// frequency, or by cpu_capacity when cpufreq is not exposed.
+struct LbCpuTopology {
+    int n_cpus = 0;
+    std::vector<uint32_t> perf;          // per cpu: max kHz or capacity; 0 = unknown
+    std::vector<uint64_t> clusters;      // cpu bitmasks, fastest cluster first
+
+    bool heterogeneous() const { return clusters.size() > 1; }
+};
+
+// Reads the topology once per call (cheap: a few small sysfs files).
+// Without sysfs information all cpus form one cluster.
+LbCpuTopology lb_cpu_topology();
+
+// Stable identity of the SoC layout (cpu count + per-cpu performance).
+uint64_t lb_cpu_signature(const LbCpuTopology & topo);
+
+// Affinity masks worth probing: the fastest cluster, then each slower
+// cluster added in turn. A single entry (all cpus) on homogeneous machines.
+std::vector<uint64_t> lb_cpu_candidate_masks(const LbCpuTopology & topo);
+
+inline int lb_cpu_count(uint64_t mask) { return __builtin_popcountll(mask); }
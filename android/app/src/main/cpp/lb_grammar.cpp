@@ -0,0 +1,695 @@
+// android/app/src/main/cpp/lb_grammar.cpp
+#include "lb_grammar.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+
+// ------------------------------- GBNF parser ------------------------------
+// llama.cpp's dialect: `name ::= alternatives`, one rule per line (newlines
+// are allowed inside parentheses and after `|`), "literals", [character
+// classes] with ranges and ^negation, `.`, ( groups ), and the postfix
+// operators * + ? {m} {m,} {m,n}. Repetitions become helper rules.
+class LbGbnfParser {
+public:
+    explicit LbGbnfParser(const char * src) : p_(src) {}
+
+    bool run(LbGrammar & g, const char * root, std::string * err);
+
+private:
+    using Seq = std::vector<LbGElem>;
+
+    static bool is_name_char(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+    }
+
+    bool fail(const char * msg) {
+        if (err_.empty()) {
+            err_ = msg;
+            if (*p_) { err_ += " at: "; err_.append(p_, strnlen(p_, 24)); }
+        }
+        return false;
+    }
+
+    uint32_t id_of(const std::string & name) {
+        auto it = ids_.find(name);
+        if (it != ids_.end()) return it->second;
+        const uint32_t id = (uint32_t)rules_.size();
+        ids_.emplace(name, id);
+        rules_.emplace_back();
+        defined_.push_back(false);
+        return id;
+    }
+
+    // A new helper rule named after the rule it was generated for.
+    uint32_t fresh(const std::string & base) {
+        for (;;) {
+            const std::string name = base + "-" + std::to_string(++n_fresh_);
+            if (!ids_.count(name)) {
+                const uint32_t id = id_of(name);
+                defined_[id] = true;
+                return id;
+            }
+        }
+    }
+
+    void space(bool newline_ok) {
+        for (;;) {
+            const char c = *p_;
+            if (c == ' ' || c == '\t' || ((c == '\n' || c == '\r') && newline_ok)) {
+                ++p_;
+            } else if (c == '#') {
+                while (*p_ && *p_ != '\n' && *p_ != '\r') ++p_;
+            } else {
+                return;
+            }
+        }
+    }
+
+    bool name(std::string & out) {
+        const char * s = p_;
+        while (is_name_char(*p_)) ++p_;
+        if (p_ == s) return fail("expected a rule name");
+        out.assign(s, (size_t)(p_ - s));
+        return true;
+    }
+
+    bool hex(int digits, uint32_t & cp) {
+        cp = 0;
+        for (int i = 0; i < digits; ++i) {
+            const char c = *p_;
+            uint32_t v;
+            if (c >= '0' && c <= '9')      v = (uint32_t)(c - '0');
+            else if (c >= 'a' && c <= 'f') v = (uint32_t)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') v = (uint32_t)(c - 'A' + 10);
+            else return fail("bad hex escape");
+            cp = cp << 4 | v;
+            ++p_;
+        }
+        return true;
+    }
+
+    // One character of a literal or class: an escape or a UTF-8 sequence.
+    bool character(uint32_t & cp) {
+        const unsigned char c = (unsigned char)*p_;
+        if (c == 0) return fail("unexpected end of grammar");
+        if (c == '\\') {
+            ++p_;
+            const char e = *p_++;
+            switch (e) {
+                case 'x': return hex(2, cp);
+                case 'u': return hex(4, cp);
+                case 'U': return hex(8, cp);
+                case 't': cp = '\t'; return true;
+                case 'r': cp = '\r'; return true;
+                case 'n': cp = '\n'; return true;
+                case '\\': case '"': case '[': case ']': case '-': case '/': case '\'':
+                    cp = (uint32_t)(unsigned char)e;
+                    return true;
+                default:
+                    --p_;
+                    return fail("unknown escape");
+            }
+        }
+        const int len = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0;
+        if (len == 0) return fail("invalid UTF-8");
+        cp = len == 1 ? c : c & (0x7Fu >> len);
+        ++p_;
+        for (int i = 1; i < len; ++i, ++p_) {
+            if (((unsigned char)*p_ & 0xC0) != 0x80) return fail("invalid UTF-8");
+            cp = cp << 6 | ((unsigned char)*p_ & 0x3F);
+        }
+        return true;
+    }
+
+    bool count(int & out) {
+        const char * s = p_;
+        long v = 0;
+        while (*p_ >= '0' && *p_ <= '9' && v < 100000) v = v * 10 + (*p_++ - '0');
+        if (p_ == s) return fail("expected a number");
+        out = (int)v;
+        return true;
+    }
+
+    static bool is_end(const LbGElem & e) { return e.type == LB_G_END || e.type == LB_G_ALT; }
+
+    // Applies {min, max} (max < 0: unbounded) to out[last:], the last symbol.
+    void repeat(Seq & out, size_t last, int min, int max, const std::string & rule) {
+        Seq sym(out.begin() + (std::ptrdiff_t)last, out.end());
+        out.resize(last);
+        if (!(sym.size() == 1 && sym[0].type == LB_G_RULE)) {
+            const uint32_t id = fresh(rule);
+            sym.push_back({LB_G_END, 0});
+            rules_[id] = sym;
+            sym.assign(1, {LB_G_RULE, id});
+        }
+        for (int i = 0; i < min; ++i) out.insert(out.end(), sym.begin(), sym.end());
+        if (max < 0) {
+            // R ::= sym R |
+            const uint32_t id = fresh(rule);
+            Seq body = sym;
+            body.push_back({LB_G_RULE, id});
+            body.push_back({LB_G_ALT, 0});
+            body.push_back({LB_G_END, 0});
+            rules_[id] = body;
+            out.push_back({LB_G_RULE, id});
+            return;
+        }
+        // R_k ::= sym R_(k-1) |   (R_1 ::= sym |)
+        uint32_t inner = 0;
+        for (int k = 1; k <= max - min; ++k) {
+            const uint32_t id = fresh(rule);
+            Seq body = sym;
+            if (k > 1) body.push_back({LB_G_RULE, inner});
+            body.push_back({LB_G_ALT, 0});
+            body.push_back({LB_G_END, 0});
+            rules_[id] = body;
+            inner = id;
+        }
+        if (max > min) out.push_back({LB_G_RULE, inner});
+    }
+
+    bool sequence(Seq & out, const std::string & rule, bool nested) {
+        size_t last = out.size();
+        bool have_sym = false;
+        for (;;) {
+            const char c = *p_;
+            if (c == '"') {
+                ++p_;
+                last = out.size();
+                while (*p_ != '"') {
+                    uint32_t cp;
+                    if (!character(cp)) return false;
+                    out.push_back({LB_G_CHAR, cp});
+                }
+                ++p_;
+                have_sym = true;
+            } else if (c == '[') {
+                ++p_;
+                last = out.size();
+                LbGType first = LB_G_CHAR;
+                if (*p_ == '^') { ++p_; first = LB_G_CHAR_NOT; }
+                bool any = false;
+                while (*p_ != ']') {
+                    uint32_t lo;
+                    if (!character(lo)) return false;
+                    out.push_back({any ? LB_G_CHAR_ALT : first, lo});
+                    any = true;
+                    if (p_[0] == '-' && p_[1] != ']' && p_[1] != '\0') {
+                        ++p_;
+                        uint32_t hi;
+                        if (!character(hi)) return false;
+                        out.push_back({LB_G_CHAR_UPPER, hi});
+                    }
+                }
+                if (!any) return fail("empty character class");
+                ++p_;
+                have_sym = true;
+            } else if (c == '.') {
+                ++p_;
+                last = out.size();
+                out.push_back({LB_G_CHAR_ANY, 0});
+                have_sym = true;
+            } else if (is_name_char(c)) {
+                std::string ref;
+                if (!name(ref)) return false;
+                last = out.size();
+                out.push_back({LB_G_RULE, id_of(ref)});
+                have_sym = true;
+            } else if (c == '(') {
+                ++p_;
+                space(true);
+                const uint32_t id = fresh(rule);
+                Seq body;
+                if (!alternatives(body, rule, true)) return false;
+                rules_[id] = std::move(body);
+                if (*p_ != ')') return fail("expected )");
+                ++p_;
+                last = out.size();
+                out.push_back({LB_G_RULE, id});
+                have_sym = true;
+            } else if (c == '*' || c == '+' || c == '?' || c == '{') {
+                if (!have_sym) return fail("repetition without a symbol");
+                int min = 0, max = -1;
+                ++p_;
+                if (c == '+') min = 1;
+                else if (c == '?') max = 1;
+                else if (c == '{') {
+                    space(false);
+                    if (!count(min)) return false;
+                    space(false);
+                    max = min;
+                    if (*p_ == ',') {
+                        ++p_;
+                        space(false);
+                        max = -1;
+                        if (*p_ >= '0' && *p_ <= '9' && !count(max)) return false;
+                        space(false);
+                    }
+                    if (*p_ != '}') return fail("expected }");
+                    ++p_;
+                    if (max >= 0 && max < min) return fail("bad repetition bounds");
+                }
+                repeat(out, last, min, max, rule);
+                have_sym = false;  // x** is not allowed
+            } else {
+                return true;
+            }
+            space(nested);
+        }
+    }
+
+    bool alternatives(Seq & out, const std::string & rule, bool nested) {
+        if (!sequence(out, rule, nested)) return false;
+        while (*p_ == '|') {
+            ++p_;
+            space(true);
+            out.push_back({LB_G_ALT, 0});
+            if (!sequence(out, rule, nested)) return false;
+        }
+        out.push_back({LB_G_END, 0});
+        return true;
+    }
+
+    bool rule() {
+        std::string n;
+        if (!name(n)) return false;
+        space(false);
+        if (std::strncmp(p_, "::=", 3) != 0) return fail("expected ::=");
+        p_ += 3;
+        space(true);
+        Seq body;
+        if (!alternatives(body, n, false)) return false;
+        const uint32_t id = id_of(n);
+        if (defined_[id]) return fail("rule defined twice");
+        rules_[id] = std::move(body);
+        defined_[id] = true;
+        if (*p_ == '\r') ++p_;
+        if (*p_ == '\n') ++p_;
+        else if (*p_) return fail("expected end of line");
+        return true;
+    }
+
+    // Rejects rules that can reach themselves before consuming a character,
+    // which would make stack expansion loop.
+    bool check_left_recursion() {
+        const size_t n = rules_.size();
+        std::vector<bool> nullable(n, false);
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t r = 0; r < n; ++r) {
+                if (nullable[r]) continue;
+                const Seq & s = rules_[r];
+                bool empty = true;  // of the current alternative
+                for (size_t i = 0; i < s.size(); ++i) {
+                    if (is_end(s[i])) {
+                        if (empty) { nullable[r] = true; changed = true; break; }
+                        empty = true;
+                        continue;
+                    }
+                    const bool consumes = s[i].type == LB_G_RULE ? !nullable[s[i].value]
+                                                                 : s[i].type != LB_G_CHAR_UPPER && s[i].type != LB_G_CHAR_ALT;
+                    if (consumes) empty = false;
+                }
+            }
+        }
+        // rules each rule can reach without consuming a character
+        std::vector<std::vector<uint32_t>> left(n);
+        for (size_t r = 0; r < n; ++r) {
+            const Seq & s = rules_[r];
+            bool open = true;  // still at the start of the current alternative
+            for (size_t i = 0; i < s.size(); ++i) {
+                if (is_end(s[i])) { open = true; continue; }
+                if (!open) continue;
+                if (s[i].type == LB_G_RULE) {
+                    left[r].push_back(s[i].value);
+                    open = nullable[s[i].value];
+                } else if (s[i].type != LB_G_CHAR_UPPER && s[i].type != LB_G_CHAR_ALT) {
+                    open = false;
+                }
+            }
+        }
+        // state: 0 unvisited, 1 on the DFS path, 2 done
+        std::vector<uint8_t> state(n, 0);
+        std::vector<std::pair<uint32_t, size_t>> todo;  // (rule, next edge)
+        for (uint32_t r0 = 0; r0 < n; ++r0) {
+            if (state[r0]) continue;
+            state[r0] = 1;
+            todo.assign(1, {r0, 0});
+            while (!todo.empty()) {
+                const uint32_t r = todo.back().first;
+                if (todo.back().second == left[r].size()) {
+                    state[r] = 2;
+                    todo.pop_back();
+                    continue;
+                }
+                const uint32_t k = left[r][todo.back().second++];
+                if (state[k] == 1) {
+                    err_ = "left recursion in the grammar";
+                    return false;
+                }
+                if (state[k] == 0) {
+                    state[k] = 1;
+                    todo.push_back({k, 0});
+                }
+            }
+        }
+        return true;
+    }
+
+    const char * p_;
+    std::unordered_map<std::string, uint32_t> ids_;
+    std::vector<Seq>  rules_;
+    std::vector<bool> defined_;
+    uint32_t          n_fresh_ = 0;
+    std::string       err_;
+};
+
+bool LbGbnfParser::run(LbGrammar & g, const char * root, std::string * err) {
+    bool ok = true;
+    for (space(true); ok && *p_; space(true)) ok = rule();
+    if (ok) {
+        for (const auto & kv : ids_) {
+            if (!defined_[kv.second]) { err_ = "undefined rule: " + kv.first; ok = false; break; }
+        }
+    }
+    const std::string start = root && root[0] ? root : "root";
+    if (ok && !ids_.count(start)) { err_ = "missing start rule: " + start; ok = false; }
+    if (ok) ok = check_left_recursion();
+    if (!ok) {
+        if (err) *err = err_;
+        return false;
+    }
+    g.rules_ = std::move(rules_);
+    g.root_  = ids_[start];
+    return true;
+}
+
+std::shared_ptr<const LbGrammar> LbGrammar::parse(const char * text, const char * root, std::string * err) {
+    if (!text) {
+        if (err) *err = "no grammar";
+        return nullptr;
+    }
+    auto g = std::make_shared<LbGrammar>();
+    LbGbnfParser p(text);
+    if (!p.run(*g, root, err)) return nullptr;
+    return g;
+}
+
+// -------------------------------- Vocab trie ------------------------------
+LbVocabTrie::LbVocabTrie(const llama_vocab * vocab) {
+    n_vocab_ = llama_vocab_n_tokens(vocab);
+    off_.resize((size_t)n_vocab_ + 1);
+    eog_.resize((size_t)n_vocab_);
+    std::vector<char> buf(256);
+    for (int32_t t = 0; t < n_vocab_; ++t) {
+        off_[(size_t)t] = (uint32_t)bytes_.size();
+        eog_[(size_t)t] = llama_vocab_is_eog(vocab, t) ? 1 : 0;
+        int32_t n = llama_token_to_piece(vocab, t, buf.data(), (int32_t)buf.size(), 0, false);
+        if (n < 0) {
+            buf.resize((size_t)-n);
+            n = llama_token_to_piece(vocab, t, buf.data(), (int32_t)buf.size(), 0, false);
+        }
+        if (n > 0) bytes_.insert(bytes_.end(), buf.data(), buf.data() + n);
+    }
+    off_[(size_t)n_vocab_] = (uint32_t)bytes_.size();
+
+    // control tokens have no piece; end-of-generation is decided separately
+    for (int32_t t = 0; t < n_vocab_; ++t) {
+        if (!eog_[(size_t)t] && off_[(size_t)t + 1] > off_[(size_t)t]) tok_ids_.push_back(t);
+    }
+    auto view = [this](llama_token t) {
+        return std::string_view(bytes_.data() + off_[(size_t)t], off_[(size_t)t + 1] - off_[(size_t)t]);
+    };
+    std::sort(tok_ids_.begin(), tok_ids_.end(),
+              [&](llama_token a, llama_token b) { return view(a) < view(b); });
+    nodes_.reserve(tok_ids_.size() * 2);
+    nodes_.push_back(Node{});
+    max_depth_ = build(0, 0, (uint32_t)tok_ids_.size(), 0);
+}
+
+// Fills node (whose tokens, tok_ids_[lo, hi), share `depth` leading bytes)
+// and its subtree; returns the subtree's depth.
+uint32_t LbVocabTrie::build(uint32_t node, uint32_t lo, uint32_t hi, uint32_t depth) {
+    auto len = [this](uint32_t i) { const llama_token t = tok_ids_[i]; return off_[(size_t)t + 1] - off_[(size_t)t]; };
+    auto at  = [this](uint32_t i, uint32_t d) { return (uint8_t)bytes_[off_[(size_t)tok_ids_[i]] + d]; };
+
+    uint32_t i = lo;
+    while (i < hi && len(i) == depth) ++i;  // shorter pieces sort first
+    nodes_[node].tok   = lo;
+    nodes_[node].n_tok = (uint16_t)(i - lo);
+
+    uint32_t groups = 0;
+    for (uint32_t j = i; j < hi; ++groups) {
+        const uint8_t b = at(j, depth);
+        while (j < hi && at(j, depth) == b) ++j;
+    }
+    const uint32_t first = (uint32_t)nodes_.size();
+    nodes_[node].child   = first;
+    nodes_[node].n_child = (uint16_t)groups;
+    nodes_.resize(nodes_.size() + groups);
+
+    uint32_t deepest = depth;
+    uint32_t k = first;
+    for (uint32_t j = i; j < hi; ++k) {
+        const uint8_t b = at(j, depth);
+        const uint32_t g0 = j;
+        while (j < hi && at(j, depth) == b) ++j;
+        nodes_[k].byte = b;
+        deepest = std::max(deepest, build(k, g0, j, depth + 1));
+    }
+    return deepest;
+}
+
+const char * LbVocabTrie::piece(llama_token t, int32_t * len) const {
+    if (t < 0 || t >= n_vocab_) { *len = 0; return nullptr; }
+    *len = (int32_t)(off_[(size_t)t + 1] - off_[(size_t)t]);
+    return bytes_.data() + off_[(size_t)t];
+}
+
+// ------------------------------ Grammar state -----------------------------
+namespace {
+
+inline bool is_end(const LbGElem * e) { return e->type == LB_G_END || e->type == LB_G_ALT; }
+
+// Whether `cp` is in the set starting at `pos`; *next gets the element after it.
+bool match_char(const LbGElem * pos, uint32_t cp, const LbGElem ** next) {
+    if (pos->type == LB_G_CHAR_ANY) { *next = pos + 1; return true; }
+    const bool positive = pos->type == LB_G_CHAR;
+    bool found = false;
+    do {
+        if (pos[1].type == LB_G_CHAR_UPPER) {
+            found = found || (pos->value <= cp && cp <= pos[1].value);
+            pos += 2;
+        } else {
+            found = found || pos->value == cp;
+            pos += 1;
+        }
+    } while (pos->type == LB_G_CHAR_ALT);
+    *next = pos;
+    return found == positive;
+}
+
+// Whether some code point in [low, high] (the completions of a partly
+// generated one) is in the set.
+bool match_partial(const LbGElem * pos, uint32_t low, uint32_t high) {
+    if (pos->type == LB_G_CHAR_ANY) return true;
+    const bool positive = pos->type == LB_G_CHAR;
+    do {
+        const uint32_t lo = pos->value;
+        uint32_t hi = lo;
+        if (pos[1].type == LB_G_CHAR_UPPER) { hi = pos[1].value; pos += 2; } else { pos += 1; }
+        if (positive ? (lo <= high && hi >= low) : (lo <= low && hi >= high)) return positive;
+    } while (pos->type == LB_G_CHAR_ALT);
+    return !positive;
+}
+
+} // namespace
+
+bool LbGrammarState::StackSet::contains(const Stack & s) const {
+    for (size_t i = 0; i < n; ++i) {
+        if (v[i] == s) return true;
+    }
+    return false;
+}
+
+void LbGrammarState::StackSet::add(const Stack & s) {
+    if (contains(s)) return;
+    if (n == v.size()) v.emplace_back();
+    v[n++].assign(s.begin(), s.end());
+}
+
+// Resolves rule references on top of `s` until every resulting stack has a
+// character set on top (or is empty: the text may end there).
+void LbGrammarState::expand(const Stack & s, StackSet & out) const {
+    if (s.empty()) { out.add(s); return; }
+    const LbGElem * pos = s.back();
+    if (pos->type != LB_G_RULE) { out.add(s); return; }
+
+    const LbGElem * alt = g_->rules()[pos->value].data();
+    Stack ns;
+    for (;;) {
+        ns.assign(s.begin(), s.end() - 1);
+        if (!is_end(pos + 1)) ns.push_back(pos + 1);
+        if (!is_end(alt)) ns.push_back(alt);
+        expand(ns, out);
+        while (!is_end(alt)) ++alt;
+        if (alt->type != LB_G_ALT) break;
+        ++alt;
+    }
+}
+
+void LbGrammarState::begin(std::shared_ptr<const LbGrammar> g) {
+    g_ = std::move(g);
+    stacks_.clear();
+    utf8_ = Utf8{};
+    if (!g_) return;
+    const LbGElem * alt = g_->rules()[g_->root()].data();
+    Stack s;
+    for (;;) {
+        s.clear();
+        if (!is_end(alt)) s.push_back(alt);
+        expand(s, stacks_);
+        while (!is_end(alt)) ++alt;
+        if (alt->type != LB_G_ALT) break;
+        ++alt;
+    }
+}
+
+bool LbGrammarState::can_end() const {
+    if (utf8_.remain != 0) return false;
+    for (size_t i = 0; i < stacks_.n; ++i) {
+        if (stacks_.v[i].empty()) return true;
+    }
+    return false;
+}
+
+bool LbGrammarState::can_continue() const {
+    for (size_t i = 0; i < stacks_.n; ++i) {
+        if (!stacks_.v[i].empty()) return true;
+    }
+    return false;
+}
+
+// Advances the stacks `in` (with partial code point `u`) over one byte.
+bool LbGrammarState::step(const StackSet & in, Utf8 u, uint8_t b, StackSet & out, Utf8 * u_out) const {
+    out.clear();
+    Utf8 nu = u;
+    uint32_t cp = 0;
+    bool complete = false;
+    if (u.remain == 0) {
+        if (b < 0x80)                { cp = b; complete = true; }
+        else if ((b & 0xE0) == 0xC0) { nu.value = b & 0x1Fu; nu.remain = 1; }
+        else if ((b & 0xF0) == 0xE0) { nu.value = b & 0x0Fu; nu.remain = 2; }
+        else if ((b & 0xF8) == 0xF0) { nu.value = b & 0x07u; nu.remain = 3; }
+        else return false;
+        nu.len = (int8_t)(nu.remain + 1);
+    } else {
+        if ((b & 0xC0) != 0x80) return false;
+        nu.value  = u.value << 6 | (b & 0x3Fu);
+        nu.remain = (int8_t)(u.remain - 1);
+        if (nu.remain == 0) { cp = nu.value; nu = Utf8{}; complete = true; }
+    }
+    *u_out = nu;
+
+    // Only shortest-form encodings of scalar values: an overlong one would
+    // let the model spell a character the grammar excludes, and a prefix
+    // that can only end in a surrogate (ED A0..BF) can never complete.
+    static const uint32_t k_min[] = {0, 0, 0x80, 0x800, 0x10000};
+    const uint32_t min_cp = k_min[u.remain == 0 ? nu.len : u.len];
+    if (!complete) {
+        const uint32_t low  = std::max(nu.value << (6 * nu.remain), min_cp);
+        const uint32_t high = std::min((nu.value << (6 * nu.remain)) | ((1u << (6 * nu.remain)) - 1), 0x10FFFFu);
+        if (low > high || (low >= 0xD800 && high <= 0xDFFF)) return false;
+        for (size_t i = 0; i < in.n; ++i) {
+            const Stack & s = in.v[i];
+            if (!s.empty() && match_partial(s.back(), low, high)) out.add(s);
+        }
+        return out.n > 0;
+    }
+    if (cp < min_cp || (cp >= 0xD800 && cp <= 0xDFFF)) return false;
+    Stack ns;
+    for (size_t i = 0; i < in.n; ++i) {
+        const Stack & s = in.v[i];
+        if (s.empty()) continue;
+        const LbGElem * next;
+        if (!match_char(s.back(), cp, &next)) continue;
+        ns.assign(s.begin(), s.end() - 1);
+        if (!is_end(next)) ns.push_back(next);
+        expand(ns, out);
+    }
+    return out.n > 0;
+}
+
+// Runs the piece of `t` through the grammar from the current state; the
+// resulting stacks end up in *out.
+bool LbGrammarState::walk(const LbVocabTrie & trie, llama_token t, StackSet * out, Utf8 * u_out) const {
+    int32_t len = 0;
+    const char * p = trie.piece(t, &len);
+    if (len <= 0) return false;
+    if (levels_.size() < 2) levels_.resize(2);
+    const StackSet * cur = &stacks_;
+    Utf8 u = utf8_;
+    for (int32_t i = 0; i < len; ++i) {
+        StackSet & nxt = levels_[(size_t)(i & 1)].set;
+        if (!step(*cur, u, (uint8_t)p[i], nxt, &u)) return false;
+        cur = &nxt;
+    }
+    if (out) {
+        out->clear();
+        for (size_t i = 0; i < cur->n; ++i) out->add(cur->v[i]);
+    }
+    *u_out = u;
+    return true;
+}
+
+bool LbGrammarState::allows(const LbVocabTrie & trie, llama_token t) const {
+    if (!g_) return true;
+    if (t < 0 || t >= trie.n_vocab()) return false;
+    if (trie.is_eog(t)) return can_end();
+    Utf8 u;
+    return walk(trie, t, nullptr, &u);
+}
+
+bool LbGrammarState::accept(const LbVocabTrie & trie, llama_token t) {
+    if (!g_) return true;
+    if (t < 0 || t >= trie.n_vocab()) return false;
+    if (trie.is_eog(t)) return can_end();
+    StackSet next;
+    Utf8 u;
+    if (!walk(trie, t, &next, &u)) return false;
+    std::swap(stacks_, next);
+    utf8_ = u;
+    return true;
+}
+
+void LbGrammarState::mask_node(const LbVocabTrie & trie, uint32_t node, uint32_t depth,
+                               std::vector<uint8_t> & allowed, int32_t * n_allowed) {
+    const StackSet & in = depth == 0 ? stacks_ : levels_[depth].set;
+    const Utf8       u  = depth == 0 ? utf8_   : levels_[depth].utf8;
+    const LbVocabTrie::Node & nd = trie.nodes_[node];
+    for (uint32_t k = 0; k < nd.n_child; ++k) {
+        const uint32_t child = nd.child + k;
+        const LbVocabTrie::Node & cn = trie.nodes_[child];
+        Level & next = levels_[depth + 1];
+        if (!step(in, u, cn.byte, next.set, &next.utf8)) continue;  // prunes the subtree
+        for (uint32_t j = 0; j < cn.n_tok; ++j) allowed[(size_t)trie.tok_ids_[cn.tok + j]] = 1;
+        *n_allowed += cn.n_tok;
+        mask_node(trie, child, depth + 1, allowed, n_allowed);
+    }
+}
+
+int32_t LbGrammarState::mask(const LbVocabTrie & trie, std::vector<uint8_t> & allowed) {
+    allowed.assign((size_t)trie.n_vocab(), 0);
+    if (!g_) { std::fill(allowed.begin(), allowed.end(), 1); return trie.n_vocab(); }
+    if (levels_.size() < trie.max_depth_ + 2) levels_.resize(trie.max_depth_ + 2);
+    int32_t n = 0;
+    mask_node(trie, 0, 0, allowed, &n);
+    if (can_end()) {
+        for (int32_t t = 0; t < trie.n_vocab(); ++t) {
+            if (trie.is_eog(t)) { allowed[(size_t)t] = 1; ++n; }
+        }
+    }
+    return n;
+}
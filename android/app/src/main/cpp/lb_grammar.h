@@ -0,0 +1,136 @@
+// android/app/src/main/cpp/lb_grammar.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <llama.h>
+
+// Constrained decoding: a GBNF grammar (llama.cpp's dialect) is compiled to
+// rules of element sequences and run as a set of pushdown stacks over
+// Unicode code points. The vocabulary is matched against it through a byte
+// trie of token pieces built once per model: walking the trie advances the
+// grammar one byte at a time, so pieces sharing a prefix share that work and
+// a dead prefix prunes every token below it.
+
+// Grammar element (same encoding as llama-grammar). A rule is a list of
+// alternatives, each a sequence of elements closed by ALT (more follow) or
+// END (last). A character set is CHAR / CHAR_NOT / CHAR_ANY followed by
+// optional CHAR_UPPER (range end) and CHAR_ALT (further members).
+enum LbGType : uint8_t {
+    LB_G_END = 0,
+    LB_G_ALT,
+    LB_G_RULE,        // value: rule id
+    LB_G_CHAR,        // value: code point
+    LB_G_CHAR_NOT,    // negated set
+    LB_G_CHAR_UPPER,  // value: inclusive end of the range begun by the previous element
+    LB_G_CHAR_ALT,    // value: another member of the set
+    LB_G_CHAR_ANY,    // any code point
+};
+
+struct LbGElem {
+    LbGType  type;
+    uint32_t value;
+};
+
+class LbGrammar {
+public:
+    // Compiles GBNF `text`, starting at rule `root` (null: "root"). Returns
+    // null and sets *err on syntax errors, undefined rules and left
+    // recursion.
+    static std::shared_ptr<const LbGrammar> parse(const char * text, const char * root, std::string * err);
+
+    const std::vector<std::vector<LbGElem>> & rules() const { return rules_; }
+    uint32_t root() const { return root_; }
+
+private:
+    std::vector<std::vector<LbGElem>> rules_;
+    uint32_t root_ = 0;
+    friend class LbGbnfParser;
+};
+
+// Token pieces of one vocabulary in a byte trie. Immutable once built;
+// shared by every context on the model.
+class LbVocabTrie {
+public:
+    explicit LbVocabTrie(const llama_vocab * vocab);
+
+    int32_t n_vocab() const { return n_vocab_; }
+    bool    is_eog(llama_token t) const { return eog_[(size_t)t] != 0; }
+    const char * piece(llama_token t, int32_t * len) const;
+
+private:
+    friend class LbGrammarState;
+    struct Node {
+        uint32_t child;     // first child; children are contiguous, sorted by byte
+        uint32_t tok;       // first of this node's tokens in tok_ids_
+        uint16_t n_child;
+        uint16_t n_tok;     // tokens whose piece ends here
+        uint8_t  byte;      // edge from the parent
+    };
+    uint32_t build(uint32_t node, uint32_t lo, uint32_t hi, uint32_t depth);
+
+    int32_t n_vocab_ = 0;
+    std::vector<char>        bytes_;     // all pieces back to back
+    std::vector<uint32_t>    off_;       // piece t is bytes_[off_[t], off_[t+1])
+    std::vector<uint8_t>     eog_;
+    std::vector<llama_token> tok_ids_;   // tokens sorted by piece
+    std::vector<Node>        nodes_;     // nodes_[0] is the root
+    uint32_t                 max_depth_ = 0;  // longest piece
+};
+
+// Where a grammar stands after the text generated so far: the live stacks
+// plus a code point whose UTF-8 bytes are only partly generated.
+class LbGrammarState {
+public:
+    using Stack = std::vector<const LbGElem *>;
+
+    void reset() { g_.reset(); stacks_.clear(); utf8_ = Utf8{}; }
+    void begin(std::shared_ptr<const LbGrammar> g);
+    bool active() const { return (bool)g_; }
+
+    // Whether the text may end here / continue at all.
+    bool can_end() const;
+    bool can_continue() const;
+
+    // Whether `t` keeps the text in the language (an EOG token iff can_end()).
+    bool allows(const LbVocabTrie & trie, llama_token t) const;
+    // Advances over `t`; false (state unchanged) if it is not allowed.
+    bool accept(const LbVocabTrie & trie, llama_token t);
+
+    // Sets allowed[t] to 1 for every token allows() accepts, 0 otherwise;
+    // returns how many were allowed.
+    int32_t mask(const LbVocabTrie & trie, std::vector<uint8_t> & allowed);
+
+    struct Utf8 {
+        uint32_t value  = 0;
+        int8_t   remain = 0;   // continuation bytes still expected
+        int8_t   len    = 0;   // bytes of the whole sequence
+    };
+
+private:
+    // Stack sets reused across calls (capacity kept).
+    struct StackSet {
+        std::vector<Stack> v;
+        size_t n = 0;
+        void clear() { n = 0; }
+        bool contains(const Stack & s) const;
+        void add(const Stack & s);
+    };
+    struct Level {
+        StackSet set;
+        Utf8     utf8;
+    };
+
+    void expand(const Stack & s, StackSet & out) const;
+    bool step(const StackSet & in, Utf8 u, uint8_t b, StackSet & out, Utf8 * u_out) const;
+    void mask_node(const LbVocabTrie & trie, uint32_t node, uint32_t depth,
+                   std::vector<uint8_t> & allowed, int32_t * n_allowed);
+    bool walk(const LbVocabTrie & trie, llama_token t, StackSet * out, Utf8 * u_out) const;
+
+    std::shared_ptr<const LbGrammar> g_;
+    StackSet stacks_;
+    Utf8     utf8_;
+    mutable std::vector<Level> levels_;  // per trie depth (mask) / per byte (walk)
+};
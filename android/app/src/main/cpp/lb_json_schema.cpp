@@ -0,0 +1,532 @@
+// android/app/src/main/cpp/lb_json_schema.cpp
+#include "lb_json_schema.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// ---------------------------------- JSON ----------------------------------
+struct JVal {
+    enum Type { NUL, BOOL, NUM, STR, ARR, OBJ } type = NUL;
+    bool        b = false;
+    std::string s;                                   // STR: text, NUM: source digits
+    std::vector<JVal> a;
+    std::vector<std::pair<std::string, JVal>> o;     // in document order
+
+    const JVal * get(const char * key) const {
+        if (type != OBJ) return nullptr;
+        for (const auto & kv : o) {
+            if (kv.first == key) return &kv.second;
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const char * p) : p_(p) {}
+
+    bool parse(JVal & out, std::string * err) {
+        ws();
+        bool ok = value(out, 0);
+        if (ok) { ws(); if (*p_) ok = fail("trailing characters"); }
+        if (!ok && err) *err = err_;
+        return ok;
+    }
+
+private:
+    bool fail(const char * msg) {
+        if (err_.empty()) err_ = std::string("schema is not valid JSON: ") + msg;
+        return false;
+    }
+
+    void ws() { while (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r') ++p_; }
+
+    static void put_utf8(std::string & out, uint32_t cp) {
+        if (cp < 0x80) { out += (char)cp; return; }
+        if (cp < 0x800) { out += (char)(0xC0 | cp >> 6); }
+        else if (cp < 0x10000) { out += (char)(0xE0 | cp >> 12); out += (char)(0x80 | (cp >> 6 & 0x3F)); }
+        else { out += (char)(0xF0 | cp >> 18); out += (char)(0x80 | (cp >> 12 & 0x3F)); out += (char)(0x80 | (cp >> 6 & 0x3F)); }
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+
+    bool hex4(uint32_t & v) {
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = *p_++;
+            v <<= 4;
+            if (c >= '0' && c <= '9')      v |= (uint32_t)(c - '0');
+            else if (c >= 'a' && c <= 'f') v |= (uint32_t)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') v |= (uint32_t)(c - 'A' + 10);
+            else return fail("bad \\u escape");
+        }
+        return true;
+    }
+
+    bool string(std::string & out) {
+        ++p_;  // opening quote
+        for (;;) {
+            const char c = *p_++;
+            if (c == '"') return true;
+            if (c == '\0' || (unsigned char)c < 0x20) return fail("unterminated string");
+            if (c != '\\') { out += c; continue; }
+            const char e = *p_++;
+            switch (e) {
+                case '"': case '\\': case '/': out += e; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t cp;
+                    if (!hex4(cp)) return false;
+                    if (cp >= 0xDC00 && cp < 0xE000) return fail("unpaired surrogate");
+                    if (cp >= 0xD800 && cp < 0xDC00) {  // must be followed by a low surrogate
+                        if (p_[0] != '\\' || p_[1] != 'u') return fail("unpaired surrogate");
+                        p_ += 2;
+                        uint32_t lo;
+                        if (!hex4(lo)) return false;
+                        if (lo < 0xDC00 || lo >= 0xE000) return fail("unpaired surrogate");
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+                    put_utf8(out, cp);
+                    break;
+                }
+                default: return fail("bad escape");
+            }
+        }
+    }
+
+    bool value(JVal & v, int depth) {
+        if (depth > 64) return fail("nested too deeply");
+        const char c = *p_;
+        if (c == '{') {
+            ++p_;
+            v.type = JVal::OBJ;
+            ws();
+            if (*p_ == '}') { ++p_; return true; }
+            for (;;) {
+                if (*p_ != '"') return fail("expected a key");
+                std::string key;
+                if (!string(key)) return false;
+                ws();
+                if (*p_++ != ':') return fail("expected :");
+                ws();
+                v.o.emplace_back(std::move(key), JVal{});
+                if (!value(v.o.back().second, depth + 1)) return false;
+                ws();
+                if (*p_ == ',') { ++p_; ws(); continue; }
+                if (*p_++ == '}') return true;
+                return fail("expected , or }");
+            }
+        }
+        if (c == '[') {
+            ++p_;
+            v.type = JVal::ARR;
+            ws();
+            if (*p_ == ']') { ++p_; return true; }
+            for (;;) {
+                v.a.emplace_back();
+                if (!value(v.a.back(), depth + 1)) return false;
+                ws();
+                if (*p_ == ',') { ++p_; ws(); continue; }
+                if (*p_++ == ']') return true;
+                return fail("expected , or ]");
+            }
+        }
+        if (c == '"') { v.type = JVal::STR; return string(v.s); }
+        if (!strncmp(p_, "true", 4))  { p_ += 4; v.type = JVal::BOOL; v.b = true;  return true; }
+        if (!strncmp(p_, "false", 5)) { p_ += 5; v.type = JVal::BOOL; v.b = false; return true; }
+        if (!strncmp(p_, "null", 4))  { p_ += 4; v.type = JVal::NUL; return true; }
+        if (c == '-' || (c >= '0' && c <= '9')) {
+            const char * s = p_;
+            if (*p_ == '-') ++p_;
+            while ((*p_ >= '0' && *p_ <= '9') || *p_ == '.' || *p_ == 'e' || *p_ == 'E' || *p_ == '+' || *p_ == '-') ++p_;
+            v.type = JVal::NUM;
+            v.s.assign(s, (size_t)(p_ - s));
+            return true;
+        }
+        return fail("unexpected character");
+    }
+
+    const char * p_;
+    std::string  err_;
+};
+
+// Compact JSON text of `v` (what a const / enum value must be generated as).
+void to_json(const JVal & v, std::string & out) {
+    switch (v.type) {
+        case JVal::NUL:  out += "null"; break;
+        case JVal::BOOL: out += v.b ? "true" : "false"; break;
+        case JVal::NUM:  out += v.s; break;
+        case JVal::STR:
+            out += '"';
+            for (const char c : v.s) {
+                if (c == '"' || c == '\\') { out += '\\'; out += c; }
+                else if (c == '\n') out += "\\n";
+                else if (c == '\r') out += "\\r";
+                else if (c == '\t') out += "\\t";
+                else if ((unsigned char)c < 0x20) { char b[8]; snprintf(b, sizeof(b), "\\u%04x", c); out += b; }
+                else out += c;
+            }
+            out += '"';
+            break;
+        case JVal::ARR:
+            out += '[';
+            for (size_t i = 0; i < v.a.size(); ++i) { if (i) out += ','; to_json(v.a[i], out); }
+            out += ']';
+            break;
+        case JVal::OBJ:
+            out += '{';
+            for (size_t i = 0; i < v.o.size(); ++i) {
+                if (i) out += ',';
+                JVal k; k.type = JVal::STR; k.s = v.o[i].first;
+                to_json(k, out);
+                out += ':';
+                to_json(v.o[i].second, out);
+            }
+            out += '}';
+            break;
+    }
+}
+
+// ------------------------------ Schema → GBNF -----------------------------
+// Primitive rules, as in llama.cpp's converter: name, body, rules it uses.
+struct Prim { const char * name; const char * body; const char * deps[6]; };
+const Prim kPrims[] = {
+    {"space",          R"g(| " " | "\n" [ \t]{0,20})g",                                       {}},
+    {"boolean",        R"g(("true" | "false") space)g",                                       {"space"}},
+    {"null",           R"g("null" space)g",                                                   {"space"}},
+    {"char",           R"g([^"\\\x7F\x00-\x1F] | [\\] (["\\bfnrt] | "u" [0-9a-fA-F]{4}))g",   {}},
+    {"string",         R"g("\"" char* "\"" space)g",                                          {"char", "space"}},
+    {"integral-part",  R"g([0] | [1-9] [0-9]{0,15})g",                                        {}},
+    {"decimal-part",   R"g([0-9]{1,16})g",                                                    {}},
+    {"integer",        R"g(("-"? integral-part) space)g",                                     {"integral-part", "space"}},
+    {"number",         R"g(("-"? integral-part) ("." decimal-part)? ([eE] [-+]? integral-part)? space)g",
+                                                                                           {"integral-part", "decimal-part", "space"}},
+    {"value",          R"g(object | array | string | number | boolean | null)g",             {"object", "array", "string", "number", "boolean", "null"}},
+    {"object",         R"g("{" space ( string ":" space value ("," space string ":" space value)* )? "}" space)g",
+                                                                                           {"string", "value", "space"}},
+    {"array",          R"g("[" space ( value ("," space value)* )? "]" space)g",             {"value", "space"}},
+};
+
+std::string gbnf_literal(const std::string & text) {
+    std::string out = "\"";
+    for (const char c : text) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (c == '\n') out += "\\n";
+        else if (c == '\r') out += "\\r";
+        else if (c == '\t') out += "\\t";
+        else if ((unsigned char)c < 0x20) { char b[8]; snprintf(b, sizeof(b), "\\x%02X", c); out += b; }
+        else out += c;
+    }
+    return out + "\"";
+}
+
+std::string rule_name(const std::string & s) {
+    std::string out;
+    for (const char c : s) {
+        const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+        out += ok ? c : '-';
+    }
+    return out.empty() ? "r" : out;
+}
+
+class SchemaConverter {
+public:
+    explicit SchemaConverter(const JVal & root) : root_(root) {}
+
+    bool run(std::string * gbnf, std::string * err) {
+        std::string body;
+        const bool ok = visit(root_, "root", body);
+        if (ok) rules_["root"] = body;
+        if (!ok) {
+            if (err) *err = err_;
+            return false;
+        }
+        gbnf->clear();
+        for (const auto & kv : rules_) *gbnf += kv.first + " ::= " + kv.second + "\n";
+        return true;
+    }
+
+private:
+    bool fail(const std::string & msg) {
+        if (err_.empty()) err_ = msg;
+        return false;
+    }
+
+    std::string prim(const char * name) {
+        for (const Prim & p : kPrims) {
+            if (strcmp(p.name, name) != 0) continue;
+            if (!rules_.count(name)) {
+                rules_[name] = p.body;
+                for (const char * d : p.deps) if (d) prim(d);
+            }
+            break;
+        }
+        return name;
+    }
+
+    // Adds rule `name` (made unique unless the same body is already there).
+    std::string add_rule(const std::string & name, const std::string & body) {
+        const std::string base = rule_name(name);
+        std::string key = base;
+        for (int i = 1; rules_.count(key) && rules_[key] != body; ++i) key = base + std::to_string(i);
+        rules_[key] = body;
+        return key;
+    }
+
+    bool sub_rule(const JVal & s, const std::string & name, std::string & ref) {
+        std::string body;
+        if (!visit(s, name, body)) return false;
+        ref = add_rule(name, body);
+        return true;
+    }
+
+    bool resolve(const std::string & ref, const JVal ** out) {
+        if (ref.compare(0, 2, "#/") != 0) return fail("only local $ref is supported: " + ref);
+        const JVal * v = &root_;
+        size_t i = 2;
+        while (i <= ref.size()) {
+            size_t j = ref.find('/', i);
+            if (j == std::string::npos) j = ref.size();
+            std::string seg = ref.substr(i, j - i);
+            for (size_t k; (k = seg.find("~1")) != std::string::npos;) seg.replace(k, 2, "/");
+            for (size_t k; (k = seg.find("~0")) != std::string::npos;) seg.replace(k, 2, "~");
+            v = v->get(seg.c_str());
+            if (!v) return fail("unresolved $ref: " + ref);
+            i = j + 1;
+        }
+        *out = v;
+        return true;
+    }
+
+    bool visit(const JVal & s, const std::string & name, std::string & out) {
+        if (++depth_ > 64) return fail("schema nested too deeply");
+        const bool ok = visit_inner(s, name, out);
+        --depth_;
+        return ok;
+    }
+
+    bool visit_inner(const JVal & s, const std::string & name, std::string & out) {
+        if (s.type == JVal::BOOL && s.b) { out = prim("value"); return true; }
+        if (s.type != JVal::OBJ) return fail("schema must be an object");
+        if (s.o.empty()) { out = prim("value"); return true; }
+
+        if (const JVal * ref = s.get("$ref")) {
+            if (ref->type != JVal::STR) return fail("$ref must be a string");
+            auto it = refs_.find(ref->s);
+            if (it != refs_.end()) { out = it->second; return true; }
+            const JVal * target;
+            if (!resolve(ref->s, &target)) return false;
+            std::string rn = rule_name("ref-" + ref->s.substr(ref->s.rfind('/') + 1));
+            while (rules_.count(rn)) rn += "-";
+            rules_[rn] = "";  // reserved: recursive refs resolve to it
+            refs_[ref->s] = rn;
+            std::string body;
+            if (!visit(*target, rn, body)) return false;
+            rules_[rn] = body;
+            out = rn;
+            return true;
+        }
+        if (s.get("allOf")) return fail("allOf is not supported");
+
+        const JVal * alts = s.get("anyOf");
+        if (!alts) alts = s.get("oneOf");
+        if (alts) {
+            if (alts->type != JVal::ARR || alts->a.empty()) return fail("anyOf/oneOf must be a non-empty array");
+            out.clear();
+            for (size_t i = 0; i < alts->a.size(); ++i) {
+                std::string r;
+                if (!sub_rule(alts->a[i], name + "-" + std::to_string(i), r)) return false;
+                out += (i ? " | " : "") + r;
+            }
+            return true;
+        }
+        if (const JVal * c = s.get("const")) {
+            std::string j;
+            to_json(*c, j);
+            out = gbnf_literal(j) + " " + prim("space");
+            return true;
+        }
+        if (const JVal * e = s.get("enum")) {
+            if (e->type != JVal::ARR || e->a.empty()) return fail("enum must be a non-empty array");
+            out = "(";
+            for (size_t i = 0; i < e->a.size(); ++i) {
+                std::string j;
+                to_json(e->a[i], j);
+                out += (i ? " | " : "") + gbnf_literal(j);
+            }
+            out += ") " + prim("space");
+            return true;
+        }
+
+        const JVal * type = s.get("type");
+        if (type && type->type == JVal::ARR) {
+            out.clear();
+            for (size_t i = 0; i < type->a.size(); ++i) {
+                const JVal & t = type->a[i];
+                if (t.type != JVal::STR) return fail("type must be a string");
+                std::string body;
+                if (!visit_type(s, t.s, name + "-" + t.s, body)) return false;
+                out += (i ? " | " : "") + add_rule(name + "-" + t.s, body);
+            }
+            if (out.empty()) return fail("empty type list");
+            return true;
+        }
+        if (type && type->type != JVal::STR) return fail("type must be a string");
+        std::string t = type ? type->s : "";
+        if (t.empty()) {
+            if (s.get("properties")) t = "object";
+            else if (s.get("items") || s.get("prefixItems")) t = "array";
+            else { out = prim("value"); return true; }
+        }
+        return visit_type(s, t, name, out);
+    }
+
+    static int count(const JVal & s, const char * key, int def) {
+        const JVal * v = s.get(key);
+        return v && v->type == JVal::NUM ? atoi(v->s.c_str()) : def;
+    }
+
+    // {min, max} (max < 0: unbounded) copies of `item` separated by `sep`.
+    static std::string repetition(const std::string & item, const std::string & sep, int min, int max) {
+        if (max == 0) return "";
+        std::string rest = "(" + (sep.empty() ? "" : sep + " ") + item + ")";
+        const int lo = min > 0 ? min - 1 : 0;
+        const int hi = max < 0 ? -1 : max - 1;
+        if (hi == 0)       rest.clear();
+        else if (hi < 0)   rest += lo == 0 ? "*" : "{" + std::to_string(lo) + ",}";
+        else if (hi == lo) rest += "{" + std::to_string(lo) + "}";
+        else               rest += "{" + std::to_string(lo) + "," + std::to_string(hi) + "}";
+        std::string out = item + (rest.empty() ? "" : " " + rest);
+        return min == 0 ? "(" + out + ")?" : out;
+    }
+
+    bool visit_type(const JVal & s, const std::string & t, const std::string & name, std::string & out) {
+        if (t == "object") return object(s, name, out);
+        if (t == "array") {
+            const std::string sp = prim("space");
+            if (const JVal * tuple = s.get("prefixItems")) {
+                if (tuple->type != JVal::ARR) return fail("prefixItems must be an array");
+                out = "\"[\" " + sp;
+                for (size_t i = 0; i < tuple->a.size(); ++i) {
+                    std::string r;
+                    if (!sub_rule(tuple->a[i], name + "-" + std::to_string(i), r)) return false;
+                    out += (i ? " \",\" " + sp + " " : " ") + r;
+                }
+                out += " \"]\" " + sp;
+                return true;
+            }
+            std::string item = prim("value");
+            if (const JVal * items = s.get("items")) {
+                if (!sub_rule(*items, name + "-item", item)) return false;
+            }
+            const std::string body = repetition(item, "\",\" " + sp, count(s, "minItems", 0), count(s, "maxItems", -1));
+            out = "\"[\" " + sp + (body.empty() ? "" : " " + body) + " \"]\" " + sp;
+            return true;
+        }
+        if (t == "string") {
+            const int min = count(s, "minLength", 0), max = count(s, "maxLength", -1);
+            if (min == 0 && max < 0) { out = prim("string"); return true; }
+            std::string reps = "{" + std::to_string(min) + (max == min ? "" : "," + (max < 0 ? "" : std::to_string(max))) + "}";
+            out = "\"\\\"\" " + prim("char") + reps + " \"\\\"\" " + prim("space");
+            return true;
+        }
+        if (t == "number" || t == "integer" || t == "boolean" || t == "null") {
+            out = prim(t.c_str());
+            return true;
+        }
+        return fail("unsupported type: " + t);
+    }
+
+    // Required properties in schema order, then any subset of the optional
+    // ones in schema order, then (if allowed) further string keys.
+    bool object(const JVal & s, const std::string & name, std::string & out) {
+        const std::string sp = prim("space");
+        const JVal * props = s.get("properties");
+        const JVal * extra = s.get("additionalProperties");
+        if (!props || props->type != JVal::OBJ || props->o.empty()) {
+            if (extra && extra->type == JVal::BOOL && !extra->b) { out = "\"{\" " + sp + " \"}\" " + sp; return true; }
+            if (!extra || extra->type == JVal::BOOL) { out = prim("object"); return true; }
+        }
+        std::vector<std::string> required, optional;  // kv rule names
+        std::vector<std::string> opt_keys;
+        const JVal * req = s.get("required");
+        auto is_required = [&](const std::string & k) {
+            if (!req || req->type != JVal::ARR) return false;
+            for (const JVal & r : req->a) if (r.type == JVal::STR && r.s == k) return true;
+            return false;
+        };
+        if (props && props->type == JVal::OBJ) {
+            for (const auto & kv : props->o) {
+                std::string value;
+                if (!sub_rule(kv.second, name + "-" + kv.first, value)) return false;
+                JVal key; key.type = JVal::STR; key.s = kv.first;
+                std::string kj;
+                to_json(key, kj);
+                const std::string kv_rule = add_rule(name + "-" + kv.first + "-kv",
+                                                     gbnf_literal(kj) + " " + sp + " \":\" " + sp + " " + value);
+                if (is_required(kv.first)) {
+                    required.push_back(kv_rule);
+                } else {
+                    optional.push_back(kv_rule);
+                    opt_keys.push_back(kv.first);
+                }
+            }
+        }
+        if (extra && !(extra->type == JVal::BOOL && !extra->b)) {
+            std::string value = prim("value");
+            if (extra->type == JVal::OBJ && !sub_rule(*extra, name + "-additional", value)) return false;
+            optional.push_back(add_rule(name + "-additional-kv", prim("string") + " \":\" " + sp + " " + value));
+            opt_keys.push_back("*");
+        }
+
+        out = "\"{\" " + sp;
+        for (size_t i = 0; i < required.size(); ++i) out += (i ? " \",\" " + sp + " " : " ") + required[i];
+        if (!optional.empty()) {
+            // alternative i starts with optional[i]; the rest may follow in order
+            std::vector<std::string> rest(optional.size());
+            for (size_t i = optional.size(); i-- > 1;) {
+                std::string body = "( \",\" " + sp + " " + optional[i] + " )" + (opt_keys[i] == "*" ? "*" : "?");
+                if (i + 1 < optional.size()) body += " " + rest[i + 1];
+                rest[i] = add_rule(name + "-" + opt_keys[i - 1] + "-rest", body);
+            }
+            out += " (";
+            if (!required.empty()) out += " \",\" " + sp + " (";
+            for (size_t i = 0; i < optional.size(); ++i) {
+                std::string alt = optional[i];
+                if (opt_keys[i] == "*") alt += " ( \",\" " + sp + " " + optional[i] + " )*";
+                if (i + 1 < optional.size()) alt += " " + rest[i + 1];
+                out += (i ? " | " : " ") + alt;
+            }
+            if (!required.empty()) out += " )";
+            out += " )?";
+        }
+        out += " \"}\" " + sp;
+        return true;
+    }
+
+    const JVal & root_;
+    std::map<std::string, std::string> rules_;
+    std::map<std::string, std::string> refs_;  // $ref → rule name
+    std::string err_;
+    int depth_ = 0;
+};
+
+} // namespace
+
+bool lb_json_schema_to_gbnf(const char * schema, std::string * gbnf, std::string * err) {
+    if (!schema) {
+        if (err) *err = "no schema";
+        return false;
+    }
+    JVal root;
+    if (!JsonParser(schema).parse(root, err)) return false;
+    return SchemaConverter(root).run(gbnf, err);
+}
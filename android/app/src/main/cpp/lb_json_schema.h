@@ -0,0 +1,12 @@
+// android/app/src/main/cpp/lb_json_schema.h
+#pragma once
+#include <string>
+
+// Converts a JSON schema to a GBNF grammar (start rule "root") for the JSON
+// texts it accepts, following llama.cpp's json-schema-to-grammar. Covers the
+// subset tool calls and structured replies use: type (or a list of types),
+// properties / required / additionalProperties, items / prefixItems with
+// minItems / maxItems, enum, const, anyOf / oneOf, minLength / maxLength on
+// strings and local $ref (#/definitions/..., #/$defs/...). Other keywords
+// are ignored, except allOf and remote refs, which fail the conversion.
+bool lb_json_schema_to_gbnf(const char * schema, std::string * gbnf, std::string * err);
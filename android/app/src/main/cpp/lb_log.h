@@ -0,0 +1,19 @@
+// android/app/src/main/cpp/lb_log.h
+#pragma once
+
+// Logging shim: logcat on Android, stderr everywhere else (Linux desktop,
+// local profiling builds). Format strings must be literals.
+#if defined(__ANDROID__)
+#include <android/log.h>
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  "llama_bridge", __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, "llama_bridge", __VA_ARGS__)
+#else
+#include <cstdio>
+#define LB_LOG_(tag, ...) do {                        \
+        std::fprintf(stderr, "[llama_bridge] " tag " "); \
+        std::fprintf(stderr, __VA_ARGS__);             \
+        std::fputc('\n', stderr);                      \
+    } while (0)
+#define LOGI(...) LB_LOG_("I", __VA_ARGS__)
+#define LOGE(...) LB_LOG_("E", __VA_ARGS__)
+#endif
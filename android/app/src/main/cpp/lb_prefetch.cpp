@@ -0,0 +1,76 @@
+// android/app/src/main/cpp/lb_prefetch.cpp
+#include "lb_prefetch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "lb_log.h"
+
+namespace {
+
+constexpr int64_t kChunk = 16 << 20;  // bytes per readahead call
+
+std::mutex            g_mu;       // guards g_path
+std::string           g_path;     // file of the current run, "" none
+std::atomic<uint32_t> g_run{0};   // bumped per start/stop: older runs quit
+std::atomic<int64_t>  g_done{0};
+std::atomic<int64_t>  g_total{0};
+
+void run(int fd, uint32_t id, int64_t size) {
+    const auto t0 = std::chrono::steady_clock::now();
+    int64_t off = 0;
+    while (off < size && g_run.load(std::memory_order_relaxed) == id) {
+        const int64_t n = std::min(kChunk, size - off);
+        // readahead() queues the reads and returns once they are issued;
+        // the fadvise hint does the same where readahead is unsupported.
+        if (readahead(fd, (off64_t)off, (size_t)n) != 0) {
+            posix_fadvise(fd, (off_t)off, (off_t)n, POSIX_FADV_WILLNEED);
+        }
+        off += n;
+        if (g_run.load(std::memory_order_relaxed) == id) g_done.store(off, std::memory_order_relaxed);
+    }
+    close(fd);
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    LOGI("prefetch: %lld of %lld MB queued in %.0f ms%s", (long long)(off >> 20), (long long)(size >> 20), ms,
+         off < size ? " (stopped)" : "");
+}
+
+} // namespace
+
+bool lb_prefetch_file(const char * path) {
+    std::lock_guard<std::mutex> lock(g_mu);
+    const std::string p = path ? path : "";
+    if (!p.empty() && p == g_path) return true;
+
+    const uint32_t id = g_run.fetch_add(1) + 1;
+    g_path.clear();
+    if (p.empty()) return true;
+
+    const int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("prefetch: cannot open %s", p.c_str());
+        return false;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    g_path = p;
+    g_done.store(0);
+    g_total.store((int64_t)st.st_size);
+    std::thread(run, fd, id, (int64_t)st.st_size).detach();
+    return true;
+}
+
+void lb_prefetch_progress(int64_t * done, int64_t * total) {
+    if (done)  *done  = g_done.load(std::memory_order_relaxed);
+    if (total) *total = g_total.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,16 @@
+// android/app/src/main/cpp/lb_prefetch.h
+#pragma once
+#include <cstdint>
+
+// Page-cache prefetch of a model file before it is opened (e.g. while the
+// user is still picking a model), so the mmap'd load faults pages in from
+// memory instead of flash. One file at a time, read ahead in chunks on a
+// detached thread.
+
+// Starts prefetching `path`; a run for another file stops at its next
+// chunk. Null or "" only stops the current run; repeating the current path
+// does nothing. Returns false if the file cannot be opened.
+bool lb_prefetch_file(const char * path);
+
+// Bytes of the current (or last) run queued so far and the file size.
+void lb_prefetch_progress(int64_t * done, int64_t * total);
@@ -0,0 +1,211 @@
+// android/app/src/main/cpp/lb_prefix_cache.cpp
+#include "lb_prefix_cache.h"
+
+#include <algorithm>
+
+struct LbPrefixCache::Node {
+    std::vector<llama_token> edge;   // tokens from the parent to here; empty at a root
+    Node *   parent = nullptr;
+    std::unordered_map<llama_token, std::unique_ptr<Node>> kids;  // by first edge token
+    int32_t  depth = 0;              // tokens from the root through `edge`
+    Blob     blob;                   // snapshot of the prompt ending here, or null
+    uint64_t last_used = 0;
+};
+
+LbPrefixCache::LbPrefixCache() = default;
+LbPrefixCache::~LbPrefixCache() = default;
+
+void LbPrefixCache::configure(size_t budget_bytes, int32_t min_tokens) {
+    std::lock_guard<std::mutex> lock(mu_);
+    budget_     = budget_bytes;
+    min_tokens_ = std::max<int32_t>(1, min_tokens);
+    st_.budget  = (int64_t)budget_bytes;
+    if (budget_bytes == 0) {
+        roots_.clear();
+        entries_.clear();
+        st_.bytes = 0;
+        st_.entries = 0;
+        return;
+    }
+    while (st_.bytes > (int64_t)budget_bytes) evict_lru();
+}
+
+// Follows `toks` down from `root`. Returns the deepest node reached; every
+// entry below it shares the first *n_match tokens, which may end inside the
+// node's edge.
+LbPrefixCache::Node * LbPrefixCache::walk(Node * root, const llama_token * toks, int32_t n,
+                                          int32_t * n_match) const {
+    Node * node = root;
+    int32_t i = 0;
+    while (i < n) {
+        auto it = node->kids.find(toks[i]);
+        if (it == node->kids.end()) break;
+        Node * k = it->second.get();
+        const int32_t e = (int32_t)k->edge.size();
+        int32_t j = 1;
+        while (j < e && i + j < n && k->edge[(size_t)j] == toks[i + j]) ++j;
+        i += j;
+        node = k;
+        if (j < e) break;
+    }
+    *n_match = i;
+    return node;
+}
+
+// The entry with the fewest tokens under `sub` (cheapest to restore).
+LbPrefixCache::Node * LbPrefixCache::smallest(Node * sub) const {
+    Node * best = nullptr;
+    std::vector<Node *> todo{sub};
+    while (!todo.empty()) {
+        Node * x = todo.back();
+        todo.pop_back();
+        if (x->blob && (!best || x->depth < best->depth)) best = x;
+        for (auto & kv : x->kids) todo.push_back(kv.second.get());
+    }
+    return best;
+}
+
+bool LbPrefixCache::lookup(const llama_token * toks, int32_t n, uint64_t layout, Hit * out) {
+    *out = Hit{};
+    if (!enabled() || n < min_tokens()) return false;
+    std::lock_guard<std::mutex> lock(mu_);
+    st_.lookups++;
+    auto r = roots_.find(layout);
+    if (r == roots_.end()) return false;
+    int32_t m = 0;
+    Node * sub = walk(r->second.get(), toks, n, &m);
+    Node * e = m > 0 ? smallest(sub) : nullptr;
+    if (!e) return false;
+    e->last_used = ++tick_;
+    out->n_match  = m;
+    out->n_tokens = e->depth;
+    out->blob     = e->blob;
+    return true;
+}
+
+int32_t LbPrefixCache::covered(const llama_token * toks, int32_t n, uint64_t layout) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto r = roots_.find(layout);
+    if (r == roots_.end()) return 0;
+    int32_t m = 0;
+    Node * sub = walk(r->second.get(), toks, n, &m);
+    return m > 0 && smallest(sub) ? m : 0;
+}
+
+// Cuts k's edge after `at` tokens; the rest, with k's children and blob,
+// moves to a new single child.
+void LbPrefixCache::split(Node * k, int32_t at) {
+    std::unique_ptr<Node> tail(new Node());
+    tail->edge.assign(k->edge.begin() + at, k->edge.end());
+    tail->parent    = k;
+    tail->depth     = k->depth;
+    tail->blob      = std::move(k->blob);
+    tail->last_used = k->last_used;
+    tail->kids      = std::move(k->kids);
+    for (auto & kv : tail->kids) kv.second->parent = tail.get();
+    if (tail->blob) { entries_.erase(k); entries_.insert(tail.get()); }
+
+    k->edge.resize((size_t)at);
+    k->depth -= (int32_t)tail->edge.size();
+    k->kids.clear();
+    const llama_token first = tail->edge[0];
+    k->kids.emplace(first, std::move(tail));
+}
+
+void LbPrefixCache::insert(const llama_token * toks, int32_t n, uint64_t layout,
+                           std::vector<uint8_t> && data) {
+    if (n <= 0 || !fits(data.size())) return;
+    const int64_t size = (int64_t)data.size();
+    Blob blob = std::make_shared<const std::vector<uint8_t>>(std::move(data));
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!enabled()) return;
+
+    std::unique_ptr<Node> & root = roots_[layout];
+    if (!root) root.reset(new Node());
+    Node * node = root.get();
+    int32_t i = 0;
+    while (i < n) {
+        auto it = node->kids.find(toks[i]);
+        if (it == node->kids.end()) {
+            std::unique_ptr<Node> leaf(new Node());
+            leaf->edge.assign(toks + i, toks + n);
+            leaf->parent = node;
+            leaf->depth  = n;
+            Node * l = leaf.get();
+            node->kids.emplace(toks[i], std::move(leaf));
+            node = l;
+            break;
+        }
+        Node * k = it->second.get();
+        const int32_t e = (int32_t)k->edge.size();
+        int32_t j = 1;
+        while (j < e && i + j < n && k->edge[(size_t)j] == toks[i + j]) ++j;
+        if (j < e) split(k, j);
+        node = k;
+        i += j;
+    }
+
+    if (node->blob) st_.bytes -= (int64_t)node->blob->size();
+    node->blob      = std::move(blob);
+    node->last_used = ++tick_;
+    entries_.insert(node);
+    st_.bytes += size;
+
+    // shorter prompts on the path are restored just as well from this one
+    for (Node * p = node->parent; p && p->parent; p = p->parent) {
+        if (p->blob) drop(p);
+    }
+    // the new entry is the most recent, and fits on its own
+    while (st_.bytes > (int64_t)budget_.load()) evict_lru();
+    st_.entries = (int32_t)entries_.size();
+}
+
+void LbPrefixCache::evict_lru() {
+    Node * lru = nullptr;
+    for (Node * x : entries_) {
+        if (!lru || x->last_used < lru->last_used) lru = x;
+    }
+    if (!lru) return;
+    drop(lru);
+    st_.evictions++;
+    st_.entries = (int32_t)entries_.size();
+}
+
+void LbPrefixCache::drop(Node * x) {
+    st_.bytes -= (int64_t)x->blob->size();
+    x->blob.reset();
+    entries_.erase(x);
+    prune(x);
+}
+
+// Removes the empty leaves above `x` and merges a blob-less node with its
+// only child, so every inner node is a branch point or an entry.
+void LbPrefixCache::prune(Node * x) {
+    while (x->parent && !x->blob && x->kids.empty()) {
+        Node * p = x->parent;
+        p->kids.erase(x->edge[0]);
+        x = p;
+    }
+    if (!x->parent || x->blob || x->kids.size() != 1) return;
+    std::unique_ptr<Node> only = std::move(x->kids.begin()->second);
+    x->kids.clear();
+    x->edge.insert(x->edge.end(), only->edge.begin(), only->edge.end());
+    x->depth     = only->depth;
+    x->blob      = std::move(only->blob);
+    x->last_used = only->last_used;
+    x->kids      = std::move(only->kids);
+    for (auto & kv : x->kids) kv.second->parent = x;
+    if (x->blob) { entries_.erase(only.get()); entries_.insert(x); }
+}
+
+void LbPrefixCache::restored(int32_t n_tokens) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (n_tokens <= 0) return;
+    st_.hits++;
+    st_.tokens_restored += n_tokens;
+}
+
+LbPrefixCache::Stats LbPrefixCache::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return st_;
+}
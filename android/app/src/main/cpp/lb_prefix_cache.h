@@ -0,0 +1,82 @@
+// android/app/src/main/cpp/lb_prefix_cache.h
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <llama.h>
+
+// KV snapshots of earlier prompts in a radix tree keyed by their tokens, so
+// a prompt sharing a long prefix with *any* earlier one (system prompt, chat
+// template header, few-shot examples) restores that prefix instead of
+// decoding it. One cache per model, shared by its contexts.
+//
+// An entry is the llama_state_seq_get_data() blob of a whole prompt. A
+// lookup follows the prompt down the tree and returns the smallest entry
+// below the deepest point reached; the caller restores it and trims the
+// sequence back to the matched length. Inserting a prompt drops the entries
+// on its path (they are prefixes of it, so it covers them), and the least
+// recently used entries go once the blobs exceed the byte budget.
+class LbPrefixCache {
+public:
+    using Blob = std::shared_ptr<const std::vector<uint8_t>>;
+
+    struct Hit {
+        int32_t n_match  = 0;  // leading prompt tokens the blob holds
+        int32_t n_tokens = 0;  // tokens in the blob (>= n_match)
+        Blob    blob;
+    };
+
+    struct Stats {
+        int64_t bytes = 0;
+        int64_t budget = 0;
+        int64_t tokens_restored = 0;
+        int32_t entries = 0;
+        int32_t lookups = 0;
+        int32_t hits = 0;
+        int32_t evictions = 0;
+    };
+
+    LbPrefixCache();
+    ~LbPrefixCache();
+
+    // A zero budget disables the cache and drops every entry. Prompts shorter
+    // than `min_tokens` are neither stored nor looked up.
+    void    configure(size_t budget_bytes, int32_t min_tokens);
+    bool    enabled() const { return budget_.load(std::memory_order_relaxed) > 0; }
+    int32_t min_tokens() const { return min_tokens_.load(std::memory_order_relaxed); }
+    bool    fits(size_t bytes) const { return bytes <= budget_.load(std::memory_order_relaxed); }
+
+    // Entries are only matched against contexts with the same KV `layout`
+    // (cache types, V transposition), which llama needs to restore them.
+    bool    lookup(const llama_token * toks, int32_t n, uint64_t layout, Hit * out);
+    // Leading tokens of `toks` some entry already holds.
+    int32_t covered(const llama_token * toks, int32_t n, uint64_t layout) const;
+    void    insert(const llama_token * toks, int32_t n, uint64_t layout, std::vector<uint8_t> && data);
+
+    // Records the outcome of restoring a hit (0 tokens: llama refused it).
+    void    restored(int32_t n_tokens);
+    Stats   stats() const;
+
+private:
+    struct Node;
+
+    Node *  walk(Node * root, const llama_token * toks, int32_t n, int32_t * n_match) const;
+    Node *  smallest(Node * sub) const;
+    void    split(Node * k, int32_t at);
+    void    drop(Node * x);
+    void    prune(Node * x);
+    void    evict_lru();
+
+    mutable std::mutex mu_;
+    std::atomic<size_t>  budget_{0};
+    std::atomic<int32_t> min_tokens_{64};
+    std::unordered_map<uint64_t, std::unique_ptr<Node>> roots_;  // one tree per KV layout
+    std::unordered_set<Node *> entries_;                         // nodes holding a blob
+    uint64_t tick_ = 0;
+    Stats    st_;
+};
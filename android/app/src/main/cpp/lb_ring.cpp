@@ -0,0 +1,49 @@
+// android/app/src/main/cpp/lb_ring.cpp
+#include "lb_ring.h"
+
+#include <algorithm>
+#include <cstring>
+
+void LbRing::init(size_t capacity) {
+    size_t cap = 64;
+    while (cap < capacity) cap <<= 1;
+    buf_.assign(cap, 0);
+    mask_ = cap - 1;
+    reset();
+}
+
+void LbRing::put(size_t at, const void * src, size_t n) {
+    const size_t off   = at & mask_;
+    const size_t first = std::min(n, buf_.size() - off);
+    memcpy(buf_.data() + off, src, first);
+    memcpy(buf_.data(), (const char *)src + first, n - first);
+}
+
+void LbRing::get(size_t at, void * dst, size_t n) const {
+    const size_t off   = at & mask_;
+    const size_t first = std::min(n, buf_.size() - off);
+    memcpy(dst, buf_.data() + off, first);
+    memcpy((char *)dst + first, buf_.data(), n - first);
+}
+
+bool LbRing::push(const LbRingRec & rec, const char * text) {
+    const size_t need = sizeof(LbRingRec) + rec.len;
+    const size_t head = head_.load(std::memory_order_relaxed);
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    if (buf_.size() - (head - tail) < need) return false;
+    put(head, &rec, sizeof(LbRingRec));
+    if (rec.len > 0) put(head + sizeof(LbRingRec), text, rec.len);
+    head_.store(head + need, std::memory_order_release);
+    return true;
+}
+
+bool LbRing::pop(LbRingRec & rec, std::string & text) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    const size_t head = head_.load(std::memory_order_acquire);
+    if (head == tail) return false;
+    get(tail, &rec, sizeof(LbRingRec));
+    text.resize(rec.len);
+    if (rec.len > 0) get(tail + sizeof(LbRingRec), &text[0], rec.len);
+    tail_.store(tail + sizeof(LbRingRec) + rec.len, std::memory_order_release);
+    return true;
+}
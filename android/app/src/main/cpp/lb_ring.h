@@ -0,0 +1,46 @@
+// android/app/src/main/cpp/lb_ring.h
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Header of one stream update in the ring: the stream's state after a step
+// plus `len` bytes of new text that follow it.
+struct LbRingRec {
+    int64_t  port;            // Dart port the update goes to
+    int32_t  id;
+    int32_t  status;          // lb_stream_status
+    int32_t  prefill_done;
+    int32_t  prefill_total;
+    uint32_t len;
+};
+
+// Lock-free single-producer/single-consumer ring of LbRingRec + text
+// records. The generation thread pushes, the poster thread pops; neither
+// blocks the other. Records are written whole or not at all.
+class LbRing {
+public:
+    // Capacity is rounded up to a power of two. Call before any push/pop.
+    void init(size_t capacity);
+
+    // Producer. False when the record does not fit right now (or ever:
+    // records larger than the capacity are rejected).
+    bool push(const LbRingRec & rec, const char * text);
+
+    // Consumer. False when empty; otherwise `text` holds the record's bytes.
+    bool pop(LbRingRec & rec, std::string & text);
+
+    // Discards everything. Only while neither side is running.
+    void reset() { head_.store(0); tail_.store(0); }
+
+private:
+    void put(size_t at, const void * src, size_t n);
+    void get(size_t at, void * dst, size_t n) const;
+
+    std::vector<char> buf_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};  // next write (producer-owned)
+    alignas(64) std::atomic<size_t> tail_{0};  // next read (consumer-owned)
+};
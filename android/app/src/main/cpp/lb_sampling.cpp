@@ -0,0 +1,197 @@
+// android/app/src/main/cpp/lb_sampling.cpp
+#include "lb_sampling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "lb_simd.h"
+
+extern "C" __attribute__((visibility("default")))
+void lb_sampling_default_params(lb_sampling_params * out) {
+    if (!out) return;
+    out->temperature       = 0.8f;
+    out->top_k             = 40;
+    out->top_p             = 0.95f;
+    out->min_p             = 0.05f;
+    out->repeat_penalty    = 1.0f;
+    out->frequency_penalty = 0.0f;
+    out->presence_penalty  = 0.0f;
+    out->repeat_last_n     = 64;
+    out->seed              = LB_SEED_RANDOM;
+}
+
+void LbSampler::init(int32_t n_vocab, int32_t n_ctx) {
+    n_vocab_ = n_vocab;
+    n_ctx_   = std::max(1, n_ctx);
+    counts_.assign((size_t)n_vocab, 0);
+    ring_.assign((size_t)n_ctx_, 0);
+    ring_len_ = ring_head_ = 0;
+    const size_t cap = (size_t)std::max(LB_SAMPLING_MAX_CANDIDATES, 1);
+    cand_id_.resize(cap);
+    cand_logit_.resize(cap);
+    cand_w_.resize(cap);
+}
+
+void LbSampler::begin(const lb_sampling_params & params,
+                      const llama_token * prompt, int32_t n_prompt) {
+    p_ = params;
+
+    // drop the previous request's history without touching all of counts_
+    for (int32_t i = 0; i < ring_len_; ++i) {
+        const llama_token t = ring_[(size_t)((ring_head_ + i) % window_)];
+        if (t >= 0 && t < n_vocab_) counts_[(size_t)t] = 0;
+    }
+    ring_len_ = ring_head_ = 0;
+    window_ = p_.repeat_last_n < 0 ? n_ctx_ : std::min(p_.repeat_last_n, n_ctx_);
+
+    // Candidate buffers sized for this request's top_k here, never per token.
+    const size_t k = (size_t)std::min(p_.top_k, n_vocab_);
+    if (k > cand_id_.size()) {
+        cand_id_.resize(k); cand_logit_.resize(k); cand_w_.resize(k);
+    }
+
+    const uint32_t seed = p_.seed == LB_SEED_RANDOM ? std::random_device{}() : p_.seed;
+    rng_.seed(seed);
+
+    const bool penalize = p_.repeat_penalty != 1.0f || p_.frequency_penalty != 0.0f ||
+                          p_.presence_penalty != 0.0f;
+    if (penalize && window_ > 0 && prompt) {
+        for (int32_t i = std::max(0, n_prompt - window_); i < n_prompt; ++i) accept(prompt[i]);
+    }
+}
+
+void LbSampler::accept(llama_token tok) {
+    if (window_ <= 0 || tok < 0 || tok >= n_vocab_) return;
+    if (ring_len_ == window_) {
+        const llama_token old = ring_[(size_t)ring_head_];
+        if (counts_[(size_t)old] > 0) counts_[(size_t)old]--;
+        ring_[(size_t)ring_head_] = tok;
+        ring_head_ = (ring_head_ + 1) % window_;
+    } else {
+        ring_[(size_t)((ring_head_ + ring_len_) % window_)] = tok;
+        ring_len_++;
+    }
+    if (counts_[(size_t)tok] < 0x7FFFu) counts_[(size_t)tok]++; // top bit: apply_penalties mark
+}
+
+void LbSampler::apply_penalties(float * logits) {
+    if (ring_len_ == 0) return;
+    if (p_.repeat_penalty == 1.0f && p_.frequency_penalty == 0.0f && p_.presence_penalty == 0.0f) return;
+
+    // Each distinct token once: mark its count with the top bit when applied,
+    // then clear the marks.
+    for (int32_t i = 0; i < ring_len_; ++i) {
+        const llama_token t = ring_[(size_t)((ring_head_ + i) % window_)];
+        const uint16_t c = counts_[(size_t)t];
+        if (c == 0 || (c & 0x8000u)) continue;
+        float & l = logits[t];
+        l = l <= 0.0f ? l * p_.repeat_penalty : l / p_.repeat_penalty;
+        l -= (float)c * p_.frequency_penalty + p_.presence_penalty;
+        counts_[(size_t)t] = (uint16_t)(0x8000u | c); // mark as applied
+    }
+    for (int32_t i = 0; i < ring_len_; ++i) {
+        const llama_token t = ring_[(size_t)((ring_head_ + i) % window_)];
+        counts_[(size_t)t] &= 0x7FFFu;
+    }
+}
+
+float LbSampler::next_uniform() {
+    // 24 random mantissa bits: identical sequence on every platform
+    return (float)(rng_() >> 8) * (1.0f / 16777216.0f);
+}
+
+// Candidates after top-k / top-p / min-p with temperature weights in
+// cand_w_ (unnormalized, summing to *total). Returns the candidate count,
+// 0 if top-k found none.
+int32_t LbSampler::weigh(const float * logits, float * total) {
+    // top-k (or the candidate cap): sorted, strongest first
+    int32_t k = p_.top_k > 0 ? p_.top_k : LB_SAMPLING_MAX_CANDIDATES;
+    k = std::min({k, n_vocab_, (int32_t)cand_id_.size()});  // sized by init/begin
+    int32_t n = lb_topk_f32(logits, n_vocab_, k, cand_id_.data(), cand_logit_.data());
+    if (n <= 0) return 0;
+
+    // softmax at T=1 over the candidates for the truncation stages
+    const float max_l = cand_logit_[0];
+    float sum = 0.0f;
+    for (int32_t i = 0; i < n; ++i) {
+        cand_w_[(size_t)i] = std::exp(cand_logit_[(size_t)i] - max_l);
+        sum += cand_w_[(size_t)i];
+    }
+
+    // top-p: smallest prefix whose mass reaches top_p
+    if (p_.top_p < 1.0f) {
+        const float target = p_.top_p * sum;
+        float cum = 0.0f;
+        int32_t keep = n;
+        for (int32_t i = 0; i < n; ++i) {
+            cum += cand_w_[(size_t)i];
+            if (cum >= target) { keep = i + 1; break; }
+        }
+        n = std::max(1, keep);
+    }
+
+    // min-p: relative to the most likely candidate (weight 1 after shift)
+    if (p_.min_p > 0.0f) {
+        int32_t keep = 1;
+        while (keep < n && cand_w_[(size_t)keep] >= p_.min_p) keep++;
+        n = keep;
+    }
+
+    // temperature
+    const float inv_t = 1.0f / p_.temperature;
+    float t = 0.0f;
+    for (int32_t i = 0; i < n; ++i) {
+        cand_w_[(size_t)i] = std::exp((cand_logit_[(size_t)i] - max_l) * inv_t);
+        t += cand_w_[(size_t)i];
+    }
+    *total = t;
+    return n;
+}
+
+llama_token LbSampler::sample(float * logits) {
+    apply_penalties(logits);
+    return resample(logits);
+}
+
+llama_token LbSampler::resample(const float * logits) {
+    if (greedy()) return (llama_token)lb_argmax_f32(logits, n_vocab_);
+
+    float total = 0.0f;
+    const int32_t n = weigh(logits, &total);
+    if (n <= 0) return (llama_token)lb_argmax_f32(logits, n_vocab_);
+
+    float u = next_uniform() * total;
+    for (int32_t i = 0; i < n; ++i) {
+        u -= cand_w_[(size_t)i];
+        if (u < 0.0f) return (llama_token)cand_id_[(size_t)i];
+    }
+    return (llama_token)cand_id_[(size_t)(n - 1)];
+}
+
+int32_t LbSampler::probs(float * logits, const int32_t ** ids, const float ** p) {
+    apply_penalties(logits);
+    float total = 0.0f;
+    int32_t n = greedy() ? 0 : weigh(logits, &total);
+    if (n <= 0) {
+        cand_id_[0] = lb_argmax_f32(logits, n_vocab_);
+        cand_w_[0]  = 1.0f;
+        n = 1;
+    } else {
+        const float inv = 1.0f / total;
+        for (int32_t i = 0; i < n; ++i) cand_w_[(size_t)i] *= inv;
+    }
+    *ids = cand_id_.data();
+    *p   = cand_w_.data();
+    return n;
+}
+
+int32_t LbSampler::draw(const float * w, int32_t n) {
+    float total = 0.0f;
+    for (int32_t i = 0; i < n; ++i) total += w[i];
+    float u = next_uniform() * total;
+    for (int32_t i = 0; i < n; ++i) {
+        u -= w[i];
+        if (u < 0.0f) return i;
+    }
+    return n - 1;
+}
@@ -0,0 +1,94 @@
+// android/app/src/main/cpp/lb_sampling.h
+#pragma once
+#include <cstdint>
+#include <random>
+#include <vector>
+#include <llama.h>
+
+// Seed value meaning "pick a random seed per request".
+#define LB_SEED_RANDOM 0xFFFFFFFFu
+
+// Candidate cap used when top_k is disabled (<= 0). Sampling always runs on
+// a pruned, sorted candidate set rather than the whole vocabulary.
+#define LB_SAMPLING_MAX_CANDIDATES 256
+
+// Plain C layout: bound as an ffi.Struct in lib/llm/llama_ffi.dart.
+// Fill with lb_sampling_default_params() and override fields.
+extern "C" {
+typedef struct lb_sampling_params {
+    float    temperature;       // <= 0: greedy argmax
+    int32_t  top_k;             // <= 0: disabled (LB_SAMPLING_MAX_CANDIDATES cap)
+    float    top_p;             // >= 1: disabled
+    float    min_p;             // <= 0: disabled
+    float    repeat_penalty;    // 1: disabled
+    float    frequency_penalty; // 0: disabled
+    float    presence_penalty;  // 0: disabled
+    int32_t  repeat_last_n;     // history window for penalties; -1 = n_ctx
+    uint32_t seed;              // LB_SEED_RANDOM: random per request
+} lb_sampling_params;
+}
+
+// Pipeline: penalties -> top-k -> top-p -> min-p -> temperature -> draw.
+// Penalties touch only the tokens in the history window; every later stage
+// works on at most max(top_k, LB_SAMPLING_MAX_CANDIDATES) candidates taken in
+// one vectorized pass (lb_topk_f32) into the sampler's own candidate buffers,
+// so a token costs one scan of the row and no heap allocation.
+class LbSampler {
+public:
+    // Allocates per-vocab buffers; call once per context.
+    void init(int32_t n_vocab, int32_t n_ctx);
+
+    // Starts a request. `prompt` seeds the penalty history. Allocates only
+    // when top_k exceeds every earlier request's candidate buffers.
+    void begin(const lb_sampling_params & params,
+               const llama_token * prompt, int32_t n_prompt);
+
+    // Picks the next token from a logits row. Penalties are applied to
+    // `logits` in place (the row is overwritten by the next decode anyway).
+    llama_token sample(float * logits);
+
+    // Draws again from a row sample() already penalized, e.g. after masking
+    // out tokens a grammar rejects (logit -INFINITY).
+    llama_token resample(const float * logits);
+
+    // The distribution sample() draws from: candidates strongest first and
+    // their probabilities (summing to 1). Greedy yields the argmax with p = 1.
+    // Penalties are applied to `logits` as in sample(). The pointers stay
+    // valid until the next call.
+    int32_t probs(float * logits, const int32_t ** ids, const float ** p);
+
+    // Index drawn from `n` non-negative weights (need not be normalized).
+    int32_t draw(const float * w, int32_t n);
+
+    // Records an emitted token in the penalty history.
+    void accept(llama_token tok);
+
+    const lb_sampling_params & params() const { return p_; }
+    bool greedy() const { return p_.temperature <= 0.0f; }
+
+    float next_uniform(); // [0, 1)
+
+private:
+    void apply_penalties(float * logits);
+    int32_t weigh(const float * logits, float * total);
+
+    lb_sampling_params p_{};
+    int32_t n_vocab_ = 0;
+    int32_t n_ctx_   = 0;
+    std::mt19937 rng_;
+
+    // penalty history: ring of the last `window_` tokens + per-token counts
+    std::vector<llama_token> ring_;
+    int32_t  window_ = 0;
+    int32_t  ring_len_ = 0;
+    int32_t  ring_head_ = 0;
+    std::vector<uint16_t> counts_;
+
+    // candidate scratch
+    std::vector<int32_t> cand_id_;
+    std::vector<float>   cand_logit_;
+    std::vector<float>   cand_w_;
+};
+
+extern "C" __attribute__((visibility("default")))
+void lb_sampling_default_params(lb_sampling_params * out);
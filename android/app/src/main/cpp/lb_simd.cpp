@@ -0,0 +1,397 @@
+// android/app/src/main/cpp/lb_simd.cpp
+#include "lb_simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define LB_HAVE_NEON 1
+#include <arm_neon.h>
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LB_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr float NEG_INF = -std::numeric_limits<float>::infinity();
+
+// Folds per-lane (value, index) candidates into `best`/`best_i` keeping the
+// lowest index on ties; each lane already holds its first occurrence.
+inline void merge_lanes(const float * v, const int32_t * idx, int n_lanes,
+                        float & best, int32_t & best_i) {
+    for (int j = 0; j < n_lanes; ++j) {
+        if (v[j] > best || (v[j] == best && idx[j] < best_i)) {
+            best = v[j]; best_i = idx[j];
+        }
+    }
+}
+
+// ------------------------------ Scalar -----------------------------------
+int32_t argmax_scalar(const float * x, int32_t n) {
+    int32_t best_i = 0;
+    float best = NEG_INF;
+    for (int32_t i = 0; i < n; ++i) {
+        if (x[i] > best) { best = x[i]; best_i = i; }
+    }
+    return best_i;
+}
+
+float max_scalar(const float * x, int32_t n) {
+    float m = NEG_INF;
+    for (int32_t i = 0; i < n; ++i) if (x[i] > m) m = x[i];
+    return m;
+}
+
+float dot_scalar(const float * a, const float * b, int32_t n) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    int32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];         s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2]; s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+// ------------------------------- NEON ------------------------------------
+#if defined(LB_HAVE_NEON)
+int32_t argmax_neon(const float * x, int32_t n) {
+    // four independent accumulators hide the compare->select latency
+    float32x4_t b0 = vdupq_n_f32(NEG_INF), b1 = b0, b2 = b0, b3 = b0;
+    const uint32_t lane[4] = {0, 1, 2, 3};
+    uint32x4_t i0 = vld1q_u32(lane);
+    uint32x4_t i1 = vaddq_u32(i0, vdupq_n_u32(4));
+    uint32x4_t i2 = vaddq_u32(i0, vdupq_n_u32(8));
+    uint32x4_t i3 = vaddq_u32(i0, vdupq_n_u32(12));
+    uint32x4_t k0 = i0, k1 = i1, k2 = i2, k3 = i3;
+    const uint32x4_t step = vdupq_n_u32(16);
+
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const float32x4_t v0 = vld1q_f32(x + i);
+        const float32x4_t v1 = vld1q_f32(x + i + 4);
+        const float32x4_t v2 = vld1q_f32(x + i + 8);
+        const float32x4_t v3 = vld1q_f32(x + i + 12);
+        const uint32x4_t g0 = vcgtq_f32(v0, b0);
+        const uint32x4_t g1 = vcgtq_f32(v1, b1);
+        const uint32x4_t g2 = vcgtq_f32(v2, b2);
+        const uint32x4_t g3 = vcgtq_f32(v3, b3);
+        b0 = vbslq_f32(g0, v0, b0); k0 = vbslq_u32(g0, i0, k0);
+        b1 = vbslq_f32(g1, v1, b1); k1 = vbslq_u32(g1, i1, k1);
+        b2 = vbslq_f32(g2, v2, b2); k2 = vbslq_u32(g2, i2, k2);
+        b3 = vbslq_f32(g3, v3, b3); k3 = vbslq_u32(g3, i3, k3);
+        i0 = vaddq_u32(i0, step); i1 = vaddq_u32(i1, step);
+        i2 = vaddq_u32(i2, step); i3 = vaddq_u32(i3, step);
+    }
+
+    float   bv[16];
+    int32_t bi[16];
+    vst1q_f32(bv, b0);      vst1q_f32(bv + 4, b1);
+    vst1q_f32(bv + 8, b2);  vst1q_f32(bv + 12, b3);
+    vst1q_u32((uint32_t *)bi, k0);      vst1q_u32((uint32_t *)bi + 4, k1);
+    vst1q_u32((uint32_t *)bi + 8, k2);  vst1q_u32((uint32_t *)bi + 12, k3);
+
+    float best = NEG_INF; int32_t best_i = 0;
+    merge_lanes(bv, bi, 16, best, best_i);
+    for (; i < n; ++i) if (x[i] > best) { best = x[i]; best_i = i; }
+    return best_i;
+}
+
+float max_neon(const float * x, int32_t n) {
+    float32x4_t m0 = vdupq_n_f32(NEG_INF), m1 = m0;
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // vmaxnmq ignores a quiet NaN operand, like the scalar `>` scan
+        m0 = vmaxnmq_f32(m0, vld1q_f32(x + i));
+        m1 = vmaxnmq_f32(m1, vld1q_f32(x + i + 4));
+    }
+    float m = vmaxnmvq_f32(vmaxnmq_f32(m0, m1));
+    for (; i < n; ++i) if (x[i] > m) m = x[i];
+    return m;
+}
+
+float dot_neon(const float * a, const float * b, int32_t n) {
+    float32x4_t s0 = vdupq_n_f32(0.0f), s1 = s0, s2 = s0, s3 = s0;
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = vfmaq_f32(s0, vld1q_f32(a + i),      vld1q_f32(b + i));
+        s1 = vfmaq_f32(s1, vld1q_f32(a + i + 4),  vld1q_f32(b + i + 4));
+        s2 = vfmaq_f32(s2, vld1q_f32(a + i + 8),  vld1q_f32(b + i + 8));
+        s3 = vfmaq_f32(s3, vld1q_f32(a + i + 12), vld1q_f32(b + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) s0 = vfmaq_f32(s0, vld1q_f32(a + i), vld1q_f32(b + i));
+    float s = vaddvq_f32(vaddq_f32(vaddq_f32(s0, s1), vaddq_f32(s2, s3)));
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+#endif
+
+// ------------------------------- x86 -------------------------------------
+#if defined(LB_HAVE_X86)
+__attribute__((target("avx2")))
+int32_t argmax_avx2(const float * x, int32_t n) {
+    __m256  b0 = _mm256_set1_ps(NEG_INF), b1 = b0;
+    __m256i i0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i i1 = _mm256_add_epi32(i0, _mm256_set1_epi32(8));
+    __m256i k0 = i0, k1 = i1;
+    const __m256i step = _mm256_set1_epi32(16);
+
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m256 v0 = _mm256_loadu_ps(x + i);
+        const __m256 v1 = _mm256_loadu_ps(x + i + 8);
+        const __m256 g0 = _mm256_cmp_ps(v0, b0, _CMP_GT_OQ);
+        const __m256 g1 = _mm256_cmp_ps(v1, b1, _CMP_GT_OQ);
+        b0 = _mm256_blendv_ps(b0, v0, g0);
+        b1 = _mm256_blendv_ps(b1, v1, g1);
+        k0 = _mm256_blendv_epi8(k0, i0, _mm256_castps_si256(g0));
+        k1 = _mm256_blendv_epi8(k1, i1, _mm256_castps_si256(g1));
+        i0 = _mm256_add_epi32(i0, step);
+        i1 = _mm256_add_epi32(i1, step);
+    }
+
+    alignas(32) float   bv[16];
+    alignas(32) int32_t bi[16];
+    _mm256_store_ps(bv, b0); _mm256_store_ps(bv + 8, b1);
+    _mm256_store_si256((__m256i *)bi, k0);
+    _mm256_store_si256((__m256i *)(bi + 8), k1);
+
+    float best = NEG_INF; int32_t best_i = 0;
+    merge_lanes(bv, bi, 16, best, best_i);
+    for (; i < n; ++i) if (x[i] > best) { best = x[i]; best_i = i; }
+    return best_i;
+}
+
+__attribute__((target("avx2")))
+float max_avx2(const float * x, int32_t n) {
+    // _mm256_max_ps returns the second operand when either is NaN, so keep
+    // the running max second to skip NaNs.
+    __m256 m0 = _mm256_set1_ps(NEG_INF), m1 = m0;
+    int32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        m0 = _mm256_max_ps(_mm256_loadu_ps(x + i),     m0);
+        m1 = _mm256_max_ps(_mm256_loadu_ps(x + i + 8), m1);
+    }
+    alignas(32) float t[8];
+    _mm256_store_ps(t, _mm256_max_ps(m0, m1));
+    float m = NEG_INF;
+    for (float v : t) if (v > m) m = v;
+    for (; i < n; ++i) if (x[i] > m) m = x[i];
+    return m;
+}
+
+__attribute__((target("avx2,fma")))
+float dot_avx2(const float * a, const float * b, int32_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+    int32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),      _mm256_loadu_ps(b + i),      s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),  _mm256_loadu_ps(b + i + 8),  s1);
+        s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), s2);
+        s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), s3);
+    }
+    for (; i + 8 <= n; i += 8) s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    alignas(32) float t[8];
+    _mm256_store_ps(t, _mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    float s = ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7]));
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+
+__attribute__((target("avx512f")))
+int32_t argmax_avx512(const float * x, int32_t n) {
+    __m512  b0 = _mm512_set1_ps(NEG_INF), b1 = b0;
+    __m512i i0 = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i i1 = _mm512_add_epi32(i0, _mm512_set1_epi32(16));
+    __m512i k0 = i0, k1 = i1;
+    const __m512i step = _mm512_set1_epi32(32);
+
+    int32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m512 v0 = _mm512_loadu_ps(x + i);
+        const __m512 v1 = _mm512_loadu_ps(x + i + 16);
+        const __mmask16 g0 = _mm512_cmp_ps_mask(v0, b0, _CMP_GT_OQ);
+        const __mmask16 g1 = _mm512_cmp_ps_mask(v1, b1, _CMP_GT_OQ);
+        b0 = _mm512_mask_blend_ps(g0, b0, v0);
+        b1 = _mm512_mask_blend_ps(g1, b1, v1);
+        k0 = _mm512_mask_blend_epi32(g0, k0, i0);
+        k1 = _mm512_mask_blend_epi32(g1, k1, i1);
+        i0 = _mm512_add_epi32(i0, step);
+        i1 = _mm512_add_epi32(i1, step);
+    }
+
+    alignas(64) float   bv[32];
+    alignas(64) int32_t bi[32];
+    _mm512_store_ps(bv, b0); _mm512_store_ps(bv + 16, b1);
+    _mm512_store_si512(bi, k0);
+    _mm512_store_si512(bi + 16, k1);
+
+    float best = NEG_INF; int32_t best_i = 0;
+    merge_lanes(bv, bi, 32, best, best_i);
+    for (; i < n; ++i) if (x[i] > best) { best = x[i]; best_i = i; }
+    return best_i;
+}
+
+__attribute__((target("avx512f")))
+float max_avx512(const float * x, int32_t n) {
+    __m512 m0 = _mm512_set1_ps(NEG_INF), m1 = m0;
+    int32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m512 v0 = _mm512_loadu_ps(x + i);
+        const __m512 v1 = _mm512_loadu_ps(x + i + 16);
+        m0 = _mm512_mask_mov_ps(m0, _mm512_cmp_ps_mask(v0, m0, _CMP_GT_OQ), v0);
+        m1 = _mm512_mask_mov_ps(m1, _mm512_cmp_ps_mask(v1, m1, _CMP_GT_OQ), v1);
+    }
+    m0 = _mm512_mask_mov_ps(m0, _mm512_cmp_ps_mask(m1, m0, _CMP_GT_OQ), m1);
+    alignas(64) float t[16];
+    _mm512_store_ps(t, m0);
+    float m = NEG_INF;
+    for (float v : t) if (v > m) m = v;
+    for (; i < n; ++i) if (x[i] > m) m = x[i];
+    return m;
+}
+
+__attribute__((target("avx512f")))
+float dot_avx512(const float * a, const float * b, int32_t n) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = s0;
+    int32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i),      s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+    }
+    if (i + 16 <= n) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+        i += 16;
+    }
+    float s = _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+#endif
+
+// ----------------------------- Dispatch ----------------------------------
+struct Kernels {
+    int32_t (*argmax)(const float *, int32_t);
+    float   (*max)(const float *, int32_t);
+    float   (*dot)(const float *, const float *, int32_t);
+    const char * name;
+};
+
+Kernels pick_kernels() {
+    const char * force = std::getenv("LB_SIMD");
+    if (force && !*force) force = nullptr;
+    const bool forced_scalar = force && std::strcmp(force, "scalar") == 0;
+    (void)forced_scalar;
+#if defined(LB_HAVE_NEON)
+    if (!forced_scalar) return { argmax_neon, max_neon, dot_neon, "neon" };
+#elif defined(LB_HAVE_X86)
+    __builtin_cpu_init();
+    const bool want512 = !force || std::strcmp(force, "avx512") == 0;
+    const bool want2   = !force || std::strcmp(force, "avx2") == 0 || want512;
+    if (want512 && __builtin_cpu_supports("avx512f")) {
+        return { argmax_avx512, max_avx512, dot_avx512, "avx512" };
+    }
+    if (want2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return { argmax_avx2, max_avx2, dot_avx2, "avx2" };
+    }
+#endif
+    return { argmax_scalar, max_scalar, dot_scalar, "scalar" };
+}
+
+const Kernels & kernels() {
+    static const Kernels k = pick_kernels();
+    return k;
+}
+
+// Min-heap for top-k over the caller's parallel ids/vals arrays, so no
+// scratch is needed. Entry `a` ranks below `b` when its value is smaller, or
+// equal with a higher id; the root is the weakest kept candidate.
+inline bool weaker(const float * v, const int32_t * id, int32_t a, int32_t b) {
+    return v[a] < v[b] || (v[a] == v[b] && id[a] > id[b]);
+}
+
+inline void heap_swap(float * v, int32_t * id, int32_t a, int32_t b) {
+    std::swap(v[a], v[b]);
+    std::swap(id[a], id[b]);
+}
+
+void sift_up(float * v, int32_t * id, int32_t i) {
+    while (i > 0) {
+        const int32_t parent = (i - 1) / 2;
+        if (!weaker(v, id, i, parent)) break;
+        heap_swap(v, id, i, parent);
+        i = parent;
+    }
+}
+
+void sift_down(float * v, int32_t * id, int32_t i, int32_t size) {
+    for (;;) {
+        const int32_t l = 2 * i + 1;
+        if (l >= size) break;
+        int32_t m = l;
+        if (l + 1 < size && weaker(v, id, l + 1, l)) m = l + 1;
+        if (!weaker(v, id, m, i)) break;
+        heap_swap(v, id, m, i);
+        i = m;
+    }
+}
+
+} // namespace
+
+int32_t lb_argmax_f32(const float * x, int32_t n) {
+    if (!x || n <= 0) return 0;
+    return kernels().argmax(x, n);
+}
+
+int32_t lb_topk_f32(const float * x, int32_t n, int32_t k, int32_t * ids, float * vals) {
+    if (!x || n <= 0 || k <= 0 || !ids || !vals) return 0;
+    if (k == 1) {
+        const int32_t i = lb_argmax_f32(x, n);
+        if (std::isnan(x[i])) return 0;
+        ids[0] = i; vals[0] = x[i];
+        return 1;
+    }
+    k = std::min(k, n);
+
+    // Min-heap of the k best so far, built in place in ids/vals. Blocks whose
+    // vector max cannot beat the heap root are skipped without a scalar
+    // pass; later ids never win ties, so `<=` is exact.
+    constexpr int32_t BLOCK = 64;
+    int32_t size = 0;
+
+    const Kernels & K = kernels();
+    for (int32_t b = 0; b < n; b += BLOCK) {
+        const int32_t len = std::min(BLOCK, n - b);
+        if (size == k && K.max(x + b, len) <= vals[0]) continue;
+        for (int32_t i = b; i < b + len; ++i) {
+            const float v = x[i];
+            if (std::isnan(v)) continue;
+            if (size < k) {
+                vals[size] = v; ids[size] = i;
+                sift_up(vals, ids, size++);
+            } else if (v > vals[0]) {
+                vals[0] = v; ids[0] = i;
+                sift_down(vals, ids, 0, size);
+            }
+        }
+    }
+
+    // Heap sort: moving each root (weakest) behind the shrinking heap leaves
+    // the strongest first.
+    for (int32_t end = size - 1; end > 0; --end) {
+        heap_swap(vals, ids, 0, end);
+        sift_down(vals, ids, 0, end);
+    }
+    return size;
+}
+
+float lb_dot_f32(const float * a, const float * b, int32_t n) {
+    if (!a || !b || n <= 0) return 0.0f;
+    return kernels().dot(a, b, n);
+}
+
+const char * lb_simd_isa() { return kernels().name; }
@@ -0,0 +1,24 @@
+// android/app/src/main/cpp/lb_simd.h
+#pragma once
+#include <cstdint>
+
+// Vectorized reductions over a logits row. The implementation is picked once
+// at first use: NEON on arm64, AVX-512F / AVX2 on x86-64 (runtime CPU check),
+// scalar otherwise. Set LB_SIMD=scalar|avx2|avx512 to force a variant.
+//
+// Ties resolve to the lowest index and NaNs are ignored, matching a plain
+// `if (v > best)` scan.
+
+// Index of the largest value in x[0..n); 0 when n == 0 or nothing beats -inf.
+int32_t lb_argmax_f32(const float * x, int32_t n);
+
+// The k largest values of x[0..n) in one pass, written to ids/vals in
+// descending order. Returns the number written (min(k, n), NaNs skipped).
+// ids/vals (k entries) double as the working heap: no allocation.
+int32_t lb_topk_f32(const float * x, int32_t n, int32_t k, int32_t * ids, float * vals);
+
+// Dot product of a[0..n) and b[0..n) (cosine similarity for unit vectors).
+float lb_dot_f32(const float * a, const float * b, int32_t n);
+
+// Name of the selected kernel ("neon", "avx512", "avx2", "scalar").
+const char * lb_simd_isa();
@@ -0,0 +1,167 @@
+// android/app/src/main/cpp/lb_state_file.cpp
+#include "lb_state_file.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lb_log.h"
+
+namespace {
+
+constexpr char     MAGIC[4] = {'L', 'B', 'K', 'V'};
+constexpr uint32_t VERSION  = 1;
+
+struct Header {
+    char     magic[4];
+    uint32_t version;
+    uint64_t model_id;
+    uint32_t n_ctx;
+    uint32_t n_tokens;
+    uint64_t state_size;
+};
+static_assert(sizeof(Header) == 32, "snapshot header layout");
+
+// Persists a rename in `path`'s directory; best effort.
+void fsync_dir_of(const char * path) {
+    std::string dir(path);
+    const size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// FNV-1a
+inline void mix(uint64_t & h, const void * p, size_t n) {
+    const unsigned char * b = (const unsigned char *)p;
+    for (size_t i = 0; i < n; ++i) { h ^= b[i]; h *= 0x100000001b3ULL; }
+}
+
+// Read-only mapping that unmaps itself.
+struct Mapping {
+    void * addr = MAP_FAILED;
+    size_t size = 0;
+    ~Mapping() { if (addr != MAP_FAILED) munmap(addr, size); }
+};
+
+} // namespace
+
+uint64_t lb_model_identity(const llama_model * model) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char desc[256] = {0};
+    llama_model_desc(model, desc, sizeof(desc));
+    mix(h, desc, std::strlen(desc));
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const uint64_t fields[] = {
+        llama_model_n_params(model),
+        llama_model_size(model),
+        (uint64_t)llama_vocab_n_tokens(vocab),
+        (uint64_t)llama_model_n_embd(model),
+        (uint64_t)llama_model_n_layer(model),
+        (uint64_t)llama_model_n_ctx_train(model),
+    };
+    mix(h, fields, sizeof(fields));
+    return h;
+}
+
+int32_t state_file_write(llama_context * ctx, uint64_t model_id, llama_seq_id seq,
+                         const std::vector<llama_token> & tokens, const char * path) {
+    const size_t state_size = llama_state_seq_get_size(ctx, seq);
+    const size_t tok_bytes  = tokens.size() * sizeof(llama_token);
+    const size_t total      = sizeof(Header) + tok_bytes + state_size;
+
+    const std::string tmp = std::string(path) + ".tmp";
+    const int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { LOGE("state: cannot create %s", tmp.c_str()); return LB_STATE_IO; }
+
+    // Serialize straight into the mapped file: no intermediate copy of what
+    // can be tens of MB of KV. The blocks are allocated up front: a store to
+    // a mapped page the disk has no room for raises SIGBUS, not an error.
+    int32_t rc = LB_STATE_IO;
+    const int frc = posix_fallocate(fd, 0, (off_t)total);
+    if (frc != 0) LOGE("state: cannot reserve %zu bytes for %s (%s)", total, tmp.c_str(), std::strerror(frc));
+    if (frc == 0) {
+        void * addr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            uint8_t * p = (uint8_t *)addr;
+            Header hdr{};
+            std::memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+            hdr.version    = VERSION;
+            hdr.model_id   = model_id;
+            hdr.n_ctx      = llama_n_ctx(ctx);
+            hdr.n_tokens   = (uint32_t)tokens.size();
+            hdr.state_size = state_size;
+            std::memcpy(p, &hdr, sizeof(hdr));
+            if (tok_bytes) std::memcpy(p + sizeof(hdr), tokens.data(), tok_bytes);
+
+            const size_t got = llama_state_seq_get_data(ctx, p + sizeof(hdr) + tok_bytes, state_size, seq);
+            rc = got == state_size ? LB_STATE_OK : LB_STATE_REJECTED;
+            if (rc == LB_STATE_OK && msync(addr, total, MS_SYNC) != 0) rc = LB_STATE_IO;
+            munmap(addr, total);
+        }
+    }
+    // On disk before the rename publishes it, so power loss cannot leave a
+    // renamed file with missing blocks.
+    if (rc == LB_STATE_OK && fsync(fd) != 0) rc = LB_STATE_IO;
+    close(fd);
+
+    if (rc == LB_STATE_OK && std::rename(tmp.c_str(), path) != 0) rc = LB_STATE_IO;
+    if (rc == LB_STATE_OK) fsync_dir_of(path);
+    if (rc != LB_STATE_OK) {
+        std::remove(tmp.c_str());
+        LOGE("state: save to %s failed (%d)", path, rc);
+        return rc;
+    }
+    LOGI("state: saved %zu tokens, %zu bytes -> %s", tokens.size(), total, path);
+    return LB_STATE_OK;
+}
+
+int32_t state_file_read(llama_context * ctx, uint64_t model_id, llama_seq_id seq,
+                        const char * path, std::vector<llama_token> & tokens) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return LB_STATE_IO;
+
+    Mapping map;
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+        map.size = (size_t)st.st_size;
+        map.addr = mmap(nullptr, map.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map.addr == MAP_FAILED) return map.size ? LB_STATE_IO : LB_STATE_STALE;
+    madvise(map.addr, map.size, MADV_SEQUENTIAL);
+
+    const uint8_t * p = (const uint8_t *)map.addr;
+    Header hdr;
+    std::memcpy(&hdr, p, sizeof(hdr));
+    const size_t tok_bytes = (size_t)hdr.n_tokens * sizeof(llama_token);
+    if (std::memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0 || hdr.version != VERSION ||
+        hdr.model_id != model_id ||
+        hdr.n_tokens > llama_n_ctx(ctx) ||
+        sizeof(Header) + tok_bytes + hdr.state_size != map.size) {
+        LOGI("state: %s is stale or from another model", path);
+        return LB_STATE_STALE;
+    }
+
+    llama_kv_self_seq_rm(ctx, seq, -1, -1);
+    tokens.clear();
+    const size_t used = llama_state_seq_set_data(ctx, p + sizeof(Header) + tok_bytes,
+                                                 (size_t)hdr.state_size, seq);
+    if (used == 0) {
+        llama_kv_self_seq_rm(ctx, seq, -1, -1);
+        LOGE("state: llama rejected %s", path);
+        return LB_STATE_REJECTED;
+    }
+
+    const llama_token * toks = (const llama_token *)(p + sizeof(Header));
+    tokens.assign(toks, toks + hdr.n_tokens);
+    LOGI("state: restored %u tokens from %s", hdr.n_tokens, path);
+    return LB_STATE_OK;
+}
@@ -0,0 +1,40 @@
+// android/app/src/main/cpp/lb_state_file.h
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <llama.h>
+
+// On-disk snapshot of one KV sequence plus the tokens it holds. A snapshot
+// can be restored into any sequence of a context on the same model.
+//
+//   header (magic "LBKV", version, model id, n_ctx, n_tokens, state size)
+//   llama_token[n_tokens]
+//   llama_state_seq_get_data() bytes
+//
+// Written into a preallocated temp file (a full disk fails the save with
+// LB_STATE_IO instead of faulting), synced, then renamed, so neither a crash
+// nor power loss leaves a torn snapshot; read through mmap so llama copies
+// straight from the page cache.
+
+// Stable 64-bit identity of a loaded model (architecture, sizes, vocab).
+// Snapshots from a different model or quantization are rejected on read.
+uint64_t lb_model_identity(const llama_model * model);
+
+// Return codes shared by state_file_write/state_file_read.
+enum {
+    LB_STATE_OK       =  0,
+    LB_STATE_IO       = -2, // missing, unreadable or unwritable file
+    LB_STATE_STALE    = -3, // wrong magic/version/model, or truncated
+    LB_STATE_REJECTED = -4, // llama refused the state (KV layout changed)
+};
+
+// `model_id` is lb_model_identity() of the context's model, mixed with
+// anything else the KV depends on (applied LoRA adapters); a snapshot only
+// reads back under the same id.
+int32_t state_file_write(llama_context * ctx, uint64_t model_id, llama_seq_id seq,
+                         const std::vector<llama_token> & tokens, const char * path);
+
+// On success `tokens` holds the restored sequence. On any failure after the
+// KV was touched, `seq` is cleared and `tokens` emptied.
+int32_t state_file_read(llama_context * ctx, uint64_t model_id, llama_seq_id seq,
+                        const char * path, std::vector<llama_token> & tokens);
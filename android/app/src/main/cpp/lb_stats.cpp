@@ -0,0 +1,87 @@
+// android/app/src/main/cpp/lb_stats.cpp
+#include "lb_stats.h"
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+#include <unistd.h>
+
+void LbLatencyHist::add(double ms) {
+    const double us = ms * 1000.0;
+    int b = us <= 1.0 ? 0 : (int)std::ceil(std::log2(us) * LB_HIST_PER_OCTAVE);
+    if (b >= LB_HIST_BUCKETS) b = LB_HIST_BUCKETS - 1;
+    counts[b]++;
+    total++;
+}
+
+void LbLatencyHist::merge(const LbLatencyHist & o) {
+    if (o.total == 0) return;
+    for (int i = 0; i < LB_HIST_BUCKETS; ++i) counts[i] += o.counts[i];
+    total += o.total;
+}
+
+float LbLatencyHist::quantile(double q) const {
+    if (total == 0) return 0.0f;
+    const uint64_t rank = (uint64_t)std::ceil(q * (double)total);
+    uint64_t seen = 0;
+    int b = 0;
+    for (; b < LB_HIST_BUCKETS - 1; ++b) {
+        seen += counts[b];
+        if (seen >= rank && seen > 0) break;
+    }
+    return (float)(std::exp2((double)b / LB_HIST_PER_OCTAVE) / 1000.0);
+}
+
+void LbStatsAcc::merge_into(LbStatsAcc & dst) const {
+    dst.tokenize_ms    += tokenize_ms;
+    dst.prefill_ms     += prefill_ms;
+    dst.sample_ms      += sample_ms;
+    dst.decode_ms      += decode_ms;
+    dst.detok_ms       += detok_ms;
+    dst.prefill_tokens += prefill_tokens;
+    dst.decode_tokens  += decode_tokens;
+    dst.requests       += requests;
+    dst.ttft_sum_ms    += ttft_sum_ms;
+    if (ttft_count > 0) dst.ttft_last_ms = ttft_last_ms;
+    dst.ttft_count     += ttft_count;
+    dst.token_ms.merge(token_ms);
+}
+
+int64_t lb_peak_rss_bytes() {
+    struct rusage ru{};
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return (int64_t)ru.ru_maxrss * 1024;  // kilobytes on Linux/Android
+}
+
+int64_t lb_mapped_rss_bytes(const char * path) {
+    // smaps names mappings by canonical path.
+    char real[PATH_MAX];
+    if (!path || !realpath(path, real)) return 0;
+    FILE * f = std::fopen("/proc/self/smaps", "r");
+    if (!f) return 0;
+    const size_t n = std::strlen(real);
+    int64_t kb = 0;
+    bool    in = false;  // inside an entry of `path`
+    char line[PATH_MAX + 128];
+    while (std::fgets(line, sizeof(line), f)) {
+        long long v = 0;
+        if (std::sscanf(line, "Rss: %lld kB", &v) == 1) {
+            if (in) kb += v;
+        } else if (std::strchr(line, '-') && std::strchr(line, '-') < std::strchr(line, ' ')) {
+            // Entry header: "start-end perms offset dev inode   path".
+            const char * p = std::strchr(line, '/');
+            in = p && std::strncmp(p, real, n) == 0 && (p[n] == '\n' || p[n] == '\0');
+        }
+    }
+    std::fclose(f);
+    return kb * 1024;
+}
+
+int64_t lb_physical_ram_bytes() {
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    const long page  = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page > 0 ? (int64_t)pages * page : 0;
+}
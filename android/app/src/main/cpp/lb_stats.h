@@ -0,0 +1,56 @@
+// android/app/src/main/cpp/lb_stats.h
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+// Log-spaced latency histogram: LB_HIST_PER_OCTAVE buckets per doubling
+// from 1 µs up to ~1 min. Adding a sample is one log2 and an increment;
+// quantiles are read off the bucket edges (within ~19%).
+#define LB_HIST_PER_OCTAVE 4
+#define LB_HIST_BUCKETS    (26 * LB_HIST_PER_OCTAVE)
+
+struct LbLatencyHist {
+    uint32_t counts[LB_HIST_BUCKETS] = {};
+    uint64_t total = 0;
+
+    void add(double ms);
+    void merge(const LbLatencyHist & o);
+    // Upper edge (ms) of the bucket holding quantile q in [0, 1]; 0 when empty.
+    float quantile(double q) const;
+};
+
+// Counters one context accumulates. The thread running requests adds to a
+// private copy and merges it into the published one once per step/token
+// (see stats_commit in llama_bridge.cpp), so readers never wait on a decode.
+struct LbStatsAcc {
+    double  tokenize_ms = 0.0;
+    double  prefill_ms  = 0.0;
+    double  sample_ms   = 0.0;
+    double  decode_ms   = 0.0;
+    double  detok_ms    = 0.0;
+    int64_t prefill_tokens = 0;
+    int64_t decode_tokens  = 0;
+    int32_t requests       = 0;
+    int32_t ttft_count     = 0;
+    double  ttft_sum_ms    = 0.0;
+    float   ttft_last_ms   = 0.0f;
+    LbLatencyHist token_ms;               // gaps between a stream's tokens
+
+    void merge_into(LbStatsAcc & dst) const;
+};
+
+// Process high-water resident set size in bytes (getrusage).
+int64_t lb_peak_rss_bytes();
+
+// Bytes of `path`'s file mappings currently in RAM (Rss summed over its
+// entries in /proc/self/smaps); 0 when it is not mapped.
+int64_t lb_mapped_rss_bytes(const char * path);
+
+// Installed RAM in bytes, 0 if unknown.
+int64_t lb_physical_ram_bytes();
+
+using LbClock = std::chrono::steady_clock;
+
+inline double lb_ms_since(LbClock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(LbClock::now() - t0).count();
+}
@@ -0,0 +1,152 @@
+// android/app/src/main/cpp/lb_stop.cpp
+#include "lb_stop.h"
+
+#include <algorithm>
+
+LbStopSet::LbStopSet(const std::vector<std::string> & strings, const std::vector<llama_token> & tokens)
+    : tokens_(tokens) {
+    std::sort(tokens_.begin(), tokens_.end());
+    tokens_.erase(std::unique(tokens_.begin(), tokens_.end()), tokens_.end());
+
+    // Trie of the strings; a zero entry means no child yet (the root is
+    // never a child).
+    nodes_.emplace_back();
+    Node * root = &nodes_[0];
+    std::fill(std::begin(root->next), std::end(root->next), 0u);
+    root->depth = root->match = 0;
+    for (const std::string & s : strings) {
+        if (s.empty()) continue;
+        uint32_t n = 0;
+        for (const char ch : s) {
+            const uint8_t b = (uint8_t)ch;
+            if (nodes_[n].next[b] == 0) {
+                Node k;
+                std::fill(std::begin(k.next), std::end(k.next), 0u);
+                k.depth = nodes_[n].depth + 1;
+                k.match = 0;
+                nodes_[n].next[b] = (uint32_t)nodes_.size();
+                nodes_.push_back(k);
+            }
+            n = nodes_[n].next[b];
+        }
+        nodes_[n].match = (uint32_t)s.size();
+    }
+
+    // Breadth-first: each node's failure link is the longest proper suffix
+    // of its string that is in the trie; missing edges are filled from it,
+    // which turns the trie into a full DFA. A node also matches what its
+    // failure link matches (the longest string wins: it starts earliest).
+    std::vector<uint32_t> fail(nodes_.size(), 0), queue;
+    queue.reserve(nodes_.size());
+    for (uint32_t b = 0; b < 256; ++b) {
+        if (nodes_[0].next[b] != 0) queue.push_back(nodes_[0].next[b]);
+    }
+    for (size_t qi = 0; qi < queue.size(); ++qi) {
+        const uint32_t u = queue[qi];
+        Node & nu = nodes_[u];
+        nu.match = std::max(nu.match, nodes_[fail[u]].match);
+        for (uint32_t b = 0; b < 256; ++b) {
+            const uint32_t v = nu.next[b];
+            const uint32_t f = nodes_[fail[u]].next[b];
+            if (v != 0) {
+                fail[v] = f;
+                queue.push_back(v);
+            } else {
+                nu.next[b] = f;
+            }
+        }
+    }
+}
+
+bool LbStopSet::is_stop_token(llama_token t) const {
+    return std::binary_search(tokens_.begin(), tokens_.end(), t);
+}
+
+void LbStopMatcher::begin(std::shared_ptr<const LbStopSet> set) {
+    reset();
+    if (set && !set->empty()) set_ = std::move(set);
+}
+
+bool LbStopMatcher::feed(const char * p, size_t n) {
+    if (stopped()) return true;
+    if (!set_) { fed_ += n; return false; }
+    const LbStopSet::Node * nodes = set_->nodes_.data();
+    uint32_t s = node_;
+    for (size_t i = 0; i < n; ++i) {
+        s = nodes[s].next[(uint8_t)p[i]];
+        if (nodes[s].match != 0) {
+            stop_at_ = fed_ + i + 1 - nodes[s].match;
+            node_ = s;
+            fed_ += i + 1;
+            return true;
+        }
+    }
+    node_ = s;
+    fed_ += n;
+    return false;
+}
+
+size_t LbStopMatcher::safe_end() const {
+    if (stopped()) return stop_at_;
+    return set_ ? fed_ - set_->nodes_[node_].depth : fed_;
+}
+
+// ---------------------------- Stream detok --------------------------------
+void LbStreamDetok::push(const llama_vocab * vocab, llama_token tok) {
+    char buf[128];
+    int32_t n;
+    if (n_tokens == 0) {
+        // First piece goes through llama_detokenize so it gets the same
+        // leading-space handling (add_space_prefix) as a full detok.
+        n = llama_detokenize(vocab, &tok, 1, buf, (int32_t)sizeof(buf), true, false);
+    } else {
+        n = llama_token_to_piece(vocab, tok, buf, (int32_t)sizeof(buf), 0, false);
+    }
+    n_tokens++;
+    if (n > 0) { text.append(buf, (size_t)n); return; }
+    if (n == 0) return;
+
+    std::string big((size_t)-n, '\0');
+    n = (n_tokens == 1)
+        ? llama_detokenize(vocab, &tok, 1, big.data(), (int32_t)big.size(), true, false)
+        : llama_token_to_piece(vocab, tok, big.data(), (int32_t)big.size(), 0, false);
+    if (n > 0) text.append(big.data(), (size_t)n);
+}
+
+size_t LbStreamDetok::complete_end() const {
+    const size_t n = text.size();
+    size_t i = n;
+    for (int k = 0; k < 4 && i > emitted; ++k) {
+        const unsigned char c = (unsigned char)text[--i];
+        if ((c & 0xC0) == 0x80) continue;            // continuation byte
+        const size_t need = c < 0x80          ? 1
+                          : (c & 0xE0) == 0xC0 ? 2
+                          : (c & 0xF0) == 0xE0 ? 3
+                          : (c & 0xF8) == 0xF0 ? 4 : 1;
+        return (n - i < need) ? i : n;
+    }
+    return n;
+}
+
+size_t LbStreamDetok::take(std::string & out, size_t limit) {
+    const size_t end = std::min(complete_end(), limit);
+    if (end <= emitted) return 0;
+    const size_t k = end - emitted;
+    out.append(text, emitted, k);
+    emitted = end;
+    return k;
+}
+
+bool lb_detok_step(LbStreamDetok & dt, LbStopMatcher & stop, const llama_vocab * vocab,
+                   llama_token tok, std::string & out) {
+    const size_t prev = dt.text.size();
+    dt.push(vocab, tok);
+    if (!stop.active()) { dt.take(out); return false; }
+    const bool hit = stop.feed(dt.text.data() + prev, dt.text.size() - prev);
+    dt.take(out, stop.safe_end());
+    return hit;
+}
+
+void lb_detok_flush(LbStreamDetok & dt, const LbStopMatcher & stop, std::string & out) {
+    if (!stop.stopped()) dt.take(out);
+}
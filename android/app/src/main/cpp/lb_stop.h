@@ -0,0 +1,90 @@
+// android/app/src/main/cpp/lb_stop.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <llama.h>
+
+// Stop sequences of a request: byte strings matched over the generated text
+// by one Aho-Corasick automaton, plus token ids. The automaton is a full
+// transition table (256 entries per node), so each generated byte costs one
+// lookup whatever the reply length or the number of strings.
+class LbStopSet {
+public:
+    // Empty strings are ignored.
+    LbStopSet(const std::vector<std::string> & strings, const std::vector<llama_token> & tokens);
+
+    bool empty() const { return nodes_.size() <= 1 && tokens_.empty(); }
+    bool is_stop_token(llama_token t) const;
+
+private:
+    friend class LbStopMatcher;
+    struct Node {
+        uint32_t next[256];
+        uint32_t depth;    // length of the string prefix this node spells
+        uint32_t match;    // longest stop string ending here, 0 none
+    };
+
+    std::vector<Node>        nodes_;   // nodes_[0] is the root
+    std::vector<llama_token> tokens_;  // sorted
+};
+
+// Progress of one generation through an LbStopSet. Bytes are fed as they
+// are generated; the tail that may still grow into a stop string is held
+// back, so a matched string is never released.
+class LbStopMatcher {
+public:
+    void reset() { set_.reset(); node_ = 0; fed_ = 0; stop_at_ = SIZE_MAX; }
+    void begin(std::shared_ptr<const LbStopSet> set);
+    bool active() const { return (bool)set_; }
+    bool stopped() const { return stop_at_ != SIZE_MAX; }
+    bool is_stop_token(llama_token t) const { return set_ && set_->is_stop_token(t); }
+
+    // Scans `n` more bytes. Returns true once a stop string has completed;
+    // later calls are no-ops.
+    bool feed(const char * p, size_t n);
+
+    // How much of the bytes fed may be released: up to the start of the
+    // matched string once stopped, otherwise all but the longest tail that
+    // is a prefix of a stop string.
+    size_t safe_end() const;
+
+private:
+    std::shared_ptr<const LbStopSet> set_;
+    uint32_t node_    = 0;
+    size_t   fed_     = 0;
+    size_t   stop_at_ = SIZE_MAX;
+};
+
+// Streaming detokenizer: converts one token per push() and releases only
+// complete UTF-8 sequences, so per-token cost does not grow with reply length.
+// `text` always equals llama_detokenize(gen, remove_special=true,
+// unparse_special=false) of the tokens pushed so far.
+struct LbStreamDetok {
+    std::string text;        // all bytes decoded so far (incl. a partial UTF-8 tail)
+    size_t      emitted = 0; // bytes already handed to the caller
+    int         n_tokens = 0;
+
+    void reset() { text.clear(); emitted = 0; n_tokens = 0; }
+    void push(const llama_vocab * vocab, llama_token tok);
+
+    // End of the longest prefix of `text` that does not stop inside a
+    // multi-byte sequence. Invalid bytes are passed through, never held.
+    size_t complete_end() const;
+
+    // Appends the newly completed bytes before `limit` to `out`; returns
+    // how many.
+    size_t take(std::string & out, size_t limit = SIZE_MAX);
+};
+
+// Converts `tok` and appends to `out` what may be released: complete UTF-8
+// that cannot be the start of a stop string. Returns true when a stop string
+// completed; nothing from its first byte on is released.
+bool lb_detok_step(LbStreamDetok & dt, LbStopMatcher & stop, const llama_vocab * vocab,
+                   llama_token tok, std::string & out);
+
+// Releases the tail held back for a stop string that will not come, once
+// generation ended for another reason.
+void lb_detok_flush(LbStreamDetok & dt, const LbStopMatcher & stop, std::string & out);
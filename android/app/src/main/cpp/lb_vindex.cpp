@@ -0,0 +1,227 @@
+// android/app/src/main/cpp/lb_vindex.cpp
+#include "lb_vindex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lb_log.h"
+#include "lb_simd.h"
+
+namespace {
+
+constexpr char     MAGIC[4]  = {'L', 'B', 'V', 'I'};
+constexpr uint32_t VERSION   = 1;
+constexpr int64_t  DEAD      = std::numeric_limits<int64_t>::min();  // tombstoned row's group
+constexpr uint64_t MIN_ROWS  = 256;                                  // first allocation
+
+void normalize_into(float * dst, const float * src, int32_t n) {
+    const float ss = lb_dot_f32(src, src, n);
+    const float inv = ss > 0.0f ? 1.0f / std::sqrt(ss) : 0.0f;
+    for (int32_t i = 0; i < n; ++i) dst[i] = src[i] * inv;
+}
+
+} // namespace
+
+struct LbVecIndex::Header {
+    char     magic[4];
+    uint32_t version;
+    int32_t  dim;
+    uint32_t reserved0;
+    uint64_t tag;
+    uint64_t count;    // rows written, tombstones included
+    uint64_t n_dead;
+    uint8_t  reserved[24];
+};
+
+uint8_t * LbVecIndex::row(uint64_t i) const {
+    return base_ + sizeof(Header) + i * stride_;
+}
+
+int32_t LbVecIndex::open(const char * path, int32_t dim, uint64_t tag) {
+    static_assert(sizeof(Header) == 64, "index header layout");
+    if (!path || dim <= 0) return LB_VINDEX_ARGS;
+    std::lock_guard<std::mutex> lock(mu_);
+    if (fd_ >= 0) return LB_VINDEX_ARGS;
+
+    fd_ = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) { LOGE("index: cannot open %s", path); return LB_VINDEX_IO; }
+    dim_    = dim;
+    stride_ = 2 * sizeof(int64_t) + (size_t)dim * sizeof(float);
+
+    struct stat st{};
+    if (fstat(fd_, &st) != 0) { ::close(fd_); fd_ = -1; return LB_VINDEX_IO; }
+    const size_t fsize = (size_t)st.st_size;
+    if (fsize == 0) {
+        if (!reserve(MIN_ROWS)) { ::close(fd_); fd_ = -1; return LB_VINDEX_IO; }
+        Header * h = header();
+        std::memcpy(h->magic, MAGIC, 4);
+        h->version = VERSION;
+        h->dim     = dim;
+        h->tag     = tag;
+        h->count   = 0;
+        h->n_dead  = 0;
+        LOGI("index: created %s (dim %d)", path, dim);
+        return LB_VINDEX_OK;
+    }
+
+    if (fsize < sizeof(Header)) { ::close(fd_); fd_ = -1; return LB_VINDEX_STALE; }
+    void * addr = mmap(nullptr, fsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) { ::close(fd_); fd_ = -1; return LB_VINDEX_IO; }
+    base_   = (uint8_t *)addr;
+    mapped_ = fsize;
+
+    const Header * h = header();
+    if (std::memcmp(h->magic, MAGIC, 4) != 0 || h->version != VERSION || h->dim != dim ||
+        h->tag != tag || sizeof(Header) + h->count * stride_ > fsize) {
+        LOGE("index: %s is stale (dim %d tag %llx)", path, h->dim, (unsigned long long)h->tag);
+        close();
+        return LB_VINDEX_STALE;
+    }
+    rows_.reserve((size_t)(h->count - h->n_dead));
+    for (uint64_t i = 0; i < h->count; ++i) {
+        RowKey k;
+        std::memcpy(&k, row(i), sizeof(k));
+        if (k.group != DEAD) rows_[k] = i;
+    }
+    LOGI("index: opened %s, %zu rows", path, rows_.size());
+    return LB_VINDEX_OK;
+}
+
+void LbVecIndex::close() {
+    if (base_) munmap(base_, mapped_);
+    if (fd_ >= 0) ::close(fd_);
+    base_ = nullptr; mapped_ = 0; fd_ = -1;
+    rows_.clear();
+}
+
+// Grows the file (doubling) and remaps so that `rows` rows fit. The blocks
+// are allocated up front: a sparse tail would turn a full disk into SIGBUS
+// on the first store through the mapping instead of an error here.
+bool LbVecIndex::reserve(uint64_t rows) {
+    const size_t need = sizeof(Header) + rows * stride_;
+    if (need <= mapped_) return true;
+    size_t size = std::max(need, sizeof(Header) + MIN_ROWS * stride_);
+    size = std::max(size, 2 * mapped_);
+    const int err = posix_fallocate(fd_, 0, (off_t)size);
+    if (err != 0) {
+        LOGE("index: cannot grow to %zu bytes: %s", size, strerror(err));
+        return false;
+    }
+    void * addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) return false;
+    if (base_) munmap(base_, mapped_);
+    base_   = (uint8_t *)addr;
+    mapped_ = size;
+    return true;
+}
+
+int32_t LbVecIndex::add(int32_t n, const int64_t * groups, const int64_t * keys, const float * vecs) {
+    if (n < 0 || (n > 0 && (!groups || !keys || !vecs))) return LB_VINDEX_ARGS;
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!base_) return LB_VINDEX_ARGS;
+    if (!reserve(header()->count + (uint64_t)n)) return LB_VINDEX_IO;
+
+    Header * h = header();
+    for (int32_t j = 0; j < n; ++j) {
+        const RowKey k{groups[j], keys[j]};
+        if (k.group == DEAD) continue;
+        const float * v = vecs + (size_t)j * (size_t)dim_;
+        auto it = rows_.find(k);
+        if (it != rows_.end()) {  // replace in place
+            normalize_into((float *)(row(it->second) + sizeof(RowKey)), v, dim_);
+            continue;
+        }
+        uint8_t * r = row(h->count);
+        std::memcpy(r, &k, sizeof(k));
+        normalize_into((float *)(r + sizeof(RowKey)), v, dim_);
+        rows_[k] = h->count;
+        h->count++;  // publish after the row is complete
+    }
+    return LB_VINDEX_OK;
+}
+
+int32_t LbVecIndex::remove_group(int64_t group) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!base_ || group == DEAD) return 0;
+    Header * h = header();
+    int32_t removed = 0;
+    for (auto it = rows_.begin(); it != rows_.end();) {
+        if (it->first.group != group) { ++it; continue; }
+        std::memcpy(row(it->second), &DEAD, sizeof(DEAD));
+        it = rows_.erase(it);
+        removed++;
+    }
+    h->n_dead += (uint64_t)removed;
+    if (h->n_dead >= MIN_ROWS && h->n_dead > h->count / 2) compact();
+    return removed;
+}
+
+// Slides live rows over the tombstones, keeping their order, then shrinks
+// the file to fit.
+void LbVecIndex::compact() {
+    Header * h = header();
+    uint64_t w = 0;
+    for (uint64_t i = 0; i < h->count; ++i) {
+        RowKey k;
+        std::memcpy(&k, row(i), sizeof(k));
+        if (k.group == DEAD) continue;
+        if (w != i) std::memmove(row(w), row(i), stride_);
+        rows_[k] = w++;
+    }
+    h->count  = w;
+    h->n_dead = 0;
+
+    // Give the freed tail back: keep whole MIN_ROWS blocks so the next few
+    // appends do not regrow the file straight away.
+    const uint64_t keep = std::max<uint64_t>(MIN_ROWS, (w + MIN_ROWS - 1) / MIN_ROWS * MIN_ROWS);
+    const size_t size = sizeof(Header) + keep * stride_;
+    if (size >= mapped_) return;
+    void * addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) return;  // keep the larger mapping; nothing is lost
+    munmap(base_, mapped_);
+    base_   = (uint8_t *)addr;
+    mapped_ = size;
+    if (ftruncate(fd_, (off_t)size) != 0) LOGE("index: cannot shrink to %zu bytes", size);
+}
+
+int32_t LbVecIndex::search(const float * query, int32_t k, int64_t * groups, int64_t * keys, float * scores) {
+    if (!query || k <= 0 || !groups || !keys || !scores) return 0;
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!base_ || rows_.empty()) return 0;
+
+    const Header * h = header();
+    const int32_t n = (int32_t)h->count;
+    query_.resize((size_t)dim_);
+    normalize_into(query_.data(), query, dim_);
+    scores_.resize((size_t)n);
+    const float nan = std::numeric_limits<float>::quiet_NaN();  // skipped by lb_topk_f32
+    for (int32_t i = 0; i < n; ++i) {
+        const uint8_t * r = row((uint64_t)i);
+        int64_t g;
+        std::memcpy(&g, r, sizeof(g));
+        scores_[(size_t)i] = g == DEAD ? nan
+                                       : lb_dot_f32(query_.data(), (const float *)(r + sizeof(RowKey)), dim_);
+    }
+
+    k = std::min(k, (int32_t)rows_.size());
+    std::vector<int32_t> ids((size_t)k);
+    const int32_t got = lb_topk_f32(scores_.data(), n, k, ids.data(), scores);
+    for (int32_t j = 0; j < got; ++j) {
+        RowKey rk;
+        std::memcpy(&rk, row((uint64_t)ids[(size_t)j]), sizeof(rk));
+        groups[j] = rk.group;
+        keys[j]   = rk.key;
+    }
+    return got;
+}
+
+int32_t LbVecIndex::size() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return (int32_t)rows_.size();
+}
@@ -0,0 +1,78 @@
+// android/app/src/main/cpp/lb_vindex.h
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// File-backed set of unit-length float vectors, each tagged with a (group,
+// key) pair, searched by cosine similarity. Rows are normalized on insert,
+// so a query is one SIMD dot product per row plus a top-k pass; the file is
+// mapped, so opening costs nothing beyond building the (group, key) lookup.
+//
+//   header (magic "LBVI", version, dim, tag, count, n_dead)
+//   row[count]: int64 group, int64 key, float v[dim]
+//
+// A row is written before `count` covers it, so a crash mid-append loses at
+// most that row. Removed rows are tombstoned and compacted away once they
+// outnumber the live ones.
+
+// Return codes shared by the LbVecIndex calls.
+enum {
+    LB_VINDEX_OK    =  0,
+    LB_VINDEX_ARGS  = -1, // bad arguments
+    LB_VINDEX_IO    = -2, // cannot create, grow or map the file
+    LB_VINDEX_STALE = -3, // wrong magic/version/dim/tag, or truncated
+};
+
+class LbVecIndex {
+public:
+    ~LbVecIndex() { close(); }
+
+    // Opens `path`, creating it when missing. `tag` identifies the embedding
+    // model; a file written with another tag or dimension is STALE (the
+    // caller deletes it and re-embeds).
+    int32_t open(const char * path, int32_t dim, uint64_t tag);
+    void    close();
+
+    // Adds or replaces n rows; vecs is n * dim floats (normalized on copy).
+    int32_t add(int32_t n, const int64_t * groups, const int64_t * keys, const float * vecs);
+
+    // Removes every row of `group`; returns how many.
+    int32_t remove_group(int64_t group);
+
+    // Best min(k, size()) rows for `query` (need not be normalized), highest
+    // cosine first. Returns the number written.
+    int32_t search(const float * query, int32_t k, int64_t * groups, int64_t * keys, float * scores);
+
+    int32_t size() const;  // live rows
+    int32_t dim() const { return dim_; }
+
+private:
+    struct Header;
+    struct RowKey {
+        int64_t group, key;
+        bool operator==(const RowKey & o) const { return group == o.group && key == o.key; }
+    };
+    struct RowKeyHash {
+        size_t operator()(const RowKey & k) const {
+            return (size_t)(k.group * 0x9e3779b97f4a7c15ULL ^ (uint64_t)k.key);
+        }
+    };
+
+    Header *  header() const { return (Header *)base_; }
+    uint8_t * row(uint64_t i) const;
+    bool      reserve(uint64_t rows);
+    void      compact();
+
+    mutable std::mutex mu_;
+    int       fd_     = -1;
+    uint8_t * base_   = nullptr;
+    size_t    mapped_ = 0;
+    size_t    stride_ = 0;
+    int32_t   dim_    = 0;
+    std::unordered_map<RowKey, uint64_t, RowKeyHash> rows_;  // live rows only
+    std::vector<float> scores_;                              // search scratch
+    std::vector<float> query_;
+};
@@ -1,361 +1,3654 @@
 // android/app/src/main/cpp/llama_bridge.cpp
-#include <android/log.h>
 #include <string>
 #include <vector>
 #include <cstring>
-#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <ggml-cpu.h>
 #include <llama.h>
 
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  "llama_bridge", __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, "llama_bridge", __VA_ARGS__)
+#include "lb_cpu.h"
+#include "lb_grammar.h"
+#include "lb_json_schema.h"
+#include "lb_log.h"
+#include "lb_prefetch.h"
+#include "lb_prefix_cache.h"
+#include "lb_ring.h"
+#include "lb_sampling.h"
+#include "lb_simd.h"
+#include "lb_state_file.h"
+#include "lb_stats.h"
+#include "lb_stop.h"
+#include "lb_vindex.h"
+
+// ---------------------------- Batch arena --------------------------------
+// One llama_batch per context, sized to n_batch and reused for every prefill
+// and decode step, so the steady-state loop never touches the allocator.
+struct BatchArena {
+    llama_batch batch{};
+    int32_t     cap = 0;
+
+    void init(int32_t n_batch) {
+        release();
+        cap   = n_batch > 0 ? n_batch : 1;
+        batch = llama_batch_init(cap, 0, 1);
+    }
+    void release() {
+        if (cap > 0) llama_batch_free(batch);
+        batch = llama_batch{};
+        cap   = 0;
+    }
+    void clear() { batch.n_tokens = 0; }
+    bool add(llama_token tok, llama_pos pos, llama_seq_id seq, bool logits) {
+        const int32_t i = batch.n_tokens;
+        if (i >= cap) return false;
+        batch.token[i]     = tok;
+        batch.pos[i]       = pos;
+        batch.n_seq_id[i]  = 1;
+        batch.seq_id[i][0] = seq;
+        batch.logits[i]    = logits ? 1 : 0;
+        batch.n_tokens     = i + 1;
+        return true;
+    }
+};
 
 // -----------------------------------------------------------------------------
-// Globals
+// Handles
 // -----------------------------------------------------------------------------
-static llama_model*   g_model = nullptr;
-static llama_context* g_ctx   = nullptr;
+extern "C" {
+// Opaque to callers. A model owns the mmap'd weights; any number of contexts
+// (independent KV caches, one per conversation) can be created on it.
+typedef struct lb_model lb_model;
+typedef struct lb_ctx   lb_ctx;
+// A model load running in the background (lb_model_open_async).
+typedef struct lb_load_job lb_load_job;
+// A file-backed vector index (lb_index_open); independent of any model.
+typedef struct lb_index lb_index;
+
+// Snapshot for lb_ctx_stream_get_progress(); fields are read individually, so
+// a snapshot taken mid-update may mix two adjacent steps.
+typedef struct lb_progress {
+    int32_t prefill_done;    // prompt tokens in KV so far (incl. reused)
+    int32_t prefill_total;   // prompt tokens of the current request
+    int32_t prefill_reused;  // of those, served from the KV prefix cache
+    float   prefill_tok_s;   // throughput of the last prefill (decoded tokens only)
+    int32_t decode_tokens;   // tokens generated by the current request
+    float   decode_tok_s;    // generation throughput, excluding prefill
+} lb_progress;
+
+// Performance counters of one context (lb_ctx_get_stats), accumulated over
+// all requests since it was created or lb_ctx_stats_reset(). Phase times
+// are wall-clock sums; a scheduler step that carries prompt tokens counts
+// as prefill, a step with only generating streams as decode (draft model
+// decodes included).
+typedef struct lb_stats {
+    int64_t peak_rss_bytes;   // process high-water resident set size
+    int32_t requests;         // eval / stream_begin / stream_open calls
+    int32_t prefill_tokens;   // prompt tokens decoded (prefix-cache hits excluded)
+    int32_t decode_tokens;    // tokens generated
+    float   tokenize_ms;
+    float   prefill_ms;
+    float   sample_ms;
+    float   decode_ms;
+    float   detok_ms;
+    float   prefill_tok_s;    // prefill_tokens / prefill time
+    float   decode_tok_s;     // decode_tokens / (decode + sample + detok time)
+    float   ttft_ms;          // last request: call to first token
+    float   ttft_avg_ms;
+    float   token_p50_ms;     // gap between consecutive tokens of a stream
+    float   token_p95_ms;
+    float   token_p99_ms;
+    int32_t kv_used;          // cells holding tokens, all sequences
+    int32_t kv_total;         // n_ctx
+    int32_t n_threads;        // decode threads
+    int32_t n_threads_batch;  // prefill threads
+} lb_stats;
+
+// Prefix cache counters of one model (lb_model_prefix_stats), since it was
+// opened.
+typedef struct lb_prefix_stats {
+    int64_t bytes;            // snapshot bytes held
+    int64_t budget_bytes;     // 0: cache off
+    int64_t tokens_restored;  // prompt tokens restored instead of decoded
+    int32_t entries;          // prompts held
+    int32_t lookups;          // prompts matched against the cache
+    int32_t hits;             // of those, restored from it
+    int32_t evictions;        // entries dropped for the budget
+} lb_prefix_stats;
+
+// One model held by the model cache (lb_models_list).
+typedef struct lb_model_info {
+    int64_t  size_bytes;      // weights (llama_model_size); what the budget counts
+    int64_t  resident_bytes;  // of those, in RAM now (mapped pages present; all if not mmap'd)
+    int32_t  in_use;          // references besides the cache's: openers and contexts
+    int32_t  pinned;          // 1: never evicted
+    uint64_t last_used;       // grows with every open; the lowest unpinned is evicted first
+    char     path[512];       // as opened, truncated to fit
+} lb_model_info;
+
+// KV cache element type for lb_load_params.type_k / type_v.
+enum lb_kv_type {
+    LB_KV_F16  = 0,
+    LB_KV_Q8_0 = 1,
+    LB_KV_Q4_0 = 2,
+};
+
+// Versioned load settings for lb_model_open() / lb_ctx_create(). Fill with
+// lb_load_default_params() and override fields. New fields are only ever
+// appended, together with a version bump; the bridge reads the fields that
+// exist in `version`.
+#define LB_LOAD_PARAMS_VERSION 3
+typedef struct lb_load_params {
+    uint32_t version;          // LB_LOAD_PARAMS_VERSION the caller was built against
+    uint32_t n_ctx;            // 0: library default
+    uint32_t n_batch;          // 0: library default
+    uint32_t n_ubatch;         // 0: library default (never above n_batch)
+    int32_t  n_threads;        // <= 0: library default
+    int32_t  n_threads_batch;  // <= 0: same as n_threads
+    int32_t  flash_attn;       // -1: library default (on if V is quantized), 0 off, 1 on
+    int32_t  type_k;           // lb_kv_type
+    int32_t  type_v;           // lb_kv_type; quantized V requires flash attention
+    int32_t  use_mmap;         // 0 / 1 (model only)
+    int32_t  use_mlock;        // 0 / 1 (model only)
+    // v2
+    uint32_t n_seq_max;        // concurrent streams per context (0: 1, max LB_MAX_STREAMS);
+                               // each gets n_ctx / n_seq_max cells
+    // v3
+    int32_t  pooling;          // lb_pooling; anything but LB_POOL_NONE makes an
+                               // embedding context (lb_ctx_embed_batch only)
+} lb_load_params;
+
+// How lb_ctx_embed_batch() reduces a text's token embeddings to one vector.
+enum lb_pooling {
+    LB_POOL_NONE = 0,  // not an embedding context
+    LB_POOL_MEAN = 1,
+    LB_POOL_CLS  = 2,  // first token (BERT-style encoders)
+    LB_POOL_LAST = 3,  // last token (decoder-only embedding models)
+};
+
+#define LB_MAX_STREAMS 64
+
+// Stream states reported by lb_ctx_stream_read() / lb_ctx_stream_poll().
+enum lb_stream_status {
+    LB_STREAM_PREFILL   = 1,  // prompt still being decoded
+    LB_STREAM_DECODE    = 2,  // generating
+    LB_STREAM_DONE      = 3,  // end of generation, a stop string or token, max tokens, full
+                              // context or a grammar that admits no further text
+    LB_STREAM_CANCELLED = 4,
+    LB_STREAM_ERROR     = 5,  // llama_decode failed (sequence cleared), the prompt did not
+                              // fit, or the grammar allowed no token
+};
+
+// State of an lb_model_open_async job.
+enum lb_load_state {
+    LB_LOAD_RUNNING   = 1,
+    LB_LOAD_DONE      = 2,  // weights loaded; take them with lb_load_job_finish
+    LB_LOAD_FAILED    = 3,
+    LB_LOAD_CANCELLED = 4,
+};
+
+// Output constraint of a request (lb_request_params.grammar_kind).
+enum lb_grammar_kind {
+    LB_GRAMMAR_NONE        = 0,
+    LB_GRAMMAR_GBNF        = 1,  // llama.cpp GBNF text
+    LB_GRAMMAR_JSON_SCHEMA = 2,  // JSON schema text; output is JSON it accepts
+};
+
+// Versioned per-request options for the *_req calls (null: none). Fill with
+// lb_request_default_params() and override fields; like lb_load_params,
+// fields are only appended, with a version bump. Strings and arrays are
+// read during the call only.
+#define LB_REQUEST_PARAMS_VERSION 2
+typedef struct lb_request_params {
+    uint32_t     version;       // LB_REQUEST_PARAMS_VERSION the caller was built against
+    int32_t      grammar_kind;  // lb_grammar_kind
+    const char * grammar;       // GBNF or JSON schema text
+    const char * grammar_root;  // GBNF start rule (null: "root")
+    // version 2
+    const char * const * stop;          // generation ends where one of these n_stop strings
+    int32_t              n_stop;        // appears; the string itself is not emitted
+    const int32_t *      stop_tokens;   // token ids that end generation like end-of-generation
+    int32_t              n_stop_tokens; // (not emitted)
+} lb_request_params;
+
+// Speculative decoding (lb_ctx_set_draft): a small draft model proposes up to
+// n_draft tokens per step and the target verifies them in its one decode.
+#define LB_SPEC_MAX_DRAFT 16
+typedef struct lb_spec_params {
+    int32_t n_draft;          // initial draft length per step (<= 0: 4)
+    int32_t n_draft_max;      // cap for the adaptive length (<= 0: 8, at most LB_SPEC_MAX_DRAFT)
+    int32_t adaptive;         // 1: +2 after a fully accepted draft, -1 otherwise; 0: fixed n_draft
+} lb_spec_params;
+
+// Per-stream counters for lb_ctx_stream_spec_stats().
+typedef struct lb_spec_stats {
+    int32_t n_draft;          // proposal length of the next step (0: no speculation)
+    int32_t steps;            // target decodes that verified proposals
+    int32_t drafted;          // tokens proposed (draft model or prompt lookup)
+    int32_t accepted;         // of those, accepted by the target
+    float   accept_rate;      // accepted / drafted
+    float   tokens_per_step;  // tokens generated per verifying decode (accepted + 1)
+} lb_spec_stats;
+
+// Prompt-lookup speculation (lb_ctx_set_lookup): proposals are copied from
+// the last earlier occurrence of the stream's trailing n-gram in its prompt
+// and output. No draft model; verified like draft proposals.
+typedef struct lb_lookup_params {
+    int32_t ngram_min;        // shortest trailing n-gram matched (<= 0: 2)
+    int32_t ngram_max;        // longest, tried first (<= 0: 4)
+    int32_t n_draft_max;      // tokens proposed per step (<= 0: 8, at most LB_SPEC_MAX_DRAFT)
+} lb_lookup_params;
+
+// Thread settings chosen by lb_ctx_autotune(). A zero mask means "no pinning".
+typedef struct lb_tune_result {
+    int32_t  n_threads;        // single-token decode
+    int32_t  n_threads_batch;  // prompt prefill
+    uint64_t cpumask;          // cores for decode (bit i = cpu i)
+    uint64_t cpumask_batch;    // cores for prefill
+    float    decode_tok_s;     // measured by the probe that picked the setting
+    float    prefill_tok_s;
+    int32_t  from_cache;       // 1: read from the profile, no probe ran
+} lb_tune_result;
+}
+
+// A LoRA adapter loaded on a model (lb_model_lora_load). A freed one keeps
+// its slot with a null adapter, so ids stay stable.
+struct LbLora {
+    std::string          path;
+    llama_adapter_lora * adapter = nullptr;
+    int32_t              users   = 0;   // contexts it is applied on
+};
+
+// Weights plus the settings contexts inherit. Reference counted: the opener
+// holds one reference and every context one more, so lb_model_close() may
+// be called while contexts are still alive.
+struct lb_model {
+    llama_model *    model = nullptr;
+    lb_load_params   params{};         // defaults for contexts created with null params
+    std::atomic<int> refs{1};
+
+    // Tuned thread settings (lb_ctx_autotune), applied to every new context.
+    std::mutex       tune_mu;
+    bool             tune_active = false;
+    lb_tune_result   tune{};
+
+    // KV snapshots of earlier prompts, shared by the contexts on this model
+    // (lb_model_set_prefix_cache; off until configured).
+    LbPrefixCache    prefix;
+
+    // Byte trie of the vocabulary for constrained decoding, built by the
+    // first request with a grammar (model_trie).
+    std::mutex       trie_mu;
+    std::shared_ptr<const LbVocabTrie> trie;
+
+    // LoRA adapters on these weights, indexed by id.
+    std::mutex          lora_mu;
+    std::vector<LbLora> loras;
+
+    // Model cache bookkeeping; the flags and last_used belong to g_models.mu.
+    std::string      path;             // as opened
+    int64_t          size_bytes = 0;   // llama_model_size
+    bool             cached = false;   // g_models holds a reference
+    bool             pinned = false;
+    uint64_t         last_used = 0;    // g_models.tick of the last open
+};
+
+// KV bookkeeping of one sequence.
+struct LbSeq {
+    std::vector<llama_token> tokens;      // tokens resident in KV, index = pos
+    std::vector<llama_token> dropped;     // shifted-out tokens, oldest first
+    int32_t dropped_keep = 0;             // pinned prefix length `dropped` follows
+};
+
+// The subset of Dart_CObject (dart_api.h) the poster builds. Its layout is
+// part of the Dart embedding ABI; Dart_PostCObject itself comes in from Dart
+// as NativeApi.postCObject, so no Dart SDK sources are compiled in.
+enum { LB_DART_INT32 = 2, LB_DART_INT64 = 3, LB_DART_ARRAY = 6, LB_DART_TYPED_DATA = 7 };
+enum { LB_DART_UINT8 = 2 };
+struct LbDartObj {
+    int32_t type;
+    union {
+        int32_t as_int32;
+        int64_t as_int64;
+        struct { intptr_t length; LbDartObj ** values; } as_array;
+        struct { int32_t type; intptr_t length; const uint8_t * values; } as_typed_data;
+        uint8_t size[40];  // as large as the union in dart_api.h
+    } value;
+};
+typedef bool (*LbDartPost)(int64_t port, LbDartObj * message);
+
+// One scheduler stream (lb_ctx_stream_open). Slot i always decodes on KV
+// sequence i, so a closed slot keeps its tokens for the next prompt that
+// shares them. Fields above `prompt` are read lock-free by
+// lb_ctx_stream_stop/poll; the rest belong to the owner of lb_ctx::mu.
+struct LbSlot {
+    std::atomic<int32_t> id{-1};          // stream id while open, -1 when free
+    std::atomic<bool>    cancel{false};
+    std::atomic<int32_t> status{LB_STREAM_DONE};
+    std::atomic<int32_t> prefill_done{0};
+    std::atomic<int32_t> prefill_total{0};
+    std::atomic<int32_t> prefill_reused{0};
+    std::atomic<float>   prefill_tok_s{0.0f};
+    std::atomic<int32_t> decode_tokens{0};
+    std::atomic<float>   decode_tok_s{0.0f};
+    std::atomic<int32_t> spec_k{0};              // adaptive draft length
+    std::atomic<int32_t> spec_steps{0};
+    std::atomic<int32_t> spec_drafted{0};
+    std::atomic<int32_t> spec_accepted{0};
+
+    std::vector<llama_token> prompt;      // prompt as it must appear in KV (see prefill_match)
+    int32_t     n_fed    = 0;             // of `prompt`, decoded so far
+    int32_t     skipped  = 0;             // prompt tokens covered by a shifted-out block
+    int32_t     n_step   = 0;             // tokens this slot put in the current batch
+    int32_t     i_logits = -1;            // batch row holding this slot's logits, -1 none
+    llama_token pending  = 0;             // sampled, decoded in the next step
+    int32_t     remaining = 0;
+    uint64_t    last_used = 0;            // lb_ctx::tick when last opened
+    std::vector<llama_token> gen;
+    LbStreamDetok detok;
+    LbSampler   sampler;
+    bool        sampler_ready = false;    // sampler.init() done (per-vocab buffers)
+    LbGrammarState grammar;               // output constraint; inactive without one
+    LbStopMatcher  stop;                  // stop strings / tokens; inactive without any
+    std::string out;                      // text queued since the last read
+    std::string read;                     // buffer handed out by lb_ctx_stream_read
+    int64_t     port = 0;                 // lb_ctx_stream_attach: Dart port for updates, 0 none
+    int32_t     posted_done = -1;         // prefill_done of the last update pushed
+    bool        posted_end = false;       // final update pushed
+    std::chrono::steady_clock::time_point t_prefill, t_decode;
+    LbClock::time_point t_open, t_last;   // stats: request start, last token
+
+    // speculative decoding (lb_ctx::draft)
+    int32_t     n_draft = 0;              // proposals in this step's batch after `pending`
+    std::vector<llama_token> draft;       // the proposals d1..dk
+    std::vector<int32_t> q_off;           // sampling only: start of proposal j's draft
+    std::vector<int32_t> q_id;            // distribution in q_id / q_p
+    std::vector<float>   q_p;
+    LbSampler   draft_sampler;            // the stream's sampler without penalties
+    bool        draft_ready = false;      // draft_sampler.init() done
+    bool        spec_lookup = false;      // this step's proposals came from the prompt lookup
+
+    // prompt lookup: prompt + output, and the index just past the latest
+    // occurrence of each n-gram in it (ngram_key -> index)
+    std::vector<llama_token> hist;
+    std::unordered_map<uint64_t, int32_t> ngrams;
+};
+
+// One llama_context and everything the bridge tracks about it. Calls on one
+// context are serialized by `mu`; different contexts run in parallel. Cancel,
+// stop and progress only touch atomics and never take `mu`. Returned strings
+// point into this struct and stay valid until the next call on the same
+// context (for streams: the next read of the same stream).
+//
+// Sequence 0 backs the single-stream API (lb_ctx_eval, lb_ctx_stream_begin);
+// the scheduler (lb_ctx_stream_open + lb_ctx_step) uses all sequences. The
+// two are mutually exclusive while either has work in flight.
+struct lb_ctx {
+    lb_model *      model = nullptr;
+    llama_context * ctx   = nullptr;
+    lb_load_params  params{};
+    std::mutex      mu;
+
+    BatchArena         batch;             // per-context decode buffers
+    std::vector<LbSeq> seqs;              // one per KV sequence (n_seq_max)
+    int32_t            seq_cap = 0;       // cells per sequence: n_ctx / n_seq_max
+    uint64_t           kv_layout = 0;     // KV types / V layout: prefix cache entries must match
+
+    // LoRA adapters applied (lb_ctx_lora_set): adapter id and scale, by id.
+    std::vector<std::pair<int32_t, float>> loras;
+    uint64_t           lora_sig = 0;      // of `loras` (0: none); mixed into kv_layout
+
+    // Context shifting: when a sequence is full, the oldest tokens after the
+    // first shift_keep are discarded and the rest shifted down (see ctx_shift).
+    int32_t shift_keep    = 1;            // pinned prefix (BOS / system prompt); < 0: off
+    int32_t shift_discard = 0;            // tokens dropped per shift; 0: half the unpinned window
+    std::vector<llama_token> prefill_eff; // prompt minus a dropped block (scratch)
+
+    // scheduler
+    std::unique_ptr<LbSlot[]> slots;      // seqs.size() entries
+    int32_t  n_open = 0;                  // slots with a stream id
+    int32_t  serial = 0;                  // stream id = serial * LB_MAX_STREAMS + slot
+    uint64_t tick   = 0;
+    int32_t  rr     = 0;                  // slot that gets prefill room first next step
+    bool     stepping = false;            // ctx_step's llama_decode is running (see ctx_abort)
+    bool     uninterruptible = false;     // autotune / embedding decodes: ctx_abort ignores `cancel`
+
+    // Speculative decoding (lb_ctx_set_draft): a context on the draft model
+    // with the same sequence layout; its sequence i follows slot i.
+    lb_ctx *       draft = nullptr;
+    lb_spec_params spec{};
+    std::vector<llama_token> spec_tail;   // scratch: tokens the draft sequence lacks
+    std::vector<float>       spec_resid;  // scratch: rejection residual
+    bool             lookup_on = false;   // lb_ctx_set_lookup
+    lb_lookup_params lookup{};
+
+    // Native generation (lb_ctx_async_start): `gen` steps the scheduler and
+    // pushes stream updates into `ring`; `poster` drains it and posts them to
+    // Dart ports, coalesced over `cadence_ms`.
+    std::thread             gen, poster;
+    bool                    async_on = false;
+    std::atomic<bool>       async_quit{false};
+    std::atomic<int32_t>    api_waiting{0};   // API calls queued on `mu` (see ApiLock)
+    std::condition_variable gen_cv;           // with `mu`: work arrived or quit
+    LbRing                  ring;
+    LbDartPost              dart_post = nullptr;
+    int64_t                 events_port = 0;
+    int32_t                 cadence_ms = 0;
+    std::mutex              post_mu;
+    std::condition_variable post_cv;
+    bool                    post_pending = false;  // with post_mu: ring has records
+
+    // reusable result/scratch buffers (capacity survives across calls)
+    std::string              eval_result;
+    std::vector<llama_token> eval_prompt;
+    std::vector<llama_token> eval_gen;
+    LbStreamDetok            eval_detok;
+    LbSampler                eval_sampler;
+    std::string              stream_delta;
+
+    // streaming state
+    bool stream_running   = false;
+    int  stream_remaining = 0;
+    std::vector<llama_token> stream_prompt;
+    std::vector<llama_token> stream_gen;
+    LbStreamDetok stream_detok;           // incremental text of stream_gen
+    LbSampler   stream_sampler;
+
+    // Constrained decoding (lb_request_params.grammar): per-request states
+    // of the single-stream calls (slots carry their own), the model's trie
+    // once a request used a grammar, and the last compiled grammar, reused
+    // while requests repeat its source.
+    LbGrammarState eval_grammar;
+    LbGrammarState stream_grammar;
+    std::shared_ptr<const LbVocabTrie> trie;
+    std::shared_ptr<const LbGrammar>   grammar;
+    std::string                        grammar_key;      // kind, root and source of `grammar`
+    std::vector<uint8_t>               grammar_allowed;  // mask scratch
+
+    // Stop sequences (lb_request_params.stop / stop_tokens), laid out like
+    // the grammar: per-request matchers and the last set built.
+    LbStopMatcher eval_stop;
+    LbStopMatcher stream_stop;
+    std::shared_ptr<const LbStopSet> stops;
+    std::string                      stops_key;
+
+    // Cross-thread state: cancel and progress may be read/raised from
+    // another isolate while the owner is blocked in prefill/decode. Cancel
+    // also aborts a running llama_decode (ctx_abort). It stays raised until
+    // the single-stream request it ends has finished (cancel_consume), so
+    // a cancel that arrives just before a request starts still stops it.
+    std::atomic<bool>    cancel{false};
+    std::atomic<int32_t> prefill_done{0};
+    std::atomic<int32_t> prefill_total{0};
+    std::atomic<int32_t> prefill_reused{0};
+    std::atomic<float>   prefill_tok_s{0.0f};
+    std::atomic<int32_t> decode_tokens{0};
+    std::atomic<float>   decode_tok_s{0.0f};
+    std::chrono::steady_clock::time_point decode_t0;
+
+    // Performance counters (lb_ctx_get_stats): `st` belongs to the owner of
+    // `mu` and is folded into `stats` under `stats_mu` by stats_commit().
+    LbStatsAcc           st;
+    std::mutex           stats_mu;
+    LbStatsAcc           stats;
+    std::atomic<int32_t> kv_used{0};
+    std::atomic<int32_t> kv_total{0};
+    std::atomic<int32_t> n_threads{0};
+    std::atomic<int32_t> n_threads_batch{0};
+    LbClock::time_point  req_t0, tok_t_last;  // single-stream request
+
+    // Thread pools attached to `ctx` (see threadpools_apply).
+    ggml_threadpool * tp_decode = nullptr;
+    ggml_threadpool * tp_batch  = nullptr;
+};
+
+// Takes `mu` for a stream call that may race the generation thread. The
+// thread lets go of `mu` between steps but would usually win it straight
+// back; while api_waiting > 0 it waits until the caller has it.
+struct ApiLock {
+    lb_ctx & c;
+    explicit ApiLock(lb_ctx & ctx) : c(ctx) {
+        c.api_waiting.fetch_add(1);
+        c.mu.lock();
+        c.api_waiting.fetch_sub(1);
+    }
+    ~ApiLock() { c.mu.unlock(); }
+    ApiLock(const ApiLock &) = delete;
+    ApiLock & operator=(const ApiLock &) = delete;
+};
+
+// ------------------------------ Tunables ---------------------------------
+static const int   PREFIX_MIN_GAIN      = 16;   // restore a cached prefix only if it saves this many tokens
+
+// ------------------------------ Utils -----------------------------------
+// llama_backend_init() sets up process-wide state; it is never torn down
+// because other models or contexts may still be alive.
+static void backend_init_once() {
+    static std::once_flag once;
+    std::call_once(once, [] { llama_backend_init(); });
+}
+
+static const llama_vocab * ctx_vocab(const lb_ctx & c) {
+    return llama_model_get_vocab(c.model->model);
+}
+
+static inline void kv_clear(lb_ctx & c) {
+    // If your headers have llama_memory_clear(ctx), prefer that.
+    // This call exists across many versions (deprecated on newest).
+    llama_kv_self_clear(c.ctx);
+    for (LbSeq & s : c.seqs) { s.tokens.clear(); s.dropped.clear(); }
+}
+
+static void seq_clear(lb_ctx & c, llama_seq_id seq) {
+    llama_kv_self_seq_rm(c.ctx, seq, -1, -1);
+    c.seqs[(size_t)seq].tokens.clear();
+    c.seqs[(size_t)seq].dropped.clear();
+}
+
+// Drops whatever an aborted llama_decode left in `seq` past its recorded
+// tokens (finished ubatches stay in the cache), so the sequence again holds
+// exactly `tokens` and its prefix is reused by the next request.
+static void seq_trim(lb_ctx & c, llama_seq_id seq) {
+    if (!llama_kv_self_seq_rm(c.ctx, seq, (llama_pos)c.seqs[(size_t)seq].tokens.size(), -1)) {
+        seq_clear(c, seq);  // recurrent caches may refuse a partial removal
+    }
+}
+
+// llama's abort callback, polled from the thread running llama_decode while
+// the graph computes. Cancelling the single-stream request interrupts its
+// decode at once; a scheduler step is interrupted only once every stream in
+// its batch has been stopped, so one cancel never costs the others a step.
+static bool ctx_abort(void * data) {
+    lb_ctx & c = *(lb_ctx *)data;
+    if (!c.stepping) return !c.uninterruptible && c.cancel.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < c.seqs.size(); ++i) {
+        const LbSlot & s = c.slots[i];
+        if (s.n_step > 0 && !s.cancel.load(std::memory_order_relaxed)) return false;
+    }
+    return true;
+}
+
+// Records an emitted token: time to first token for the request's first,
+// otherwise the gap since its previous one.
+static void stats_token(lb_ctx & c, LbClock::time_point t_start, LbClock::time_point & t_last, bool first) {
+    const LbClock::time_point now = LbClock::now();
+    if (first) {
+        const float ttft = (float)std::chrono::duration<double, std::milli>(now - t_start).count();
+        c.st.ttft_last_ms = ttft;
+        c.st.ttft_sum_ms += ttft;
+        c.st.ttft_count++;
+    } else {
+        c.st.token_ms.add(std::chrono::duration<double, std::milli>(now - t_last).count());
+    }
+    c.st.decode_tokens++;
+    t_last = now;
+}
+
+// Publishes the counters gathered since the last commit. Called by the
+// owner of `mu` once per request, step or token.
+static void stats_commit(lb_ctx & c) {
+    int32_t used = 0;
+    for (const LbSeq & q : c.seqs) used += (int32_t)q.tokens.size();
+    c.kv_used.store(used, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(c.stats_mu);
+    c.st.merge_into(c.stats);
+    c.st = LbStatsAcc{};
+}
+
+static ggml_type kv_ggml_type(int32_t t) {
+    switch (t) {
+        case LB_KV_Q8_0: return GGML_TYPE_Q8_0;
+        case LB_KV_Q4_0: return GGML_TYPE_Q4_0;
+        default:         return GGML_TYPE_F16;
+    }
+}
+
+// Rejects params from a newer bridge; null means library defaults.
+static bool load_params_supported(const lb_load_params * params) {
+    if (!params || (params->version > 0 && params->version <= LB_LOAD_PARAMS_VERSION)) return true;
+    LOGE("lb_load_params version %u not supported (max %d)", params->version, LB_LOAD_PARAMS_VERSION);
+    return false;
+}
+
+// Context parameters for `lp`; zero/negative fields keep the library defaults.
+static llama_context_params context_params(const lb_load_params & lp) {
+    llama_context_params cparams = llama_context_default_params();
+    if (lp.n_ctx > 0)   cparams.n_ctx   = lp.n_ctx;
+    if (lp.n_batch > 0) cparams.n_batch = lp.n_batch;
+    if (lp.n_ubatch > 0) cparams.n_ubatch = lp.n_ubatch;
+    cparams.n_ubatch = std::min(cparams.n_ubatch, cparams.n_batch);
+    if (lp.n_threads > 0) {
+        cparams.n_threads       = lp.n_threads;
+        cparams.n_threads_batch = lp.n_threads;
+    }
+    if (lp.n_threads_batch > 0) cparams.n_threads_batch = lp.n_threads_batch;
+    cparams.type_k = kv_ggml_type(lp.type_k);
+    cparams.type_v = kv_ggml_type(lp.type_v);
+    if (lp.flash_attn >= 0) {
+        cparams.flash_attn = lp.flash_attn != 0;
+    } else if (cparams.type_v != GGML_TYPE_F16) {
+        cparams.flash_attn = true;  // llama refuses a quantized V cache without it
+    }
+    cparams.n_seq_max = std::max(1u, std::min(lp.n_seq_max, (uint32_t)LB_MAX_STREAMS));
+    if (lp.pooling != LB_POOL_NONE) {
+        cparams.embeddings   = true;
+        cparams.pooling_type = lp.pooling == LB_POOL_CLS  ? LLAMA_POOLING_TYPE_CLS
+                             : lp.pooling == LB_POOL_LAST ? LLAMA_POOLING_TYPE_LAST
+                                                          : LLAMA_POOLING_TYPE_MEAN;
+        cparams.n_ubatch = cparams.n_batch;  // non-causal encoders need a text in one ubatch
+    }
+    return cparams;
+}
+
+// Drops one reference; the weights go with the last one.
+static void model_release(lb_model * m) {
+    if (!m || m->refs.fetch_sub(1) != 1) return;
+    for (LbLora & l : m->loras) {
+        if (l.adapter) llama_adapter_lora_free(l.adapter);
+    }
+    llama_model_free(m->model);
+    delete m;
+}
+
+// --------------------------- Thread pools --------------------------------
+static ggml_threadpool * threadpool_new(int n_threads, uint64_t mask) {
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+    for (int c = 0; c < 64 && c < GGML_MAX_N_THREADS; ++c) tpp.cpumask[c] = (mask >> c) & 1;
+    tpp.strict_cpu = false;  // threads share the mask instead of one core each
+    return ggml_threadpool_new(&tpp);
+}
+
+static void threadpools_release(lb_ctx & c) {
+    if (c.ctx) llama_detach_threadpool(c.ctx);
+    if (c.tp_decode) { ggml_threadpool_free(c.tp_decode); c.tp_decode = nullptr; }
+    if (c.tp_batch)  { ggml_threadpool_free(c.tp_batch);  c.tp_batch  = nullptr; }
+}
+
+// Decode (1-token batches) and prefill run on separate pools, each with its
+// own thread count and core set.
+static bool threadpools_apply(lb_ctx & c, int n_dec, uint64_t mask_dec, int n_bat, uint64_t mask_bat) {
+    threadpools_release(c);
+    c.tp_decode = threadpool_new(n_dec, mask_dec);
+    c.tp_batch  = threadpool_new(n_bat, mask_bat);
+    if (!c.tp_decode || !c.tp_batch) { threadpools_release(c); return false; }
+    llama_attach_threadpool(c.ctx, c.tp_decode, c.tp_batch);
+    llama_set_n_threads(c.ctx, n_dec, n_bat);
+    c.n_threads = n_dec;
+    c.n_threads_batch = n_bat;
+    return true;
+}
+
+static void stream_reset(lb_ctx & c) {
+    c.stream_running = false;
+    c.stream_remaining = 0;
+    c.stream_prompt.clear();
+    c.stream_gen.clear();
+    c.stream_detok.reset();
+    c.stream_grammar.reset();
+    c.stream_stop.reset();
+}
+
+// Creates c.ctx for c.model with c.params and sizes the per-context buffers.
+static bool ctx_create(lb_ctx & c) {
+    const llama_context_params cparams = context_params(c.params);
+    c.ctx = llama_init_from_model(c.model->model, cparams);
+    if (!c.ctx) return false;
+    llama_set_abort_callback(c.ctx, ctx_abort, &c);
+    c.n_threads = cparams.n_threads;
+    c.n_threads_batch = cparams.n_threads_batch;
+    LOGI("context: n_ctx=%u n_batch=%u n_ubatch=%u threads=%d/%d flash_attn=%d kv=%d/%d",
+         llama_n_ctx(c.ctx), llama_n_batch(c.ctx), llama_n_ubatch(c.ctx),
+         cparams.n_threads, cparams.n_threads_batch, (int)cparams.flash_attn,
+         (int)cparams.type_k, (int)cparams.type_v);
+
+    const uint32_t n_ctx = llama_n_ctx(c.ctx);
+    const int32_t  n_seq = (int32_t)cparams.n_seq_max;
+    c.batch.init((int32_t)llama_n_batch(c.ctx));
+    c.seq_cap = (int32_t)n_ctx / n_seq;
+    c.kv_total = (int32_t)n_ctx;
+    c.kv_layout = ((uint64_t)cparams.type_k | (uint64_t)cparams.type_v << 8 |
+                   (uint64_t)(cparams.flash_attn ? 1 : 0) << 16) ^ c.lora_sig;
+    if (!c.loras.empty()) {
+        // lb_ctx_reset: the new llama_context starts without adapters
+        std::lock_guard<std::mutex> lock(c.model->lora_mu);
+        for (const auto & [id, scale] : c.loras) {
+            llama_set_adapter_lora(c.ctx, c.model->loras[(size_t)id].adapter, scale);
+        }
+    }
+    c.seqs.assign((size_t)n_seq, LbSeq{});
+    for (LbSeq & s : c.seqs) s.tokens.reserve((size_t)c.seq_cap);
+    c.slots.reset(new LbSlot[(size_t)n_seq]);
+    c.n_open = 0;
+    c.eval_gen.reserve(n_ctx);
+    c.stream_gen.reserve(n_ctx);
+    c.eval_result.reserve(4 * (size_t)n_ctx);
+    c.eval_detok.text.reserve(4 * (size_t)n_ctx);
+    c.stream_delta.reserve(256);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(ctx_vocab(c));
+    c.eval_sampler.init(n_vocab, (int32_t)n_ctx);
+    c.stream_sampler.init(n_vocab, (int32_t)n_ctx);
+    c.stream_detok.text.reserve(4 * (size_t)n_ctx);
+    stream_reset(c);
+
+    lb_tune_result tune{};
+    bool tuned = false;
+    {
+        std::lock_guard<std::mutex> lock(c.model->tune_mu);
+        tuned = c.model->tune_active;
+        tune  = c.model->tune;
+    }
+    if (tuned && !threadpools_apply(c, tune.n_threads, tune.cpumask,
+                                    tune.n_threads_batch, tune.cpumask_batch)) {
+        LOGE("tuned thread pools could not be recreated; using defaults");
+    }
+    return true;
+}
+
+static void ctx_destroy(lb_ctx & c) {
+    c.batch.release();
+    if (c.ctx) { llama_free(c.ctx); c.ctx = nullptr; }
+    threadpools_release(c);  // after the context: it may still reference them
+}
+
+// Parameters used when the caller passes none: plain greedy argmax.
+static lb_sampling_params greedy_params() {
+    lb_sampling_params p;
+    lb_sampling_default_params(&p);
+    p.temperature = 0.0f;
+    return p;
+}
+
+// Tokenizes into `out`, reusing its capacity. Returns false on failure.
+static bool tokenize_into(const llama_vocab * vocab, const char * text,
+                          std::vector<llama_token> & out) {
+    const int text_len = (int) std::strlen(text);
+    int32_t guess = std::max(32, text_len + 8);
+    out.resize(guess);
+    int n_tok = llama_tokenize(vocab, text, text_len, out.data(), guess, 1, 0);
+    if (n_tok < 0) {
+        int need = -n_tok;
+        out.resize(need);
+        n_tok = llama_tokenize(vocab, text, text_len, out.data(), need, 1, 0);
+        if (n_tok <= 0) return false;
+    }
+    out.resize(n_tok);
+    return true;
+}
+
+// Decodes `toks` at positions [pos0, pos0+n) on `seq`, requesting logits for
+// the last token only, and records them in its token list. Returns the
+// llama_decode status (or -1 if the tokens do not fit in one n_batch batch).
+// An aborted decode (2, see ctx_abort) is trimmed back to the recorded
+// tokens; after any other failure the KV contents are unknown, so the
+// sequence is dropped.
+static int32_t decode_tokens(lb_ctx & c, llama_seq_id seq, const llama_token * toks, int n, int pos0,
+                             bool logits_last = true) {
+    c.batch.clear();
+    for (int i = 0; i < n; ++i) {
+        if (!c.batch.add(toks[i], pos0 + i, seq, logits_last && i == n - 1)) return -1;
+    }
+    const int32_t rc = llama_decode(c.ctx, c.batch.batch);
+    if (rc == 2) { seq_trim(c, seq); return rc; }
+    if (rc != 0) { seq_clear(c, seq); return rc; }
+    std::vector<llama_token> & kv = c.seqs[(size_t)seq].tokens;
+    kv.resize((size_t)pos0);
+    kv.insert(kv.end(), toks, toks + n);
+    return 0;
+}
+
+// Frees at least `need` cells in `seq`: removes the oldest tokens after the
+// pinned prefix and shifts the rest down (RoPE is re-applied lazily by
+// llama), so generation continues without re-prefilling. Returns false when
+// shifting is off, unsupported by the model, or the unpinned part is too small.
+static bool ctx_shift(lb_ctx & c, llama_seq_id seq, int need) {
+    if (c.shift_keep < 0 || !llama_kv_self_can_shift(c.ctx)) return false;
+    LbSeq & s = c.seqs[(size_t)seq];
+    const int n_past = (int)s.tokens.size();
+    const int n_keep = std::min((int)c.shift_keep, n_past);
+    const int avail  = n_past - n_keep;
+    const int n_discard = std::max(need, c.shift_discard > 0 ? (int)c.shift_discard : avail / 2);
+    if (need <= 0 || n_discard > avail) return false;
+
+    if (!llama_kv_self_seq_rm(c.ctx, seq, n_keep, n_keep + n_discard)) return false;
+    llama_kv_self_seq_add(c.ctx, seq, n_keep + n_discard, n_past, -n_discard);
+
+    // `dropped` lets the next prompt, which still contains these tokens,
+    // be matched against the shifted cache (see prefill_match).
+    if (s.dropped.empty() || s.dropped_keep != n_keep) {
+        s.dropped.clear();
+        s.dropped_keep = n_keep;
+    }
+    const auto first = s.tokens.begin() + n_keep;
+    s.dropped.insert(s.dropped.end(), first, first + n_discard);
+    s.tokens.erase(first, first + n_discard);
+    LOGI("context shift: seq %d kept %d, discarded %d, %d cached", seq, n_keep, n_discard, (int)s.tokens.size());
+    return true;
+}
+
+// Makes room for `n` more tokens in `seq`, shifting if needed.
+static bool seq_reserve(lb_ctx & c, llama_seq_id seq, int n) {
+    const int room = c.seq_cap - (int)c.seqs[(size_t)seq].tokens.size();
+    return n <= room || ctx_shift(c, seq, n - room);
+}
+
+// Appends `toks` to `seq` after the cached tokens, shifting the context
+// first if they do not fit. Returns 0, a llama_decode error, or -5 when the
+// context is full and cannot be shifted.
+static int32_t decode_append(lb_ctx & c, llama_seq_id seq, const llama_token * toks, int n,
+                             bool logits_last = true) {
+    if (!seq_reserve(c, seq, n)) return -5;
+    return decode_tokens(c, seq, toks, n, (int)c.seqs[(size_t)seq].tokens.size(), logits_last);
+}
+
+// ---------------------------- Prefix cache -------------------------------
+// Prompts are matched against the model's prefix cache as well as against
+// what their own sequence holds, so a prefix shared with any earlier prompt
+// (of any conversation or context on the model) is restored from its KV
+// snapshot instead of being decoded again. Resident sequences are not copied
+// into each other with llama_kv_self_seq_cp: the copy shares cells, and a
+// later context shift on either sequence would move both.
+static bool prefix_cache_usable(const lb_ctx & c) {
+    return c.model->prefix.enabled() && c.params.pooling == LB_POOL_NONE &&
+           !llama_model_is_recurrent(c.model->model);
+}
+
+// Replaces `seq` with the cache's longest prefix of `prompt` when that beats
+// the `lcp` tokens the sequence already shares with it. Returns the tokens
+// `seq` now shares with `prompt`: `lcp` when nothing was restored, 0 when
+// llama refused the snapshot (the sequence is then empty).
+static int prefix_restore(lb_ctx & c, llama_seq_id seq, const std::vector<llama_token> & prompt, int lcp) {
+    if (!prefix_cache_usable(c)) return lcp;
+    const int n = (int)prompt.size();
+    LbPrefixCache & pc = c.model->prefix;
+    LbPrefixCache::Hit hit;
+    if (!pc.lookup(prompt.data(), n, c.kv_layout, &hit)) return lcp;
+    const int m = std::min(hit.n_match, n - 1);  // the last token is decoded for its logits
+    if (m < lcp + PREFIX_MIN_GAIN || hit.n_tokens > c.seq_cap) return lcp;
+
+    const LbClock::time_point t0 = LbClock::now();
+    seq_clear(c, seq);
+    const std::vector<uint8_t> & blob = *hit.blob;
+    if (llama_state_seq_set_data(c.ctx, blob.data(), blob.size(), seq) == 0 ||
+        !llama_kv_self_seq_rm(c.ctx, seq, m, -1)) {
+        LOGE("prefix cache: seq %d could not restore %d tokens", seq, hit.n_tokens);
+        seq_clear(c, seq);
+        pc.restored(0);
+        return 0;
+    }
+    c.seqs[(size_t)seq].tokens.assign(prompt.begin(), prompt.begin() + m);
+    pc.restored(m - lcp);
+    LOGI("prefix cache: seq %d restored %d tokens (had %d) in %.1f ms", seq, m, lcp, lb_ms_since(t0));
+    return m;
+}
+
+// Offers the prompt `seq` holds right after its prefill to the cache, unless
+// an entry already covers it. Sequences that were shifted are skipped: their
+// cells were computed with the dropped tokens in context.
+static void prefix_offer(lb_ctx & c, llama_seq_id seq) {
+    if (!prefix_cache_usable(c)) return;
+    LbPrefixCache & pc = c.model->prefix;
+    const LbSeq & s = c.seqs[(size_t)seq];
+    const int32_t n = (int32_t)s.tokens.size();
+    if (n < pc.min_tokens() || !s.dropped.empty()) return;
+    if (pc.covered(s.tokens.data(), n, c.kv_layout) >= n) return;
+    const size_t size = llama_state_seq_get_size(c.ctx, seq);
+    if (size == 0 || !pc.fits(size)) return;
+    std::vector<uint8_t> data(size);
+    if (llama_state_seq_get_data(c.ctx, data.data(), size, seq) != size) return;
+    pc.insert(s.tokens.data(), n, c.kv_layout, std::move(data));
+}
+
+// Trims `seq` to the longest common prefix of its cached tokens and
+// `prompt` (or a longer prefix from the prefix cache), and returns the prompt as it must appear in the cache. At least
+// the last prompt token is left to decode so its logits are current.
+// `*lcp`: tokens already cached; `*skipped`: prompt tokens that need no
+// decoding because an earlier shift dropped exactly that block (the prompt
+// is then matched with the block removed, so a growing conversation keeps
+// extending the shifted cache).
+static const std::vector<llama_token> & prefill_match(lb_ctx & c, llama_seq_id seq,
+                                                      const std::vector<llama_token> & prompt,
+                                                      int * lcp_out, int * skipped) {
+    LbSeq & s = c.seqs[(size_t)seq];
+    const int n = (int)prompt.size();
+    const std::vector<llama_token> * src = &prompt;
+    const int keep = s.dropped_keep;
+    const int d    = (int)s.dropped.size();
+    if (d > 0 && n > keep + d && (int)s.tokens.size() >= keep &&
+        std::equal(prompt.begin(), prompt.begin() + keep, s.tokens.begin()) &&
+        std::equal(s.dropped.begin(), s.dropped.end(), prompt.begin() + keep)) {
+        c.prefill_eff.assign(prompt.begin(), prompt.begin() + keep);
+        c.prefill_eff.insert(c.prefill_eff.end(), prompt.begin() + keep + d, prompt.end());
+        src = &c.prefill_eff;
+    } else {
+        s.dropped.clear();
+    }
+    const std::vector<llama_token> & eff = *src;
+    const int ne = (int)eff.size();
+
+    const int m = std::min(ne, (int)s.tokens.size());
+    int lcp = 0;
+    while (lcp < m && s.tokens[(size_t)lcp] == eff[(size_t)lcp]) ++lcp;
+    if (lcp == ne) lcp = ne - 1;
+    if (src == &prompt) lcp = prefix_restore(c, seq, prompt, lcp);
+
+    if (lcp < (int)s.tokens.size()) {
+        // drop the diverging tail; recurrent caches may refuse a partial removal
+        if (llama_kv_self_seq_rm(c.ctx, seq, lcp, -1)) {
+            s.tokens.resize((size_t)lcp);
+            if (lcp < keep) s.dropped.clear();
+        } else {
+            seq_clear(c, seq);
+            lcp = 0;
+        }
+    }
+
+    *lcp_out = lcp;
+    *skipped = n - ne;
+    if (lcp > 0) LOGI("prefix reuse: seq %d, %d/%d prompt tokens cached (%d shifted out)", seq, lcp, n, n - ne);
+    return eff;
+}
+
+// Brings KV seq 0 to `prompt`, keeping the longest common prefix with what
+// is already cached and decoding only the rest (see prefill_match). Sets
+// `*n_reused`. Prompts longer than the context are shifted while they are
+// decoded (unless shifting is off).
+//
+// The suffix is decoded in n_batch-sized chunks; progress is published after
+// each chunk. Cancelling aborts the chunk in flight. Returns 0, a
+// llama_decode error, -4 when cancelled (KV keeps the chunks already done),
+// or -5 when the prompt cannot fit in the context.
+static int32_t prefill_reuse(lb_ctx & c, const std::vector<llama_token> & prompt, int * n_reused) {
+    const int n = (int)prompt.size();
+    *n_reused = 0;
+    if (n == 0) return -1;
+    if (n > c.seq_cap && c.shift_keep < 0) {
+        LOGE("prompt of %d tokens exceeds the %d-token context", n, c.seq_cap);
+        return -5;
+    }
+
+    int lcp = 0, skipped = 0;
+    const std::vector<llama_token> & eff = prefill_match(c, 0, prompt, &lcp, &skipped);
+    const int ne = (int)eff.size();
+    *n_reused = lcp;
+    c.prefill_total  = n;
+    c.prefill_reused = lcp + skipped;
+    c.prefill_done   = lcp + skipped;
+
+    const auto t0 = std::chrono::steady_clock::now();
+    const int chunk = std::max(1, c.batch.cap);
+    for (int i = lcp; i < ne; i += chunk) {
+        if (c.cancel.load(std::memory_order_relaxed)) return -4;
+        const int len = std::min(chunk, ne - i);
+        const int32_t rc = decode_append(c, 0, eff.data() + i, len, i + len == ne);
+        if (rc == 2) return -4;
+        if (rc != 0) return rc;
+        c.prefill_done = skipped + i + len;
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - t0).count();
+    const float tps = ms > 0.0 ? (float)((ne - lcp) * 1000.0 / ms) : 0.0f;
+    c.prefill_tok_s = tps;
+    c.st.prefill_ms += ms;
+    c.st.prefill_tokens += ne - lcp;
+    LOGI("prefill: %d tokens in %.1f ms (%.1f tok/s)", ne - lcp, ms, tps);
+    prefix_offer(c, 0);
+    return 0;
+}
+
+// Resets per-request progress; called when a new request starts. A
+// pending cancel is left raised for the request to honour.
+static void progress_begin(lb_ctx & c) {
+    c.prefill_done = c.prefill_total = c.prefill_reused = 0;
+    c.prefill_tok_s = 0.0f;
+    c.decode_tokens = 0;
+    c.decode_tok_s = 0.0f;
+}
+
+// Lowers the cancel flag once the single-stream request ended (cancelled
+// or not), so it does not abort later work on the context.
+static void cancel_consume(lb_ctx & c) {
+    c.cancel.store(false, std::memory_order_relaxed);
+}
+
+// Marks the start of generation (after prefill).
+static void decode_timer_start(lb_ctx & c) {
+    c.decode_t0 = std::chrono::steady_clock::now();
+}
+
+// Publishes generation throughput after `n_gen` tokens.
+static void decode_timer_tick(lb_ctx & c, int n_gen) {
+    const double s = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - c.decode_t0).count();
+    c.decode_tokens = n_gen;
+    c.decode_tok_s  = s > 0.0 ? (float)(n_gen / s) : 0.0f;
+}
+
+// ------------------------------ Model cache ------------------------------
+// Keeps closed models resident up to a byte budget, so reopening one (the
+// user switching back to an earlier model) is a lookup instead of a load.
+// The cache holds one reference per model; lb_model_open of the same file
+// with the same mmap/mlock settings returns the resident model, whose
+// context defaults stay those of the open that loaded it. Over the budget,
+// the least recently opened unpinned models are dropped; one still in use
+// lives on until its last context is freed, it is just no longer cached.
+// Off (budget 0) until lb_models_set_budget.
+
+struct LbModelCache {
+    std::mutex              mu;
+    int64_t                 budget = 0;
+    uint64_t                tick   = 0;
+    std::vector<lb_model *> models;
+};
+static LbModelCache g_models;
+
+static bool model_matches(const lb_model & m, const char * path, const lb_load_params & lp) {
+    return m.path == path && m.params.use_mmap == lp.use_mmap && m.params.use_mlock == lp.use_mlock;
+}
+
+// Drops least recently used unpinned models other than `keep` until
+// `incoming` more bytes fit the budget. The dropped references go to `out`:
+// release them after unlocking, as that may unmap gigabytes.
+static void models_trim_locked(int64_t incoming, const lb_model * keep, std::vector<lb_model *> & out) {
+    int64_t total = incoming;
+    for (const lb_model * m : g_models.models) total += m->size_bytes;
+    while (total > g_models.budget) {
+        auto lru = g_models.models.end();
+        for (auto it = g_models.models.begin(); it != g_models.models.end(); ++it) {
+            if ((*it)->pinned || *it == keep) continue;
+            if (lru == g_models.models.end() || (*it)->last_used < (*lru)->last_used) lru = it;
+        }
+        if (lru == g_models.models.end()) break;  // the rest is pinned
+        lb_model * m = *lru;
+        LOGI("model cache: evicting %s (%lld MB%s)", m->path.c_str(), (long long)(m->size_bytes >> 20),
+             m->refs.load() > 1 ? ", still in use" : "");
+        total -= m->size_bytes;
+        m->cached = false;
+        g_models.models.erase(lru);
+        out.push_back(m);
+    }
+}
+
+static void models_release(const std::vector<lb_model *> & ms) {
+    for (lb_model * m : ms) model_release(m);
+}
+
+// The resident model matching an open, with a reference for the caller;
+// null on a miss.
+static lb_model * models_find(const char * path, const lb_load_params & lp) {
+    std::lock_guard<std::mutex> lock(g_models.mu);
+    if (g_models.budget == 0) return nullptr;
+    for (lb_model * m : g_models.models) {
+        if (!model_matches(*m, path, lp)) continue;
+        m->refs.fetch_add(1);
+        m->last_used = ++g_models.tick;
+        return m;
+    }
+    return nullptr;
+}
+
+// Makes room for a file about to be loaded (its size stands in for the
+// weights), so evicted models are unmapped before it is read, not after.
+static void models_reserve(const char * path) {
+    struct stat st{};
+    if (stat(path, &st) != 0) return;
+    std::vector<lb_model *> drop;
+    {
+        std::lock_guard<std::mutex> lock(g_models.mu);
+        if (g_models.budget == 0) return;
+        models_trim_locked((int64_t)st.st_size, nullptr, drop);
+    }
+    models_release(drop);
+}
+
+// Caches freshly loaded `m`. Returns the model to hand out: `m`, or the twin
+// another thread loaded meanwhile (`m` is then released).
+static lb_model * models_insert(lb_model * m) {
+    std::vector<lb_model *> drop;
+    lb_model * out = m;
+    {
+        std::lock_guard<std::mutex> lock(g_models.mu);
+        if (g_models.budget == 0) return m;
+        for (lb_model * r : g_models.models) {
+            if (model_matches(*r, m->path.c_str(), m->params)) { out = r; break; }
+        }
+        if (out != m) {
+            out->refs.fetch_add(1);
+            out->last_used = ++g_models.tick;
+            drop.push_back(m);
+        } else {
+            m->refs.fetch_add(1);
+            m->cached    = true;
+            m->last_used = ++g_models.tick;
+            g_models.models.push_back(m);
+            models_trim_locked(0, m, drop);
+        }
+    }
+    models_release(drop);
+    return out;
+}
+
+// Keeps up to `budget_bytes` of weights resident after their last close
+// (-1: half the installed RAM). Models over the new budget are evicted;
+// 0 turns the cache off and drops every model it holds, pinned or not.
+// Thread-safe. Returns 0, or -1 bad arguments.
+extern "C" __attribute__((visibility("default")))
+int lb_models_set_budget(int64_t budget_bytes) {
+    if (budget_bytes < -1) return -1;
+    if (budget_bytes == -1) budget_bytes = lb_physical_ram_bytes() / 2;
+    std::vector<lb_model *> drop;
+    {
+        std::lock_guard<std::mutex> lock(g_models.mu);
+        g_models.budget = budget_bytes;
+        if (budget_bytes == 0) {
+            for (lb_model * m : g_models.models) m->cached = m->pinned = false;
+            drop.swap(g_models.models);
+        } else {
+            models_trim_locked(0, nullptr, drop);
+        }
+    }
+    LOGI("model cache: budget %lld MB, %zu dropped", (long long)(budget_bytes >> 20), drop.size());
+    models_release(drop);
+    return 0;
+}
+
+// Exempts a cached model from eviction (pin != 0) or makes it evictable
+// again. Pinned models still count against the budget. Thread-safe.
+// Returns 0, or -1 bad arguments or `model` is not in the cache.
+extern "C" __attribute__((visibility("default")))
+int lb_model_pin(lb_model* model, int32_t pin) {
+    if (!model) return -1;
+    std::lock_guard<std::mutex> lock(g_models.mu);
+    if (!model->cached) return -1;
+    model->pinned = pin != 0;
+    return 0;
+}
+
+// Fills up to `cap` entries of `out` (most recently used first) and sets
+// *budget_bytes (may be null). Reading resident sizes walks
+// /proc/self/smaps, so this is for settings screens, not per token.
+// Thread-safe. Returns the number of cached models, or -1 bad arguments.
+extern "C" __attribute__((visibility("default")))
+int lb_models_list(lb_model_info* out, int32_t cap, int64_t* budget_bytes) {
+    if (cap < 0 || (cap > 0 && !out)) return -1;
+    std::vector<lb_model *> ms;
+    {
+        std::lock_guard<std::mutex> lock(g_models.mu);
+        if (budget_bytes) *budget_bytes = g_models.budget;
+        ms = g_models.models;
+        std::sort(ms.begin(), ms.end(), [](const lb_model * a, const lb_model * b) {
+            return a->last_used > b->last_used;
+        });
+        for (int32_t i = 0; i < cap && i < (int32_t)ms.size(); ++i) {
+            lb_model_info & o = out[i];
+            o = lb_model_info{};
+            o.size_bytes = ms[(size_t)i]->size_bytes;
+            o.in_use     = ms[(size_t)i]->refs.load() - 1;
+            o.pinned     = ms[(size_t)i]->pinned ? 1 : 0;
+            o.last_used  = ms[(size_t)i]->last_used;
+            std::snprintf(o.path, sizeof(o.path), "%s", ms[(size_t)i]->path.c_str());
+            ms[(size_t)i]->refs.fetch_add(1);  // alive through the smaps walk below
+        }
+    }
+    const int32_t n = std::min(cap, (int32_t)ms.size());
+    for (int32_t i = 0; i < n; ++i) {
+        lb_model * m = ms[(size_t)i];
+        out[i].resident_bytes = m->params.use_mmap ? std::min(lb_mapped_rss_bytes(m->path.c_str()), m->size_bytes)
+                                                   : m->size_bytes;
+        model_release(m);
+    }
+    return (int)ms.size();
+}
+
+// ------------------------------- Models ----------------------------------
+extern "C" __attribute__((visibility("default")))
+void lb_load_default_params(lb_load_params* out) {
+    if (!out) return;
+    const llama_model_params mp = llama_model_default_params();
+    *out = lb_load_params{};
+    out->version         = LB_LOAD_PARAMS_VERSION;
+    out->n_ctx           = 0;
+    out->n_batch         = 0;
+    out->n_ubatch        = 0;
+    out->n_threads       = 0;
+    out->n_threads_batch = 0;
+    out->flash_attn      = -1;
+    out->type_k          = LB_KV_F16;
+    out->type_v          = LB_KV_F16;
+    out->use_mmap        = mp.use_mmap ? 1 : 0;
+    out->use_mlock       = mp.use_mlock ? 1 : 0;
+    out->n_seq_max       = 1;
+    out->pooling         = LB_POOL_NONE;
+}
+
+// Defaults overlaid with the fields `src` has (per its version). Older
+// callers pass a shorter struct, so it is never read past its version.
+static void load_params_copy(lb_load_params & dst, const lb_load_params * src) {
+    lb_load_default_params(&dst);
+    if (!src) return;
+    const size_t n = src->version == 1 ? offsetof(lb_load_params, n_seq_max)
+                   : src->version == 2 ? offsetof(lb_load_params, pooling)
+                                       : sizeof(lb_load_params);
+    std::memcpy(&dst, src, n);
+    dst.version = LB_LOAD_PARAMS_VERSION;
+}
+
+// lb_model_open without the argument checks. `progress` (may be null) is
+// llama's load callback; returning false from it aborts the load (-2). A
+// model served from the cache reports 1.0 once.
+static int model_open(const char * path, const lb_load_params * params,
+                      llama_progress_callback progress, void * progress_data, lb_model ** out) {
+    backend_init_once();
+
+    lb_model * m = new lb_model();
+    load_params_copy(m->params, params);
+    if (lb_model * hit = models_find(path, m->params)) {
+        LOGI("model cache: %s already resident", path);
+        delete m;
+        if (progress) progress(1.0f, progress_data);
+        *out = hit;
+        return 0;
+    }
+    models_reserve(path);
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap  = m->params.use_mmap != 0;
+    mparams.use_mlock = m->params.use_mlock != 0;
+    if (progress) {
+        mparams.progress_callback           = progress;
+        mparams.progress_callback_user_data = progress_data;
+    }
+    m->model = llama_model_load_from_file(path, mparams);
+    if (!m->model) {
+        LOGE("llama_model_load_from_file failed");
+        delete m;
+        return -2;
+    }
+    m->path       = path;
+    m->size_bytes = (int64_t)llama_model_size(m->model);
+    *out = models_insert(m);
+    return 0;
+}
+
+// Loads weights once; create contexts on them with lb_ctx_create(). `params`
+// may be null (library defaults); it is copied and becomes the default for
+// those contexts. Blocks for the whole load; see lb_model_open_async. With
+// the model cache on, a resident model of the same file is returned at once
+// (its context defaults are those of its first open).
+// Thread-safe.
+// Returns 0 and sets *out, or -1 bad path, -2 model load failed,
+// -4 unsupported params version.
+extern "C" __attribute__((visibility("default")))
+int lb_model_open(const char* model_path_cstr, const lb_load_params* params, lb_model** out) {
+    LOGI("[lb_model_open] path: %s", model_path_cstr ? model_path_cstr : "(null)");
+    if (!out) return -1;
+    *out = nullptr;
+    if (!model_path_cstr || model_path_cstr[0] == '\0') return -1;
+    if (!load_params_supported(params)) return -4;
+    return model_open(model_path_cstr, params, nullptr, nullptr, out);
+}
+
+// Releases the opener's reference. Contexts keep the weights alive until
+// they are freed, and the model cache (lb_models_set_budget) beyond that.
+extern "C" __attribute__((visibility("default")))
+void lb_model_close(lb_model* model) {
+    model_release(model);
+}
+
+// Keeps KV snapshots of up to `budget_bytes` of earlier prompts of at least
+// `min_tokens` tokens (<= 0: 64) for every context on `model`, so prompts
+// sharing a prefix with any of them skip decoding it. 0 disables the cache
+// and frees it. Thread-safe; takes effect with the next prompt.
+// Returns 0, or -1 bad arguments, -6 the model cannot trim a restored
+// sequence (recurrent).
+extern "C" __attribute__((visibility("default")))
+int lb_model_set_prefix_cache(lb_model* model, int64_t budget_bytes, int32_t min_tokens) {
+    if (!model || budget_bytes < 0) return -1;
+    if (budget_bytes > 0 && llama_model_is_recurrent(model->model)) return -6;
+    model->prefix.configure((size_t)budget_bytes, min_tokens > 0 ? min_tokens : 64);
+    LOGI("prefix cache: budget %lld bytes, min %d tokens", (long long)budget_bytes,
+         model->prefix.min_tokens());
+    return 0;
+}
+
+// Returns 0, or -1 bad arguments. Thread-safe.
+extern "C" __attribute__((visibility("default")))
+int lb_model_prefix_stats(lb_model* model, lb_prefix_stats* out) {
+    if (!model || !out) return -1;
+    const LbPrefixCache::Stats st = model->prefix.stats();
+    *out = lb_prefix_stats{};
+    out->bytes           = st.bytes;
+    out->budget_bytes    = st.budget;
+    out->tokens_restored = st.tokens_restored;
+    out->entries         = st.entries;
+    out->lookups         = st.lookups;
+    out->hits            = st.hits;
+    out->evictions       = st.evictions;
+    return 0;
+}
+
+// ----------------------------- Async loading -----------------------------
+// lb_model_open on a background thread, so the caller stays responsive
+// through a multi-second mmap + page-in. llama's load callback reports the
+// fraction of tensor data read and is where a cancel lands: returning false
+// aborts the load, which unmaps what was read. lb_model_prefetch warms the
+// page cache earlier still, before the user has committed to a model.
+
+struct lb_load_job {
+    std::string          path;
+    lb_load_params       params{};
+    LbDartPost           post = nullptr;         // with `port`: [state, permille] updates
+    int64_t              port = 0;
+    std::atomic<bool>    cancel{false};
+    std::atomic<int32_t> state{LB_LOAD_RUNNING};
+    std::atomic<float>   progress{0.0f};
+    int32_t              posted = -1;            // permille last posted (load thread)
+    int32_t              rc = 0;                 // model_open result
+    lb_model *           model = nullptr;        // handed out by lb_load_job_finish
+    LbClock::time_point  t0;
+    std::thread          thread;
+};
+
+static void load_job_post(lb_load_job & j, int32_t state, int32_t permille) {
+    if (!j.post || j.port == 0) return;
+    LbDartObj v[2], * items[2] = {&v[0], &v[1]};
+    v[0].type = LB_DART_INT32;
+    v[0].value.as_int32 = state;
+    v[1].type = LB_DART_INT32;
+    v[1].value.as_int32 = permille;
+    LbDartObj msg;
+    msg.type = LB_DART_ARRAY;
+    msg.value.as_array.length = 2;
+    msg.value.as_array.values = items;
+    j.post(j.port, &msg);
+}
+
+// llama_progress_callback: posts each whole percent, keeps loading unless
+// cancelled.
+static bool load_job_progress(float p, void * user) {
+    lb_load_job & j = *(lb_load_job *)user;
+    j.progress.store(p, std::memory_order_relaxed);
+    const int32_t permille = (int32_t)(std::clamp(p, 0.0f, 1.0f) * 1000.0f);
+    if (permille / 10 != j.posted / 10) {
+        j.posted = permille;
+        load_job_post(j, LB_LOAD_RUNNING, permille);
+    }
+    return !j.cancel.load(std::memory_order_relaxed);
+}
+
+static void load_job_run(lb_load_job * job) {
+    lb_load_job & j = *job;
+    j.rc = model_open(j.path.c_str(), &j.params, load_job_progress, &j, &j.model);
+    const int32_t st = j.rc == 0                ? LB_LOAD_DONE
+                     : j.cancel.load()          ? LB_LOAD_CANCELLED
+                                                : LB_LOAD_FAILED;
+    LOGI("load: %s after %.0f ms", st == LB_LOAD_DONE ? "done" : st == LB_LOAD_CANCELLED ? "cancelled" : "failed",
+         lb_ms_since(j.t0));
+    j.state.store(st);
+    load_job_post(j, st, st == LB_LOAD_DONE ? 1000 : std::max(0, j.posted));
+}
+
+// Starts lb_model_open(path, params) on a background thread. If
+// `post_cobject` (NativeApi.postCObject) and `port` are set, the port gets
+// [LB_LOAD_RUNNING, permille] for each whole percent loaded and a final
+// [state, permille] when the load ends. Every job must be ended with
+// lb_load_job_finish.
+// Returns 0 and sets *out, or -1 bad arguments, -4 unsupported params
+// version.
+extern "C" __attribute__((visibility("default")))
+int lb_model_open_async(const char* model_path_cstr, const lb_load_params* params,
+                        void* post_cobject, int64_t port, lb_load_job** out) {
+    LOGI("[lb_model_open_async] path: %s", model_path_cstr ? model_path_cstr : "(null)");
+    if (!out) return -1;
+    *out = nullptr;
+    if (!model_path_cstr || model_path_cstr[0] == '\0') return -1;
+    if (!load_params_supported(params)) return -4;
+
+    lb_load_job * j = new lb_load_job();
+    j->path = model_path_cstr;
+    load_params_copy(j->params, params);
+    j->post = (LbDartPost)post_cobject;
+    j->port = port;
+    j->t0   = LbClock::now();
+    j->thread = std::thread(load_job_run, j);
+    *out = j;
+    return 0;
+}
+
+// Asks the load to stop at its next progress callback. Safe from any thread.
+extern "C" __attribute__((visibility("default")))
+void lb_load_job_cancel(lb_load_job* job) {
+    if (job) job->cancel.store(true, std::memory_order_relaxed);
+}
+
+// Returns the lb_load_state and sets *progress (may be null) to the
+// fraction loaded. Safe from any thread.
+extern "C" __attribute__((visibility("default")))
+int lb_load_job_poll(lb_load_job* job, float* progress) {
+    if (!job) return LB_LOAD_FAILED;
+    if (progress) *progress = job->progress.load(std::memory_order_relaxed);
+    return job->state.load();
+}
+
+// Waits for the load to end and frees the job. A job cancelled after its
+// weights were already in is cancelled all the same.
+// Returns 0 and sets *out (release with lb_model_close; null `out` releases
+// it here), or -1 bad arguments, -2 model load failed, -5 cancelled.
+extern "C" __attribute__((visibility("default")))
+int lb_load_job_finish(lb_load_job* job, lb_model** out) {
+    if (out) *out = nullptr;
+    if (!job) return -1;
+    job->thread.join();
+    int rc = job->rc;
+    lb_model * m = job->model;
+    if (job->cancel.load()) {
+        model_release(m);
+        m  = nullptr;
+        rc = -5;
+    }
+    delete job;
+    if (out) *out = m;
+    else     model_release(m);
+    return rc;
+}
+
+// Starts reading `path` into the page cache in the background, so a later
+// lb_model_open of it reads from memory. Prefetching another file (or null)
+// stops the previous run. Returns 0, or -1 the file cannot be opened.
+extern "C" __attribute__((visibility("default")))
+int lb_model_prefetch(const char* path) {
+    return lb_prefetch_file(path) ? 0 : -1;
+}
+
+// ------------------------------ Contexts ---------------------------------
+// `params` may be null (the model's load params); only the context fields
+// are used. Thread-safe; each context has its own KV cache, n_seq_max
+// sequences and streams.
+// Returns 0 and sets *out, or -1 bad arguments, -3 context creation failed,
+// -4 unsupported params version.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_create(lb_model* model, const lb_load_params* params, lb_ctx** out) {
+    if (!out) return -1;
+    *out = nullptr;
+    if (!model) return -1;
+    if (!load_params_supported(params)) return -4;
+
+    lb_ctx * c = new lb_ctx();
+    c->model  = model;
+    if (params) load_params_copy(c->params, params);
+    else        c->params = model->params;
+    if (!ctx_create(*c)) {
+        LOGE("llama_init_from_model failed");
+        delete c;
+        return -3;
+    }
+    model->refs.fetch_add(1);
+    *out = c;
+    LOGI("context created OK (sampling kernel: %s)", lb_simd_isa());
+    return 0;
+}
+
+static void async_stop(lb_ctx & c);  // see "Native generation"
+
+// No other call on `ctx` may be in flight, including cancel/progress.
+extern "C" __attribute__((visibility("default")))
+void lb_ctx_free(lb_ctx* ctx) {
+    if (!ctx) return;
+    async_stop(*ctx);
+    if (ctx->draft) lb_ctx_free(ctx->draft);
+    ctx_destroy(*ctx);
+    if (!ctx->loras.empty()) {
+        std::lock_guard<std::mutex> lock(ctx->model->lora_mu);
+        for (const auto & l : ctx->loras) ctx->model->loras[(size_t)l.first].users--;
+    }
+    model_release(ctx->model);
+    delete ctx;
+}
+
+// Recreates the llama_context in place (same handle, empty KV cache).
+// Returns 0, -1 bad handle or streams still open, -2 context creation failed
+// (the handle is then unusable until a later reset succeeds).
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_reset(lb_ctx* ctx) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    if (ctx->n_open > 0) return -1;
+    ctx_destroy(*ctx);
+    return ctx_create(*ctx) ? 0 : -2;
+}
+
+// Drops cached tokens of every sequence without an open stream.
+extern "C" __attribute__((visibility("default")))
+void lb_ctx_clear_history(lb_ctx* ctx) {
+    if (!ctx) return;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx) return;
+    if (c.n_open == 0) {
+        kv_clear(c);
+        if (c.draft) kv_clear(*c.draft);
+    } else {
+        for (size_t i = 0; i < c.seqs.size(); ++i) {
+            if (c.slots[i].id.load() >= 0) continue;
+            seq_clear(c, (llama_seq_id)i);
+            if (c.draft) seq_clear(*c.draft, (llama_seq_id)i);
+        }
+    }
+    stream_reset(c);
+    stats_commit(c);
+}
+
+// Context shifting for long chats/generations. `n_keep`: leading tokens that
+// are never discarded (BOS + system prompt); < 0 disables shifting, so a
+// full context ends generation and over-long prompts fail with -5.
+// `n_discard`: tokens dropped per shift; 0 = half of the unpinned window.
+extern "C" __attribute__((visibility("default")))
+void lb_ctx_set_context_shift(lb_ctx* ctx, int n_keep, int n_discard) {
+    if (!ctx) return;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    ctx->shift_keep    = n_keep;
+    ctx->shift_discard = std::max(0, n_discard);
+}
+
+// ----------------------------- LoRA adapters -----------------------------
+// Adapters are loaded once per model and stay in memory with it (also while
+// it sits in the model cache), so switching a context to another persona or
+// task is llama_set_adapter_lora, not a reload of the base weights. KV
+// computed under one adapter set is wrong under another: a change clears the
+// context's sequences, and the set is mixed into kv_layout and the session
+// snapshot id so prefix cache entries and snapshots never cross over.
+
+// FNV-1a over the applied adapters' paths and scales. Needs the model's
+// lora_mu.
+static uint64_t lora_signature(const lb_ctx & c) {
+    if (c.loras.empty()) return 0;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto mix = [&h](const void * p, size_t n) {
+        for (size_t i = 0; i < n; ++i) { h ^= ((const uint8_t *)p)[i]; h *= 0x100000001b3ULL; }
+    };
+    for (const auto & [id, scale] : c.loras) {
+        const std::string & path = c.model->loras[(size_t)id].path;
+        mix(path.data(), path.size() + 1);
+        mix(&scale, sizeof(scale));
+    }
+    return h;
+}
+
+// After c.loras changed: new signature, sequences cleared. Needs the
+// model's lora_mu.
+static void lora_changed(lb_ctx & c) {
+    const uint64_t sig = lora_signature(c);
+    c.kv_layout ^= c.lora_sig ^ sig;
+    c.lora_sig = sig;
+    kv_clear(c);
+    if (c.draft) kv_clear(*c.draft);
+    stream_reset(c);
+}
+
+// Loads the adapter at `path` for `model`, or finds it already loaded.
+// Thread-safe. Returns 0 and sets *out_id, or -1 bad arguments, -2 the file
+// is not a LoRA adapter for this model.
+extern "C" __attribute__((visibility("default")))
+int lb_model_lora_load(lb_model* model, const char* path, int32_t* out_id) {
+    if (!out_id) return -1;
+    *out_id = -1;
+    if (!model || !path || path[0] == '\0') return -1;
+    auto find = [&]() {
+        for (size_t i = 0; i < model->loras.size(); ++i) {
+            if (model->loras[i].adapter && model->loras[i].path == path) return (int32_t)i;
+        }
+        return (int32_t)-1;
+    };
+    {
+        std::lock_guard<std::mutex> lock(model->lora_mu);
+        if ((*out_id = find()) >= 0) return 0;
+    }
+
+    const LbClock::time_point t0 = LbClock::now();
+    llama_adapter_lora * a = llama_adapter_lora_init(model->model, path);  // reads the file: unlocked
+    if (!a) {
+        LOGE("lora: cannot load %s", path);
+        return -2;
+    }
+    std::lock_guard<std::mutex> lock(model->lora_mu);
+    if ((*out_id = find()) >= 0) {  // loaded meanwhile by another thread
+        llama_adapter_lora_free(a);
+        return 0;
+    }
+    LbLora l;
+    l.path    = path;
+    l.adapter = a;
+    model->loras.push_back(std::move(l));
+    *out_id = (int32_t)model->loras.size() - 1;
+    LOGI("lora: %s loaded as %d in %.0f ms", path, *out_id, lb_ms_since(t0));
+    return 0;
+}
+
+// Frees an adapter no context uses any more; the model frees the rest when
+// it goes. Thread-safe. Returns 0, or -1 unknown id, -6 still applied.
+extern "C" __attribute__((visibility("default")))
+int lb_model_lora_unload(lb_model* model, int32_t id) {
+    if (!model) return -1;
+    std::lock_guard<std::mutex> lock(model->lora_mu);
+    if (id < 0 || id >= (int32_t)model->loras.size() || !model->loras[(size_t)id].adapter) return -1;
+    LbLora & l = model->loras[(size_t)id];
+    if (l.users > 0) return -6;
+    llama_adapter_lora_free(l.adapter);
+    l.adapter = nullptr;
+    l.path.clear();
+    return 0;
+}
+
+// Applies adapter `id` of the context's model with `scale`, or changes its
+// scale if applied; 0 removes it. Adapters add up. Any change clears the
+// context's cached tokens. Not while streams are open.
+// Returns 0, or -1 bad arguments / unknown id / streams open, -3 rejected by
+// llama.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_lora_set(lb_ctx* ctx, int32_t id, float scale) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.n_open > 0 || c.stream_running) return -1;
+    std::lock_guard<std::mutex> llock(c.model->lora_mu);
+    if (id < 0 || id >= (int32_t)c.model->loras.size() || !c.model->loras[(size_t)id].adapter) return -1;
+    LbLora & l = c.model->loras[(size_t)id];
+
+    auto it = std::find_if(c.loras.begin(), c.loras.end(), [id](const auto & e) { return e.first == id; });
+    if (scale == 0.0f) {
+        if (it == c.loras.end()) return 0;
+        llama_rm_adapter_lora(c.ctx, l.adapter);
+        c.loras.erase(it);
+        l.users--;
+    } else {
+        if (it != c.loras.end() && it->second == scale) return 0;
+        if (llama_set_adapter_lora(c.ctx, l.adapter, scale) != 0) return -3;
+        if (it != c.loras.end()) {
+            it->second = scale;
+        } else {
+            c.loras.insert(std::lower_bound(c.loras.begin(), c.loras.end(), std::make_pair(id, scale)),
+                           std::make_pair(id, scale));
+            l.users++;
+        }
+    }
+    lora_changed(c);
+    LOGI("lora: %s at %.2f (%zu applied)", l.path.c_str(), scale, c.loras.size());
+    return 0;
+}
+
+// Removes every adapter from the context (the base model again). Returns 0,
+// or -1 bad handle / streams open.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_lora_clear(lb_ctx* ctx) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.n_open > 0 || c.stream_running) return -1;
+    if (c.loras.empty()) return 0;
+    std::lock_guard<std::mutex> llock(c.model->lora_mu);
+    llama_clear_adapter_lora(c.ctx);
+    for (const auto & l : c.loras) c.model->loras[(size_t)l.first].users--;
+    c.loras.clear();
+    lora_changed(c);
+    return 0;
+}
+
+// ------------------------- Constrained decoding ----------------------------
+// A request may restrict its output to a GBNF grammar or a JSON schema
+// (lb_request_params). Sampling stays unconstrained first: the pick is kept
+// if the grammar accepts it, which costs one walk of its piece. Only when it
+// is rejected is the full mask computed, by walking the model's vocabulary
+// trie (shared prefixes are matched once, dead prefixes prune whole
+// subtrees), and the pick redrawn from the allowed tokens. Constrained
+// streams take no speculative proposals; they end when the grammar admits
+// no further text (or earlier, at a stop sequence).
+
+extern "C" __attribute__((visibility("default")))
+void lb_request_default_params(lb_request_params* out) {
+    if (!out) return;
+    *out = lb_request_params{};
+    out->version      = LB_REQUEST_PARAMS_VERSION;
+    out->grammar_kind = LB_GRAMMAR_NONE;
+}
+
+static bool request_params_copy(lb_request_params & dst, const lb_request_params * src) {
+    lb_request_default_params(&dst);
+    if (!src) return true;
+    if (src->version < 1 || src->version > LB_REQUEST_PARAMS_VERSION) return false;
+    const size_t n = src->version == 1 ? offsetof(lb_request_params, stop)
+                                       : sizeof(lb_request_params);
+    std::memcpy(&dst, src, n);
+    dst.version = LB_REQUEST_PARAMS_VERSION;
+    return true;
+}
+
+// Compiles GBNF or a JSON schema; null (with *err set) if it is rejected.
+static std::shared_ptr<const LbGrammar> grammar_compile(int32_t kind, const char * text, const char * root,
+                                                        std::string * err) {
+    if (kind == LB_GRAMMAR_GBNF) return LbGrammar::parse(text, root, err);
+    if (kind != LB_GRAMMAR_JSON_SCHEMA) { *err = "unknown grammar kind"; return nullptr; }
+    std::string gbnf;
+    if (!lb_json_schema_to_gbnf(text, &gbnf, err)) return nullptr;
+    return LbGrammar::parse(gbnf.c_str(), "root", err);
+}
+
+static std::shared_ptr<const LbVocabTrie> model_trie(lb_model & m) {
+    std::lock_guard<std::mutex> lock(m.trie_mu);
+    if (!m.trie) {
+        const LbClock::time_point t0 = LbClock::now();
+        m.trie = std::make_shared<const LbVocabTrie>(llama_model_get_vocab(m.model));
+        LOGI("grammar: vocabulary trie of %d tokens built in %.1f ms", m.trie->n_vocab(), lb_ms_since(t0));
+    }
+    return m.trie;
+}
+
+// Starts `state` on the grammar `r` asks for (inactive without one).
+// Returns 0, or -7 if the grammar is rejected.
+static int32_t request_grammar(lb_ctx & c, const lb_request_params & r, LbGrammarState & state) {
+    if (r.grammar_kind == LB_GRAMMAR_NONE) return 0;
+    if (!r.grammar) return -7;
+
+    std::string key = std::to_string(r.grammar_kind) + '\n' + (r.grammar_root ? r.grammar_root : "") + '\n' + r.grammar;
+    if (!c.grammar || key != c.grammar_key) {
+        std::string err;
+        std::shared_ptr<const LbGrammar> g = grammar_compile(r.grammar_kind, r.grammar, r.grammar_root, &err);
+        if (!g) {
+            LOGE("grammar rejected: %s", err.c_str());
+            return -7;
+        }
+        c.grammar     = std::move(g);
+        c.grammar_key = std::move(key);
+    }
+    if (!c.trie) c.trie = model_trie(*c.model);
+    state.begin(c.grammar);
+    return 0;
+}
+
+// The next token under `g`: the sampler's own pick when the grammar allows
+// it, otherwise a redraw with every disallowed logit at -INFINITY. Greedy
+// picks are then exactly the best allowed token; for sampling, keeping an
+// allowed first pick and renormalizing after a rejected one adds up to the
+// masked distribution (the redraw truncates top-k / top-p among the allowed
+// tokens). -1 when the grammar allows no token at all.
+static llama_token sample_constrained(lb_ctx & c, LbSampler & smp, LbGrammarState & g, float * logits) {
+    const llama_token t = smp.sample(logits);
+    if (!g.active() || g.allows(*c.trie, t)) return t;
+    if (g.mask(*c.trie, c.grammar_allowed) == 0) return -1;
+    const int32_t n = c.trie->n_vocab();
+    for (int32_t i = 0; i < n; ++i) {
+        if (!c.grammar_allowed[(size_t)i]) logits[i] = -INFINITY;
+    }
+    return smp.resample(logits);
+}
+
+// Checks a grammar without a model. Returns 0, or -7 with the reason in
+// `err` (NUL-terminated, truncated to err_len bytes; may be null).
+extern "C" __attribute__((visibility("default")))
+int32_t lb_grammar_validate(int32_t kind, const char* text, const char* root, char* err, int32_t err_len) {
+    std::string e;
+    const bool ok = text && grammar_compile(kind, text, root, &e) != nullptr;
+    if (!text) e = "no grammar";
+    if (err && err_len > 0) snprintf(err, (size_t)err_len, "%s", ok ? "" : e.c_str());
+    return ok ? 0 : -7;
+}
+
+// ---------------------------- Stop sequences -------------------------------
+// Generation ends where a caller-supplied stop string appears in the text or
+// a stop token is sampled, besides end-of-generation and max tokens. The
+// strings are matched incrementally (lb_stop.h): each token feeds only its
+// own bytes, and text that could still become a stop string is held back
+// until it cannot, so a stop string never reaches the caller.
+
+// Starts `stop` on the strings and tokens `r` lists (inactive without any).
+// Returns 0, or -7 if the lists are malformed.
+static int32_t request_stops(lb_ctx & c, const lb_request_params & r, LbStopMatcher & stop) {
+    if (r.n_stop < 0 || r.n_stop_tokens < 0) return -7;
+    if ((r.n_stop > 0 && !r.stop) || (r.n_stop_tokens > 0 && !r.stop_tokens)) return -7;
+    if (r.n_stop == 0 && r.n_stop_tokens == 0) return 0;
+
+    // Length-prefixed, so no two lists share a key.
+    std::string key;
+    for (int32_t i = 0; i < r.n_stop; ++i) {
+        const char * p = r.stop[i] ? r.stop[i] : "";
+        key += std::to_string(std::strlen(p)) + ':' + p;
+    }
+    key += '\n';
+    for (int32_t i = 0; i < r.n_stop_tokens; ++i) key += std::to_string(r.stop_tokens[i]) + ',';
+    if (!c.stops || key != c.stops_key) {
+        std::vector<std::string> strings;
+        for (int32_t i = 0; i < r.n_stop; ++i) {
+            if (r.stop[i]) strings.emplace_back(r.stop[i]);
+        }
+        c.stops = std::make_shared<const LbStopSet>(
+            strings, std::vector<llama_token>(r.stop_tokens, r.stop_tokens + r.n_stop_tokens));
+        c.stops_key = std::move(key);
+    }
+    stop.begin(c.stops);
+    return 0;
+}
+
+// Starts a request's grammar and stop sequences from `req` (may be null).
+// Returns 0, or -7 if the params, the grammar or the stop lists are rejected.
+static int32_t request_begin(lb_ctx & c, const lb_request_params * req, LbGrammarState & grammar,
+                             LbStopMatcher & stop) {
+    grammar.reset();
+    stop.reset();
+    lb_request_params r;
+    if (!request_params_copy(r, req)) return -7;
+    if (request_stops(c, r, stop) != 0) return -7;
+    return request_grammar(c, r, grammar);
+}
+
+// --------------------------- Non-streaming -------------------------------
+// `sampling` and `req` may be null (greedy, unconstrained). The result stays
+// valid until the next call on `ctx`.
+extern "C" __attribute__((visibility("default")))
+const char* lb_ctx_eval_req(lb_ctx* ctx, const char* prompt_cstr, int max_tokens,
+                            const lb_sampling_params* sampling, const lb_request_params* req) {
+    if (!ctx) return "Model not loaded.";
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    std::string & result = c.eval_result; result.clear();
+    if (!c.ctx) { result = "Model not loaded."; return result.c_str(); }
+    if (c.n_open > 0) { result = "Busy: streams are open."; return result.c_str(); }
+    if (!prompt_cstr) prompt_cstr = "";
+    if (request_begin(c, req, c.eval_grammar, c.eval_stop) != 0) {
+        result = "Invalid request params."; return result.c_str();
+    }
+
+    const llama_vocab * vocab = ctx_vocab(c);
+    progress_begin(c);
+    c.req_t0 = LbClock::now();
+    c.st.requests++;
+
+    // tokenize prompt
+    std::vector<llama_token> & prompt_tokens = c.eval_prompt;
+    const bool tok_ok = tokenize_into(vocab, prompt_cstr, prompt_tokens);
+    c.st.tokenize_ms += lb_ms_since(c.req_t0);
+    if (!tok_ok) {
+        stats_commit(c);
+        result = "Tokenization failed."; return result.c_str();
+    }
+
+    // feed prompt (only the part not already in the KV cache)
+    int n_reused = 0;
+    const int32_t prc = prefill_reuse(c, prompt_tokens, &n_reused);
+    stats_commit(c);
+    if (prc == -4) { cancel_consume(c); result = "Cancelled."; return result.c_str(); }
+    if (prc == -5) { result = "Prompt is longer than the context."; return result.c_str(); }
+    if (prc != 0)  { result = "Decode failed on prompt."; return result.c_str(); }
+
+    const lb_sampling_params sp = sampling ? *sampling : greedy_params();
+    c.eval_sampler.begin(sp, prompt_tokens.data(), (int32_t)prompt_tokens.size());
+
+    std::vector<llama_token> & gen = c.eval_gen; gen.clear();
+    LbStreamDetok & dt = c.eval_detok; dt.reset();
+    decode_timer_start(c);
+
+    for (int t = 0; t < max_tokens; ++t) {
+        if (c.cancel.load(std::memory_order_relaxed)) break;
+        float * logits = llama_get_logits_ith(c.ctx, -1);
+        if (!logits) { result = "No logits."; return result.c_str(); }
+
+        LbClock::time_point t0 = LbClock::now();
+        const llama_token next = sample_constrained(c, c.eval_sampler, c.eval_grammar, logits);
+        c.st.sample_ms += lb_ms_since(t0);
+        if (next < 0) { LOGE("eval: grammar allows no token"); break; }
+        if (llama_vocab_is_eog(vocab, next) || c.eval_stop.is_stop_token(next)) break;
+
+        c.eval_sampler.accept(next);
+        if (c.eval_grammar.active()) c.eval_grammar.accept(*c.trie, next);
+        gen.push_back(next);
+        stats_token(c, c.req_t0, c.tok_t_last, gen.size() == 1);
+
+        // feed back next token (shifts the context when it is full)
+        t0 = LbClock::now();
+        const int32_t drc = decode_append(c, 0, &next, 1);
+        c.st.decode_ms += lb_ms_since(t0);
+        if (drc == -5) {  // context full: `next` is accepted, so it still ends the reply
+            lb_detok_step(dt, c.eval_stop, vocab, next, result);
+            break;
+        }
+        if (drc != 0) break;
+        decode_timer_tick(c, (int)gen.size());
+
+        // Incremental detok: only the new token's piece is converted
+        t0 = LbClock::now();
+        const bool hit = lb_detok_step(dt, c.eval_stop, vocab, next, result);
+        c.st.detok_ms += lb_ms_since(t0);
+
+        if (hit || (c.eval_grammar.active() && !c.eval_grammar.can_continue())) break;
+    }
+
+    lb_detok_flush(dt, c.eval_stop, result);
+    c.eval_grammar.reset();
+    c.eval_stop.reset();
+    cancel_consume(c);
+    stats_commit(c);
+    return result.c_str();
+}
+
+extern "C" __attribute__((visibility("default")))
+const char* lb_ctx_eval(lb_ctx* ctx, const char* prompt_cstr, int max_tokens,
+                        const lb_sampling_params* sampling) {
+    return lb_ctx_eval_req(ctx, prompt_cstr, max_tokens, sampling, nullptr);
+}
+
+// ------------------------------ Streaming --------------------------------
+// `sampling` and `req` may be null (greedy, unconstrained); both are
+// copied, the caller keeps ownership. Single stream on seq 0, driven by
+// lb_ctx_stream_next(). For several concurrent streams use
+// lb_ctx_stream_open() instead.
+// Returns 0, or -1 not loaded / scheduler streams open, -2 tokenization
+// failed, -3 decode failed, -4 cancelled during prefill, -5 prompt longer
+// than the context (shifting off), -7 request params or grammar rejected.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_stream_begin_req(lb_ctx* ctx, const char* prompt_cstr, int max_tokens,
+                            const lb_sampling_params* sampling, const lb_request_params* req) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.n_open > 0) return -1;
+    if (!prompt_cstr) prompt_cstr = "";
+
+    stream_reset(c);
+    if (request_begin(c, req, c.stream_grammar, c.stream_stop) != 0) return -7;
+    progress_begin(c);
+    c.req_t0 = LbClock::now();
+    c.st.requests++;
+
+    // tokenize prompt
+    const bool tok_ok = tokenize_into(ctx_vocab(c), prompt_cstr, c.stream_prompt);
+    c.st.tokenize_ms += lb_ms_since(c.req_t0);
+    if (!tok_ok) { stats_commit(c); return -2; }
+
+    // feed prompt (only the part not already in the KV cache)
+    int n_reused = 0;
+    const int32_t prc = prefill_reuse(c, c.stream_prompt, &n_reused);
+    stats_commit(c);
+    if (prc == -4) { cancel_consume(c); return -4; }
+    if (prc == -5) return prc;
+    if (prc != 0) return -3;
+
+    c.stream_sampler.begin(sampling ? *sampling : greedy_params(),
+                           c.stream_prompt.data(), (int32_t)c.stream_prompt.size());
+
+    c.stream_running   = true;
+    c.stream_remaining = std::max(1, max_tokens);
+    c.stream_gen.clear();
+    decode_timer_start(c);
+    return 0;
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_stream_begin(lb_ctx* ctx, const char* prompt_cstr, int max_tokens,
+                        const lb_sampling_params* sampling) {
+    return lb_ctx_stream_begin_req(ctx, prompt_cstr, max_tokens, sampling, nullptr);
+}
+
+// returns: nullptr=hard error; ""=no new chars yet / finished; else text delta
+// to append (valid until the next call on `ctx`)
+extern "C" __attribute__((visibility("default")))
+const char* lb_ctx_stream_next(lb_ctx* ctx) {
+    if (!ctx) return nullptr;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    std::string & delta = c.stream_delta; delta.clear();
+
+    if (!c.ctx) return nullptr;
+    if (!c.stream_running)  { return ""; }
+    if (c.cancel.load(std::memory_order_relaxed)) {
+        stream_reset(c); cancel_consume(c); return "";
+    }
+    if (c.stream_remaining <= 0) {
+        c.stream_running = false; return "";
+    }
+
+    const llama_vocab * vocab = ctx_vocab(c);
+
+    float * logits = llama_get_logits_ith(c.ctx, -1);
+    if (!logits) { c.stream_running = false; return nullptr; }
+
+    LbClock::time_point t = LbClock::now();
+    const llama_token next = sample_constrained(c, c.stream_sampler, c.stream_grammar, logits);
+    c.st.sample_ms += lb_ms_since(t);
+    if (next < 0) {
+        LOGE("stream: grammar allows no token");
+        c.stream_running = false;
+        stats_commit(c);
+        return nullptr;
+    }
+    if (llama_vocab_is_eog(vocab, next) || c.stream_stop.is_stop_token(next)) {
+        c.stream_running = false;
+        stats_commit(c);
+        lb_detok_flush(c.stream_detok, c.stream_stop, delta);
+        return delta.c_str();
+    }
+
+    c.stream_sampler.accept(next);
+    if (c.stream_grammar.active()) c.stream_grammar.accept(*c.trie, next);
+    c.stream_gen.push_back(next);
+    stats_token(c, c.req_t0, c.tok_t_last, c.stream_gen.size() == 1);
+
+    // feed it back (shifts the context when it is full); a full context
+    // that cannot shift ends the stream normally
+    t = LbClock::now();
+    const int32_t drc = decode_append(c, 0, &next, 1);
+    c.st.decode_ms += lb_ms_since(t);
+    stats_commit(c);
+    if (drc == 2)  { stream_reset(c); cancel_consume(c); return ""; }  // cancelled mid-decode
+    if (drc == -5) {  // `next` is accepted: release it before ending
+        c.stream_running = false;
+        lb_detok_step(c.stream_detok, c.stream_stop, vocab, next, delta);
+        lb_detok_flush(c.stream_detok, c.stream_stop, delta);
+        return delta.c_str();
+    }
+    if (drc != 0)  { c.stream_running = false; return nullptr; }
+
+    c.stream_remaining -= 1;
+    decode_timer_tick(c, (int)c.stream_gen.size());
+
+    // Incremental detok: convert only the new token, emit complete UTF-8
+    // that is not (the start of) a stop string
+    t = LbClock::now();
+    const bool hit = lb_detok_step(c.stream_detok, c.stream_stop, vocab, next, delta);
+    c.st.detok_ms += lb_ms_since(t);
+
+    if (hit || c.stream_remaining <= 0 ||
+        (c.stream_grammar.active() && !c.stream_grammar.can_continue())) {
+        c.stream_running = false;
+        lb_detok_flush(c.stream_detok, c.stream_stop, delta);
+    }
+
+    return delta.c_str();
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_stream_is_running(lb_ctx* ctx) {
+    if (!ctx) return 0;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    return (ctx->stream_running && !ctx->cancel.load(std::memory_order_relaxed)) ? 1 : 0;
+}
+
+// Safe to call from any thread/isolate: only raises a flag, which aborts a
+// prefill or decode in flight within one graph node. The stream ends at the
+// next lb_ctx_stream_next(); the KV cache keeps what was fully decoded. A
+// cancel raised between requests stops the next eval or stream.
+extern "C" __attribute__((visibility("default")))
+void lb_ctx_stream_cancel(lb_ctx* ctx) {
+    if (ctx) ctx->cancel.store(true, std::memory_order_relaxed);
+}
+
+// Safe to call from any thread/isolate while a request is running.
+extern "C" __attribute__((visibility("default")))
+void lb_ctx_stream_get_progress(lb_ctx* ctx, lb_progress* out) {
+    if (!out) return;
+    *out = lb_progress{};
+    if (!ctx) return;
+    out->prefill_done   = ctx->prefill_done.load(std::memory_order_relaxed);
+    out->prefill_total  = ctx->prefill_total.load(std::memory_order_relaxed);
+    out->prefill_reused = ctx->prefill_reused.load(std::memory_order_relaxed);
+    out->prefill_tok_s  = ctx->prefill_tok_s.load(std::memory_order_relaxed);
+    out->decode_tokens  = ctx->decode_tokens.load(std::memory_order_relaxed);
+    out->decode_tok_s   = ctx->decode_tok_s.load(std::memory_order_relaxed);
+}
+
+// ------------------------------ Scheduler --------------------------------
+// Continuous batching: every open stream owns one KV sequence, and each
+// lb_ctx_step() issues a single llama_decode carrying the next token of every
+// generating stream plus, in the room left in n_batch, the next prompt chunk
+// of streams still prefilling. Streams are opened and closed between steps,
+// so a long prompt is fed over several steps without stalling the others.
+// Decoding k sequences together costs little more than decoding one (the
+// weights are read once per step), so total tokens/s grows with k.
+//
+// Typical loop: lb_ctx_stream_open() per request, then lb_ctx_step() while it
+// returns > 0, draining each stream with lb_ctx_stream_read() after every
+// step, and lb_ctx_stream_close() once a stream reports a final status.
+
+// Open slot for `id`, or null (unknown, closed or reused). Lock-free: the
+// slot array only changes in ctx_create, which needs every stream closed.
+static LbSlot * slot_of(lb_ctx & c, int32_t id) {
+    if (id < 0 || !c.slots) return nullptr;
+    const size_t i = (size_t)(id % LB_MAX_STREAMS);
+    if (i >= c.seqs.size()) return nullptr;
+    LbSlot & s = c.slots[i];
+    return s.id.load() == id ? &s : nullptr;
+}
+
+static bool slot_active(const LbSlot & s) {
+    const int32_t st = s.status.load(std::memory_order_relaxed);
+    return st == LB_STREAM_PREFILL || st == LB_STREAM_DECODE;
+}
+
+static int count_active(lb_ctx & c) {
+    int n = 0;
+    for (size_t i = 0; i < c.seqs.size(); ++i) {
+        if (c.slots[i].id.load() >= 0 && slot_active(c.slots[i])) ++n;
+    }
+    return n;
+}
+
+// Prompt-lookup index. Keys hash an n-gram together with its length.
+static uint64_t ngram_key(const llama_token * t, int n) {
+    uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t)n;
+    for (int i = 0; i < n; ++i) h = (h ^ (uint32_t)t[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// Indexes the n-grams ending at hist[e]; hist[e + 1] continues them.
+static void lookup_index(const lb_ctx & c, LbSlot & s, size_t e) {
+    for (int n = c.lookup.ngram_min; n <= c.lookup.ngram_max && (size_t)n <= e + 1; ++n) {
+        s.ngrams[ngram_key(&s.hist[e + 1 - (size_t)n], n)] = (int32_t)(e + 1);
+    }
+}
+
+static void lookup_begin(const lb_ctx & c, LbSlot & s, const std::vector<llama_token> & prompt) {
+    s.hist.assign(prompt.begin(), prompt.end());
+    s.ngrams.clear();
+    for (size_t e = 0; e + 1 < s.hist.size(); ++e) lookup_index(c, s, e);
+}
+
+static void lookup_push(const lb_ctx & c, LbSlot & s, llama_token t) {
+    s.hist.push_back(t);
+    if (s.hist.size() >= 2) lookup_index(c, s, s.hist.size() - 2);
+}
+
+// Emits the slot's next token: it becomes `pending` and its text is queued.
+// Same stop rules as lb_ctx_stream_next(). Returns false once the stream
+// has ended (end of generation, a stop string or token, max tokens or the
+// end of its grammar).
+static bool slot_emit(lb_ctx & c, LbSlot & s, llama_token next) {
+    const llama_vocab * vocab = ctx_vocab(c);
+    if (llama_vocab_is_eog(vocab, next) || s.stop.is_stop_token(next)) {
+        lb_detok_flush(s.detok, s.stop, s.out);
+        s.status = LB_STREAM_DONE;
+        return false;
+    }
+
+    s.sampler.accept(next);
+    if (s.grammar.active()) s.grammar.accept(*c.trie, next);
+    if (c.lookup_on) lookup_push(c, s, next);
+    s.gen.push_back(next);
+    s.pending = next;
+    s.remaining -= 1;
+    stats_token(c, s.t_open, s.t_last, s.gen.size() == 1);
+
+    const LbClock::time_point t = LbClock::now();
+    const bool hit = lb_detok_step(s.detok, s.stop, vocab, next, s.out);
+    c.st.detok_ms += lb_ms_since(t);
+
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - s.t_decode).count();
+    s.decode_tokens = (int32_t)s.gen.size();
+    s.decode_tok_s  = secs > 0.0 ? (float)(s.gen.size() / secs) : 0.0f;
+
+    const bool stop = hit || s.remaining <= 0 || (s.grammar.active() && !s.grammar.can_continue());
+    if (stop) lb_detok_flush(s.detok, s.stop, s.out);
+    s.status = stop ? LB_STREAM_DONE : LB_STREAM_DECODE;
+    return !stop;
+}
+
+// Samples the slot's next token from its logits row.
+static void slot_sample(lb_ctx & c, LbSlot & s) {
+    float * logits = llama_get_logits_ith(c.ctx, s.i_logits);
+    s.i_logits = -1;
+    if (!logits) { s.status = LB_STREAM_ERROR; return; }
+    const LbClock::time_point t = LbClock::now();
+    const llama_token next = sample_constrained(c, s.sampler, s.grammar, logits);
+    c.st.sample_ms += lb_ms_since(t);
+    if (next < 0) {
+        LOGE("stream %d: grammar allows no token", (int)s.id.load());
+        s.status = LB_STREAM_ERROR;
+        return;
+    }
+    slot_emit(c, s, next);
+}
+
+// Speculative decoding. With a draft attached, a generating stream's part of
+// the step batch becomes [pending, d1..dk]: the draft model proposes d1..dk
+// (k draft decodes per step, batched across streams), the target scores all
+// k+1 positions in the step's one llama_decode, and the stream keeps the
+// proposals the target agrees with plus one token of the target's own.
+// Greedy streams accept d_j only if it is the target's argmax, so their
+// output is the same as without a draft. Sampling streams use the standard
+// rejection scheme (accept with probability min(1, p/q), otherwise draw from
+// max(0, p - q)), which leaves the output distribution unchanged. Rejected
+// cells are removed from the target's cache at once; the draft sequence is
+// trimmed to its common prefix with the target before the next proposal.
+
+// Token ids must mean the same in both models (the checks of llama.cpp's
+// speculative example): tokenizer type, special tokens, vocab sizes within
+// LB_SPEC_VOCAB_MAX_DIFF and identical token texts on the shared range.
+#define LB_SPEC_VOCAB_MAX_DIFF 128
+static bool draft_compatible(const llama_model * tgt, const llama_model * dft) {
+    const llama_vocab * vt = llama_model_get_vocab(tgt);
+    const llama_vocab * vd = llama_model_get_vocab(dft);
+    if (llama_vocab_type(vt) != llama_vocab_type(vd)) return false;
+    const bool add_bos = llama_vocab_get_add_bos(vt);
+    const bool add_eos = llama_vocab_get_add_eos(vt);
+    if (add_bos != llama_vocab_get_add_bos(vd) || add_eos != llama_vocab_get_add_eos(vd)) return false;
+    if (add_bos && llama_vocab_bos(vt) != llama_vocab_bos(vd)) return false;
+    if (add_eos && llama_vocab_eos(vt) != llama_vocab_eos(vd)) return false;
+    const int nt = llama_vocab_n_tokens(vt);
+    const int nd = llama_vocab_n_tokens(vd);
+    if (std::abs(nt - nd) > LB_SPEC_VOCAB_MAX_DIFF) return false;
+    for (int i = 0; i < std::min(nt, nd); ++i) {
+        if (std::strcmp(llama_vocab_get_text(vt, i), llama_vocab_get_text(vd, i)) != 0) return false;
+    }
+    return true;
+}
+
+// Brings draft sequence `seq` to the slot's committed tokens (the target's
+// cache plus `pending`), decoding what it lacks in n_batch chunks, so the
+// draft's last logits row predicts the token after `pending`. Usually one
+// or two tokens; the whole prompt on a stream's first step and after a
+// context shift of the target.
+static bool draft_sync(lb_ctx & c, llama_seq_id seq, const LbSlot & s) {
+    lb_ctx & d = *c.draft;
+    const std::vector<llama_token> & tgt = c.seqs[(size_t)seq].tokens;
+    std::vector<llama_token> & kv = d.seqs[(size_t)seq].tokens;
+    const size_t n = tgt.size() + 1;
+    const size_t m = std::min(kv.size(), n);
+    size_t lcp = 0;
+    while (lcp < m && kv[lcp] == (lcp < tgt.size() ? tgt[lcp] : s.pending)) ++lcp;
+    if (lcp == n) --lcp;  // its logits must be current
+    if (lcp < kv.size()) {
+        if (llama_kv_self_seq_rm(d.ctx, seq, (llama_pos)lcp, -1)) {
+            kv.resize(lcp);
+        } else {
+            seq_clear(d, seq);
+            lcp = 0;
+        }
+    }
+
+    std::vector<llama_token> & tail = c.spec_tail;
+    tail.assign(tgt.begin() + (std::ptrdiff_t)lcp, tgt.end());
+    tail.push_back(s.pending);
+    const size_t chunk = (size_t)std::max(1, d.batch.cap);
+    for (size_t i = 0; i < tail.size(); i += chunk) {
+        const size_t len = std::min(chunk, tail.size() - i);
+        if (decode_tokens(d, seq, tail.data() + i, (int)len, (int)(lcp + i), i + len == tail.size()) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends the slot's next proposal, drawn from a draft logits row. Ends the
+// slot's drafting on a missing row or an end-of-generation proposal.
+static void spec_propose(lb_ctx & c, LbSlot & s, float * logits) {
+    if (!logits) { s.n_draft = (int32_t)s.draft.size(); return; }
+    llama_token t;
+    if (s.sampler.greedy()) {
+        t = s.draft_sampler.sample(logits);
+    } else {
+        const int32_t * ids;
+        const float *   p;
+        const int32_t n = s.draft_sampler.probs(logits, &ids, &p);
+        t = ids[s.draft_sampler.draw(p, n)];
+        s.q_off.push_back((int32_t)s.q_id.size());
+        s.q_id.insert(s.q_id.end(), ids, ids + n);
+        s.q_p.insert(s.q_p.end(), p, p + n);
+    }
+    s.draft.push_back(t);
+    if (llama_vocab_is_eog(ctx_vocab(*c.draft), t)) s.n_draft = (int32_t)s.draft.size();
+}
+
+// Proposes up to `k` tokens that followed the latest earlier occurrence of
+// the longest trailing n-gram of the slot's history (which ends with
+// `pending`). Returns the number proposed, 0 without a match. As proposals
+// are deterministic, q is 1 for the proposed token.
+static int lookup_propose(const lb_ctx & c, LbSlot & s, int k) {
+    if (k <= 0) return 0;
+    const std::vector<llama_token> & h = s.hist;
+    const size_t len = h.size();
+    for (int n = c.lookup.ngram_max; n >= c.lookup.ngram_min; --n) {
+        if ((size_t)n > len) continue;
+        const auto it = s.ngrams.find(ngram_key(&h[len - (size_t)n], n));
+        if (it == s.ngrams.end()) continue;
+        const size_t p = (size_t)it->second;
+        if (!std::equal(h.begin() + (std::ptrdiff_t)(p - (size_t)n), h.begin() + (std::ptrdiff_t)p,
+                        h.end() - n)) continue;  // hash collision
+        const int m = (int)std::min((size_t)k, len - p);
+        for (int j = 0; j < m; ++j) {
+            s.draft.push_back(h[p + (size_t)j]);
+            if (!s.sampler.greedy()) {
+                s.q_off.push_back((int32_t)s.q_id.size());
+                s.q_id.push_back(h[p + (size_t)j]);
+                s.q_p.push_back(1.0f);
+            }
+        }
+        return m;
+    }
+    return 0;
+}
+
+// Fills every generating stream's proposals for this step: from the prompt
+// lookup when it matches, otherwise from the draft model. The budget is the
+// batch room left after one token per generating stream; streams near their
+// token limit or the end of their sequence propose less.
+static void spec_draft(lb_ctx & c) {
+    const int n = (int)c.seqs.size();
+    int room = c.batch.cap;
+    for (int i = 0; i < n; ++i) {
+        LbSlot & s = c.slots[(size_t)i];
+        s.n_draft = 0;
+        s.draft.clear();
+        s.q_off.clear(); s.q_id.clear(); s.q_p.clear();
+        s.spec_lookup = false;
+        if (s.id.load() >= 0 && s.status.load() == LB_STREAM_DECODE) room--;
+    }
+
+    // lookup proposals, or the first draft proposal from each stream's sync decode
+    for (int i = 0; i < n; ++i) {
+        LbSlot & s = c.slots[(size_t)i];
+        if (s.id.load() < 0 || s.status.load() != LB_STREAM_DECODE) continue;
+        if (s.cancel.load(std::memory_order_relaxed)) continue;
+        if (s.grammar.active()) continue;  // proposals are not checked against it
+        // Stop short of a context shift: the plain step then shifts exactly
+        // where it would without proposals, which keeps greedy output identical.
+        int cells = c.seq_cap - (int)c.seqs[(size_t)i].tokens.size() - 1;
+        if (c.lookup_on) {
+            const int m = lookup_propose(c, s, std::min({(int)c.lookup.n_draft_max, s.remaining - 1, room, cells}));
+            if (m > 0) {
+                room -= m;
+                s.n_draft = m;
+                s.spec_lookup = true;
+                continue;
+            }
+        }
+        if (!c.draft) continue;
+        cells = std::min(cells, c.draft->seq_cap - (int)c.seqs[(size_t)i].tokens.size() - 1);
+        const int k = std::min({(int)s.spec_k.load(), s.remaining - 1, room, cells});
+        if (k <= 0) continue;
+        if (!draft_sync(c, i, s)) continue;
+        room -= k;
+        s.n_draft = k;
+        spec_propose(c, s, llama_get_logits_ith(c.draft->ctx, -1));
+    }
+
+    // the rest: one draft decode per position across all drafting streams
+    if (!c.draft) return;
+    lb_ctx & d = *c.draft;
+    int row[LB_MAX_STREAMS];
+    BatchArena & b = d.batch;
+    for (int j = 1; ; ++j) {
+        b.clear();
+        for (int i = 0; i < n; ++i) {
+            LbSlot & s = c.slots[(size_t)i];
+            row[i] = -1;
+            if (s.n_draft <= j || (int)s.draft.size() != j) continue;
+            if (!b.add(s.draft[(size_t)j - 1], (llama_pos)d.seqs[(size_t)i].tokens.size(), i, true)) {
+                s.n_draft = j;
+                continue;
+            }
+            row[i] = b.batch.n_tokens - 1;
+        }
+        if (b.batch.n_tokens == 0) break;
+        const bool ok = llama_decode(d.ctx, b.batch) == 0;
+        for (int i = 0; i < n; ++i) {
+            if (row[i] < 0) continue;
+            LbSlot & s = c.slots[(size_t)i];
+            if (!ok) {  // keep the proposals so far; resync next step
+                seq_clear(d, i);
+                s.n_draft = j;
+                continue;
+            }
+            d.seqs[(size_t)i].tokens.push_back(s.draft[(size_t)j - 1]);
+            spec_propose(c, s, llama_get_logits_ith(d.ctx, row[i]));
+        }
+        if (!ok) break;
+    }
+    for (int i = 0; i < n; ++i) c.slots[(size_t)i].n_draft = (int32_t)c.slots[(size_t)i].draft.size();
+}
 
-// streaming state
-static bool g_stream_running = false;
-static int  g_stream_remaining = 0;
-static std::vector<llama_token> g_stream_prompt;
-static std::vector<llama_token> g_stream_gen;
-static int  g_stream_pos = 0;                   // absolute position in sequence
-static size_t g_stream_emitted_chars = 0;       // how many chars already sent to client
+// The target's verdict on proposal j: draft[j] if accepted, otherwise the
+// replacement token.
+static llama_token spec_accept(lb_ctx & c, LbSlot & s, int j, float * logits) {
+    if (s.sampler.greedy()) return s.sampler.sample(logits);
 
-// ------------------------------ Tunables ---------------------------------
-static const int   EARLY_MIN_CHARS      = 16;   // don’t stop too early
-static const int   EARLY_MIN_TOKENS     = 8;
-static const bool  STOP_ON_DOUBLE_NL    = true;
-static const bool  STOP_ON_SENTENCE_END = true; // stop after .!? if enough text
+    const llama_token d = s.draft[(size_t)j];
+    const int32_t * ids;
+    const float *   p;
+    const int32_t n = s.sampler.probs(logits, &ids, &p);
+    const size_t q0 = (size_t)s.q_off[(size_t)j];
+    const size_t q1 = (size_t)j + 1 < s.q_off.size() ? (size_t)s.q_off[(size_t)j + 1] : s.q_id.size();
+    auto q_of = [&](int32_t tok) {
+        for (size_t t = q0; t < q1; ++t) {
+            if (s.q_id[t] == tok) return s.q_p[t];
+        }
+        return 0.0f;
+    };
 
-// ------------------------------ Utils -----------------------------------
-static std::string detok(const llama_vocab * vocab,
-                         const std::vector<llama_token> & toks,
-                         bool remove_special = true,
-                         bool unparse_special = false) {
-    if (toks.empty()) return {};
-    int need = llama_detokenize(vocab, toks.data(), (int32_t)toks.size(),
-                                nullptr, 0, remove_special, unparse_special);
-    if (need < 0) {
-        int len = -need + 1;
-        std::string out(len, '\0');
-        int got = llama_detokenize(vocab, toks.data(), (int32_t)toks.size(),
-                                   out.data(), len, remove_special, unparse_special);
-        if (got > 0 && got <= len) { out.resize(got); return out; }
-        return {};
-    } else if (need == 0) {
-        return {};
-    } else {
-        std::string out(need, '\0');
-        int got = llama_detokenize(vocab, toks.data(), (int32_t)toks.size(),
-                                   out.data(), need, remove_special, unparse_special);
-        if (got > 0 && got <= need) { out.resize(got); return out; }
-        return {};
+    float pd = 0.0f;
+    for (int32_t t = 0; t < n; ++t) {
+        if (ids[t] == d) { pd = p[t]; break; }
     }
-}
+    const float qd = q_of(d);
+    if (qd > 0.0f && s.sampler.next_uniform() * qd < pd) return d;
 
-static inline void kv_clear() {
-    // If your headers have llama_memory_clear(g_ctx), prefer that.
-    // This call exists across many versions (deprecated on newest).
-    llama_kv_self_clear(g_ctx);
+    std::vector<float> & r = c.spec_resid;
+    r.resize((size_t)n);
+    float sum = 0.0f;
+    for (int32_t t = 0; t < n; ++t) {
+        r[(size_t)t] = std::max(0.0f, p[t] - q_of(ids[t]));
+        sum += r[(size_t)t];
+    }
+    return ids[sum > 0.0f ? s.sampler.draw(r.data(), n) : s.sampler.draw(p, n)];
 }
 
-static void stream_reset() {
-    g_stream_running = false;
-    g_stream_remaining = 0;
-    g_stream_prompt.clear();
-    g_stream_gen.clear();
-    g_stream_pos = 0;
-    g_stream_emitted_chars = 0;
+// Checks the step's proposals against the target rows for [pending, d1..dk]
+// and emits the accepted prefix plus one target token (the next `pending`).
+// Cells of rejected proposals are removed from the target's cache.
+static void slot_verify(lb_ctx & c, llama_seq_id seq, LbSlot & s) {
+    std::vector<llama_token> & kv = c.seqs[(size_t)seq].tokens;
+    kv.push_back(s.pending);
+    const int    k       = s.n_draft;
+    const size_t n_cells = kv.size() + (size_t)k;  // filled by the batch
+    int acc = 0;
+    for (int j = 0; j <= k; ++j) {
+        float * logits = llama_get_logits_ith(c.ctx, s.i_logits + j);
+        if (!logits) { s.status = LB_STREAM_ERROR; break; }
+        const LbClock::time_point t = LbClock::now();
+        const llama_token next = j < k ? spec_accept(c, s, j, logits) : s.sampler.sample(logits);
+        c.st.sample_ms += lb_ms_since(t);
+        const bool hit = j < k && next == s.draft[(size_t)j];
+        if (hit) { kv.push_back(next); ++acc; }
+        if (!slot_emit(c, s, next) || !hit) break;
+    }
+    s.i_logits = -1;
+    if (kv.size() < n_cells && !llama_kv_self_seq_rm(c.ctx, seq, (llama_pos)kv.size(), -1)) {
+        seq_clear(c, seq);
+        s.status = LB_STREAM_ERROR;
+    }
+
+    s.spec_steps.fetch_add(1, std::memory_order_relaxed);
+    s.spec_drafted.fetch_add(k, std::memory_order_relaxed);
+    s.spec_accepted.fetch_add(acc, std::memory_order_relaxed);
+    if (c.spec.adaptive && !s.spec_lookup) {
+        const int32_t cur = s.spec_k.load();
+        s.spec_k = acc == k ? std::min(cur + 2, c.spec.n_draft_max) : std::max(1, cur - 1);
+    }
 }
 
-static bool should_stop_early(const std::string &full_text, int n_gen_tokens) {
-    if ((int)full_text.size() < EARLY_MIN_CHARS || n_gen_tokens < EARLY_MIN_TOKENS) return false;
-    if (STOP_ON_DOUBLE_NL) {
-        if (full_text.find("\n\n") != std::string::npos) return true;
+// Queues a stream; its prompt is decoded by the following lb_ctx_step()
+// calls. The stream gets the free sequence sharing the longest prefix with
+// the prompt (least recently used on ties), so a follow-up turn of a
+// conversation lands where its history is already cached. `sampling` and
+// `req` may be null (greedy, unconstrained). Sets *out_id; `id %
+// LB_MAX_STREAMS` is its KV sequence.
+// Returns 0, or -1 not loaded / single stream running, -2 tokenization
+// failed, -5 prompt longer than a sequence (shifting off), -6 every
+// sequence is in use (retry after a close), -7 request params or grammar
+// rejected.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_stream_open_req(lb_ctx* ctx, const char* prompt_cstr, int max_tokens,
+                           const lb_sampling_params* sampling, const lb_request_params* req,
+                           int32_t* out_id) {
+    if (!ctx || !out_id) return -1;
+    *out_id = -1;
+    ApiLock lock(*ctx);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.stream_running) return -1;
+    if (!prompt_cstr) prompt_cstr = "";
+
+    const llama_vocab * vocab = ctx_vocab(c);
+    const LbClock::time_point t_open = LbClock::now();
+    std::vector<llama_token> & toks = c.eval_prompt;
+    const bool tok_ok = tokenize_into(vocab, prompt_cstr, toks);
+    c.st.tokenize_ms += lb_ms_since(t_open);
+    if (!tok_ok || toks.empty()) return -2;
+    if ((int)toks.size() > c.seq_cap && c.shift_keep < 0) return -5;
+
+    int best = -1;
+    size_t best_lcp = 0;
+    for (size_t i = 0; i < c.seqs.size(); ++i) {
+        if (c.slots[i].id.load() >= 0) continue;
+        const std::vector<llama_token> & kv = c.seqs[i].tokens;
+        const size_t m = std::min(kv.size(), toks.size());
+        size_t lcp = 0;
+        while (lcp < m && kv[lcp] == toks[lcp]) ++lcp;
+        if (best < 0 || lcp > best_lcp ||
+            (lcp == best_lcp && c.slots[i].last_used < c.slots[(size_t)best].last_used)) {
+            best = (int)i;
+            best_lcp = lcp;
+        }
+    }
+    if (best < 0) return -6;
+
+    LbSlot & s = c.slots[(size_t)best];
+    if (request_begin(c, req, s.grammar, s.stop) != 0) return -7;
+    if (!s.sampler_ready) {
+        s.sampler.init(llama_vocab_n_tokens(vocab), c.seq_cap);
+        s.gen.reserve((size_t)c.seq_cap);
+        s.sampler_ready = true;
     }
-    if (STOP_ON_SENTENCE_END) {
-        char c = full_text.empty() ? '\0' : full_text.back();
-        if (c == '.' || c == '!' || c == '?') return true;
+    s.sampler.begin(sampling ? *sampling : greedy_params(), toks.data(), (int32_t)toks.size());
+    if (c.draft) {
+        if (!s.draft_ready) {
+            s.draft_sampler.init(llama_vocab_n_tokens(ctx_vocab(*c.draft)), c.seq_cap);
+            s.draft_ready = true;
+        }
+        // proposals need no penalty history (it could not be rolled back)
+        lb_sampling_params dp = s.sampler.params();
+        dp.repeat_penalty    = 1.0f;
+        dp.frequency_penalty = 0.0f;
+        dp.presence_penalty  = 0.0f;
+        if (dp.seed != LB_SEED_RANDOM) dp.seed ^= 0x9E3779B9u;
+        s.draft_sampler.begin(dp, nullptr, 0);
     }
-    return false;
+    if (c.lookup_on) lookup_begin(c, s, toks);
+    s.n_draft = 0;
+    s.spec_k = s.grammar.active() ? 0 : c.draft ? c.spec.n_draft : c.lookup_on ? c.lookup.n_draft_max : 0;
+    s.spec_steps = s.spec_drafted = s.spec_accepted = 0;
+
+    int lcp = 0, skipped = 0;
+    s.prompt   = prefill_match(c, best, toks, &lcp, &skipped);
+    s.n_fed    = lcp;
+    s.skipped  = skipped;
+    s.n_step   = 0;
+    s.i_logits = -1;
+    s.remaining = std::max(1, max_tokens);
+    s.gen.clear();
+    s.detok.reset();
+    s.out.clear();
+    s.read.clear();
+    s.port = 0;
+    s.posted_done = -1;
+    s.posted_end = false;
+    s.prefill_total  = (int32_t)toks.size();
+    s.prefill_reused = lcp + skipped;
+    s.prefill_done   = lcp + skipped;
+    s.prefill_tok_s  = 0.0f;
+    s.decode_tokens  = 0;
+    s.decode_tok_s   = 0.0f;
+    s.t_prefill = std::chrono::steady_clock::now();
+    s.t_open = t_open;
+    c.st.requests++;
+    s.last_used = ++c.tick;
+    s.cancel = false;
+    s.status = LB_STREAM_PREFILL;
+
+    c.serial = (c.serial + 1) % (INT32_MAX / LB_MAX_STREAMS);
+    const int32_t id = c.serial * LB_MAX_STREAMS + best;
+    s.id = id;  // published last: stop/poll see a fully reset slot
+    c.n_open++;
+    *out_id = id;
+    if (c.async_on) c.gen_cv.notify_one();
+    return 0;
 }
 
-// ----------------------------- Lifecycle --------------------------------
 extern "C" __attribute__((visibility("default")))
-int lb_load(const char* model_path_cstr) {
-    LOGI("[lb_load] path: %s", model_path_cstr ? model_path_cstr : "(null)");
-    if (!model_path_cstr || model_path_cstr[0] == '\0') return -1;
+int lb_ctx_stream_open(lb_ctx* ctx, const char* prompt_cstr, int max_tokens,
+                       const lb_sampling_params* sampling, int32_t* out_id) {
+    return lb_ctx_stream_open_req(ctx, prompt_cstr, max_tokens, sampling, nullptr, out_id);
+}
 
-    if (g_ctx)   { llama_free(g_ctx); g_ctx = nullptr; }
-    if (g_model) { llama_model_free(g_model); g_model = nullptr; }
+// One batched decode over all open streams; the caller holds `mu`.
+static int ctx_step(lb_ctx & c) {
+    if (!c.ctx) return -1;
+    const int n = (int)c.seqs.size();
+    LbClock::time_point t = LbClock::now();
+    if (c.draft || c.lookup_on) spec_draft(c);
+    c.st.decode_ms += lb_ms_since(t);
+    BatchArena & b = c.batch;
+    b.clear();
 
-    llama_backend_init();
+    // one token for every generating stream (plus its proposals)
+    for (int i = 0; i < n; ++i) {
+        LbSlot & s = c.slots[(size_t)i];
+        s.n_step = 0;
+        s.i_logits = -1;
+        if (s.id.load() < 0 || !slot_active(s)) continue;
+        if (s.cancel.load(std::memory_order_relaxed)) { s.status = LB_STREAM_CANCELLED; continue; }
+        if (s.status.load() != LB_STREAM_DECODE) continue;
+        if (!seq_reserve(c, i, 1)) {  // full context ends it normally
+            lb_detok_flush(s.detok, s.stop, s.out);
+            s.status = LB_STREAM_DONE;
+            continue;
+        }
+        const llama_pos pos = (llama_pos)c.seqs[(size_t)i].tokens.size();
+        if (!b.add(s.pending, pos, i, true)) continue;  // next step
+        s.i_logits = b.batch.n_tokens - 1;
+        for (int j = 0; j < s.n_draft; ++j) b.add(s.draft[(size_t)j], pos + 1 + j, i, true);
+        s.n_step = 1 + s.n_draft;
+    }
 
-    llama_model_params mparams = llama_model_default_params();
-    g_model = llama_model_load_from_file(model_path_cstr, mparams);
-    if (!g_model) {
-        LOGE("llama_model_load_from_file failed");
-        llama_backend_free();
-        return -2;
+    // prompt chunks in the room left; the first pick rotates between steps
+    for (int k = 0; k < n; ++k) {
+        const int i = (c.rr + k) % n;
+        LbSlot & s = c.slots[(size_t)i];
+        if (s.id.load() < 0 || s.status.load() != LB_STREAM_PREFILL) continue;
+        const int room = b.cap - b.batch.n_tokens;
+        if (room <= 0) break;
+        const int len = std::min(room, (int)s.prompt.size() - s.n_fed);
+        if (!seq_reserve(c, i, len)) {
+            LOGE("step: prompt of stream %d does not fit its sequence", (int)s.id.load());
+            s.status = LB_STREAM_ERROR;
+            continue;
+        }
+        const int  pos0 = (int)c.seqs[(size_t)i].tokens.size();
+        const bool last = s.n_fed + len == (int)s.prompt.size();
+        for (int t = 0; t < len; ++t) {
+            b.add(s.prompt[(size_t)(s.n_fed + t)], pos0 + t, i, last && t == len - 1);
+        }
+        if (last) s.i_logits = b.batch.n_tokens - 1;
+        s.n_step = len;
     }
+    c.rr = (c.rr + 1) % n;
+    if (b.batch.n_tokens == 0) return count_active(c);
 
-    llama_context_params cparams = llama_context_default_params();
-    g_ctx = llama_init_from_model(g_model, cparams);
-    if (!g_ctx) {
-        LOGE("llama_init_from_model failed");
-        llama_model_free(g_model); g_model = nullptr;
-        llama_backend_free();
-        return -3;
+    int n_prompt = 0;
+    for (int i = 0; i < n; ++i) {
+        const LbSlot & s = c.slots[(size_t)i];
+        if (s.n_step > 0 && s.status.load() == LB_STREAM_PREFILL) n_prompt += s.n_step;
+    }
+    t = LbClock::now();
+    c.stepping = true;
+    const int32_t rc = llama_decode(c.ctx, b.batch);
+    c.stepping = false;
+    (n_prompt > 0 ? c.st.prefill_ms : c.st.decode_ms) += lb_ms_since(t);
+    if (rc == 0) c.st.prefill_tokens += n_prompt;
+    if (rc == 2) {
+        // every stream in the batch was stopped: end them, keep their prefixes
+        for (int i = 0; i < n; ++i) {
+            LbSlot & s = c.slots[(size_t)i];
+            if (s.n_step == 0) continue;
+            seq_trim(c, i);
+            s.n_draft = 0;
+            s.i_logits = -1;
+            s.status = LB_STREAM_CANCELLED;
+        }
+        return count_active(c);
+    }
+    if (rc != 0) {
+        LOGE("step: llama_decode failed (%d) on %d tokens", rc, b.batch.n_tokens);
+        for (int i = 0; i < n; ++i) {
+            LbSlot & s = c.slots[(size_t)i];
+            if (s.n_step == 0) continue;
+            seq_clear(c, i);
+            s.status = LB_STREAM_ERROR;
+        }
+        return count_active(c);
     }
 
-    stream_reset();
-    LOGI("model+context created OK");
-    return 0;
+    for (int i = 0; i < n; ++i) {
+        LbSlot & s = c.slots[(size_t)i];
+        if (s.n_step == 0) continue;
+        std::vector<llama_token> & kv = c.seqs[(size_t)i].tokens;
+        if (s.status.load() == LB_STREAM_DECODE) {
+            if (s.n_draft > 0) { slot_verify(c, i, s); continue; }
+            kv.push_back(s.pending);
+        } else {
+            kv.insert(kv.end(), s.prompt.begin() + s.n_fed, s.prompt.begin() + s.n_fed + s.n_step);
+            s.n_fed += s.n_step;
+            s.prefill_done = s.skipped + s.n_fed;
+            if (s.n_fed == (int)s.prompt.size()) {
+                const auto now = std::chrono::steady_clock::now();
+                const double ms = std::chrono::duration<double, std::milli>(now - s.t_prefill).count();
+                const int decoded = (int)s.prompt.size() - (s.prefill_reused - s.skipped);
+                s.prefill_tok_s = ms > 0.0 ? (float)(decoded * 1000.0 / ms) : 0.0f;
+                s.t_decode = now;
+                LOGI("stream %d: prefill %d tokens in %.1f ms", (int)s.id.load(), decoded, ms);
+                prefix_offer(c, i);
+            }
+        }
+        if (s.i_logits >= 0) slot_sample(c, s);
+    }
+    return count_active(c);
 }
 
+// Runs one batched decode over all open streams (see the section comment).
+// Returns the number of streams still prefilling or generating (0: idle,
+// nothing was decoded), or -1 bad handle / the native generation thread is
+// stepping this context. A failed llama_decode ends the streams that were in
+// the batch with LB_STREAM_ERROR.
 extern "C" __attribute__((visibility("default")))
-int lb_is_loaded() { return (g_ctx && g_model) ? 1 : 0; }
+int lb_ctx_step(lb_ctx* ctx) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    if (ctx->async_on) return -1;
+    const int rc = ctx_step(*ctx);
+    stats_commit(*ctx);
+    return rc;
+}
 
+// Text generated since the last read of stream `id`; *status (optional)
+// receives its lb_stream_status. Once the status is final and the text has
+// been read, close the stream. Returns null for an unknown id. The string
+// stays valid until the next read of the same stream.
 extern "C" __attribute__((visibility("default")))
-int lb_reset() {
-    if (!g_model) return -1;
-    if (g_ctx) { llama_free(g_ctx); g_ctx = nullptr; }
-    llama_context_params cparams = llama_context_default_params();
-    g_ctx = llama_init_from_model(g_model, cparams);
-    if (!g_ctx) return -2;
-    stream_reset();
-    return 0;
+const char* lb_ctx_stream_read(lb_ctx* ctx, int32_t id, int32_t* status) {
+    if (!ctx) return nullptr;
+    ApiLock lock(*ctx);
+    LbSlot * s = slot_of(*ctx, id);
+    if (!s) return nullptr;
+    s->read.swap(s->out);
+    s->out.clear();
+    if (status) *status = s->status.load();
+    return s->read.c_str();
 }
 
+// Safe to call from any thread/isolate: only raises the stream's flag; the
+// next step ends it with LB_STREAM_CANCELLED. A step in flight is aborted
+// once all of its streams are stopped (see ctx_abort). Unknown ids are ignored.
 extern "C" __attribute__((visibility("default")))
-void lb_free() {
-    stream_reset();
-    if (g_ctx)   { llama_free(g_ctx); g_ctx = nullptr; }
-    if (g_model) { llama_model_free(g_model); g_model = nullptr; }
-    llama_backend_free();
+void lb_ctx_stream_stop(lb_ctx* ctx, int32_t id) {
+    if (!ctx) return;
+    if (LbSlot * s = slot_of(*ctx, id)) s->cancel.store(true, std::memory_order_relaxed);
 }
 
+// Safe to call from any thread/isolate. Returns the stream's status and
+// fills `out` (optional), or -1 for an unknown id.
 extern "C" __attribute__((visibility("default")))
-void lb_clear_history() {
-    if (!g_ctx) return;
-    kv_clear();
-    stream_reset();
+int lb_ctx_stream_poll(lb_ctx* ctx, int32_t id, lb_progress* out) {
+    if (out) *out = lb_progress{};
+    if (!ctx) return -1;
+    LbSlot * s = slot_of(*ctx, id);
+    if (!s) return -1;
+    if (out) {
+        out->prefill_done   = s->prefill_done.load(std::memory_order_relaxed);
+        out->prefill_total  = s->prefill_total.load(std::memory_order_relaxed);
+        out->prefill_reused = s->prefill_reused.load(std::memory_order_relaxed);
+        out->prefill_tok_s  = s->prefill_tok_s.load(std::memory_order_relaxed);
+        out->decode_tokens  = s->decode_tokens.load(std::memory_order_relaxed);
+        out->decode_tok_s   = s->decode_tok_s.load(std::memory_order_relaxed);
+    }
+    return s->status.load(std::memory_order_relaxed);
 }
 
-// --------------------------- Non-streaming -------------------------------
+// Frees the stream's slot; a still-running stream is cancelled. Its sequence
+// keeps the decoded tokens for prefix reuse by a later stream.
+// Returns 0, or -1 unknown id.
 extern "C" __attribute__((visibility("default")))
-const char* lb_eval(const char* prompt_cstr, int max_tokens) {
-    static std::string result; result.clear();
-    if (!g_ctx || !g_model) { result = "Model not loaded."; return result.c_str(); }
-    if (!prompt_cstr) prompt_cstr = "";
+int lb_ctx_stream_close(lb_ctx* ctx, int32_t id) {
+    if (!ctx) return -1;
+    ApiLock lock(*ctx);
+    LbSlot * s = slot_of(*ctx, id);
+    if (!s) return -1;
+    if (slot_active(*s)) s->status = LB_STREAM_CANCELLED;
+    s->id = -1;
+    s->out.clear();
+    s->port = 0;
+    ctx->n_open--;
+    return 0;
+}
 
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
-    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+extern "C" __attribute__((visibility("default")))
+void lb_spec_default_params(lb_spec_params* out) {
+    if (!out) return;
+    out->n_draft     = 4;
+    out->n_draft_max = 8;
+    out->adaptive    = 1;
+}
 
-    // tokenize prompt
-    const int prompt_len = (int) std::strlen(prompt_cstr);
-    int32_t guess = std::max(32, prompt_len + 8);
-    std::vector<llama_token> prompt_tokens(guess);
-    int n_tok = llama_tokenize(vocab, prompt_cstr, prompt_len,
-                               prompt_tokens.data(), guess, 1, 0);
-    if (n_tok < 0) {
-        int need = -n_tok;
-        prompt_tokens.resize(need);
-        n_tok = llama_tokenize(vocab, prompt_cstr, prompt_len,
-                               prompt_tokens.data(), need, 1, 0);
-        if (n_tok <= 0) { result = "Tokenization failed."; return result.c_str(); }
-    } else {
-        prompt_tokens.resize(n_tok);
+// Attaches a draft model for speculative decoding of scheduler streams
+// (lb_ctx_stream_open); null `draft` detaches it. The bridge creates a
+// context on the draft with this context's size and sequence layout and
+// holds a reference, so the caller may close its handle right away. `spec`
+// may be null (defaults). The single-stream API (lb_ctx_eval,
+// lb_ctx_stream_begin) does not speculate.
+// Returns 0, or -1 bad handle / streams open, -3 draft context creation
+// failed, -6 vocabularies differ or a model cannot roll back its cache
+// (recurrent).
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_set_draft(lb_ctx* ctx, lb_model* draft, const lb_spec_params* spec) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.n_open > 0 || c.stream_running) return -1;
+    if (c.draft) { lb_ctx_free(c.draft); c.draft = nullptr; }
+    for (size_t i = 0; i < c.seqs.size(); ++i) c.slots[i].draft_ready = false;
+    if (!draft) return 0;
+
+    if (llama_model_is_recurrent(c.model->model) || llama_model_is_recurrent(draft->model) ||
+        !draft_compatible(c.model->model, draft->model)) {
+        LOGE("draft model rejected: vocabularies differ or a model is recurrent");
+        return -6;
     }
+    lb_spec_params sp;
+    lb_spec_default_params(&sp);
+    if (spec) sp = *spec;
+    sp.n_draft_max = sp.n_draft_max <= 0 ? 8 : std::min(sp.n_draft_max, (int32_t)LB_SPEC_MAX_DRAFT);
+    sp.n_draft     = sp.n_draft <= 0 ? std::min(4, sp.n_draft_max) : std::min(sp.n_draft, sp.n_draft_max);
 
-    // feed prompt (set pos[] and n_tokens)
-    {
-        kv_clear();
-        const int n = (int)prompt_tokens.size();
-        llama_batch batch = llama_batch_init(n, 0, 1);
-        for (int i = 0; i < n; ++i) {
-            batch.token[i]    = prompt_tokens[i];
-            batch.pos[i]      = i;
-            batch.n_seq_id[i] = 1; batch.seq_id[i][0] = 0;
-            batch.logits[i]   = (i == n - 1) ? 1 : 0;
-        }
-        batch.n_tokens = n;
-        int32_t rc = llama_decode(g_ctx, batch);
-        llama_batch_free(batch);
-        if (rc != 0) { result = "Decode failed on prompt."; return result.c_str(); }
+    lb_load_params dp = c.params;
+    dp.version   = LB_LOAD_PARAMS_VERSION;
+    dp.n_ctx     = llama_n_ctx(c.ctx);
+    dp.n_batch   = llama_n_batch(c.ctx);
+    dp.n_seq_max = (uint32_t)c.seqs.size();
+    lb_ctx * d = nullptr;
+    if (lb_ctx_create(draft, &dp, &d) != 0) return -3;
+    d->shift_keep = -1;  // follows the target through draft_sync instead
+    c.draft = d;
+    c.spec  = sp;
+    LOGI("draft attached: n_draft=%d (max %d, %s)", sp.n_draft, sp.n_draft_max,
+         sp.adaptive ? "adaptive" : "fixed");
+    return 0;
+}
+
+// Enables prompt-lookup speculation for scheduler streams opened from now
+// on; null `params` disables it. Lookup proposals are tried first each step
+// and the draft model (if attached) only drafts for streams without a match.
+// Returns 0, or -1 bad handle / streams open, -6 the model cannot roll back
+// its cache (recurrent).
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_set_lookup(lb_ctx* ctx, const lb_lookup_params* params) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.n_open > 0 || c.stream_running) return -1;
+    c.lookup_on = false;
+    if (!params) return 0;
+    if (llama_model_is_recurrent(c.model->model)) return -6;
+
+    lb_lookup_params lp = *params;
+    lp.ngram_min   = lp.ngram_min <= 0 ? 2 : lp.ngram_min;
+    lp.ngram_max   = lp.ngram_max <= 0 ? std::max(4, lp.ngram_min) : std::max(lp.ngram_max, lp.ngram_min);
+    lp.n_draft_max = lp.n_draft_max <= 0 ? 8 : std::min(lp.n_draft_max, (int32_t)LB_SPEC_MAX_DRAFT);
+    c.lookup    = lp;
+    c.lookup_on = true;
+    LOGI("prompt lookup: ngram %d..%d, n_draft_max=%d", lp.ngram_min, lp.ngram_max, lp.n_draft_max);
+    return 0;
+}
+
+// Safe to call from any thread/isolate. Fills `out` for stream `id`.
+// Returns 0, or -1 unknown id.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_stream_spec_stats(lb_ctx* ctx, int32_t id, lb_spec_stats* out) {
+    if (out) *out = lb_spec_stats{};
+    if (!ctx) return -1;
+    LbSlot * s = slot_of(*ctx, id);
+    if (!s) return -1;
+    if (out) {
+        const int32_t steps    = s->spec_steps.load(std::memory_order_relaxed);
+        const int32_t drafted  = s->spec_drafted.load(std::memory_order_relaxed);
+        const int32_t accepted = s->spec_accepted.load(std::memory_order_relaxed);
+        out->n_draft  = s->spec_k.load(std::memory_order_relaxed);
+        out->steps    = steps;
+        out->drafted  = drafted;
+        out->accepted = accepted;
+        out->accept_rate     = drafted > 0 ? (float)accepted / (float)drafted : 0.0f;
+        out->tokens_per_step = steps > 0 ? (float)(accepted + steps) / (float)steps : 0.0f;
     }
+    return 0;
+}
 
-    std::vector<llama_token> gen; gen.reserve(std::max(1, max_tokens));
-    size_t emitted_chars = 0; // for incremental detok
+// --------------------------- Native generation ---------------------------
+// lb_ctx_async_start() moves the scheduler loop onto two native threads:
+//
+//   gen     runs lb_ctx_step's decode whenever a stream is open and, after
+//           each step, pushes every attached stream's new text and state
+//           into `ring` (single producer)
+//   poster  waits for records, lets them gather for `cadence_ms`, then posts
+//           one message per stream to its Dart port (single consumer)
+//
+// A stream message is [status, text bytes (Uint8List), prefill_done,
+// prefill_total]; text may split UTF-8 sequences only where the model's
+// output itself is malformed. When a stream ends, [id, status] also goes to
+// the context's events port, so its owner can collect stats and close it.
+// Unattached streams keep buffering for lb_ctx_stream_read.
+#define LB_RING_BYTES (64 * 1024)
 
-    for (int t = 0; t < max_tokens; ++t) {
-        float * logits = llama_get_logits_ith(g_ctx, -1);
-        if (!logits) { result = "No logits."; return result.c_str(); }
+// Pushes the updates of attached streams. Returns false when the ring was
+// full; the rest stays queued in the slots for the next call.
+static bool async_collect(lb_ctx & c) {
+    bool pushed = false, full = false;
+    for (size_t i = 0; i < c.seqs.size() && !full; ++i) {
+        LbSlot & s = c.slots[i];
+        if (s.id.load() < 0 || s.port == 0 || s.posted_end) continue;
+        const int32_t status = s.status.load();
+        const int32_t done   = s.prefill_done.load(std::memory_order_relaxed);
+        const bool    end    = status != LB_STREAM_PREFILL && status != LB_STREAM_DECODE;
+        if (s.out.empty() && !end && done == s.posted_done) continue;
 
-        // greedy argmax
-        int best_id = 0;
-        float best_val = -std::numeric_limits<float>::infinity();
-        for (int i = 0; i < n_vocab; ++i) {
-            const float v = logits[i];
-            if (v > best_val) { best_val = v; best_id = i; }
-        }
-        const llama_token next = (llama_token)best_id;
-        if (llama_vocab_is_eog(vocab, next)) break;
+        LbRingRec rec{};
+        rec.port          = s.port;
+        rec.id            = s.id.load();
+        rec.status        = status;
+        rec.prefill_done  = done;
+        rec.prefill_total = s.prefill_total.load(std::memory_order_relaxed);
+        rec.len           = (uint32_t)s.out.size();
+        if (!c.ring.push(rec, s.out.data())) { full = true; break; }
+        s.out.clear();
+        s.posted_done = done;
+        s.posted_end  = end;
+        pushed = true;
+    }
+    if (pushed) {
+        std::lock_guard<std::mutex> lock(c.post_mu);
+        if (!c.post_pending) { c.post_pending = true; c.post_cv.notify_one(); }
+    }
+    return !full;
+}
 
-        gen.push_back(next);
+// Attached streams with updates not pushed yet.
+static bool async_unposted(const lb_ctx & c) {
+    for (size_t i = 0; i < c.seqs.size(); ++i) {
+        const LbSlot & s = c.slots[i];
+        if (s.id.load() < 0 || s.port == 0 || s.posted_end) continue;
+        if (!s.out.empty() || !slot_active(s) ||
+            s.prefill_done.load(std::memory_order_relaxed) != s.posted_done) return true;
+    }
+    return false;
+}
 
-        // feed back next token (set pos[] and n_tokens)
+static void gen_loop(lb_ctx * ctx) {
+    lb_ctx & c = *ctx;
+    while (true) {
+        bool drained;
         {
-            llama_batch batch = llama_batch_init(1, 0, 1);
-            batch.token[0]    = next;
-            batch.pos[0]      = (int)prompt_tokens.size() + (int)gen.size() - 1;
-            batch.n_seq_id[0] = 1; batch.seq_id[0][0] = 0;
-            batch.logits[0]   = 1;
-            batch.n_tokens    = 1;
-            int32_t rc = llama_decode(g_ctx, batch);
-            llama_batch_free(batch);
-            if (rc != 0) break;
+            std::unique_lock<std::mutex> lock(c.mu);
+            c.gen_cv.wait(lock, [&] {
+                return c.async_quit.load() || count_active(c) > 0 || async_unposted(c);
+            });
+            if (c.async_quit.load()) break;
+            if (count_active(c) > 0) ctx_step(c);
+            stats_commit(c);
+            drained = async_collect(c);
         }
+        while (c.api_waiting.load() > 0) std::this_thread::yield();
+        if (!drained) std::this_thread::sleep_for(std::chrono::milliseconds(1));  // poster catching up
+    }
+}
+
+// Per-stream batch being coalesced by the poster.
+struct PostBatch {
+    int64_t     port = 0;
+    int32_t     id = -1, status = 0, done = 0, total = 0;
+    std::string text;
+};
+
+static void post_batch(const lb_ctx & c, const PostBatch & b) {
+    LbDartObj v[4], * items[4] = {&v[0], &v[1], &v[2], &v[3]};
+    v[0].type = LB_DART_INT32;
+    v[0].value.as_int32 = b.status;
+    v[1].type = LB_DART_TYPED_DATA;
+    v[1].value.as_typed_data.type   = LB_DART_UINT8;
+    v[1].value.as_typed_data.length = (intptr_t)b.text.size();
+    v[1].value.as_typed_data.values = (const uint8_t *)b.text.data();
+    v[2].type = LB_DART_INT32;
+    v[2].value.as_int32 = b.done;
+    v[3].type = LB_DART_INT32;
+    v[3].value.as_int32 = b.total;
+    LbDartObj msg;
+    msg.type = LB_DART_ARRAY;
+    msg.value.as_array.length = 4;
+    msg.value.as_array.values = items;
+    c.dart_post(b.port, &msg);  // fails only for a closed port: nobody is listening
+
+    if (b.status == LB_STREAM_PREFILL || b.status == LB_STREAM_DECODE || c.events_port == 0) return;
+    LbDartObj e[2], * eitems[2] = {&e[0], &e[1]};
+    e[0].type = LB_DART_INT64;
+    e[0].value.as_int64 = b.id;
+    e[1].type = LB_DART_INT32;
+    e[1].value.as_int32 = b.status;
+    msg.value.as_array.length = 2;
+    msg.value.as_array.values = eitems;
+    c.dart_post(c.events_port, &msg);
+}
 
-        // Incremental detok by diff (keeps spaces/punctuation correct)
-        std::string full = detok(vocab, gen, true, false);
-        if (full.size() > emitted_chars) {
-            result += full.substr(emitted_chars);
-            emitted_chars = full.size();
+static void post_loop(lb_ctx * ctx) {
+    lb_ctx & c = *ctx;
+    PostBatch batch[LB_MAX_STREAMS];
+    LbRingRec rec;
+    std::string text;
+    bool quit = false;
+    while (!quit) {
+        {
+            std::unique_lock<std::mutex> lock(c.post_mu);
+            c.post_cv.wait(lock, [&] { return c.post_pending || c.async_quit.load(); });
+            quit = c.async_quit.load();
+        }
+        if (!quit && c.cadence_ms > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(c.cadence_ms));
+        }
+        {
+            std::lock_guard<std::mutex> lock(c.post_mu);
+            c.post_pending = false;
+        }
+        bool touched[LB_MAX_STREAMS] = {};
+        while (c.ring.pop(rec, text)) {
+            const int slot = rec.id % LB_MAX_STREAMS;
+            PostBatch & b = batch[slot];
+            if (touched[slot] && b.id != rec.id) post_batch(c, b);  // slot reused within the window
+            if (!touched[slot] || b.id != rec.id) b.text.clear();
+            touched[slot] = true;
+            b.port   = rec.port;
+            b.id     = rec.id;
+            b.status = rec.status;
+            b.done   = rec.prefill_done;
+            b.total  = rec.prefill_total;
+            b.text  += text;
         }
+        for (int i = 0; i < LB_MAX_STREAMS; ++i) {
+            if (touched[i]) post_batch(c, batch[i]);
+        }
+    }
+}
 
-        // Early stop heuristic
-        if (should_stop_early(result, (int)gen.size())) break;
+// Joins both threads; the poster flushes what the ring still holds.
+static void async_stop(lb_ctx & c) {
+    {
+        std::lock_guard<std::mutex> lock(c.mu);
+        if (!c.async_on) return;
+        c.async_quit = true;
+        c.gen_cv.notify_one();
+    }
+    c.gen.join();
+    {
+        std::lock_guard<std::mutex> lock(c.post_mu);
+        c.post_cv.notify_one();
     }
+    c.poster.join();
+    std::lock_guard<std::mutex> lock(c.mu);
+    c.async_on = false;
+    c.async_quit = false;
+    c.post_pending = false;
+}
 
-    return result.c_str();
+// Starts native generation on `ctx`. `post_cobject` is Dart_PostCObject
+// (NativeApi.postCObject in Dart); `events_port` (0: none) receives
+// [id, status] when an attached stream ends; `cadence_ms` is how long
+// updates gather before they are posted (0: post after every step).
+// Returns 0, or -1 bad handle / already running / single-stream generation
+// in flight, -2 null post function.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_async_start(lb_ctx* ctx, void* post_cobject, int64_t events_port, int32_t cadence_ms) {
+    if (!ctx) return -1;
+    if (!post_cobject) return -2;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.async_on || c.stream_running) return -1;
+    c.dart_post   = (LbDartPost)post_cobject;
+    c.events_port = events_port;
+    c.cadence_ms  = std::max(0, cadence_ms);
+    c.ring.init(LB_RING_BYTES);
+    c.async_quit   = false;
+    c.post_pending = false;
+    c.async_on     = true;
+    c.gen    = std::thread(gen_loop, ctx);
+    c.poster = std::thread(post_loop, ctx);
+    LOGI("native generation started (cadence %d ms)", c.cadence_ms);
+    return 0;
 }
 
-// ------------------------------ Streaming --------------------------------
+// Stops native generation after the current step. Open streams stay open;
+// drive them with lb_ctx_step()/lb_ctx_stream_read() or restart. Returns 0,
+// or -1 bad handle. Must not be called from a Dart port handler that the
+// poster could be blocked on (it never is: posting does not wait).
 extern "C" __attribute__((visibility("default")))
-int lb_stream_begin(const char* prompt_cstr, int max_tokens) {
-    if (!g_ctx || !g_model) return -1;
-    if (!prompt_cstr) prompt_cstr = "";
+int lb_ctx_async_stop(lb_ctx* ctx) {
+    if (!ctx) return -1;
+    async_stop(*ctx);
+    return 0;
+}
 
-    stream_reset();
+// Sends stream `id`'s updates to Dart port `port` (a SendPort's nativePort)
+// instead of buffering them for lb_ctx_stream_read; text already buffered
+// goes out with the first update. Returns 0, or -1 unknown id / native
+// generation not running.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_stream_attach(lb_ctx* ctx, int32_t id, int64_t port) {
+    if (!ctx || port == 0) return -1;
+    ApiLock lock(*ctx);
+    lb_ctx & c = *ctx;
+    LbSlot * s = slot_of(c, id);
+    if (!s || !c.async_on) return -1;
+    s->port = port;
+    s->posted_done = -1;
+    c.gen_cv.notify_one();
+    return 0;
+}
 
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
+// ------------------------------ Embeddings -------------------------------
+// One pooled vector per text from an embedding context (lb_load_params.
+// pooling). Texts are packed a sequence each into shared decodes of up to
+// n_seq_max texts and n_batch tokens; a text longer than its sequence's share
+// of the context is cut to fit. Rows are L2-normalized when `normalize`.
+// Returns n_embd (`out` holds n_texts rows of it), or -1 bad arguments / not
+// an embedding context / out_len below n_texts * n_embd, -2 tokenization
+// failed, -3 decode failed.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_embed_batch(lb_ctx* ctx, const char* const* texts, int32_t n_texts,
+                       float* out, int32_t out_len, int32_t normalize) {
+    if (!ctx || !texts || n_texts < 0 || !out) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.params.pooling == LB_POOL_NONE) return -1;
+    const int32_t n_embd = llama_model_n_embd(c.model->model);
+    if ((int64_t)out_len < (int64_t)n_texts * n_embd) return -1;
 
-    // tokenize prompt
-    const int prompt_len = (int) std::strlen(prompt_cstr);
-    int32_t guess = std::max(32, prompt_len + 8);
-    g_stream_prompt.resize(guess);
-    int n_tok = llama_tokenize(vocab, prompt_cstr, prompt_len,
-                               g_stream_prompt.data(), guess, 1, 0);
-    if (n_tok < 0) {
-        int need = -n_tok;
-        g_stream_prompt.resize(need);
-        n_tok = llama_tokenize(vocab, prompt_cstr, prompt_len,
-                               g_stream_prompt.data(), need, 1, 0);
-        if (n_tok <= 0) return -2;
-    } else {
-        g_stream_prompt.resize(n_tok);
-    }
+    const llama_vocab * vocab = ctx_vocab(c);
+    const bool encode = llama_model_has_encoder(c.model->model) &&
+                        !llama_model_has_decoder(c.model->model);
+    const int32_t n_seq = (int32_t)c.seqs.size();
+    const int32_t cap   = std::min(c.batch.cap, c.seq_cap);
+    std::vector<llama_token> & toks = c.eval_prompt;
+    c.uninterruptible = true;  // a stream cancel is not meant for these
 
-    // fresh KV + reset counters
-    kv_clear();
-    g_stream_pos = 0;
-    g_stream_emitted_chars = 0;
+    int32_t rc = n_embd;
+    for (int32_t i = 0; i < n_texts && rc > 0;) {
+        c.st.requests++;
+        kv_clear(c);
+        c.batch.clear();
+        const int32_t first = i;
+        LbClock::time_point t = LbClock::now();
+        for (int32_t s = 0; s < n_seq && i < n_texts; ++s) {
+            if (!tokenize_into(vocab, texts[i] ? texts[i] : "", toks)) { rc = -2; break; }
+            if ((int32_t)toks.size() > cap) toks.resize((size_t)cap);
+            if (s > 0 && c.batch.batch.n_tokens + (int32_t)toks.size() > c.batch.cap) break;
+            for (size_t p = 0; p < toks.size(); ++p) c.batch.add(toks[p], (llama_pos)p, s, true);
+            ++i;
+        }
+        c.st.tokenize_ms += lb_ms_since(t);
+        if (rc < 0) break;
 
-    // feed prompt (set pos[] and n_tokens)
-    {
-        const int n = (int)g_stream_prompt.size();
-        llama_batch batch = llama_batch_init(n, 0, 1);
-        for (int i = 0; i < n; ++i) {
-            batch.token[i]    = g_stream_prompt[i];
-            batch.pos[i]      = g_stream_pos + i;
-            batch.n_seq_id[i] = 1; batch.seq_id[i][0] = 0;
-            batch.logits[i]   = (i == n - 1) ? 1 : 0;
+        t = LbClock::now();
+        const int32_t drc = encode ? llama_encode(c.ctx, c.batch.batch) : llama_decode(c.ctx, c.batch.batch);
+        c.st.prefill_ms += lb_ms_since(t);
+        if (drc != 0) { LOGE("embed: decode failed rc=%d", drc); rc = -3; break; }
+        c.st.prefill_tokens += c.batch.batch.n_tokens;
+
+        for (int32_t j = first; j < i; ++j) {
+            float * dst = out + (size_t)j * (size_t)n_embd;
+            const float * e = llama_get_embeddings_seq(c.ctx, j - first);
+            if (!e) { std::fill(dst, dst + n_embd, 0.0f); continue; }
+            float scale = 1.0f;
+            if (normalize) {
+                const float ss = lb_dot_f32(e, e, n_embd);
+                scale = ss > 0.0f ? 1.0f / std::sqrt(ss) : 0.0f;
+            }
+            for (int32_t d = 0; d < n_embd; ++d) dst[d] = e[d] * scale;
         }
-        batch.n_tokens = n;
-        int32_t rc = llama_decode(g_ctx, batch);
-        llama_batch_free(batch);
-        if (rc != 0) return -3;
-        g_stream_pos += n;
     }
+    kv_clear(c);
+    c.uninterruptible = false;
+    stats_commit(c);
+    return rc;
+}
+
+// Length of the vectors lb_ctx_embed_batch() returns, or -1 when `ctx` is not
+// an embedding context.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_embed_dim(lb_ctx* ctx) {
+    if (!ctx || !ctx->model || ctx->params.pooling == LB_POOL_NONE) return -1;
+    return llama_model_n_embd(ctx->model->model);
+}
+
+// Stable identity of the context's model (as checked by session snapshots);
+// tags vector indexes so vectors from another model are never mixed in.
+extern "C" __attribute__((visibility("default")))
+uint64_t lb_ctx_model_id(lb_ctx* ctx) {
+    if (!ctx || !ctx->model) return 0;
+    return lb_model_identity(ctx->model->model);
+}
+
+// ----------------------------- Vector index ------------------------------
+// Cosine-similarity search over (group, key)-tagged vectors kept in a mapped
+// file; see lb_vindex.h. A query reads every row once with SIMD dot
+// products, so its cost is memory bandwidth: 10k vectors of 768 floats are
+// 30 MB, a few milliseconds. Calls on one index are serialized; different
+// indexes are independent.
+struct lb_index {
+    LbVecIndex ix;
+};
 
-    g_stream_running   = true;
-    g_stream_remaining = std::max(1, max_tokens);
-    g_stream_gen.clear();
+// Opens or creates the index at `path` for `dim`-float vectors from the
+// model identified by `tag` (lb_ctx_model_id). Returns 0 and sets *out, or
+// -1 bad arguments, -2 I/O error, -3 the file holds another model's vectors
+// or is damaged (delete it and re-add).
+extern "C" __attribute__((visibility("default")))
+int lb_index_open(const char* path, int32_t dim, uint64_t tag, lb_index** out) {
+    if (!out) return -1;
+    *out = nullptr;
+    lb_index * x = new lb_index();
+    const int32_t rc = x->ix.open(path, dim, tag);
+    if (rc != LB_VINDEX_OK) { delete x; return rc; }
+    *out = x;
     return 0;
 }
 
-// returns: nullptr=hard error; ""=no new chars yet / finished; else text delta to append
 extern "C" __attribute__((visibility("default")))
-const char* lb_stream_next() {
-    static std::string delta; delta.clear();
+void lb_index_close(lb_index* index) {
+    delete index;
+}
+
+// Adds n vectors (vecs: n * dim floats, any length) under (groups[i],
+// keys[i]); an existing pair is overwritten. Returns 0, -1 bad arguments,
+// -2 the file could not grow.
+extern "C" __attribute__((visibility("default")))
+int lb_index_add(lb_index* index, int32_t n, const int64_t* groups, const int64_t* keys,
+                 const float* vecs) {
+    if (!index) return -1;
+    return index->ix.add(n, groups, keys, vecs);
+}
 
-    if (!g_ctx || !g_model) return nullptr;
-    if (!g_stream_running)  { return ""; }
-    if (g_stream_remaining <= 0) {
-        g_stream_running = false; return "";
-    }
+// Drops every vector of `group`. Returns how many were removed.
+extern "C" __attribute__((visibility("default")))
+int lb_index_remove_group(lb_index* index, int64_t group) {
+    return index ? index->ix.remove_group(group) : 0;
+}
 
-    const llama_vocab * vocab = llama_model_get_vocab(g_model);
-    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+// Up to k best matches for `query` (dim floats), best first, with their
+// cosine similarity. Returns the number written.
+extern "C" __attribute__((visibility("default")))
+int lb_index_search(lb_index* index, const float* query, int32_t k,
+                    int64_t* groups, int64_t* keys, float* scores) {
+    return index ? index->ix.search(query, k, groups, keys, scores) : 0;
+}
 
-    float * logits = llama_get_logits_ith(g_ctx, -1);
-    if (!logits) { g_stream_running = false; return nullptr; }
+extern "C" __attribute__((visibility("default")))
+int lb_index_count(lb_index* index) {
+    return index ? index->ix.size() : 0;
+}
 
-    // greedy argmax
-    int best_id = 0;
-    float best_val = -std::numeric_limits<float>::infinity();
-    for (int i = 0; i < n_vocab; ++i) {
-        const float v = logits[i];
-        if (v > best_val) { best_val = v; best_id = i; }
+// ------------------------- Performance counters --------------------------
+// Readable from any thread at any time: only `stats_mu` is taken, never the
+// context's request lock, so polling does not stall (or wait behind) a
+// decode. Returns 0, or -1 bad arguments.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_get_stats(lb_ctx* ctx, lb_stats* out) {
+    if (!ctx || !out) return -1;
+    LbStatsAcc a;
+    {
+        std::lock_guard<std::mutex> lock(ctx->stats_mu);
+        a = ctx->stats;
     }
-    const llama_token next = (llama_token)best_id;
-    if (llama_vocab_is_eog(vocab, next)) {
-        g_stream_running = false;
-        return "";
+    *out = lb_stats{};
+    out->peak_rss_bytes = lb_peak_rss_bytes();
+    out->requests       = a.requests;
+    out->prefill_tokens = (int32_t)a.prefill_tokens;
+    out->decode_tokens  = (int32_t)a.decode_tokens;
+    out->tokenize_ms    = (float)a.tokenize_ms;
+    out->prefill_ms     = (float)a.prefill_ms;
+    out->sample_ms      = (float)a.sample_ms;
+    out->decode_ms      = (float)a.decode_ms;
+    out->detok_ms       = (float)a.detok_ms;
+    out->prefill_tok_s  = a.prefill_ms > 0.0 ? (float)(a.prefill_tokens * 1000.0 / a.prefill_ms) : 0.0f;
+    const double gen_ms = a.decode_ms + a.sample_ms + a.detok_ms;
+    out->decode_tok_s   = gen_ms > 0.0 ? (float)(a.decode_tokens * 1000.0 / gen_ms) : 0.0f;
+    out->ttft_ms        = a.ttft_last_ms;
+    out->ttft_avg_ms    = a.ttft_count > 0 ? (float)(a.ttft_sum_ms / a.ttft_count) : 0.0f;
+    out->token_p50_ms   = a.token_ms.quantile(0.50);
+    out->token_p95_ms   = a.token_ms.quantile(0.95);
+    out->token_p99_ms   = a.token_ms.quantile(0.99);
+    out->kv_used         = ctx->kv_used.load(std::memory_order_relaxed);
+    out->kv_total        = ctx->kv_total.load(std::memory_order_relaxed);
+    out->n_threads       = ctx->n_threads.load(std::memory_order_relaxed);
+    out->n_threads_batch = ctx->n_threads_batch.load(std::memory_order_relaxed);
+    return 0;
+}
+
+// Zeroes the accumulated counters (not kv_*/threads/peak RSS, which are
+// current values). Counters of a request in flight keep accruing.
+extern "C" __attribute__((visibility("default")))
+void lb_ctx_stats_reset(lb_ctx* ctx) {
+    if (!ctx) return;
+    std::lock_guard<std::mutex> lock(ctx->stats_mu);
+    ctx->stats = LbStatsAcc{};
+}
+
+// ---------------------------- Session state ------------------------------
+// Snapshot of one KV sequence and the tokens in it, written next to the chat
+// transcript so a reopened conversation resumes without re-prefilling. `seq`
+// is 0 for the single-stream API, or `id % LB_MAX_STREAMS` of a closed
+// scheduler stream. Returns 0, -1 not loaded / bad seq / the sequence is in
+// use, -2 I/O error, -4 state could not be serialized.
+static bool state_seq_idle(const lb_ctx & c, int32_t seq) {
+    return c.ctx && seq >= 0 && seq < (int32_t)c.seqs.size() &&
+           c.slots[(size_t)seq].id.load() < 0 && !(seq == 0 && c.stream_running);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_state_save(lb_ctx* ctx, int32_t seq, const char* path) {
+    if (!ctx || !path) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    if (!state_seq_idle(*ctx, seq)) return -1;
+    return state_file_write(ctx->ctx, lb_model_identity(ctx->model->model) ^ ctx->lora_sig, seq,
+                            ctx->seqs[(size_t)seq].tokens, path);
+}
+
+// Restores a snapshot written by lb_ctx_state_save into `seq`. The next
+// prompt on that sequence (or a scheduler stream, which picks the sequence
+// with the longest shared prefix) reuses the restored tokens. Returns 0, -1
+// not loaded / bad seq / in use, -2 missing or unreadable, -3 stale (other
+// model or LoRA adapters, other format, truncated), -4 rejected by llama or
+// larger than the sequence. On -3 the sequence is untouched; on -4 it is
+// cleared.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_state_load(lb_ctx* ctx, int32_t seq, const char* path) {
+    if (!ctx || !path) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!state_seq_idle(c, seq)) return -1;
+    if (seq == 0) stream_reset(c);
+    LbSeq & s = c.seqs[(size_t)seq];
+    s.dropped.clear();
+    int32_t rc = state_file_read(c.ctx, lb_model_identity(c.model->model) ^ c.lora_sig, seq, path, s.tokens);
+    if (rc == LB_STATE_OK && (int32_t)s.tokens.size() > c.seq_cap) rc = LB_STATE_REJECTED;
+    if (rc == LB_STATE_REJECTED) seq_clear(c, seq);
+    return rc;
+}
+
+// ---------------------------- Thread tuning ------------------------------
+// Profile file: one lb_tune_result tagged with the model identity and the
+// SoC layout, so a copied profile or a swapped model triggers a new probe.
+namespace {
+constexpr char     TUNE_MAGIC[4] = {'L', 'B', 'T', 'N'};
+constexpr uint32_t TUNE_VERSION  = 1;
+
+struct TuneFile {
+    char           magic[4];
+    uint32_t       version;
+    uint64_t       model_id;
+    uint64_t       device_sig;
+    lb_tune_result result;
+};
+}
+
+static const int    TUNE_PREFILL_TOKENS = 32;     // per prefill probe
+static const int    TUNE_DECODE_STEPS   = 16;     // timed per decode probe, after one untimed step
+static const double TUNE_BUDGET_MS      = 20000;  // stop probing after this, keep the best so far
+
+static bool tune_file_read(const char * path, uint64_t model_id, uint64_t sig, lb_tune_result * out) {
+    FILE * f = std::fopen(path, "rb");
+    if (!f) return false;
+    TuneFile tf;
+    const bool ok = std::fread(&tf, sizeof(tf), 1, f) == 1 &&
+                    std::memcmp(tf.magic, TUNE_MAGIC, sizeof(TUNE_MAGIC)) == 0 &&
+                    tf.version == TUNE_VERSION && tf.model_id == model_id &&
+                    tf.device_sig == sig && tf.result.n_threads > 0 && tf.result.n_threads_batch > 0;
+    std::fclose(f);
+    if (ok) *out = tf.result;
+    return ok;
+}
+
+static void tune_file_write(const char * path, uint64_t model_id, uint64_t sig, const lb_tune_result & r) {
+    TuneFile tf{};
+    std::memcpy(tf.magic, TUNE_MAGIC, sizeof(TUNE_MAGIC));
+    tf.version    = TUNE_VERSION;
+    tf.model_id   = model_id;
+    tf.device_sig = sig;
+    tf.result     = r;
+    tf.result.from_cache = 0;
+    FILE * f = std::fopen(path, "wb");
+    if (!f || std::fwrite(&tf, sizeof(tf), 1, f) != 1) LOGE("tune: cannot write %s", path);
+    if (f) std::fclose(f);
+}
+
+// One prefill of n_prefill tokens plus 1 + `steps` single-token decodes on
+// seq 0 with the currently attached pools. The first decode (graph rebuilt
+// for one token, pool threads waking) is not timed. Leaves the KV cache
+// empty.
+static bool tune_probe(lb_ctx & c, int n_prefill, int steps, double * prefill_tps, double * decode_tps) {
+    using clock = std::chrono::steady_clock;
+    const int32_t n_vocab = llama_vocab_n_tokens(ctx_vocab(c));
+    steps = std::max(1, std::min(steps, (int)llama_n_ctx(c.ctx) - n_prefill - 1));
+    std::vector<llama_token> toks((size_t)(n_prefill + 1 + steps));
+    for (size_t i = 0; i < toks.size(); ++i) toks[i] = (llama_token)((i * 7919 + 13) % (size_t)n_vocab);
+
+    kv_clear(c);
+    const auto t0 = clock::now();
+    bool ok = decode_tokens(c, 0, toks.data(), n_prefill, 0) == 0;
+    const auto t1 = clock::now();
+    ok = ok && decode_tokens(c, 0, &toks[(size_t)n_prefill], 1, n_prefill) == 0;
+    const auto t2 = clock::now();
+    for (int s = 1; ok && s <= steps; ++s) {
+        ok = decode_tokens(c, 0, &toks[(size_t)(n_prefill + s)], 1, n_prefill + s) == 0;
     }
+    const auto t3 = clock::now();
+    kv_clear(c);
+    if (!ok) return false;
+
+    const double pf = std::chrono::duration<double>(t1 - t0).count();
+    const double dc = std::chrono::duration<double>(t3 - t2).count();
+    *prefill_tps = pf > 0 ? n_prefill / pf : 0;
+    *decode_tps  = dc > 0 ? steps / dc : 0;
+    return true;
+}
+
+// Picks decode and prefill thread counts and core sets for the model behind
+// `ctx`. With a valid profile at `profile_path` (same model, same SoC) its
+// settings are applied directly; otherwise (or with `force`) short probes
+// run over cluster masks (fastest cluster first, then adding slower ones) x
+// thread counts, and the result is written back. The result is applied to
+// `ctx` and to contexts created on the model afterwards. Drops the KV cache.
+// Returns 0, -1 not loaded / a stream is running, -2 probing failed.
+extern "C" __attribute__((visibility("default")))
+int lb_ctx_autotune(lb_ctx* ctx, const char* profile_path, int force, lb_tune_result* out) {
+    if (!ctx) return -1;
+    std::lock_guard<std::mutex> lock(ctx->mu);
+    lb_ctx & c = *ctx;
+    if (!c.ctx || c.stream_running || c.n_open > 0) return -1;
 
-    g_stream_gen.push_back(next);
+    const LbCpuTopology topo = lb_cpu_topology();
+    const uint64_t sig      = lb_cpu_signature(topo);
+    const uint64_t model_id = lb_model_identity(c.model->model);
 
-    // feed it back (set pos[] and n_tokens)
-    {
-        llama_batch batch = llama_batch_init(1, 0, 1);
-        batch.token[0]    = next;
-        batch.pos[0]      = g_stream_pos;
-        batch.n_seq_id[0] = 1; batch.seq_id[0][0] = 0;
-        batch.logits[0]   = 1;
-        batch.n_tokens    = 1;
-        int32_t rc = llama_decode(g_ctx, batch);
-        llama_batch_free(batch);
-        if (rc != 0) { g_stream_running = false; return nullptr; }
-        g_stream_pos += 1;
-    }
-
-    g_stream_remaining -= 1;
-
-    // Incremental detok: detok full gen then emit only the new chars
-    std::string full = detok(vocab, g_stream_gen, true, false);
-    if (full.size() > g_stream_emitted_chars) {
-        delta = full.substr(g_stream_emitted_chars);
-        g_stream_emitted_chars = full.size();
+    lb_tune_result best{};
+    if (!force && profile_path && tune_file_read(profile_path, model_id, sig, &best)) {
+        best.from_cache = 1;
     } else {
-        delta.clear();
+        const auto t_start = std::chrono::steady_clock::now();
+        const int n_prefill = std::max(1, std::min(TUNE_PREFILL_TOKENS,
+                                       std::min(c.batch.cap, (int)llama_n_ctx(c.ctx) / 2)));
+        stream_reset(c);
+        threadpools_release(c);
+        c.uninterruptible = true;  // a pending stream cancel must not fail the probes
+
+        double pf = 0, dc = 0;
+        tune_probe(c, n_prefill, 1, &pf, &dc);  // warm-up: fault in the weights
+
+        // Homogeneous CPUs: only the thread count matters, leave placement
+        // to the scheduler.
+        std::vector<uint64_t> masks = lb_cpu_candidate_masks(topo);
+        const bool pin = topo.heterogeneous();
+        double best_pf = -1, best_dc = -1;
+        bool over_budget = false;
+        for (uint64_t mask : masks) {
+            if (over_budget) break;
+            const int k = lb_cpu_count(mask);
+            std::vector<int> counts;
+            for (int t : {k, k - 1, (k + 1) / 2}) {
+                if (t >= 1 && std::find(counts.begin(), counts.end(), t) == counts.end()) counts.push_back(t);
+            }
+            for (int t : counts) {
+                if (over_budget) break;
+                const uint64_t m = pin ? mask : 0;
+                if (!threadpools_apply(c, t, m, t, m) || !tune_probe(c, n_prefill, TUNE_DECODE_STEPS, &pf, &dc)) continue;
+                LOGI("tune: mask=0x%llx threads=%d prefill %.1f tok/s, decode %.1f tok/s",
+                     (unsigned long long)m, t, pf, dc);
+                if (pf > best_pf) { best_pf = pf; best.n_threads_batch = t; best.cpumask_batch = m; best.prefill_tok_s = (float)pf; }
+                if (dc > best_dc) { best_dc = dc; best.n_threads = t; best.cpumask = m; best.decode_tok_s = (float)dc; }
+                over_budget = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - t_start).count() > TUNE_BUDGET_MS;
+            }
+        }
+        threadpools_release(c);
+        c.uninterruptible = false;
+        if (best_pf < 0 || best_dc < 0) { LOGE("tune: every probe failed"); return -2; }
+        if (profile_path) tune_file_write(profile_path, model_id, sig, best);
     }
 
-    // Early stop
-    if (should_stop_early(full, (int)g_stream_gen.size())) {
-        g_stream_running = false;
+    if (!threadpools_apply(c, best.n_threads, best.cpumask, best.n_threads_batch, best.cpumask_batch)) return -2;
+    {
+        std::lock_guard<std::mutex> tlock(c.model->tune_mu);
+        c.model->tune = best;
+        c.model->tune_active = true;
     }
+    kv_clear(c);
+    LOGI("tune: decode %d threads (mask 0x%llx), prefill %d threads (mask 0x%llx)%s",
+         best.n_threads, (unsigned long long)best.cpumask,
+         best.n_threads_batch, (unsigned long long)best.cpumask_batch,
+         best.from_cache ? " [profile]" : "");
+    if (out) *out = best;
+    return 0;
+}
 
-    return delta.c_str();
+// --------------------------- Default context -----------------------------
+// The original single-model API: lb_load() opens one process-wide model and
+// context and the calls below forward to it. g_default_mu guards only the
+// pointer, so lb_stream_cancel/get_progress from another isolate never wait
+// on a load; the forwarded calls themselves come from the loading thread.
+static std::mutex g_default_mu;
+static lb_ctx *   g_default_ctx = nullptr;
+static int32_t    g_default_shift_keep    = 1;   // lb_set_context_shift, kept across loads
+static int32_t    g_default_shift_discard = 0;
+
+static lb_ctx * default_ctx() {
+    std::lock_guard<std::mutex> lock(g_default_mu);
+    return g_default_ctx;
+}
+
+static void default_release() {
+    lb_ctx * old = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_default_mu);
+        std::swap(old, g_default_ctx);
+    }
+    lb_ctx_free(old);
 }
 
+// `params` may be null (library defaults); it is copied.
+// Returns 0, or -1 bad path, -2 model load failed, -3 context creation
+// failed (e.g. n_ctx/KV settings rejected), -4 unsupported params version.
 extern "C" __attribute__((visibility("default")))
-int lb_stream_is_running() { return g_stream_running ? 1 : 0; }
+int lb_load_ex(const char* model_path_cstr, const lb_load_params* params) {
+    if (!model_path_cstr || model_path_cstr[0] == '\0') return -1;
+    if (!load_params_supported(params)) return -4;
+
+    default_release();  // free the old weights (unless cached) before mapping the new ones
+
+    lb_model * model = nullptr;
+    const int rc = lb_model_open(model_path_cstr, params, &model);
+    if (rc != 0) return rc;
+
+    // Explicit params: a cached model keeps the defaults of its first open.
+    lb_load_params lp;
+    load_params_copy(lp, params);
+    lb_ctx * ctx = nullptr;
+    const int crc = lb_ctx_create(model, &lp, &ctx);
+    lb_model_close(model);  // the context holds its own reference
+    if (crc != 0) return -3;
+
+    ctx->shift_keep    = g_default_shift_keep;
+    ctx->shift_discard = g_default_shift_discard;
+    std::lock_guard<std::mutex> lock(g_default_mu);
+    g_default_ctx = ctx;
+    return 0;
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_load(const char* model_path_cstr) {
+    return lb_load_ex(model_path_cstr, nullptr);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_is_loaded() { return default_ctx() ? 1 : 0; }
+
+extern "C" __attribute__((visibility("default")))
+int lb_reset() {
+    lb_ctx * ctx = default_ctx();
+    return ctx ? lb_ctx_reset(ctx) : -1;
+}
+
+extern "C" __attribute__((visibility("default")))
+void lb_free() { default_release(); }
+
+extern "C" __attribute__((visibility("default")))
+void lb_clear_history() { lb_ctx_clear_history(default_ctx()); }
+
+extern "C" __attribute__((visibility("default")))
+void lb_set_context_shift(int n_keep, int n_discard) {
+    g_default_shift_keep    = n_keep;
+    g_default_shift_discard = std::max(0, n_discard);
+    lb_ctx_set_context_shift(default_ctx(), n_keep, n_discard);
+}
+
+extern "C" __attribute__((visibility("default")))
+const char* lb_eval_ex(const char* prompt_cstr, int max_tokens,
+                       const lb_sampling_params* sampling) {
+    return lb_ctx_eval(default_ctx(), prompt_cstr, max_tokens, sampling);
+}
+
+extern "C" __attribute__((visibility("default")))
+const char* lb_eval(const char* prompt_cstr, int max_tokens) {
+    return lb_eval_ex(prompt_cstr, max_tokens, nullptr);
+}
+
+extern "C" __attribute__((visibility("default")))
+const char* lb_eval_req(const char* prompt_cstr, int max_tokens,
+                        const lb_sampling_params* sampling, const lb_request_params* req) {
+    return lb_ctx_eval_req(default_ctx(), prompt_cstr, max_tokens, sampling, req);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_stream_begin_ex(const char* prompt_cstr, int max_tokens,
+                       const lb_sampling_params* sampling) {
+    return lb_ctx_stream_begin(default_ctx(), prompt_cstr, max_tokens, sampling);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_stream_begin(const char* prompt_cstr, int max_tokens) {
+    return lb_stream_begin_ex(prompt_cstr, max_tokens, nullptr);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_stream_begin_req(const char* prompt_cstr, int max_tokens,
+                        const lb_sampling_params* sampling, const lb_request_params* req) {
+    return lb_ctx_stream_begin_req(default_ctx(), prompt_cstr, max_tokens, sampling, req);
+}
+
+extern "C" __attribute__((visibility("default")))
+const char* lb_stream_next() { return lb_ctx_stream_next(default_ctx()); }
+
+extern "C" __attribute__((visibility("default")))
+int lb_stream_is_running() { return lb_ctx_stream_is_running(default_ctx()); }
 
 extern "C" __attribute__((visibility("default")))
 void lb_stream_cancel() {
-    stream_reset();
+    std::lock_guard<std::mutex> lock(g_default_mu);  // held so lb_free cannot race
+    lb_ctx_stream_cancel(g_default_ctx);
+}
+
+extern "C" __attribute__((visibility("default")))
+void lb_stream_get_progress(lb_progress* out) {
+    std::lock_guard<std::mutex> lock(g_default_mu);
+    lb_ctx_stream_get_progress(g_default_ctx, out);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_get_stats(lb_stats* out) {
+    std::lock_guard<std::mutex> lock(g_default_mu);
+    return lb_ctx_get_stats(g_default_ctx, out);
+}
+
+extern "C" __attribute__((visibility("default")))
+void lb_stats_reset() {
+    std::lock_guard<std::mutex> lock(g_default_mu);
+    lb_ctx_stats_reset(g_default_ctx);
+}
+
+extern "C" __attribute__((visibility("default")))
+int lb_state_save(const char* path) { return lb_ctx_state_save(default_ctx(), 0, path); }
+
+extern "C" __attribute__((visibility("default")))
+int lb_state_load(const char* path) { return lb_ctx_state_load(default_ctx(), 0, path); }
+
+extern "C" __attribute__((visibility("default")))
+int lb_autotune(const char* profile_path, int force, lb_tune_result* out) {
+    return lb_ctx_autotune(default_ctx(), profile_path, force, out);
 }
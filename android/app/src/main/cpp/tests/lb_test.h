@@ -0,0 +1,30 @@
+// android/app/src/main/cpp/tests/lb_test.h
+#pragma once
+#include <cstdio>
+
+// Minimal check macros for the host unit tests: a failed CHECK prints its
+// location and the test keeps going; main() returns lb_test_result().
+
+inline int & lb_test_failures() { static int n = 0; return n; }
+
+#define CHECK(cond) do {                                                       \
+        if (!(cond)) {                                                         \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            lb_test_failures()++;                                              \
+        }                                                                      \
+    } while (0)
+
+#define CHECK_MSG(cond, ...) do {                                              \
+        if (!(cond)) {                                                         \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #cond); \
+            std::fprintf(stderr, __VA_ARGS__);                                 \
+            std::fputc('\n', stderr);                                          \
+            lb_test_failures()++;                                              \
+        }                                                                      \
+    } while (0)
+
+inline int lb_test_result(const char * name) {
+    const int n = lb_test_failures();
+    std::fprintf(stderr, "%s: %s (%d failed)\n", name, n ? "FAIL" : "ok", n);
+    return n ? 1 : 0;
+}
@@ -0,0 +1,301 @@
+// android/app/src/main/cpp/tests/test_grammar.cpp
+//
+// LbGrammar / LbGrammarState / LbVocabTrie and lb_json_schema_to_gbnf
+// against a stub vocabulary: every single byte plus a few multi-byte pieces
+// (whole words and UTF-8 sequences cut at awkward places).
+#include "lb_grammar.h"
+#include "lb_json_schema.h"
+#include "lb_test.h"
+
+#include <string>
+#include <vector>
+
+// ------------------------------ Stub vocab --------------------------------
+struct llama_vocab {
+    std::vector<std::string> pieces;  // token 0 is the end-of-generation token
+};
+
+int32_t llama_vocab_n_tokens(const llama_vocab * vocab) {
+    return (int32_t)vocab->pieces.size();
+}
+
+bool llama_vocab_is_eog(const llama_vocab *, llama_token token) {
+    return token == 0;
+}
+
+int32_t llama_token_to_piece(const llama_vocab * vocab, llama_token token, char * buf, int32_t length,
+                             int32_t, bool) {
+    const std::string & p = vocab->pieces[(size_t)token];
+    if ((int32_t)p.size() > length) return -(int32_t)p.size();
+    p.copy(buf, p.size());
+    return (int32_t)p.size();
+}
+
+namespace {
+
+const llama_vocab & stub_vocab() {
+    static const llama_vocab v = [] {
+        llama_vocab v;
+        v.pieces.push_back("");  // EOG
+        for (int b = 1; b < 256; ++b) v.pieces.push_back(std::string(1, (char)b));
+        for (const char * p : {"true", "tr", "ue", "false", "null", "{\"", "\":", "\"}", "ab", "abc", "bc",
+                               "\xC3\xA9",          // é
+                               "\xA9x",             // tail of é + "x"
+                               "\xE2\x82", "\x82\xAC", "\xE2\x82\xAC",  // € in pieces
+                               "\xA9\xE2",          // tail of é + head of €
+                               "\xC3\xA9\xC3"})     // é + head of another
+            v.pieces.push_back(p);
+        return v;
+    }();
+    return v;
+}
+
+const LbVocabTrie & trie() {
+    static const LbVocabTrie t(&stub_vocab());
+    return t;
+}
+
+llama_token tok(const std::string & piece) {
+    const auto & p = stub_vocab().pieces;
+    for (size_t i = 1; i < p.size(); ++i) if (p[i] == piece) return (llama_token)i;
+    std::fprintf(stderr, "no token for piece \"%s\"\n", piece.c_str());
+    return 0;
+}
+
+std::shared_ptr<const LbGrammar> grammar(const char * text) {
+    std::string err;
+    auto g = LbGrammar::parse(text, nullptr, &err);
+    CHECK_MSG(g != nullptr, "%s: %s", text, err.c_str());
+    return g;
+}
+
+// mask() must agree with allows() token for token, EOG included.
+void check_mask(LbGrammarState & st) {
+    std::vector<uint8_t> allowed;
+    const int32_t n = st.mask(trie(), allowed);
+    int32_t count = 0;
+    for (llama_token t = 0; t < trie().n_vocab(); ++t) {
+        const bool a = st.allows(trie(), t);
+        CHECK_MSG((allowed[(size_t)t] != 0) == a, "token %d: mask %d allows %d", t, allowed[(size_t)t], a);
+        count += a;
+    }
+    CHECK(n == count);
+    CHECK(st.allows(trie(), 0) == st.can_end());
+}
+
+// Feeds `pieces` as tokens; true if every one was accepted and the text may
+// end there. Checks mask() against allows() before each step.
+bool feed(const std::shared_ptr<const LbGrammar> & g, const std::vector<std::string> & pieces) {
+    if (!g) return false;
+    LbGrammarState st;
+    st.begin(g);
+    for (const std::string & p : pieces) {
+        check_mask(st);
+        if (!st.accept(trie(), tok(p))) return false;
+    }
+    check_mask(st);
+    return st.can_end();
+}
+
+// Same, one byte per token.
+bool accepts(const std::shared_ptr<const LbGrammar> & g, const std::string & text) {
+    std::vector<std::string> bytes;
+    for (const char c : text) bytes.emplace_back(1, c);
+    return feed(g, bytes);
+}
+
+std::shared_ptr<const LbGrammar> schema(const char * json) {
+    std::string gbnf, err;
+    const bool ok = lb_json_schema_to_gbnf(json, &gbnf, &err);
+    CHECK_MSG(ok, "%s: %s", json, err.c_str());
+    return ok ? grammar(gbnf.c_str()) : nullptr;
+}
+
+// ------------------------------- Grammars ---------------------------------
+void test_sequences() {
+    auto g = grammar(R"(root ::= "a" [0-9]+ ("x" | "yz")?)");
+    CHECK(accepts(g, "a1"));
+    CHECK(accepts(g, "a123x"));
+    CHECK(accepts(g, "a9yz"));
+    CHECK(!accepts(g, "a"));
+    CHECK(!accepts(g, "ax"));
+    CHECK(!accepts(g, "a1y"));   // prefix only
+    CHECK(!accepts(g, "a1xx"));
+    CHECK(!accepts(g, "b1"));
+}
+
+void test_recursion() {
+    auto g = grammar("root ::= (\"(\" root \")\")*\n");
+    CHECK(accepts(g, ""));
+    CHECK(accepts(g, "()(())"));
+    CHECK(!accepts(g, "(()"));
+    CHECK(!accepts(g, "())"));
+}
+
+void test_char_sets() {
+    auto g = grammar(R"(root ::= "\"" [^"\\]* "\"" [a-cx]?)");
+    CHECK(accepts(g, "\"hello world\""));
+    CHECK(accepts(g, "\"\"b"));
+    CHECK(accepts(g, "\"\"x"));
+    CHECK(!accepts(g, "\"\"d"));
+    CHECK(!accepts(g, "\"a\"b\""));
+    CHECK(!accepts(g, "\"a\\\""));
+}
+
+void test_words() {
+    auto g = grammar(R"(root ::= "true" | "false" | "abc")");
+    CHECK(feed(g, {"true"}));
+    CHECK(feed(g, {"tr", "ue"}));
+    CHECK(feed(g, {"t", "r", "ue"}));
+    CHECK(feed(g, {"ab", "c"}));
+    CHECK(feed(g, {"a", "bc"}));
+    CHECK(!feed(g, {"tr"}));
+    CHECK(!feed(g, {"ab", "bc"}));
+
+    // a token running past the end of the language is refused, state kept
+    LbGrammarState st;
+    st.begin(g);
+    CHECK(st.accept(trie(), tok("ab")));
+    CHECK(!st.accept(trie(), tok("bc")));
+    CHECK(!st.allows(trie(), 0));
+    CHECK(st.accept(trie(), tok("c")));
+    CHECK(st.can_end());
+    CHECK(!st.can_continue());
+}
+
+void test_parse_errors() {
+    std::string err;
+    CHECK(!LbGrammar::parse("root ::= undefined-rule", nullptr, &err));
+    CHECK(!err.empty());
+    err.clear();
+    CHECK(!LbGrammar::parse("root ::= root \"a\" | \"b\"", nullptr, &err));  // left recursion
+    CHECK(!err.empty());
+    err.clear();
+    CHECK(!LbGrammar::parse("root ::= \"unterminated", nullptr, &err));
+    CHECK(!err.empty());
+    CHECK(LbGrammar::parse("start ::= \"a\"", "start", &err));
+}
+
+// A code point's bytes split over tokens, and tokens ending mid-sequence.
+void test_utf8_split() {
+    auto g = grammar("root ::= \"\xC3\xA9\"+ \"\xE2\x82\xAC\"\n");  // é+ €
+    CHECK(feed(g, {"\xC3\xA9", "\xE2\x82\xAC"}));
+    CHECK(feed(g, {"\xC3", "\xA9", "\xE2", "\x82", "\xAC"}));
+    CHECK(feed(g, {"\xC3", "\xA9\xE2", "\x82\xAC"}));
+    CHECK(feed(g, {"\xC3\xA9\xC3", "\xA9", "\xE2\x82", "\xAC"}));
+    CHECK(!feed(g, {"\xC3", "\xA9\xE2", "\x82"}));       // € incomplete
+    CHECK(!feed(g, {"\xC3", "\xA8", "\xE2\x82\xAC"}));   // è
+    CHECK(!feed(g, {"\xE2\x82\xAC"}));                   // needs an é first
+
+    LbGrammarState st;
+    st.begin(g);
+    CHECK(st.accept(trie(), tok("\xC3")));
+    CHECK(!st.can_end());
+    CHECK(!st.allows(trie(), tok("\xA9x")));   // é then 'x'
+    CHECK(!st.allows(trie(), tok("a")));
+    CHECK(st.allows(trie(), tok("\xA9")));
+    check_mask(st);
+
+    // a range over code points rejects a lead byte that cannot reach it
+    auto r = grammar("root ::= [\xC3\xA0-\xC3\xBF] \"x\"\n");  // [à-ÿ] x
+    CHECK(feed(r, {"\xC3", "\xA9x"}));
+    LbGrammarState rs;
+    rs.begin(r);
+    CHECK(!rs.allows(trie(), tok("\xC2")));
+    CHECK(rs.allows(trie(), tok("\xC3")));
+
+    // ED A0..BF can only spell a surrogate: refused after two bytes, not
+    // left to fail on the third
+    auto any = grammar("root ::= [^\"]*\n");
+    LbGrammarState as;
+    as.begin(any);
+    CHECK(as.accept(trie(), tok("\xED")));
+    CHECK(!as.allows(trie(), tok("\xA0")));
+    CHECK(!as.allows(trie(), tok("\xBF")));
+    CHECK(as.allows(trie(), tok("\x9F")));  // U+D7C0..U+D7FF
+    check_mask(as);
+    CHECK(!feed(any, {"\xED", "\xA0", "\x80"}));
+    CHECK(feed(any, {"\xED", "\x9F", "\xBF"}));
+}
+
+// ------------------------------ JSON schema -------------------------------
+void test_schema_object() {
+    auto g = schema(R"({
+        "type": "object",
+        "properties": {
+            "name": {"type": "string"},
+            "age":  {"type": "integer"},
+            "tags": {"type": "array", "items": {"type": "string"}, "maxItems": 2}
+        },
+        "required": ["name"]
+    })");
+    CHECK(accepts(g, R"({"name":"x"})"));
+    CHECK(accepts(g, R"({ "name": "x", "age": 30 })"));
+    CHECK(accepts(g, R"({"name":"x","tags":["a","b"]})"));
+    CHECK(accepts(g, R"({"name":"x","age":-1,"tags":[]})"));
+    CHECK(!accepts(g, R"({})"));                                  // name missing
+    CHECK(!accepts(g, R"({"age":1})"));
+    CHECK(!accepts(g, R"({"name":"x","tags":["a","b","c"]})"));   // maxItems
+    CHECK(!accepts(g, R"({"name":"x","age":1.5})"));
+    CHECK(!accepts(g, R"({"name":"x","other":1})"));              // no additionalProperties
+    CHECK(!accepts(g, R"({"name":"x","age":1,"age":2})"));
+    CHECK(feed(g, {"{\"", "n", "a", "m", "e", "\":", "\"", "x", "\"}"}));
+}
+
+void test_schema_ref_recursion() {
+    auto g = schema(R"({
+        "$defs": {
+            "node": {
+                "type": "object",
+                "properties": {
+                    "v":    {"type": "integer"},
+                    "kids": {"type": "array", "items": {"$ref": "#/$defs/node"}}
+                },
+                "required": ["v"]
+            }
+        },
+        "$ref": "#/$defs/node"
+    })");
+    CHECK(accepts(g, R"({"v":1})"));
+    CHECK(accepts(g, R"({"v":1,"kids":[{"v":2,"kids":[]},{"v":3,"kids":[{"v":4}]}]})"));
+    CHECK(!accepts(g, R"({"v":1,"kids":[{"kids":[]}]})"));
+    CHECK(!accepts(g, R"({"v":1,"kids":[1]})"));
+
+    std::string gbnf, err;
+    CHECK(!lb_json_schema_to_gbnf(R"({"$ref": "#/$defs/missing"})", &gbnf, &err));
+    CHECK(!lb_json_schema_to_gbnf(R"({"$ref": "http://example.com/s.json"})", &gbnf, &err));
+}
+
+void test_schema_enum_and_escapes() {
+    auto g = schema(R"({"enum": ["red", "gréen", "\ud83d\ude00", null, 3]})");
+    CHECK(accepts(g, "\"red\""));
+    CHECK(accepts(g, "\"gr\xC3\xA9" "en\""));
+    CHECK(accepts(g, "\"\xF0\x9F\x98\x80\""));
+    CHECK(accepts(g, "null"));
+    CHECK(accepts(g, "3"));
+    CHECK(!accepts(g, "\"blue\""));
+
+    std::string gbnf, err;
+    CHECK(!lb_json_schema_to_gbnf(R"({"const": "\ud83d"})", &gbnf, &err));          // lone high
+    CHECK(!lb_json_schema_to_gbnf(R"({"const": "\ud83dx"})", &gbnf, &err));
+    CHECK(!lb_json_schema_to_gbnf(R"({"const": "\ud83d\u0041"})", &gbnf, &err));  // not a low surrogate
+    CHECK(!lb_json_schema_to_gbnf(R"({"const": "\ud83d\ud83d"})", &gbnf, &err));
+    CHECK(!lb_json_schema_to_gbnf(R"({"const": "\ude00"})", &gbnf, &err));          // lone low
+    CHECK(!lb_json_schema_to_gbnf(R"({"allOf": [{"type": "string"}]})", &gbnf, &err));
+    CHECK(!lb_json_schema_to_gbnf(R"({"type": "string")", &gbnf, &err));
+}
+
+} // namespace
+
+int main() {
+    test_sequences();
+    test_recursion();
+    test_char_sets();
+    test_words();
+    test_parse_errors();
+    test_utf8_split();
+    test_schema_object();
+    test_schema_ref_recursion();
+    test_schema_enum_and_escapes();
+    return lb_test_result("test_grammar");
+}
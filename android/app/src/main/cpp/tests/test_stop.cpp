@@ -0,0 +1,197 @@
+// android/app/src/main/cpp/tests/test_stop.cpp
+//
+// LbStopSet / LbStopMatcher and the stop-aware streaming detokenizer
+// (lb_detok_step / lb_detok_flush) over a stub vocabulary whose tokens are
+// added on first use.
+#include "lb_stop.h"
+#include "lb_test.h"
+
+#include <string>
+#include <vector>
+
+// ------------------------------ Stub vocab --------------------------------
+struct llama_vocab {
+    std::vector<std::string> pieces;
+};
+
+int32_t llama_token_to_piece(const llama_vocab * vocab, llama_token token, char * buf, int32_t length,
+                             int32_t, bool) {
+    const std::string & p = vocab->pieces[(size_t)token];
+    if ((int32_t)p.size() > length) return -(int32_t)p.size();
+    p.copy(buf, p.size());
+    return (int32_t)p.size();
+}
+
+int32_t llama_detokenize(const llama_vocab * vocab, const llama_token * tokens, int32_t n_tokens,
+                         char * text, int32_t text_len_max, bool, bool) {
+    std::string s;
+    for (int32_t i = 0; i < n_tokens; ++i) s += vocab->pieces[(size_t)tokens[i]];
+    if ((int32_t)s.size() > text_len_max) return -(int32_t)s.size();
+    s.copy(text, s.size());
+    return (int32_t)s.size();
+}
+
+namespace {
+
+llama_vocab g_vocab;
+
+llama_token tok(const std::string & piece) {
+    for (size_t i = 0; i < g_vocab.pieces.size(); ++i) if (g_vocab.pieces[i] == piece) return (llama_token)i;
+    g_vocab.pieces.push_back(piece);
+    return (llama_token)(g_vocab.pieces.size() - 1);
+}
+
+std::shared_ptr<const LbStopSet> stops(const std::vector<std::string> & strings,
+                                       const std::vector<llama_token> & tokens = {}) {
+    return std::make_shared<const LbStopSet>(strings, tokens);
+}
+
+// One generation: each piece is a token run through lb_detok_step; `out`
+// collects what each step released.
+struct Gen {
+    LbStreamDetok dt;
+    LbStopMatcher stop;
+    std::vector<std::string> out;
+    bool hit = false;
+
+    explicit Gen(std::shared_ptr<const LbStopSet> set) { stop.begin(std::move(set)); }
+
+    bool step(const std::string & piece) {
+        std::string o;
+        hit = lb_detok_step(dt, stop, &g_vocab, tok(piece), o);
+        out.push_back(o);
+        return hit;
+    }
+    std::string run(const std::vector<std::string> & pieces) {
+        for (const std::string & p : pieces) if (step(p)) break;
+        return text();
+    }
+    std::string flush() {
+        std::string o;
+        lb_detok_flush(dt, stop, o);
+        return o;
+    }
+    std::string text() const {
+        std::string s;
+        for (const std::string & o : out) s += o;
+        return s;
+    }
+};
+
+// Feeds `text` in one go; returns where the released text ends.
+size_t matched_at(const std::vector<std::string> & strings, const std::string & text, bool * hit) {
+    LbStopMatcher m;
+    m.begin(stops(strings));
+    *hit = m.feed(text.data(), text.size());
+    return m.safe_end();
+}
+
+// ------------------------------ Automaton ---------------------------------
+void test_single_feed() {
+    bool hit;
+    CHECK(matched_at({"STOP"}, "abcSTOPdef", &hit) == 3 && hit);
+    CHECK(matched_at({"STOP"}, "STOP", &hit) == 0 && hit);
+    CHECK(matched_at({"STOP"}, "abcSTO", &hit) == 3 && !hit);   // "STO" held back
+    CHECK(matched_at({"STOP"}, "abcSTX", &hit) == 6 && !hit);
+    CHECK(matched_at({"STOP"}, "SSSTOP", &hit) == 2 && hit);    // restarts on a failed prefix
+    CHECK(matched_at({"aab"}, "aaab", &hit) == 1 && hit);
+}
+
+void test_overlapping() {
+    bool hit;
+    // "b" ends inside "ab": the earliest completed stop wins
+    CHECK(matched_at({"ab", "b"}, "xab", &hit) == 1 && hit);
+    CHECK(matched_at({"ab", "b"}, "xb", &hit) == 1 && hit);
+    CHECK(matched_at({"b", "ab"}, "xab", &hit) == 1 && hit);
+    CHECK(matched_at({"ab", "b"}, "xa", &hit) == 1 && !hit);
+    // a shorter stop completing inside a longer candidate cuts it short
+    CHECK(matched_at({"abcd", "bc"}, "xabcd", &hit) == 2 && hit);
+    // suffix links: "abx" fails over to the "bx" branch
+    CHECK(matched_at({"abc", "bxy"}, "abxy", &hit) == 1 && hit);
+    CHECK(matched_at({"abc", "bxy"}, "abx", &hit) == 1 && !hit);
+}
+
+void test_stop_tokens() {
+    LbStopSet set({}, {7, 3, 7, 11});
+    CHECK(!set.empty());
+    CHECK(set.is_stop_token(3));
+    CHECK(set.is_stop_token(7));
+    CHECK(set.is_stop_token(11));
+    CHECK(!set.is_stop_token(4));
+    CHECK(LbStopSet({"", ""}, {}).empty());
+
+    LbStopMatcher m;
+    m.begin(stops({}, {5}));
+    CHECK(m.active());
+    CHECK(m.is_stop_token(5));
+    CHECK(!m.is_stop_token(6));
+    CHECK(!m.feed("abc", 3));
+    CHECK(m.safe_end() == 3);    // no strings: nothing held back
+
+    m.begin(stops({""}, {}));    // nothing to match: inactive
+    CHECK(!m.active());
+    CHECK(!m.is_stop_token(5));
+}
+
+// --------------------------- Streamed release -----------------------------
+void test_split_across_pieces() {
+    Gen g(stops({"</s>"}));
+    CHECK(!g.step("Hi <"));
+    CHECK(g.out.back() == "Hi ");            // "<" held back
+    CHECK(!g.step("/"));
+    CHECK(g.out.back().empty());
+    CHECK(g.step("s>tail"));
+    CHECK(g.out.back().empty());
+    CHECK(g.text() == "Hi ");
+    CHECK(g.flush().empty());                // a matched stop is never released
+
+    Gen h(stops({"</s>"}));
+    CHECK(h.run({"a", "<", "/", "s", ">", "b"}) == "a");
+    CHECK(h.hit);
+}
+
+void test_held_prefix_flushed() {
+    Gen g(stops({"STOP", "\n\n"}));
+    g.run({"one", " ST", "OP?"});             // "STOP" then "?": would stop
+    CHECK(g.hit && g.text() == "one ");
+
+    Gen h(stops({"STOP", "\n\n"}));
+    CHECK(h.run({"one", " ST", "O"}) == "one ");
+    CHECK(!h.hit);
+    CHECK(h.flush() == "STO");                // generation ended another way
+
+    Gen k(stops({"STOP", "\n\n"}));
+    CHECK(k.run({"a\n", "STX"}) == "a\nSTX");  // a broken prefix is released at once
+    CHECK(k.run({"\n"}) == "a\nSTX");
+    CHECK(k.flush() == "\n");
+}
+
+void test_utf8_and_stops() {
+    // a partial UTF-8 sequence is held even without a stop string nearby
+    Gen g(stops({"END"}));
+    CHECK(g.run({"caf", "\xC3"}) == "caf");
+    CHECK(g.run({"\xA9!"}) == "caf\xC3\xA9!");
+
+    // a multi-byte stop split mid-sequence
+    Gen h(stops({"\xE2\x80\xA6"}));   // "…"
+    CHECK(h.run({"wait", "\xE2", "\x80", "\xA6", "more"}) == "wait");
+    CHECK(h.hit);
+
+    // without stops everything complete is released
+    Gen n(nullptr);
+    CHECK(!n.stop.active());
+    CHECK(n.run({"x", "\xE2\x80", "\xA6"}) == "x\xE2\x80\xA6");
+    CHECK(n.flush().empty());
+}
+
+} // namespace
+
+int main() {
+    test_single_feed();
+    test_overlapping();
+    test_stop_tokens();
+    test_split_across_pieces();
+    test_held_prefix_flushed();
+    test_utf8_and_stops();
+    return lb_test_result("test_stop");
+}
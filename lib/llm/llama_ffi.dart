@@ -1,9 +1,27 @@
 // lib/llm/llama_ffi.dart
+import 'dart:convert';
 import 'dart:ffi';
+import 'dart:io';
+import 'dart:isolate';
+import 'dart:typed_data';
 import 'package:ffi/ffi.dart';
 import 'package:flutter/foundation.dart';
+import 'load_params.dart';
+import 'output_grammar.dart';
+import 'sampling_params.dart';
 
 DynamicLibrary _openBridge() {
+  // Linux desktop bundles the bridge in <bundle>/lib (see linux/CMakeLists.txt);
+  // dlopen() does not search the runner's RUNPATH, so resolve it explicitly.
+  if (Platform.isLinux) {
+    final exeDir = File(Platform.resolvedExecutable).parent.path;
+    final bundled = '$exeDir/lib/libllama_bridge.so';
+    if (File(bundled).existsSync()) {
+      final lib = DynamicLibrary.open(bundled);
+      debugPrint('[FFI] Opened $bundled');
+      return lib;
+    }
+  }
   final lib = DynamicLibrary.open('libllama_bridge.so');
   debugPrint('[FFI] Opened libllama_bridge.so');
   return lib;
@@ -19,6 +37,46 @@ typedef _LbLoadDart = int Function(Pointer<Utf8>);
 final _LbLoadDart _lbLoad =
     _bridge.lookup<NativeFunction<_LbLoadNative>>('lb_load').asFunction();
 
+// Mirrors lb_load_params in llama_bridge.cpp (field order matters).
+final class LbLoadParams extends Struct {
+  @Uint32()
+  external int version;
+  @Uint32()
+  external int nCtx;
+  @Uint32()
+  external int nBatch;
+  @Uint32()
+  external int nUbatch;
+  @Int32()
+  external int nThreads;
+  @Int32()
+  external int nThreadsBatch;
+  @Int32()
+  external int flashAttn;
+  @Int32()
+  external int typeK;
+  @Int32()
+  external int typeV;
+  @Int32()
+  external int useMmap;
+  @Int32()
+  external int useMlock;
+  // v2
+  @Uint32()
+  external int nSeqMax;
+  // v3
+  @Int32()
+  external int pooling;
+}
+
+const int _lbLoadParamsVersion = 3;
+
+// int lb_load_ex(const char* path, const lb_load_params*)
+typedef _LbLoadExNative = Int32 Function(Pointer<Utf8>, Pointer<LbLoadParams>);
+typedef _LbLoadExDart = int Function(Pointer<Utf8>, Pointer<LbLoadParams>);
+final _LbLoadExDart _lbLoadEx =
+    _bridge.lookup<NativeFunction<_LbLoadExNative>>('lb_load_ex').asFunction();
+
 // int lb_is_loaded()
 typedef _LbIsLoadedNative = Int32 Function();
 typedef _LbIsLoadedDart = int Function();
@@ -37,6 +95,70 @@ typedef _LbEvalDart = Pointer<Utf8> Function(Pointer<Utf8>, int);
 final _LbEvalDart _lbEval =
     _bridge.lookup<NativeFunction<_LbEvalNative>>('lb_eval').asFunction();
 
+// ---------- sampling ----------
+
+// Mirrors lb_sampling_params in lb_sampling.h (field order matters).
+final class LbSamplingParams extends Struct {
+  @Float()
+  external double temperature;
+  @Int32()
+  external int topK;
+  @Float()
+  external double topP;
+  @Float()
+  external double minP;
+  @Float()
+  external double repeatPenalty;
+  @Float()
+  external double frequencyPenalty;
+  @Float()
+  external double presencePenalty;
+  @Int32()
+  external int repeatLastN;
+  @Uint32()
+  external int seed;
+}
+
+const int _lbSeedRandom = 0xFFFFFFFF;
+
+// ---------- request params ----------
+
+// Mirrors lb_request_params in llama_bridge.cpp (field order matters).
+final class LbRequestParams extends Struct {
+  @Uint32()
+  external int version;
+  @Int32()
+  external int grammarKind;
+  external Pointer<Utf8> grammar;
+  external Pointer<Utf8> grammarRoot;
+  // version 2
+  external Pointer<Pointer<Utf8>> stop;
+  @Int32()
+  external int nStop;
+  external Pointer<Int32> stopTokens;
+  @Int32()
+  external int nStopTokens;
+}
+
+const int _lbRequestParamsVersion = 2;
+
+// int lb_grammar_validate(int kind, const char* text, const char* root, char* err, int err_len)
+typedef _LbGrammarValidateNative = Int32 Function(
+    Int32, Pointer<Utf8>, Pointer<Utf8>, Pointer<Utf8>, Int32);
+typedef _LbGrammarValidateDart = int Function(
+    int, Pointer<Utf8>, Pointer<Utf8>, Pointer<Utf8>, int);
+final _LbGrammarValidateDart _lbGrammarValidate = _bridge
+    .lookup<NativeFunction<_LbGrammarValidateNative>>('lb_grammar_validate')
+    .asFunction();
+
+// const char* lb_eval_ex(const char* prompt, int max_tokens, const lb_sampling_params*)
+typedef _LbEvalExNative = Pointer<Utf8> Function(
+    Pointer<Utf8>, Int32, Pointer<LbSamplingParams>);
+typedef _LbEvalExDart = Pointer<Utf8> Function(
+    Pointer<Utf8>, int, Pointer<LbSamplingParams>);
+final _LbEvalExDart _lbEvalEx =
+    _bridge.lookup<NativeFunction<_LbEvalExNative>>('lb_eval_ex').asFunction();
+
 // void lb_free()
 typedef _LbFreeNative = Void Function();
 typedef _LbFreeDart = void Function();
@@ -57,6 +179,51 @@ final _LbClearHistoryDart? _lbClearHistory = (() {
   }
 })();
 
+// void lb_set_context_shift(int n_keep, int n_discard)
+typedef _LbSetContextShiftNative = Void Function(Int32, Int32);
+typedef _LbSetContextShiftDart = void Function(int, int);
+final _LbSetContextShiftDart _lbSetContextShift = _bridge
+    .lookup<NativeFunction<_LbSetContextShiftNative>>('lb_set_context_shift')
+    .asFunction();
+
+// ---------- thread tuning FFI ----------
+
+// Mirrors lb_tune_result in llama_bridge.cpp.
+final class LbTuneResult extends Struct {
+  @Int32()
+  external int nThreads;
+  @Int32()
+  external int nThreadsBatch;
+  @Uint64()
+  external int cpumask;
+  @Uint64()
+  external int cpumaskBatch;
+  @Float()
+  external double decodeTokPerSec;
+  @Float()
+  external double prefillTokPerSec;
+  @Int32()
+  external int fromCache;
+}
+
+// int lb_autotune(const char* profile_path, int force, lb_tune_result* out)
+typedef _LbAutotuneNative = Int32 Function(Pointer<Utf8>, Int32, Pointer<LbTuneResult>);
+typedef _LbAutotuneDart = int Function(Pointer<Utf8>, int, Pointer<LbTuneResult>);
+final _LbAutotuneDart _lbAutotune =
+    _bridge.lookup<NativeFunction<_LbAutotuneNative>>('lb_autotune').asFunction();
+
+// ---------- session state FFI ----------
+
+// int lb_state_save(const char* path) / int lb_state_load(const char* path)
+typedef _LbStatePathNative = Int32 Function(Pointer<Utf8>);
+typedef _LbStatePathDart = int Function(Pointer<Utf8>);
+final _LbStatePathDart _lbStateSave = _bridge
+    .lookup<NativeFunction<_LbStatePathNative>>('lb_state_save')
+    .asFunction();
+final _LbStatePathDart _lbStateLoad = _bridge
+    .lookup<NativeFunction<_LbStatePathNative>>('lb_state_load')
+    .asFunction();
+
 // ---------- streaming FFI ----------
 
 // int lb_stream_begin(const char* prompt, int max_tokens)
@@ -66,6 +233,15 @@ final _LbStreamBeginDart _lbStreamBegin = _bridge
     .lookup<NativeFunction<_LbStreamBeginNative>>('lb_stream_begin')
     .asFunction();
 
+// int lb_stream_begin_ex(const char* prompt, int max_tokens, const lb_sampling_params*)
+typedef _LbStreamBeginExNative = Int32 Function(
+    Pointer<Utf8>, Int32, Pointer<LbSamplingParams>);
+typedef _LbStreamBeginExDart = int Function(
+    Pointer<Utf8>, int, Pointer<LbSamplingParams>);
+final _LbStreamBeginExDart _lbStreamBeginEx = _bridge
+    .lookup<NativeFunction<_LbStreamBeginExNative>>('lb_stream_begin_ex')
+    .asFunction();
+
 // const char* lb_stream_next()
 typedef _LbStreamNextNative = Pointer<Utf8> Function();
 typedef _LbStreamNextDart = Pointer<Utf8> Function();
@@ -80,37 +256,685 @@ final _LbStreamIsRunningDart _lbStreamIsRunning = _bridge
     .lookup<NativeFunction<_LbStreamIsRunningNative>>('lb_stream_is_running')
     .asFunction();
 
-// void lb_stream_cancel()
+// void lb_stream_cancel()  (thread-safe: only raises a flag)
 typedef _LbStreamCancelNative = Void Function();
 typedef _LbStreamCancelDart = void Function();
 final _LbStreamCancelDart _lbStreamCancel = _bridge
     .lookup<NativeFunction<_LbStreamCancelNative>>('lb_stream_cancel')
     .asFunction();
 
+// Mirrors lb_progress in llama_bridge.cpp.
+final class LbProgress extends Struct {
+  @Int32()
+  external int prefillDone;
+  @Int32()
+  external int prefillTotal;
+  @Int32()
+  external int prefillReused;
+  @Float()
+  external double prefillTokPerSec;
+  @Int32()
+  external int decodeTokens;
+  @Float()
+  external double decodeTokPerSec;
+}
+
+// void lb_stream_get_progress(lb_progress* out)  (thread-safe)
+typedef _LbStreamGetProgressNative = Void Function(Pointer<LbProgress>);
+typedef _LbStreamGetProgressDart = void Function(Pointer<LbProgress>);
+final _LbStreamGetProgressDart _lbStreamGetProgress = _bridge
+    .lookup<NativeFunction<_LbStreamGetProgressNative>>('lb_stream_get_progress')
+    .asFunction();
+
+// ---------- handle API ----------
+// One model (weights) can back several contexts (KV cache + stream each).
+// Handles are plain addresses, so they can be sent to other isolates as ints
+// (Pointer.fromAddress) e.g. for cancel/progress.
+
+final class LbModel extends Opaque {}
+
+final class LbCtx extends Opaque {}
+
+// int lb_model_open(const char* path, const lb_load_params*, lb_model** out)
+typedef _LbModelOpenNative = Int32 Function(
+    Pointer<Utf8>, Pointer<LbLoadParams>, Pointer<Pointer<LbModel>>);
+typedef _LbModelOpenDart = int Function(
+    Pointer<Utf8>, Pointer<LbLoadParams>, Pointer<Pointer<LbModel>>);
+final _LbModelOpenDart _lbModelOpen =
+    _bridge.lookup<NativeFunction<_LbModelOpenNative>>('lb_model_open').asFunction();
+
+// ---------- async loading ----------
+
+final class LbLoadJob extends Opaque {}
+
+const int lbLoadRunning = 1;
+const int lbLoadDone = 2;
+const int lbLoadFailed = 3;
+const int lbLoadCancelled = 4;
+
+// int lb_model_open_async(const char* path, const lb_load_params*, void* post_cobject,
+//                         int64_t port, lb_load_job** out)
+typedef _LbModelOpenAsyncNative = Int32 Function(Pointer<Utf8>, Pointer<LbLoadParams>,
+    Pointer<Void>, Int64, Pointer<Pointer<LbLoadJob>>);
+typedef _LbModelOpenAsyncDart = int Function(Pointer<Utf8>, Pointer<LbLoadParams>,
+    Pointer<Void>, int, Pointer<Pointer<LbLoadJob>>);
+final _LbModelOpenAsyncDart _lbModelOpenAsync = _bridge
+    .lookup<NativeFunction<_LbModelOpenAsyncNative>>('lb_model_open_async')
+    .asFunction();
+
+// void lb_load_job_cancel(lb_load_job*)
+typedef _LbLoadJobCancelNative = Void Function(Pointer<LbLoadJob>);
+typedef _LbLoadJobCancelDart = void Function(Pointer<LbLoadJob>);
+final _LbLoadJobCancelDart _lbLoadJobCancel = _bridge
+    .lookup<NativeFunction<_LbLoadJobCancelNative>>('lb_load_job_cancel')
+    .asFunction();
+
+// int lb_load_job_finish(lb_load_job*, lb_model** out)
+typedef _LbLoadJobFinishNative = Int32 Function(Pointer<LbLoadJob>, Pointer<Pointer<LbModel>>);
+typedef _LbLoadJobFinishDart = int Function(Pointer<LbLoadJob>, Pointer<Pointer<LbModel>>);
+final _LbLoadJobFinishDart _lbLoadJobFinish = _bridge
+    .lookup<NativeFunction<_LbLoadJobFinishNative>>('lb_load_job_finish')
+    .asFunction();
+
+// int lb_model_prefetch(const char* path)
+typedef _LbModelPrefetchNative = Int32 Function(Pointer<Utf8>);
+typedef _LbModelPrefetchDart = int Function(Pointer<Utf8>);
+final _LbModelPrefetchDart _lbModelPrefetch = _bridge
+    .lookup<NativeFunction<_LbModelPrefetchNative>>('lb_model_prefetch')
+    .asFunction();
+
+// void lb_model_close(lb_model*)
+typedef _LbModelCloseNative = Void Function(Pointer<LbModel>);
+typedef _LbModelCloseDart = void Function(Pointer<LbModel>);
+final _LbModelCloseDart _lbModelClose =
+    _bridge.lookup<NativeFunction<_LbModelCloseNative>>('lb_model_close').asFunction();
+
+// int lb_ctx_create(lb_model*, const lb_load_params*, lb_ctx** out)
+typedef _LbCtxCreateNative = Int32 Function(
+    Pointer<LbModel>, Pointer<LbLoadParams>, Pointer<Pointer<LbCtx>>);
+typedef _LbCtxCreateDart = int Function(
+    Pointer<LbModel>, Pointer<LbLoadParams>, Pointer<Pointer<LbCtx>>);
+final _LbCtxCreateDart _lbCtxCreate =
+    _bridge.lookup<NativeFunction<_LbCtxCreateNative>>('lb_ctx_create').asFunction();
+
+// void lb_ctx_free(lb_ctx*) / void lb_ctx_clear_history(lb_ctx*) / void lb_ctx_stream_cancel(lb_ctx*)
+typedef _LbCtxVoidNative = Void Function(Pointer<LbCtx>);
+typedef _LbCtxVoidDart = void Function(Pointer<LbCtx>);
+final _LbCtxVoidDart _lbCtxFree =
+    _bridge.lookup<NativeFunction<_LbCtxVoidNative>>('lb_ctx_free').asFunction();
+final _LbCtxVoidDart _lbCtxClearHistory = _bridge
+    .lookup<NativeFunction<_LbCtxVoidNative>>('lb_ctx_clear_history')
+    .asFunction();
+final _LbCtxVoidDart _lbCtxStreamCancel = _bridge
+    .lookup<NativeFunction<_LbCtxVoidNative>>('lb_ctx_stream_cancel')
+    .asFunction();
+
+// int lb_ctx_reset(lb_ctx*) / int lb_ctx_stream_is_running(lb_ctx*)
+typedef _LbCtxIntNative = Int32 Function(Pointer<LbCtx>);
+typedef _LbCtxIntDart = int Function(Pointer<LbCtx>);
+final _LbCtxIntDart _lbCtxReset =
+    _bridge.lookup<NativeFunction<_LbCtxIntNative>>('lb_ctx_reset').asFunction();
+final _LbCtxIntDart _lbCtxStreamIsRunning = _bridge
+    .lookup<NativeFunction<_LbCtxIntNative>>('lb_ctx_stream_is_running')
+    .asFunction();
+
+// const char* lb_ctx_eval_req(lb_ctx*, const char* prompt, int max_tokens,
+//                             const lb_sampling_params*, const lb_request_params*)
+typedef _LbCtxEvalNative = Pointer<Utf8> Function(
+    Pointer<LbCtx>, Pointer<Utf8>, Int32, Pointer<LbSamplingParams>, Pointer<LbRequestParams>);
+typedef _LbCtxEvalDart = Pointer<Utf8> Function(
+    Pointer<LbCtx>, Pointer<Utf8>, int, Pointer<LbSamplingParams>, Pointer<LbRequestParams>);
+final _LbCtxEvalDart _lbCtxEval =
+    _bridge.lookup<NativeFunction<_LbCtxEvalNative>>('lb_ctx_eval_req').asFunction();
+
+// int lb_ctx_stream_begin_req(lb_ctx*, const char* prompt, int max_tokens,
+//                             const lb_sampling_params*, const lb_request_params*)
+typedef _LbCtxStreamBeginNative = Int32 Function(
+    Pointer<LbCtx>, Pointer<Utf8>, Int32, Pointer<LbSamplingParams>, Pointer<LbRequestParams>);
+typedef _LbCtxStreamBeginDart = int Function(
+    Pointer<LbCtx>, Pointer<Utf8>, int, Pointer<LbSamplingParams>, Pointer<LbRequestParams>);
+final _LbCtxStreamBeginDart _lbCtxStreamBegin = _bridge
+    .lookup<NativeFunction<_LbCtxStreamBeginNative>>('lb_ctx_stream_begin_req')
+    .asFunction();
+
+// const char* lb_ctx_stream_next(lb_ctx*)
+typedef _LbCtxStreamNextNative = Pointer<Utf8> Function(Pointer<LbCtx>);
+typedef _LbCtxStreamNextDart = Pointer<Utf8> Function(Pointer<LbCtx>);
+final _LbCtxStreamNextDart _lbCtxStreamNext = _bridge
+    .lookup<NativeFunction<_LbCtxStreamNextNative>>('lb_ctx_stream_next')
+    .asFunction();
+
+// void lb_ctx_stream_get_progress(lb_ctx*, lb_progress* out)  (thread-safe)
+typedef _LbCtxStreamGetProgressNative = Void Function(Pointer<LbCtx>, Pointer<LbProgress>);
+typedef _LbCtxStreamGetProgressDart = void Function(Pointer<LbCtx>, Pointer<LbProgress>);
+final _LbCtxStreamGetProgressDart _lbCtxStreamGetProgress = _bridge
+    .lookup<NativeFunction<_LbCtxStreamGetProgressNative>>('lb_ctx_stream_get_progress')
+    .asFunction();
+
+// void lb_ctx_set_context_shift(lb_ctx*, int n_keep, int n_discard)
+typedef _LbCtxSetContextShiftNative = Void Function(Pointer<LbCtx>, Int32, Int32);
+typedef _LbCtxSetContextShiftDart = void Function(Pointer<LbCtx>, int, int);
+final _LbCtxSetContextShiftDart _lbCtxSetContextShift = _bridge
+    .lookup<NativeFunction<_LbCtxSetContextShiftNative>>('lb_ctx_set_context_shift')
+    .asFunction();
+
+// int lb_ctx_state_save(lb_ctx*, int seq, const char* path) / lb_ctx_state_load(...)
+typedef _LbCtxStateNative = Int32 Function(Pointer<LbCtx>, Int32, Pointer<Utf8>);
+typedef _LbCtxStateDart = int Function(Pointer<LbCtx>, int, Pointer<Utf8>);
+final _LbCtxStateDart _lbCtxStateSave = _bridge
+    .lookup<NativeFunction<_LbCtxStateNative>>('lb_ctx_state_save')
+    .asFunction();
+final _LbCtxStateDart _lbCtxStateLoad = _bridge
+    .lookup<NativeFunction<_LbCtxStateNative>>('lb_ctx_state_load')
+    .asFunction();
+
+// int lb_ctx_autotune(lb_ctx*, const char* profile_path, int force, lb_tune_result* out)
+typedef _LbCtxAutotuneNative = Int32 Function(
+    Pointer<LbCtx>, Pointer<Utf8>, Int32, Pointer<LbTuneResult>);
+typedef _LbCtxAutotuneDart = int Function(
+    Pointer<LbCtx>, Pointer<Utf8>, int, Pointer<LbTuneResult>);
+final _LbCtxAutotuneDart _lbCtxAutotune = _bridge
+    .lookup<NativeFunction<_LbCtxAutotuneNative>>('lb_ctx_autotune')
+    .asFunction();
+
+// ---------- multi-stream scheduler ----------
+
+// Mirrors lb_stream_status in llama_bridge.cpp.
+const int lbStreamPrefill = 1;
+const int lbStreamDecode = 2;
+const int lbStreamDone = 3;
+const int lbStreamCancelled = 4;
+const int lbStreamError = 5;
+
+/// Stream ids map to KV sequences as `id % lbMaxStreams`.
+const int lbMaxStreams = 64;
+
+// int lb_ctx_stream_open_req(lb_ctx*, const char* prompt, int max_tokens,
+//                            const lb_sampling_params*, const lb_request_params*, int32_t* out_id)
+typedef _LbCtxStreamOpenNative = Int32 Function(Pointer<LbCtx>, Pointer<Utf8>, Int32,
+    Pointer<LbSamplingParams>, Pointer<LbRequestParams>, Pointer<Int32>);
+typedef _LbCtxStreamOpenDart = int Function(Pointer<LbCtx>, Pointer<Utf8>, int,
+    Pointer<LbSamplingParams>, Pointer<LbRequestParams>, Pointer<Int32>);
+final _LbCtxStreamOpenDart _lbCtxStreamOpen = _bridge
+    .lookup<NativeFunction<_LbCtxStreamOpenNative>>('lb_ctx_stream_open_req')
+    .asFunction();
+
+// int lb_ctx_step(lb_ctx*)
+final _LbCtxIntDart _lbCtxStep =
+    _bridge.lookup<NativeFunction<_LbCtxIntNative>>('lb_ctx_step').asFunction();
+
+// const char* lb_ctx_stream_read(lb_ctx*, int32_t id, int32_t* status)
+typedef _LbCtxStreamReadNative = Pointer<Utf8> Function(Pointer<LbCtx>, Int32, Pointer<Int32>);
+typedef _LbCtxStreamReadDart = Pointer<Utf8> Function(Pointer<LbCtx>, int, Pointer<Int32>);
+final _LbCtxStreamReadDart _lbCtxStreamRead = _bridge
+    .lookup<NativeFunction<_LbCtxStreamReadNative>>('lb_ctx_stream_read')
+    .asFunction();
+
+// void lb_ctx_stream_stop(lb_ctx*, int32_t id)  (thread-safe)
+typedef _LbCtxStreamIdVoidNative = Void Function(Pointer<LbCtx>, Int32);
+typedef _LbCtxStreamIdVoidDart = void Function(Pointer<LbCtx>, int);
+final _LbCtxStreamIdVoidDart _lbCtxStreamStop = _bridge
+    .lookup<NativeFunction<_LbCtxStreamIdVoidNative>>('lb_ctx_stream_stop')
+    .asFunction();
+
+// int lb_ctx_stream_close(lb_ctx*, int32_t id)
+typedef _LbCtxStreamIdIntNative = Int32 Function(Pointer<LbCtx>, Int32);
+typedef _LbCtxStreamIdIntDart = int Function(Pointer<LbCtx>, int);
+final _LbCtxStreamIdIntDart _lbCtxStreamClose = _bridge
+    .lookup<NativeFunction<_LbCtxStreamIdIntNative>>('lb_ctx_stream_close')
+    .asFunction();
+
+// int lb_ctx_stream_poll(lb_ctx*, int32_t id, lb_progress* out)  (thread-safe)
+typedef _LbCtxStreamPollNative = Int32 Function(Pointer<LbCtx>, Int32, Pointer<LbProgress>);
+typedef _LbCtxStreamPollDart = int Function(Pointer<LbCtx>, int, Pointer<LbProgress>);
+final _LbCtxStreamPollDart _lbCtxStreamPoll = _bridge
+    .lookup<NativeFunction<_LbCtxStreamPollNative>>('lb_ctx_stream_poll')
+    .asFunction();
+
+// ---------- speculative decoding ----------
+
+// Mirrors lb_spec_params in llama_bridge.cpp.
+final class LbSpecParams extends Struct {
+  @Int32()
+  external int nDraft;
+  @Int32()
+  external int nDraftMax;
+  @Int32()
+  external int adaptive;
+}
+
+// Mirrors lb_spec_stats in llama_bridge.cpp.
+final class LbSpecStats extends Struct {
+  @Int32()
+  external int nDraft;
+  @Int32()
+  external int steps;
+  @Int32()
+  external int drafted;
+  @Int32()
+  external int accepted;
+  @Float()
+  external double acceptRate;
+  @Float()
+  external double tokensPerStep;
+}
+
+// Mirrors lb_lookup_params in llama_bridge.cpp.
+final class LbLookupParams extends Struct {
+  @Int32()
+  external int ngramMin;
+  @Int32()
+  external int ngramMax;
+  @Int32()
+  external int nDraftMax;
+}
+
+// int lb_ctx_set_draft(lb_ctx*, lb_model* draft, const lb_spec_params*)
+typedef _LbCtxSetDraftNative = Int32 Function(
+    Pointer<LbCtx>, Pointer<LbModel>, Pointer<LbSpecParams>);
+typedef _LbCtxSetDraftDart = int Function(
+    Pointer<LbCtx>, Pointer<LbModel>, Pointer<LbSpecParams>);
+final _LbCtxSetDraftDart _lbCtxSetDraft = _bridge
+    .lookup<NativeFunction<_LbCtxSetDraftNative>>('lb_ctx_set_draft')
+    .asFunction();
+
+// int lb_ctx_set_lookup(lb_ctx*, const lb_lookup_params*)
+typedef _LbCtxSetLookupNative = Int32 Function(Pointer<LbCtx>, Pointer<LbLookupParams>);
+typedef _LbCtxSetLookupDart = int Function(Pointer<LbCtx>, Pointer<LbLookupParams>);
+final _LbCtxSetLookupDart _lbCtxSetLookup = _bridge
+    .lookup<NativeFunction<_LbCtxSetLookupNative>>('lb_ctx_set_lookup')
+    .asFunction();
+
+// int lb_ctx_stream_spec_stats(lb_ctx*, int32_t id, lb_spec_stats* out)  (thread-safe)
+typedef _LbCtxStreamSpecStatsNative = Int32 Function(Pointer<LbCtx>, Int32, Pointer<LbSpecStats>);
+typedef _LbCtxStreamSpecStatsDart = int Function(Pointer<LbCtx>, int, Pointer<LbSpecStats>);
+final _LbCtxStreamSpecStatsDart _lbCtxStreamSpecStats = _bridge
+    .lookup<NativeFunction<_LbCtxStreamSpecStatsNative>>('lb_ctx_stream_spec_stats')
+    .asFunction();
+
+// ---------- native generation ----------
+
+// int lb_ctx_async_start(lb_ctx*, void* post_cobject, int64_t events_port, int32_t cadence_ms)
+typedef _LbCtxAsyncStartNative = Int32 Function(Pointer<LbCtx>, Pointer<Void>, Int64, Int32);
+typedef _LbCtxAsyncStartDart = int Function(Pointer<LbCtx>, Pointer<Void>, int, int);
+final _LbCtxAsyncStartDart _lbCtxAsyncStart = _bridge
+    .lookup<NativeFunction<_LbCtxAsyncStartNative>>('lb_ctx_async_start')
+    .asFunction();
+
+// int lb_ctx_async_stop(lb_ctx*)
+typedef _LbCtxAsyncStopNative = Int32 Function(Pointer<LbCtx>);
+typedef _LbCtxAsyncStopDart = int Function(Pointer<LbCtx>);
+final _LbCtxAsyncStopDart _lbCtxAsyncStop = _bridge
+    .lookup<NativeFunction<_LbCtxAsyncStopNative>>('lb_ctx_async_stop')
+    .asFunction();
+
+// int lb_ctx_stream_attach(lb_ctx*, int32_t id, int64_t port)
+typedef _LbCtxStreamAttachNative = Int32 Function(Pointer<LbCtx>, Int32, Int64);
+typedef _LbCtxStreamAttachDart = int Function(Pointer<LbCtx>, int, int);
+final _LbCtxStreamAttachDart _lbCtxStreamAttach = _bridge
+    .lookup<NativeFunction<_LbCtxStreamAttachNative>>('lb_ctx_stream_attach')
+    .asFunction();
+
+// ---------- embeddings & vector index ----------
+
+final class LbIndex extends Opaque {}
+
+// int lb_ctx_embed_batch(lb_ctx*, const char* const* texts, int32_t n, float* out, int32_t out_len, int32_t normalize)
+typedef _LbCtxEmbedBatchNative = Int32 Function(
+    Pointer<LbCtx>, Pointer<Pointer<Utf8>>, Int32, Pointer<Float>, Int32, Int32);
+typedef _LbCtxEmbedBatchDart = int Function(
+    Pointer<LbCtx>, Pointer<Pointer<Utf8>>, int, Pointer<Float>, int, int);
+final _LbCtxEmbedBatchDart _lbCtxEmbedBatch = _bridge
+    .lookup<NativeFunction<_LbCtxEmbedBatchNative>>('lb_ctx_embed_batch')
+    .asFunction();
+
+// int lb_ctx_embed_dim(lb_ctx*)
+final _LbCtxIntDart _lbCtxEmbedDim = _bridge
+    .lookup<NativeFunction<_LbCtxIntNative>>('lb_ctx_embed_dim')
+    .asFunction();
+
+// uint64_t lb_ctx_model_id(lb_ctx*)
+typedef _LbCtxModelIdNative = Uint64 Function(Pointer<LbCtx>);
+typedef _LbCtxModelIdDart = int Function(Pointer<LbCtx>);
+final _LbCtxModelIdDart _lbCtxModelId = _bridge
+    .lookup<NativeFunction<_LbCtxModelIdNative>>('lb_ctx_model_id')
+    .asFunction();
+
+// int lb_index_open(const char* path, int32_t dim, uint64_t tag, lb_index** out)
+typedef _LbIndexOpenNative = Int32 Function(Pointer<Utf8>, Int32, Uint64, Pointer<Pointer<LbIndex>>);
+typedef _LbIndexOpenDart = int Function(Pointer<Utf8>, int, int, Pointer<Pointer<LbIndex>>);
+final _LbIndexOpenDart _lbIndexOpen = _bridge
+    .lookup<NativeFunction<_LbIndexOpenNative>>('lb_index_open')
+    .asFunction();
+
+// void lb_index_close(lb_index*)
+typedef _LbIndexCloseNative = Void Function(Pointer<LbIndex>);
+typedef _LbIndexCloseDart = void Function(Pointer<LbIndex>);
+final _LbIndexCloseDart _lbIndexClose = _bridge
+    .lookup<NativeFunction<_LbIndexCloseNative>>('lb_index_close')
+    .asFunction();
+
+// int lb_index_add(lb_index*, int32_t n, const int64_t* groups, const int64_t* keys, const float* vecs)
+typedef _LbIndexAddNative = Int32 Function(
+    Pointer<LbIndex>, Int32, Pointer<Int64>, Pointer<Int64>, Pointer<Float>);
+typedef _LbIndexAddDart = int Function(
+    Pointer<LbIndex>, int, Pointer<Int64>, Pointer<Int64>, Pointer<Float>);
+final _LbIndexAddDart _lbIndexAdd = _bridge
+    .lookup<NativeFunction<_LbIndexAddNative>>('lb_index_add')
+    .asFunction();
+
+// int lb_index_remove_group(lb_index*, int64_t group)
+typedef _LbIndexRemoveGroupNative = Int32 Function(Pointer<LbIndex>, Int64);
+typedef _LbIndexRemoveGroupDart = int Function(Pointer<LbIndex>, int);
+final _LbIndexRemoveGroupDart _lbIndexRemoveGroup = _bridge
+    .lookup<NativeFunction<_LbIndexRemoveGroupNative>>('lb_index_remove_group')
+    .asFunction();
+
+// int lb_index_search(lb_index*, const float* query, int32_t k, int64_t* groups, int64_t* keys, float* scores)
+typedef _LbIndexSearchNative = Int32 Function(
+    Pointer<LbIndex>, Pointer<Float>, Int32, Pointer<Int64>, Pointer<Int64>, Pointer<Float>);
+typedef _LbIndexSearchDart = int Function(
+    Pointer<LbIndex>, Pointer<Float>, int, Pointer<Int64>, Pointer<Int64>, Pointer<Float>);
+final _LbIndexSearchDart _lbIndexSearch = _bridge
+    .lookup<NativeFunction<_LbIndexSearchNative>>('lb_index_search')
+    .asFunction();
+
+// int lb_index_count(lb_index*)
+typedef _LbIndexCountNative = Int32 Function(Pointer<LbIndex>);
+typedef _LbIndexCountDart = int Function(Pointer<LbIndex>);
+final _LbIndexCountDart _lbIndexCount = _bridge
+    .lookup<NativeFunction<_LbIndexCountNative>>('lb_index_count')
+    .asFunction();
+
+// ---------- performance counters ----------
+
+// Mirrors lb_stats in llama_bridge.cpp.
+final class LbStats extends Struct {
+  @Int64()
+  external int peakRssBytes;
+  @Int32()
+  external int requests;
+  @Int32()
+  external int prefillTokens;
+  @Int32()
+  external int decodeTokens;
+  @Float()
+  external double tokenizeMs;
+  @Float()
+  external double prefillMs;
+  @Float()
+  external double sampleMs;
+  @Float()
+  external double decodeMs;
+  @Float()
+  external double detokMs;
+  @Float()
+  external double prefillTokPerSec;
+  @Float()
+  external double decodeTokPerSec;
+  @Float()
+  external double ttftMs;
+  @Float()
+  external double ttftAvgMs;
+  @Float()
+  external double tokenP50Ms;
+  @Float()
+  external double tokenP95Ms;
+  @Float()
+  external double tokenP99Ms;
+  @Int32()
+  external int kvUsed;
+  @Int32()
+  external int kvTotal;
+  @Int32()
+  external int nThreads;
+  @Int32()
+  external int nThreadsBatch;
+}
+
+// int lb_ctx_get_stats(lb_ctx*, lb_stats* out)  (thread-safe)
+typedef _LbCtxGetStatsNative = Int32 Function(Pointer<LbCtx>, Pointer<LbStats>);
+typedef _LbCtxGetStatsDart = int Function(Pointer<LbCtx>, Pointer<LbStats>);
+final _LbCtxGetStatsDart _lbCtxGetStats = _bridge
+    .lookup<NativeFunction<_LbCtxGetStatsNative>>('lb_ctx_get_stats')
+    .asFunction();
+
+// void lb_ctx_stats_reset(lb_ctx*)
+final _LbCtxVoidDart _lbCtxStatsReset = _bridge
+    .lookup<NativeFunction<_LbCtxVoidNative>>('lb_ctx_stats_reset')
+    .asFunction();
+
+// int lb_get_stats(lb_stats* out)  (thread-safe)
+typedef _LbGetStatsNative = Int32 Function(Pointer<LbStats>);
+typedef _LbGetStatsDart = int Function(Pointer<LbStats>);
+final _LbGetStatsDart _lbGetStats = _bridge
+    .lookup<NativeFunction<_LbGetStatsNative>>('lb_get_stats')
+    .asFunction();
+
+// ---------- prefix cache ----------
+
+// Mirrors lb_prefix_stats in llama_bridge.cpp.
+final class LbPrefixStats extends Struct {
+  @Int64()
+  external int bytes;
+  @Int64()
+  external int budgetBytes;
+  @Int64()
+  external int tokensRestored;
+  @Int32()
+  external int entries;
+  @Int32()
+  external int lookups;
+  @Int32()
+  external int hits;
+  @Int32()
+  external int evictions;
+}
+
+// int lb_model_set_prefix_cache(lb_model*, int64_t budget_bytes, int32_t min_tokens)
+typedef _LbModelSetPrefixCacheNative = Int32 Function(Pointer<LbModel>, Int64, Int32);
+typedef _LbModelSetPrefixCacheDart = int Function(Pointer<LbModel>, int, int);
+final _LbModelSetPrefixCacheDart _lbModelSetPrefixCache = _bridge
+    .lookup<NativeFunction<_LbModelSetPrefixCacheNative>>('lb_model_set_prefix_cache')
+    .asFunction();
+
+// int lb_model_prefix_stats(lb_model*, lb_prefix_stats* out)
+typedef _LbModelPrefixStatsNative = Int32 Function(Pointer<LbModel>, Pointer<LbPrefixStats>);
+typedef _LbModelPrefixStatsDart = int Function(Pointer<LbModel>, Pointer<LbPrefixStats>);
+final _LbModelPrefixStatsDart _lbModelPrefixStats = _bridge
+    .lookup<NativeFunction<_LbModelPrefixStatsNative>>('lb_model_prefix_stats')
+    .asFunction();
+
+// ---------- model cache ----------
+
+// Mirrors lb_model_info in llama_bridge.cpp.
+final class LbModelInfo extends Struct {
+  @Int64()
+  external int sizeBytes;
+  @Int64()
+  external int residentBytes;
+  @Int32()
+  external int inUse;
+  @Int32()
+  external int pinned;
+  @Uint64()
+  external int lastUsed;
+  @Array(512)
+  external Array<Uint8> path;
+}
+
+// int lb_models_set_budget(int64_t budget_bytes)
+typedef _LbModelsSetBudgetNative = Int32 Function(Int64);
+typedef _LbModelsSetBudgetDart = int Function(int);
+final _LbModelsSetBudgetDart _lbModelsSetBudget = _bridge
+    .lookup<NativeFunction<_LbModelsSetBudgetNative>>('lb_models_set_budget')
+    .asFunction();
+
+// int lb_model_pin(lb_model*, int32_t pin)
+typedef _LbModelPinNative = Int32 Function(Pointer<LbModel>, Int32);
+typedef _LbModelPinDart = int Function(Pointer<LbModel>, int);
+final _LbModelPinDart _lbModelPin = _bridge
+    .lookup<NativeFunction<_LbModelPinNative>>('lb_model_pin')
+    .asFunction();
+
+// int lb_models_list(lb_model_info* out, int32_t cap, int64_t* budget_bytes)
+typedef _LbModelsListNative = Int32 Function(Pointer<LbModelInfo>, Int32, Pointer<Int64>);
+typedef _LbModelsListDart = int Function(Pointer<LbModelInfo>, int, Pointer<Int64>);
+final _LbModelsListDart _lbModelsList = _bridge
+    .lookup<NativeFunction<_LbModelsListNative>>('lb_models_list')
+    .asFunction();
+
+// ---------- LoRA adapters ----------
+
+// int lb_model_lora_load(lb_model*, const char* path, int32_t* out_id)
+typedef _LbModelLoraLoadNative = Int32 Function(Pointer<LbModel>, Pointer<Utf8>, Pointer<Int32>);
+typedef _LbModelLoraLoadDart = int Function(Pointer<LbModel>, Pointer<Utf8>, Pointer<Int32>);
+final _LbModelLoraLoadDart _lbModelLoraLoad = _bridge
+    .lookup<NativeFunction<_LbModelLoraLoadNative>>('lb_model_lora_load')
+    .asFunction();
+
+// int lb_model_lora_unload(lb_model*, int32_t id)
+typedef _LbModelLoraUnloadNative = Int32 Function(Pointer<LbModel>, Int32);
+typedef _LbModelLoraUnloadDart = int Function(Pointer<LbModel>, int);
+final _LbModelLoraUnloadDart _lbModelLoraUnload = _bridge
+    .lookup<NativeFunction<_LbModelLoraUnloadNative>>('lb_model_lora_unload')
+    .asFunction();
+
+// int lb_ctx_lora_set(lb_ctx*, int32_t id, float scale)
+typedef _LbCtxLoraSetNative = Int32 Function(Pointer<LbCtx>, Int32, Float);
+typedef _LbCtxLoraSetDart = int Function(Pointer<LbCtx>, int, double);
+final _LbCtxLoraSetDart _lbCtxLoraSet = _bridge
+    .lookup<NativeFunction<_LbCtxLoraSetNative>>('lb_ctx_lora_set')
+    .asFunction();
+
+// int lb_ctx_lora_clear(lb_ctx*)
+typedef _LbCtxLoraClearNative = Int32 Function(Pointer<LbCtx>);
+typedef _LbCtxLoraClearDart = int Function(Pointer<LbCtx>);
+final _LbCtxLoraClearDart _lbCtxLoraClear = _bridge
+    .lookup<NativeFunction<_LbCtxLoraClearNative>>('lb_ctx_lora_clear')
+    .asFunction();
+
 // ---------- public helpers (call from the worker isolate) ----------
 
-int ffiLoadModelAtPath(String fullPath) {
+/// 0 on success; -3 usually means the context settings were rejected
+/// (e.g. n_ctx too large for memory), -4 a params version mismatch.
+int ffiLoadModelAtPath(String fullPath, {LoadParams? params}) {
   final p = fullPath.toNativeUtf8();
+  final lp = params == null ? nullptr : _toNativeLoad(params);
   try {
-    return _lbLoad(p);
+    return params == null ? _lbLoad(p) : _lbLoadEx(p, lp);
   } finally {
     calloc.free(p);
+    if (lp != nullptr) calloc.free(lp);
   }
 }
 
+// Caller frees the returned struct with calloc.free.
+Pointer<LbLoadParams> _toNativeLoad(LoadParams l) {
+  final ptr = calloc<LbLoadParams>();
+  ptr.ref
+    ..version = _lbLoadParamsVersion
+    ..nCtx = l.nCtx ?? 0
+    ..nBatch = l.nBatch ?? 0
+    ..nUbatch = l.nUbatch ?? 0
+    ..nThreads = l.nThreads ?? 0
+    ..nThreadsBatch = l.nThreadsBatch ?? 0
+    ..flashAttn = l.flashAttn == null ? -1 : (l.flashAttn! ? 1 : 0)
+    ..typeK = l.typeK.index
+    ..typeV = l.typeV.index
+    ..useMmap = l.useMmap ? 1 : 0
+    ..useMlock = l.useMlock ? 1 : 0
+    ..nSeqMax = l.nSeqMax ?? 0
+    ..pooling = l.pooling.index;
+  return ptr;
+}
+
 bool ffiIsLoaded() => _lbIsLoaded() != 0;
 
 int ffiReset() => _lbReset();
 
-String ffiEval(String prompt, int maxTokens) {
+// Caller frees the returned struct with calloc.free.
+Pointer<LbSamplingParams> _toNativeSampling(SamplingParams s) {
+  final ptr = calloc<LbSamplingParams>();
+  ptr.ref
+    ..temperature = s.temperature
+    ..topK = s.topK
+    ..topP = s.topP
+    ..minP = s.minP
+    ..repeatPenalty = s.repeatPenalty
+    ..frequencyPenalty = s.frequencyPenalty
+    ..presencePenalty = s.presencePenalty
+    ..repeatLastN = s.repeatLastN
+    ..seed = s.seed ?? _lbSeedRandom;
+  return ptr;
+}
+
+// Null without a grammar or stop sequences; otherwise free with _freeRequest.
+Pointer<LbRequestParams> _toNativeRequest(
+    OutputGrammar? grammar, List<String> stop, List<int> stopTokens) {
+  final g = grammar?.kind == OutputGrammarKind.none ? null : grammar;
+  if (g == null && stop.isEmpty && stopTokens.isEmpty) return nullptr;
+  final ptr = calloc<LbRequestParams>();
+  ptr.ref
+    ..version = _lbRequestParamsVersion
+    ..grammarKind = g?.kind.index ?? 0
+    ..grammar = g?.text.toNativeUtf8() ?? nullptr
+    ..grammarRoot = g?.root?.toNativeUtf8() ?? nullptr
+    ..nStop = stop.length
+    ..stop = stop.isEmpty ? nullptr : calloc<Pointer<Utf8>>(stop.length)
+    ..nStopTokens = stopTokens.length
+    ..stopTokens = stopTokens.isEmpty ? nullptr : calloc<Int32>(stopTokens.length);
+  for (var i = 0; i < stop.length; i++) {
+    ptr.ref.stop[i] = stop[i].toNativeUtf8();
+  }
+  for (var i = 0; i < stopTokens.length; i++) {
+    ptr.ref.stopTokens[i] = stopTokens[i];
+  }
+  return ptr;
+}
+
+void _freeRequest(Pointer<LbRequestParams> p) {
+  if (p == nullptr) return;
+  final r = p.ref;
+  if (r.grammar != nullptr) calloc.free(r.grammar);
+  if (r.grammarRoot != nullptr) calloc.free(r.grammarRoot);
+  if (r.stop != nullptr) {
+    for (var i = 0; i < r.nStop; i++) {
+      calloc.free(r.stop[i]);
+    }
+    calloc.free(r.stop);
+  }
+  if (r.stopTokens != nullptr) calloc.free(r.stopTokens);
+  calloc.free(p);
+}
+
+/// Null if [grammar] compiles, otherwise why it does not. Needs no model.
+String? ffiGrammarError(OutputGrammar grammar) {
+  const errLen = 256;
+  final text = grammar.text.toNativeUtf8();
+  final root = grammar.root?.toNativeUtf8() ?? nullptr;
+  final err = calloc<Uint8>(errLen).cast<Utf8>();
+  try {
+    final rc = _lbGrammarValidate(grammar.kind.index, text, root, err, errLen);
+    return rc == 0 ? null : err.toDartString();
+  } finally {
+    calloc.free(text);
+    if (root != nullptr) calloc.free(root);
+    calloc.free(err);
+  }
+}
+
+String ffiEval(String prompt, int maxTokens, {SamplingParams? sampling}) {
   final p = prompt.toNativeUtf8();
+  final sp = sampling == null ? nullptr : _toNativeSampling(sampling);
   try {
-    final res = _lbEval(p, maxTokens);
+    final res = sampling == null ? _lbEval(p, maxTokens) : _lbEvalEx(p, maxTokens, sp);
     return res.cast<Utf8>().toDartString();
   } catch (_) {
     return 'Evaluation failed.';
   } finally {
     calloc.free(p);
+    if (sp != nullptr) calloc.free(sp);
   }
 }
 
@@ -124,12 +948,16 @@ void ffiClearHistory() {
 
 // ----- streaming helpers -----
 
-int ffiStreamBegin(String prompt, int maxTokens) {
+int ffiStreamBegin(String prompt, int maxTokens, {SamplingParams? sampling}) {
   final p = prompt.toNativeUtf8();
+  final sp = sampling == null ? nullptr : _toNativeSampling(sampling);
   try {
-    return _lbStreamBegin(p, maxTokens);
+    return sampling == null
+        ? _lbStreamBegin(p, maxTokens)
+        : _lbStreamBeginEx(p, maxTokens, sp);
   } finally {
     calloc.free(p);
+    if (sp != nullptr) calloc.free(sp);
   }
 }
 
@@ -141,4 +969,908 @@ String? ffiStreamNext() {
 
 bool ffiStreamIsRunning() => _lbStreamIsRunning() != 0;
 
+/// Safe to call from any isolate, including while the worker is blocked
+/// inside prefill or decode: the computation in flight is aborted within
+/// milliseconds, and the KV cache keeps the chunks that were completed.
 void ffiStreamCancel() => _lbStreamCancel();
+
+class StreamProgress {
+  final int prefillDone;
+  final int prefillTotal;
+  final int prefillReused;
+  final double prefillTokPerSec;
+  final int decodeTokens;
+  final double decodeTokPerSec;
+
+  const StreamProgress({
+    required this.prefillDone,
+    required this.prefillTotal,
+    required this.prefillReused,
+    required this.prefillTokPerSec,
+    required this.decodeTokens,
+    required this.decodeTokPerSec,
+  });
+}
+
+/// Progress of the current request; safe to poll from any isolate.
+StreamProgress ffiStreamProgress() => _readProgress(_lbStreamGetProgress);
+
+StreamProgress _readProgress(void Function(Pointer<LbProgress>) fill) {
+  final p = calloc<LbProgress>();
+  try {
+    fill(p);
+    final r = p.ref;
+    return StreamProgress(
+      prefillDone: r.prefillDone,
+      prefillTotal: r.prefillTotal,
+      prefillReused: r.prefillReused,
+      prefillTokPerSec: r.prefillTokPerSec,
+      decodeTokens: r.decodeTokens,
+      decodeTokPerSec: r.decodeTokPerSec,
+    );
+  } finally {
+    calloc.free(p);
+  }
+}
+
+// ----- session state helpers -----
+
+/// Snapshot of the KV cache; 0 on success (see lb_state_save).
+int ffiStateSave(String path) {
+  final p = path.toNativeUtf8();
+  try {
+    return _lbStateSave(p);
+  } finally {
+    calloc.free(p);
+  }
+}
+
+/// 0 restored, -2 missing, -3 stale/other model, -4 rejected (see lb_state_load).
+int ffiStateLoad(String path) {
+  final p = path.toNativeUtf8();
+  try {
+    return _lbStateLoad(p);
+  } finally {
+    calloc.free(p);
+  }
+}
+
+/// When the context fills, keep the first [nKeep] tokens, drop the next
+/// [nDiscard] (0 = half of the rest) and continue. nKeep < 0 turns it off.
+void ffiSetContextShift(int nKeep, int nDiscard) => _lbSetContextShift(nKeep, nDiscard);
+
+// ----- thread tuning helpers -----
+
+/// Thread settings picked by [ffiAutotune]; masks are cpu bitmasks
+/// (0 = not pinned).
+class ThreadTuning {
+  final int nThreads;
+  final int nThreadsBatch;
+  final int cpumask;
+  final int cpumaskBatch;
+  final double decodeTokPerSec;
+  final double prefillTokPerSec;
+  final bool fromCache;
+
+  const ThreadTuning({
+    required this.nThreads,
+    required this.nThreadsBatch,
+    required this.cpumask,
+    required this.cpumaskBatch,
+    required this.decodeTokPerSec,
+    required this.prefillTokPerSec,
+    required this.fromCache,
+  });
+
+  Map<String, dynamic> toMap() => {
+        'nThreads': nThreads,
+        'nThreadsBatch': nThreadsBatch,
+        'cpumask': cpumask,
+        'cpumaskBatch': cpumaskBatch,
+        'decodeTokPerSec': decodeTokPerSec,
+        'prefillTokPerSec': prefillTokPerSec,
+        'fromCache': fromCache,
+      };
+
+  factory ThreadTuning.fromMap(Map<dynamic, dynamic> m) => ThreadTuning(
+        nThreads: m['nThreads'] as int,
+        nThreadsBatch: m['nThreadsBatch'] as int,
+        cpumask: m['cpumask'] as int,
+        cpumaskBatch: m['cpumaskBatch'] as int,
+        decodeTokPerSec: (m['decodeTokPerSec'] as num).toDouble(),
+        prefillTokPerSec: (m['prefillTokPerSec'] as num).toDouble(),
+        fromCache: m['fromCache'] as bool,
+      );
+}
+
+/// Applies the profile at [profilePath] if it matches this model and device,
+/// otherwise probes (a few seconds) and writes it. Null if probing failed.
+ThreadTuning? ffiAutotune(String profilePath, {bool force = false}) =>
+    _runAutotune(profilePath, (p, out) => _lbAutotune(p, force ? 1 : 0, out));
+
+ThreadTuning? _runAutotune(
+    String profilePath, int Function(Pointer<Utf8>, Pointer<LbTuneResult>) run) {
+  final p = profilePath.toNativeUtf8();
+  final out = calloc<LbTuneResult>();
+  try {
+    if (run(p, out) != 0) return null;
+    final r = out.ref;
+    return ThreadTuning(
+      nThreads: r.nThreads,
+      nThreadsBatch: r.nThreadsBatch,
+      cpumask: r.cpumask,
+      cpumaskBatch: r.cpumaskBatch,
+      decodeTokPerSec: r.decodeTokPerSec,
+      prefillTokPerSec: r.prefillTokPerSec,
+      fromCache: r.fromCache != 0,
+    );
+  } finally {
+    calloc.free(p);
+    calloc.free(out);
+  }
+}
+
+// ----- handle API helpers -----
+
+/// Opens weights that several contexts can share. Returns (rc, model);
+/// rc as for [ffiLoadModelAtPath] (-1 bad path, -2 load failed, -4 version),
+/// model is nullptr unless rc == 0. Release with [ffiModelClose].
+(int, Pointer<LbModel>) ffiModelOpen(String fullPath, {LoadParams? params}) {
+  final p = fullPath.toNativeUtf8();
+  final lp = params == null ? nullptr : _toNativeLoad(params);
+  final out = calloc<Pointer<LbModel>>();
+  try {
+    final rc = _lbModelOpen(p, lp, out);
+    return (rc, out.value);
+  } finally {
+    calloc.free(p);
+    if (lp != nullptr) calloc.free(lp);
+    calloc.free(out);
+  }
+}
+
+/// Starts [ffiModelOpen] on a native thread. [progress] receives
+/// `[lbLoadRunning, permille]` as each whole percent is loaded, then
+/// `[state, permille]` once the load has ended; call [ffiLoadJobFinish]
+/// then. Returns (rc, job): -1 bad path, -4 version mismatch.
+(int, Pointer<LbLoadJob>) ffiModelOpenAsync(String fullPath,
+    {LoadParams? params, required SendPort progress}) {
+  final p = fullPath.toNativeUtf8();
+  final lp = params == null ? nullptr : _toNativeLoad(params);
+  final out = calloc<Pointer<LbLoadJob>>();
+  try {
+    final rc = _lbModelOpenAsync(p, lp, NativeApi.postCObject.cast(), progress.nativePort, out);
+    return (rc, out.value);
+  } finally {
+    calloc.free(p);
+    if (lp != nullptr) calloc.free(lp);
+    calloc.free(out);
+  }
+}
+
+/// Stops [job] at its next progress step. Safe from any isolate.
+void ffiLoadJobCancel(Pointer<LbLoadJob> job) => _lbLoadJobCancel(job);
+
+/// Waits for [job] to end and frees it. Returns (rc, model): -2 load failed,
+/// -5 cancelled; model is nullptr unless rc == 0.
+(int, Pointer<LbModel>) ffiLoadJobFinish(Pointer<LbLoadJob> job) {
+  final out = calloc<Pointer<LbModel>>();
+  try {
+    final rc = _lbLoadJobFinish(job, out);
+    return (rc, out.value);
+  } finally {
+    calloc.free(out);
+  }
+}
+
+/// Reads [fullPath] into the page cache in the background so a later load
+/// of it starts warm; null stops the current prefetch. Returns 0, or -1 the
+/// file cannot be opened.
+int ffiModelPrefetch(String? fullPath) {
+  if (fullPath == null) return _lbModelPrefetch(nullptr);
+  final p = fullPath.toNativeUtf8();
+  try {
+    return _lbModelPrefetch(p);
+  } finally {
+    calloc.free(p);
+  }
+}
+
+/// Drops the opener's reference; live contexts keep the weights mapped.
+void ffiModelClose(Pointer<LbModel> model) => _lbModelClose(model);
+
+/// New context (own KV cache and stream) on [model]. [params] defaults to
+/// the model's load params; only the context fields are used.
+/// Returns (rc, ctx): -3 context creation failed, -4 version mismatch.
+(int, Pointer<LbCtx>) ffiCtxCreate(Pointer<LbModel> model, {LoadParams? params}) {
+  final lp = params == null ? nullptr : _toNativeLoad(params);
+  final out = calloc<Pointer<LbCtx>>();
+  try {
+    final rc = _lbCtxCreate(model, lp, out);
+    return (rc, out.value);
+  } finally {
+    if (lp != nullptr) calloc.free(lp);
+    calloc.free(out);
+  }
+}
+
+/// No other call on [ctx] (from any isolate) may be in flight.
+void ffiCtxFree(Pointer<LbCtx> ctx) => _lbCtxFree(ctx);
+
+int ffiCtxReset(Pointer<LbCtx> ctx) => _lbCtxReset(ctx);
+
+void ffiCtxClearHistory(Pointer<LbCtx> ctx) => _lbCtxClearHistory(ctx);
+
+String ffiCtxEval(Pointer<LbCtx> ctx, String prompt, int maxTokens,
+    {SamplingParams? sampling,
+    OutputGrammar? grammar,
+    List<String> stop = const [],
+    List<int> stopTokens = const []}) {
+  final p = prompt.toNativeUtf8();
+  final sp = sampling == null ? nullptr : _toNativeSampling(sampling);
+  final rq = _toNativeRequest(grammar, stop, stopTokens);
+  try {
+    return _lbCtxEval(ctx, p, maxTokens, sp, rq).cast<Utf8>().toDartString();
+  } catch (_) {
+    return 'Evaluation failed.';
+  } finally {
+    calloc.free(p);
+    if (sp != nullptr) calloc.free(sp);
+    _freeRequest(rq);
+  }
+}
+
+/// Generation ends before the first of [stop] to appear (it is not
+/// returned) or at one of [stopTokens].
+/// -7: [grammar] rejected (see [ffiGrammarError]).
+int ffiCtxStreamBegin(Pointer<LbCtx> ctx, String prompt, int maxTokens,
+    {SamplingParams? sampling,
+    OutputGrammar? grammar,
+    List<String> stop = const [],
+    List<int> stopTokens = const []}) {
+  final p = prompt.toNativeUtf8();
+  final sp = sampling == null ? nullptr : _toNativeSampling(sampling);
+  final rq = _toNativeRequest(grammar, stop, stopTokens);
+  try {
+    return _lbCtxStreamBegin(ctx, p, maxTokens, sp, rq);
+  } finally {
+    calloc.free(p);
+    if (sp != nullptr) calloc.free(sp);
+    _freeRequest(rq);
+  }
+}
+
+String? ffiCtxStreamNext(Pointer<LbCtx> ctx) {
+  final ptr = _lbCtxStreamNext(ctx);
+  if (ptr.address == 0) return null; // native error
+  return ptr.cast<Utf8>().toDartString();
+}
+
+bool ffiCtxStreamIsRunning(Pointer<LbCtx> ctx) => _lbCtxStreamIsRunning(ctx) != 0;
+
+/// Safe from any isolate; see [ffiStreamCancel].
+void ffiCtxStreamCancel(Pointer<LbCtx> ctx) => _lbCtxStreamCancel(ctx);
+
+/// Safe to poll from any isolate.
+StreamProgress ffiCtxStreamProgress(Pointer<LbCtx> ctx) =>
+    _readProgress((p) => _lbCtxStreamGetProgress(ctx, p));
+
+void ffiCtxSetContextShift(Pointer<LbCtx> ctx, int nKeep, int nDiscard) =>
+    _lbCtxSetContextShift(ctx, nKeep, nDiscard);
+
+/// Snapshot of KV sequence [seq]; see [ffiStateSave].
+int ffiCtxStateSave(Pointer<LbCtx> ctx, int seq, String path) {
+  final p = path.toNativeUtf8();
+  try {
+    return _lbCtxStateSave(ctx, seq, p);
+  } finally {
+    calloc.free(p);
+  }
+}
+
+/// Restores into KV sequence [seq]; see [ffiStateLoad].
+int ffiCtxStateLoad(Pointer<LbCtx> ctx, int seq, String path) {
+  final p = path.toNativeUtf8();
+  try {
+    return _lbCtxStateLoad(ctx, seq, p);
+  } finally {
+    calloc.free(p);
+  }
+}
+
+ThreadTuning? ffiCtxAutotune(Pointer<LbCtx> ctx, String profilePath, {bool force = false}) =>
+    _runAutotune(profilePath, (p, out) => _lbCtxAutotune(ctx, p, force ? 1 : 0, out));
+
+// ----- multi-stream scheduler helpers -----
+
+/// Queues a stream on [ctx]; its prompt is processed by later [ffiCtxStep]
+/// calls. Returns (rc, id): -2 tokenization failed, -5 prompt longer than a
+/// sequence, -6 all sequences busy (retry after a close), -7 [grammar]
+/// rejected.
+(int, int) ffiCtxStreamOpen(Pointer<LbCtx> ctx, String prompt, int maxTokens,
+    {SamplingParams? sampling,
+    OutputGrammar? grammar,
+    List<String> stop = const [],
+    List<int> stopTokens = const []}) {
+  final p = prompt.toNativeUtf8();
+  final sp = sampling == null ? nullptr : _toNativeSampling(sampling);
+  final rq = _toNativeRequest(grammar, stop, stopTokens);
+  final id = calloc<Int32>();
+  try {
+    final rc = _lbCtxStreamOpen(ctx, p, maxTokens, sp, rq, id);
+    return (rc, id.value);
+  } finally {
+    calloc.free(p);
+    if (sp != nullptr) calloc.free(sp);
+    _freeRequest(rq);
+    calloc.free(id);
+  }
+}
+
+/// One batched decode over every open stream; returns how many are still
+/// prefilling or generating.
+int ffiCtxStep(Pointer<LbCtx> ctx) => _lbCtxStep(ctx);
+
+/// Text produced since the last read and the stream's status (lbStream*).
+/// Null text for an unknown id.
+(String?, int) ffiCtxStreamRead(Pointer<LbCtx> ctx, int id) {
+  final st = calloc<Int32>();
+  try {
+    final ptr = _lbCtxStreamRead(ctx, id, st);
+    if (ptr.address == 0) return (null, lbStreamError);
+    return (ptr.cast<Utf8>().toDartString(), st.value);
+  } finally {
+    calloc.free(st);
+  }
+}
+
+/// Safe from any isolate; the stream ends at the next step. A step in
+/// flight is aborted once every stream in it has been stopped.
+void ffiCtxStreamStop(Pointer<LbCtx> ctx, int id) => _lbCtxStreamStop(ctx, id);
+
+int ffiCtxStreamClose(Pointer<LbCtx> ctx, int id) => _lbCtxStreamClose(ctx, id);
+
+/// Per-stream progress, null for an unknown id. Safe from any isolate.
+StreamProgress? ffiCtxStreamPoll(Pointer<LbCtx> ctx, int id) {
+  var known = false;
+  final p = _readProgress((out) => known = _lbCtxStreamPoll(ctx, id, out) >= 0);
+  return known ? p : null;
+}
+
+// ----- speculative decoding helpers -----
+
+/// Speculation counters of one stream; see lb_spec_stats.
+class SpecStats {
+  final int nDraft; // proposal length of the next step, 0 without speculation
+  final int steps;
+  final int drafted;
+  final int accepted;
+  final double acceptRate;
+  final double tokensPerStep;
+
+  const SpecStats({
+    required this.nDraft,
+    required this.steps,
+    required this.drafted,
+    required this.accepted,
+    required this.acceptRate,
+    required this.tokensPerStep,
+  });
+}
+
+/// Speculates [ctx]'s streams with [draft] (a smaller model sharing the
+/// vocabulary); nullptr detaches. The context keeps its own reference, so
+/// [draft] may be closed afterwards. [nDraft] / [nDraftMax] <= 0 keep the
+/// bridge defaults. Returns 0, -1 streams open, -3 no memory for the draft
+/// context, -6 incompatible vocabulary.
+int ffiCtxSetDraft(Pointer<LbCtx> ctx, Pointer<LbModel> draft,
+    {int nDraft = 0, int nDraftMax = 0, bool adaptive = true}) {
+  final sp = calloc<LbSpecParams>();
+  try {
+    sp.ref
+      ..nDraft = nDraft
+      ..nDraftMax = nDraftMax
+      ..adaptive = adaptive ? 1 : 0;
+    return _lbCtxSetDraft(ctx, draft, sp);
+  } finally {
+    calloc.free(sp);
+  }
+}
+
+/// Prompt-lookup speculation for [ctx]'s streams: continuations of the
+/// trailing [ngramMin]..[ngramMax] tokens are copied from earlier in the
+/// prompt/output and verified in the same decode. Helps with quoting and
+/// editing prompts; needs no draft model. Values <= 0 keep the bridge
+/// defaults. Returns 0, -1 streams open, -6 model cannot roll back (recurrent).
+int ffiCtxSetLookup(Pointer<LbCtx> ctx,
+    {bool enabled = true, int ngramMin = 0, int ngramMax = 0, int nDraftMax = 0}) {
+  if (!enabled) return _lbCtxSetLookup(ctx, nullptr);
+  final lp = calloc<LbLookupParams>();
+  try {
+    lp.ref
+      ..ngramMin = ngramMin
+      ..ngramMax = ngramMax
+      ..nDraftMax = nDraftMax;
+    return _lbCtxSetLookup(ctx, lp);
+  } finally {
+    calloc.free(lp);
+  }
+}
+
+/// Null for an unknown id. Safe from any isolate.
+SpecStats? ffiCtxStreamSpecStats(Pointer<LbCtx> ctx, int id) {
+  final out = calloc<LbSpecStats>();
+  try {
+    if (_lbCtxStreamSpecStats(ctx, id, out) != 0) return null;
+    final r = out.ref;
+    return SpecStats(
+      nDraft: r.nDraft,
+      steps: r.steps,
+      drafted: r.drafted,
+      accepted: r.accepted,
+      acceptRate: r.acceptRate,
+      tokensPerStep: r.tokensPerStep,
+    );
+  } finally {
+    calloc.free(out);
+  }
+}
+
+// ----- native generation helpers -----
+
+/// Moves [ctx]'s scheduler onto a native thread: open streams advance
+/// without [ffiCtxStep], and attached streams ([ffiCtxStreamAttach]) get
+/// their updates posted straight to a Dart port, gathered for [cadenceMs]
+/// (0: after every step). When an attached stream ends, [events] receives
+/// `[id, status]`; close it there. Returns 0, or -1 already running / a
+/// single-stream generation is in flight.
+int ffiCtxAsyncStart(Pointer<LbCtx> ctx, SendPort events, {int cadenceMs = 32}) =>
+    _lbCtxAsyncStart(ctx, NativeApi.postCObject.cast(), events.nativePort, cadenceMs);
+
+/// Joins the native thread; open streams stay open. [ffiCtxFree] does this too.
+int ffiCtxAsyncStop(Pointer<LbCtx> ctx) => _lbCtxAsyncStop(ctx);
+
+/// Posts stream [id]'s updates to [port] as `[status, Uint8List utf8,
+/// prefillDone, prefillTotal]` lists. Returns 0, or -1 unknown id / native
+/// generation not running.
+int ffiCtxStreamAttach(Pointer<LbCtx> ctx, int id, SendPort port) =>
+    _lbCtxStreamAttach(ctx, id, port.nativePort);
+
+// ----- embedding & vector index helpers -----
+
+/// One vector per text from an embedding context (created with
+/// [LoadParams.pooling] set), unit length when [normalize]. Null on failure.
+List<Float32List>? ffiCtxEmbedBatch(Pointer<LbCtx> ctx, List<String> texts,
+    {bool normalize = true}) {
+  final dim = _lbCtxEmbedDim(ctx);
+  if (dim <= 0) return null;
+  if (texts.isEmpty) return const [];
+  final ptrs = calloc<Pointer<Utf8>>(texts.length);
+  final out = calloc<Float>(texts.length * dim);
+  try {
+    for (var i = 0; i < texts.length; i++) {
+      ptrs[i] = texts[i].toNativeUtf8();
+    }
+    final rc = _lbCtxEmbedBatch(ctx, ptrs, texts.length, out, texts.length * dim, normalize ? 1 : 0);
+    if (rc != dim) return null;
+    final all = out.asTypedList(texts.length * dim);
+    return [
+      for (var i = 0; i < texts.length; i++)
+        Float32List.fromList(all.sublist(i * dim, (i + 1) * dim)),
+    ];
+  } finally {
+    for (var i = 0; i < texts.length; i++) {
+      if (ptrs[i] != nullptr) calloc.free(ptrs[i]);
+    }
+    calloc.free(ptrs);
+    calloc.free(out);
+  }
+}
+
+/// Vector length of an embedding context, -1 for a generation context.
+int ffiCtxEmbedDim(Pointer<LbCtx> ctx) => _lbCtxEmbedDim(ctx);
+
+/// Identity of [ctx]'s model; pass it as the index tag.
+int ffiCtxModelId(Pointer<LbCtx> ctx) => _lbCtxModelId(ctx);
+
+/// Opens (or creates) the index file at [path]. Returns (rc, index): rc -2
+/// I/O error, -3 the file belongs to another model or [dim] (delete it and
+/// re-add). Release with [ffiIndexClose].
+(int, Pointer<LbIndex>) ffiIndexOpen(String path, int dim, int tag) {
+  final p = path.toNativeUtf8();
+  final out = calloc<Pointer<LbIndex>>();
+  try {
+    final rc = _lbIndexOpen(p, dim, tag, out);
+    return (rc, out.value);
+  } finally {
+    calloc.free(p);
+    calloc.free(out);
+  }
+}
+
+void ffiIndexClose(Pointer<LbIndex> index) => _lbIndexClose(index);
+
+/// Adds (or overwrites) `(groups[i], keys[i]) -> vecs[i]`. 0 on success.
+int ffiIndexAdd(Pointer<LbIndex> index, List<int> groups, List<int> keys, List<Float32List> vecs) {
+  final n = vecs.length;
+  if (n == 0) return 0;
+  final dim = vecs.first.length;
+  final g = calloc<Int64>(n);
+  final k = calloc<Int64>(n);
+  final v = calloc<Float>(n * dim);
+  try {
+    final flat = v.asTypedList(n * dim);
+    for (var i = 0; i < n; i++) {
+      g[i] = groups[i];
+      k[i] = keys[i];
+      flat.setRange(i * dim, (i + 1) * dim, vecs[i]);
+    }
+    return _lbIndexAdd(index, n, g, k, v);
+  } finally {
+    calloc.free(g);
+    calloc.free(k);
+    calloc.free(v);
+  }
+}
+
+/// Number of vectors removed.
+int ffiIndexRemoveGroup(Pointer<LbIndex> index, int group) => _lbIndexRemoveGroup(index, group);
+
+int ffiIndexCount(Pointer<LbIndex> index) => _lbIndexCount(index);
+
+/// One search result; [score] is the cosine similarity.
+class IndexHit {
+  final int group;
+  final int key;
+  final double score;
+
+  const IndexHit(this.group, this.key, this.score);
+}
+
+/// Up to [k] nearest vectors to [query], best first.
+List<IndexHit> ffiIndexSearch(Pointer<LbIndex> index, Float32List query, int k) {
+  if (k <= 0 || query.isEmpty) return const [];
+  final q = calloc<Float>(query.length);
+  final g = calloc<Int64>(k);
+  final key = calloc<Int64>(k);
+  final s = calloc<Float>(k);
+  try {
+    q.asTypedList(query.length).setAll(0, query);
+    final n = _lbIndexSearch(index, q, k, g, key, s);
+    return [for (var i = 0; i < n; i++) IndexHit(g[i], key[i], s[i])];
+  } finally {
+    calloc.free(q);
+    calloc.free(g);
+    calloc.free(key);
+    calloc.free(s);
+  }
+}
+
+// ----- performance counter helpers -----
+
+/// Counters accumulated by one context since it was created or last reset;
+/// see lb_stats. Times are milliseconds; token latencies are read off a
+/// log-spaced histogram, so they are upper bounds within ~20%.
+class InferenceStats {
+  final int requests;
+  final int prefillTokens;
+  final int decodeTokens;
+  final double tokenizeMs;
+  final double prefillMs;
+  final double sampleMs;
+  final double decodeMs;
+  final double detokMs;
+  final double prefillTokPerSec;
+  final double decodeTokPerSec;
+  final double ttftMs; // last request
+  final double ttftAvgMs;
+  final double tokenP50Ms;
+  final double tokenP95Ms;
+  final double tokenP99Ms;
+  final int kvUsed;
+  final int kvTotal;
+  final int nThreads;
+  final int nThreadsBatch;
+  final int peakRssBytes;
+
+  const InferenceStats({
+    required this.requests,
+    required this.prefillTokens,
+    required this.decodeTokens,
+    required this.tokenizeMs,
+    required this.prefillMs,
+    required this.sampleMs,
+    required this.decodeMs,
+    required this.detokMs,
+    required this.prefillTokPerSec,
+    required this.decodeTokPerSec,
+    required this.ttftMs,
+    required this.ttftAvgMs,
+    required this.tokenP50Ms,
+    required this.tokenP95Ms,
+    required this.tokenP99Ms,
+    required this.kvUsed,
+    required this.kvTotal,
+    required this.nThreads,
+    required this.nThreadsBatch,
+    required this.peakRssBytes,
+  });
+
+  Map<String, dynamic> toMap() => {
+        'requests': requests,
+        'prefillTokens': prefillTokens,
+        'decodeTokens': decodeTokens,
+        'tokenizeMs': tokenizeMs,
+        'prefillMs': prefillMs,
+        'sampleMs': sampleMs,
+        'decodeMs': decodeMs,
+        'detokMs': detokMs,
+        'prefillTokPerSec': prefillTokPerSec,
+        'decodeTokPerSec': decodeTokPerSec,
+        'ttftMs': ttftMs,
+        'ttftAvgMs': ttftAvgMs,
+        'tokenP50Ms': tokenP50Ms,
+        'tokenP95Ms': tokenP95Ms,
+        'tokenP99Ms': tokenP99Ms,
+        'kvUsed': kvUsed,
+        'kvTotal': kvTotal,
+        'nThreads': nThreads,
+        'nThreadsBatch': nThreadsBatch,
+        'peakRssBytes': peakRssBytes,
+      };
+
+  factory InferenceStats.fromMap(Map<dynamic, dynamic> m) => InferenceStats(
+        requests: m['requests'] as int,
+        prefillTokens: m['prefillTokens'] as int,
+        decodeTokens: m['decodeTokens'] as int,
+        tokenizeMs: (m['tokenizeMs'] as num).toDouble(),
+        prefillMs: (m['prefillMs'] as num).toDouble(),
+        sampleMs: (m['sampleMs'] as num).toDouble(),
+        decodeMs: (m['decodeMs'] as num).toDouble(),
+        detokMs: (m['detokMs'] as num).toDouble(),
+        prefillTokPerSec: (m['prefillTokPerSec'] as num).toDouble(),
+        decodeTokPerSec: (m['decodeTokPerSec'] as num).toDouble(),
+        ttftMs: (m['ttftMs'] as num).toDouble(),
+        ttftAvgMs: (m['ttftAvgMs'] as num).toDouble(),
+        tokenP50Ms: (m['tokenP50Ms'] as num).toDouble(),
+        tokenP95Ms: (m['tokenP95Ms'] as num).toDouble(),
+        tokenP99Ms: (m['tokenP99Ms'] as num).toDouble(),
+        kvUsed: m['kvUsed'] as int,
+        kvTotal: m['kvTotal'] as int,
+        nThreads: m['nThreads'] as int,
+        nThreadsBatch: m['nThreadsBatch'] as int,
+        peakRssBytes: m['peakRssBytes'] as int,
+      );
+
+  @override
+  String toString() =>
+      'requests=$requests ttft=${ttftMs.toStringAsFixed(0)}ms '
+      'prefill=${prefillTokPerSec.toStringAsFixed(1)} tok/s '
+      'decode=${decodeTokPerSec.toStringAsFixed(1)} tok/s '
+      'token p50/p95/p99=${tokenP50Ms.toStringAsFixed(0)}/'
+      '${tokenP95Ms.toStringAsFixed(0)}/${tokenP99Ms.toStringAsFixed(0)}ms '
+      'kv=$kvUsed/$kvTotal threads=$nThreads/$nThreadsBatch '
+      'rss=${peakRssBytes >> 20}MB';
+}
+
+/// Never waits on a decode in flight, so it can be polled from any isolate.
+/// Null for a null handle.
+InferenceStats? ffiCtxGetStats(Pointer<LbCtx> ctx) =>
+    _readStats((out) => _lbCtxGetStats(ctx, out));
+
+/// Counters of the context opened by [ffiLoadModelAtPath]; null if none.
+InferenceStats? ffiGetStats() => _readStats(_lbGetStats);
+
+/// Zeroes [ctx]'s accumulated counters.
+void ffiCtxStatsReset(Pointer<LbCtx> ctx) => _lbCtxStatsReset(ctx);
+
+InferenceStats? _readStats(int Function(Pointer<LbStats>) fill) {
+  final p = calloc<LbStats>();
+  try {
+    if (fill(p) != 0) return null;
+    final r = p.ref;
+    return InferenceStats(
+      requests: r.requests,
+      prefillTokens: r.prefillTokens,
+      decodeTokens: r.decodeTokens,
+      tokenizeMs: r.tokenizeMs,
+      prefillMs: r.prefillMs,
+      sampleMs: r.sampleMs,
+      decodeMs: r.decodeMs,
+      detokMs: r.detokMs,
+      prefillTokPerSec: r.prefillTokPerSec,
+      decodeTokPerSec: r.decodeTokPerSec,
+      ttftMs: r.ttftMs,
+      ttftAvgMs: r.ttftAvgMs,
+      tokenP50Ms: r.tokenP50Ms,
+      tokenP95Ms: r.tokenP95Ms,
+      tokenP99Ms: r.tokenP99Ms,
+      kvUsed: r.kvUsed,
+      kvTotal: r.kvTotal,
+      nThreads: r.nThreads,
+      nThreadsBatch: r.nThreadsBatch,
+      peakRssBytes: r.peakRssBytes,
+    );
+  } finally {
+    calloc.free(p);
+  }
+}
+
+// ----- prefix cache helpers -----
+
+/// Keeps KV snapshots of earlier prompts (at most [budgetBytes]; 0 turns the
+/// cache off) for every context on [model], so a prompt sharing a prefix
+/// with any of them skips decoding it. Prompts under [minTokens] tokens
+/// (0: 64) are not cached. Returns 0, or -6 for recurrent models.
+int ffiModelSetPrefixCache(Pointer<LbModel> model, int budgetBytes, {int minTokens = 0}) =>
+    _lbModelSetPrefixCache(model, budgetBytes, minTokens);
+
+/// Counters of [model]'s prefix cache; see lb_prefix_stats.
+class PrefixCacheStats {
+  final int bytes;
+  final int budgetBytes;
+  final int tokensRestored;
+  final int entries;
+  final int lookups;
+  final int hits;
+  final int evictions;
+
+  const PrefixCacheStats({
+    required this.bytes,
+    required this.budgetBytes,
+    required this.tokensRestored,
+    required this.entries,
+    required this.lookups,
+    required this.hits,
+    required this.evictions,
+  });
+
+  Map<String, dynamic> toMap() => {
+        'bytes': bytes,
+        'budgetBytes': budgetBytes,
+        'tokensRestored': tokensRestored,
+        'entries': entries,
+        'lookups': lookups,
+        'hits': hits,
+        'evictions': evictions,
+      };
+
+  factory PrefixCacheStats.fromMap(Map<dynamic, dynamic> m) => PrefixCacheStats(
+        bytes: m['bytes'] as int,
+        budgetBytes: m['budgetBytes'] as int,
+        tokensRestored: m['tokensRestored'] as int,
+        entries: m['entries'] as int,
+        lookups: m['lookups'] as int,
+        hits: m['hits'] as int,
+        evictions: m['evictions'] as int,
+      );
+
+  @override
+  String toString() =>
+      'prefix cache: $hits/$lookups hits, $tokensRestored tokens restored, '
+      '$entries entries ${bytes >> 20}/${budgetBytes >> 20}MB, $evictions evicted';
+}
+
+/// Keeps up to [budgetBytes] of closed models' weights resident (-1: half
+/// the installed RAM; 0 off, dropping every cached model), so reopening one
+/// skips the load. Least recently opened unpinned models are evicted first.
+/// Process-wide. Returns 0, or -1 for a bad budget.
+int ffiModelsSetBudget(int budgetBytes) => _lbModelsSetBudget(budgetBytes);
+
+/// Exempts [model] from eviction, or makes it evictable again. Returns 0,
+/// or -1 when the model cache does not hold it.
+int ffiModelPin(Pointer<LbModel> model, bool pin) => _lbModelPin(model, pin ? 1 : 0);
+
+/// One model held by the model cache; see lb_model_info.
+class ResidentModel {
+  final String path;
+  final int sizeBytes;
+  final int residentBytes; // of sizeBytes, in RAM now
+  final int inUse; // openers and contexts besides the cache
+  final bool pinned;
+
+  const ResidentModel({
+    required this.path,
+    required this.sizeBytes,
+    required this.residentBytes,
+    required this.inUse,
+    required this.pinned,
+  });
+
+  Map<String, dynamic> toMap() => {
+        'path': path,
+        'sizeBytes': sizeBytes,
+        'residentBytes': residentBytes,
+        'inUse': inUse,
+        'pinned': pinned,
+      };
+
+  factory ResidentModel.fromMap(Map<dynamic, dynamic> m) => ResidentModel(
+        path: m['path'] as String,
+        sizeBytes: m['sizeBytes'] as int,
+        residentBytes: m['residentBytes'] as int,
+        inUse: m['inUse'] as int,
+        pinned: m['pinned'] as bool,
+      );
+
+  @override
+  String toString() => '$path: ${residentBytes >> 20}/${sizeBytes >> 20}MB resident'
+      '${pinned ? ', pinned' : ''}${inUse > 0 ? ', in use' : ''}';
+}
+
+/// Models in the model cache, most recently used first, and its budget.
+/// Reads /proc/self/smaps: not for hot paths.
+(List<ResidentModel>, int) ffiModelsList() {
+  const cap = 16;
+  final out = calloc<LbModelInfo>(cap);
+  final budget = calloc<Int64>();
+  try {
+    final n = _lbModelsList(out, cap, budget);
+    final models = <ResidentModel>[];
+    for (var i = 0; i < n && i < cap; i++) {
+      final r = out[i];
+      final bytes = <int>[];
+      for (var j = 0; j < 512 && r.path[j] != 0; j++) {
+        bytes.add(r.path[j]);
+      }
+      models.add(ResidentModel(
+        path: utf8.decode(bytes, allowMalformed: true),
+        sizeBytes: r.sizeBytes,
+        residentBytes: r.residentBytes,
+        inUse: r.inUse,
+        pinned: r.pinned != 0,
+      ));
+    }
+    return (models, budget.value);
+  } finally {
+    calloc.free(out);
+    calloc.free(budget);
+  }
+}
+
+/// Loads the LoRA adapter at [fullPath] for [model] (or finds it already
+/// loaded; adapters stay in memory with the model). Returns (0, id), or
+/// (-2, -1) when the file is not an adapter for this model.
+(int, int) ffiModelLoraLoad(Pointer<LbModel> model, String fullPath) {
+  final p = fullPath.toNativeUtf8();
+  final id = calloc<Int32>();
+  try {
+    final rc = _lbModelLoraLoad(model, p, id);
+    return (rc, id.value);
+  } finally {
+    calloc.free(p);
+    calloc.free(id);
+  }
+}
+
+/// Frees adapter [id] of [model]. Returns 0, -1 unknown id, -6 still
+/// applied on a context.
+int ffiModelLoraUnload(Pointer<LbModel> model, int id) => _lbModelLoraUnload(model, id);
+
+/// Applies adapter [id] to [ctx] at [scale], or rescales it; 0 removes it.
+/// Clears the context's cached tokens. Returns 0, -1 unknown id or streams
+/// open, -3 rejected by llama.
+int ffiCtxLoraSet(Pointer<LbCtx> ctx, int id, double scale) => _lbCtxLoraSet(ctx, id, scale);
+
+/// Back to the base model. Returns 0, or -1 while streams are open.
+int ffiCtxLoraClear(Pointer<LbCtx> ctx) => _lbCtxLoraClear(ctx);
+
+/// Null for a null handle.
+PrefixCacheStats? ffiModelPrefixStats(Pointer<LbModel> model) {
+  final p = calloc<LbPrefixStats>();
+  try {
+    if (_lbModelPrefixStats(model, p) != 0) return null;
+    final r = p.ref;
+    return PrefixCacheStats(
+      bytes: r.bytes,
+      budgetBytes: r.budgetBytes,
+      tokensRestored: r.tokensRestored,
+      entries: r.entries,
+      lookups: r.lookups,
+      hits: r.hits,
+      evictions: r.evictions,
+    );
+  } finally {
+    calloc.free(p);
+  }
+}
@@ -1,10 +1,30 @@
 // lib/llm/llama_worker.dart
 import 'dart:async';
+import 'dart:convert';
+import 'dart:ffi';
+import 'dart:io';
 import 'dart:isolate';
+import 'dart:math';
+import 'dart:typed_data';
 import 'package:flutter/foundation.dart';
 import 'llama_ffi.dart';
+import 'load_params.dart';
+import 'output_grammar.dart';
+import 'sampling_params.dart';
 
 class LlamaWorker {
+  /// How long generated text gathers in the bridge before it is posted to a
+  /// stream (0: every decode step). Larger values mean fewer UI updates.
+  final int streamCadenceMs;
+
+  /// Bytes of weights the bridge keeps resident after a model is closed
+  /// (-1: half the installed RAM; 0 off), so switching back to a recent
+  /// model skips the load; see [ffiModelsSetBudget]. Process-wide: workers
+  /// share the cache.
+  int modelCacheBytes;
+
+  LlamaWorker({this.streamCadenceMs = 32, this.modelCacheBytes = -1});
+
   Isolate? _iso;
   SendPort? _send;
   StreamSubscription? _sub;
@@ -12,7 +32,12 @@ class LlamaWorker {
 
   bool get isRunning => _iso != null && _send != null;
 
-  Future<void> start({Duration initTimeout = const Duration(seconds: 5)}) async {
+  Future<void>? _starting; // concurrent start() calls share one spawn
+
+  Future<void> start({Duration initTimeout = const Duration(seconds: 5)}) =>
+      _starting ??= _start(initTimeout);
+
+  Future<void> _start(Duration initTimeout) async {
     if (_iso != null) return;
     final rp = ReceivePort();
     _iso = await Isolate.spawn(_entry, rp.sendPort, debugName: 'llama_worker');
@@ -38,30 +63,142 @@ class LlamaWorker {
     _iso?.kill(priority: Isolate.immediate);
     _iso = null;
     _send = null;
+    _starting = null;
   }
 
   Future<void> _ensureReady() async {
     if (_send != null) return;
-    if (_iso == null) {
-      await start();
-      return;
-    }
-    await Future<void>.delayed(const Duration(milliseconds: 30));
+    await start();
     if (_send == null) throw StateError('Worker not ready');
   }
 
+  /// [params] null keeps the llama.cpp defaults for context and KV cache.
+  /// [draftPath]: a smaller model with the same vocabulary for speculative
+  /// decoding; if it cannot be used the model still loads, without it.
+  /// [onProgress]: fraction of the weights read, as each percent comes in.
+  /// The load runs on a native thread; [cancelLoad] or the [timeout] stop it.
   Future<bool> loadModelAtPath(String fullPath,
-      {Duration timeout = const Duration(seconds: 90)}) async {
+      {LoadParams? params,
+      String? draftPath,
+      void Function(double fraction)? onProgress,
+      Duration timeout = const Duration(seconds: 90)}) async {
+    await _ensureReady();
+    final progress = ReceivePort();
+    progress.listen((dynamic permille) {
+      if (permille is int) onProgress?.call(permille / 1000);
+    });
+    try {
+      final res = await _sendRequest(
+        {
+          'op': 'load',
+          'path': fullPath,
+          'params': params?.toMap(),
+          'draft': draftPath,
+          'cadence': streamCadenceMs,
+          'model_budget': modelCacheBytes,
+          'progress': progress.sendPort,
+        },
+        timeout: timeout,
+      );
+      return (res['ok'] as bool? ?? false);
+    } on TimeoutException {
+      await cancelLoad();
+      rethrow;
+    } finally {
+      progress.close();
+    }
+  }
+
+  /// Stops a [loadModelAtPath] in progress; it then returns false.
+  Future<void> cancelLoad() async {
+    await _ensureReady();
+    await _sendRequest({'op': 'load_cancel'}, timeout: const Duration(seconds: 3));
+  }
+
+  /// Starts reading [fullPath] into the page cache (e.g. once the user picks
+  /// a model) so its load is faster; null stops a prefetch in progress.
+  Future<void> prefetchModel(String? fullPath) async {
+    await _ensureReady();
+    await _sendRequest({'op': 'prefetch', 'path': fullPath},
+        timeout: const Duration(seconds: 3));
+  }
+
+  /// Changes [modelCacheBytes] now rather than at the next load.
+  Future<void> setModelCache(int budgetBytes) async {
+    modelCacheBytes = budgetBytes;
+    await _ensureReady();
+    await _sendRequest({'op': 'model_cache', 'budget': budgetBytes},
+        timeout: const Duration(seconds: 3));
+  }
+
+  /// Models the bridge holds resident, most recently used first.
+  Future<List<ResidentModel>> residentModels() async {
     await _ensureReady();
-    final res = await _sendRequest({'op': 'load', 'path': fullPath}, timeout: timeout);
-    return (res['ok'] as bool? ?? false);
+    final res = await _sendRequest({'op': 'model_list'},
+        timeout: const Duration(seconds: 3));
+    return [
+      for (final m in (res['models'] as List? ?? const []))
+        ResidentModel.fromMap(m as Map),
+    ];
+  }
+
+  /// Keeps the loaded model resident whatever else is loaded later (until
+  /// unpinned or the cache is turned off). False without a loaded model or
+  /// with the cache off.
+  Future<bool> pinModel({bool pin = true}) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'model_pin', 'pin': pin},
+        timeout: const Duration(seconds: 3));
+    return res['ok'] as bool? ?? false;
+  }
+
+  /// Applies the LoRA adapter at [fullPath] to the loaded model at [scale]
+  /// (or rescales it; 0 removes it), loading it on first use. Adapters stay
+  /// in memory with the model, so switching persona is a few milliseconds.
+  /// Clears the conversation's cached tokens. Returns 0, -1 without a model
+  /// or while streaming, -2 not an adapter for this model.
+  Future<int> setLora(String fullPath, {double scale = 1.0}) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'lora_set', 'path': fullPath, 'scale': scale},
+        timeout: const Duration(seconds: 30));
+    return res['rc'] as int? ?? -1;
+  }
+
+  /// Removes every adapter: the base model again.
+  Future<int> clearLoras() async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'lora_clear'},
+        timeout: const Duration(seconds: 3));
+    return res['rc'] as int? ?? -1;
+  }
+
+  /// Frees an adapter that is no longer applied. Returns 0, -1 unknown,
+  /// -6 still applied.
+  Future<int> unloadLora(String fullPath) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'lora_unload', 'path': fullPath},
+        timeout: const Duration(seconds: 3));
+    return res['rc'] as int? ?? -1;
   }
 
   Future<String> eval(String prompt,
-      {int maxTokens = 64, Duration timeoutPerCall = const Duration(seconds: 90)}) async {
+      {int maxTokens = 64,
+      SamplingParams? sampling,
+      OutputGrammar? grammar,
+      List<String> stop = const [],
+      List<int> stopTokens = const [],
+      Duration timeoutPerCall = const Duration(seconds: 90)}) async {
     await _ensureReady();
     final res = await _sendRequest(
-      {'op': 'eval', 'prompt': prompt, 'max': maxTokens},
+      {
+        'op': 'eval',
+        'prompt': prompt,
+        'max': maxTokens,
+        'sampling': sampling?.toMap(),
+        'grammar': grammar?.toMap(),
+        'stop': stop,
+        'stopTokens': stopTokens,
+      },
       timeout: timeoutPerCall,
     );
     return (res['text'] as String?) ?? 'Evaluation failed.';
@@ -72,23 +209,158 @@ class LlamaWorker {
     await _sendRequest({'op': 'clear'}, timeout: const Duration(seconds: 3));
   }
 
+  /// Context shifting for long chats; see [ffiSetContextShift].
+  Future<void> setContextShift({int keep = 1, int discard = 0}) async {
+    await _ensureReady();
+    await _sendRequest({'op': 'ctx_shift', 'keep': keep, 'discard': discard},
+        timeout: const Duration(seconds: 3));
+  }
+
+  /// Prompt-lookup speculation; see [ffiCtxSetLookup]. Kept across loads.
+  Future<void> setPromptLookup({bool enabled = true, int nDraftMax = 0}) async {
+    await _ensureReady();
+    await _sendRequest({'op': 'lookup', 'enabled': enabled, 'n_draft_max': nDraftMax},
+        timeout: const Duration(seconds: 3));
+  }
+
+  /// Picks thread counts and cores for the loaded model; see [ffiAutotune].
+  /// The first run for a (model, device) pair probes for a few seconds.
+  Future<ThreadTuning?> autotune(String profilePath, {bool force = false}) async {
+    await _ensureReady();
+    final res = await _sendRequest(
+      {'op': 'autotune', 'path': profilePath, 'force': force},
+      timeout: const Duration(seconds: 60),
+    );
+    final t = res['tuning'];
+    return t is Map ? ThreadTuning.fromMap(t) : null;
+  }
+
+  /// Performance counters of the loaded context; see [ffiCtxGetStats].
+  /// [reset] zeroes them after reading. Null when no model is loaded.
+  Future<InferenceStats?> stats({bool reset = false}) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'stats', 'reset': reset},
+        timeout: const Duration(seconds: 3));
+    final s = res['stats'];
+    return s is Map ? InferenceStats.fromMap(s) : null;
+  }
+
+  /// Prefix cache of the loaded model; see [ffiModelSetPrefixCache]. Kept
+  /// across loads (default 64 MB).
+  Future<void> setPrefixCache({int budgetBytes = 64 << 20, int minTokens = 0}) async {
+    await _ensureReady();
+    await _sendRequest({'op': 'prefix_cache', 'budget': budgetBytes, 'min_tokens': minTokens},
+        timeout: const Duration(seconds: 3));
+  }
+
+  /// Prefix cache counters of the loaded model; see [ffiModelPrefixStats].
+  Future<PrefixCacheStats?> prefixCacheStats() async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'prefix_stats'},
+        timeout: const Duration(seconds: 3));
+    final s = res['stats'];
+    return s is Map ? PrefixCacheStats.fromMap(s) : null;
+  }
+
+  /// Opens the vector index at [path] for [indexTexts] / [search]. Vectors
+  /// come from the loaded model, so the index is rebuilt empty when the
+  /// model changes. Returns the number of entries, or -1 if there is no
+  /// model loaded or the file cannot be opened.
+  Future<int> openIndex(String path) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'index_open', 'path': path},
+        timeout: const Duration(seconds: 30));
+    return res['count'] as int? ?? -1;
+  }
+
+  /// Queues `[group, key, text]` entries to be embedded and stored; an
+  /// existing (group, key) is overwritten. The worker embeds them a few at a
+  /// time once no stream is open or waiting, so replies never wait on
+  /// indexing. False if there is no index to add to.
+  Future<bool> indexTexts(List<List<Object>> entries) async {
+    if (entries.isEmpty) return true;
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'index_add', 'entries': entries},
+        timeout: const Duration(seconds: 60));
+    return res['ok'] as bool? ?? false;
+  }
+
+  Future<void> unindexGroup(int group) async {
+    await _ensureReady();
+    await _sendRequest({'op': 'index_remove', 'group': group},
+        timeout: const Duration(seconds: 5));
+  }
+
+  /// The [k] stored entries closest in meaning to [query], best first.
+  Future<List<IndexHit>> search(String query, {int k = 10}) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'search', 'query': query, 'k': k},
+        timeout: const Duration(seconds: 10));
+    final hits = res['hits'];
+    if (hits is! List) return const [];
+    return [
+      for (final h in hits.cast<List>())
+        IndexHit(h[0] as int, h[1] as int, (h[2] as num).toDouble()),
+    ];
+  }
+
+  /// Writes the model's conversation state (KV cache) to [path].
+  /// Returns the native rc; 0 on success.
+  Future<int> saveState(String path) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'state_save', 'path': path},
+        timeout: const Duration(seconds: 20));
+    return res['rc'] as int? ?? -1;
+  }
+
+  /// Restores state written by [saveState]. Returns the native rc:
+  /// 0 restored, -2 no snapshot, -3 stale (other model), -4 rejected.
+  Future<int> loadState(String path) async {
+    await _ensureReady();
+    final res = await _sendRequest({'op': 'state_load', 'path': path},
+        timeout: const Duration(seconds: 20));
+    return res['rc'] as int? ?? -1;
+  }
+
   /// Streamed generation with a watchdog.
-  /// - onToken: called on every emitted text piece (may be small).
-  /// - maxSilence: if no piece/tick received for this long, we cancel and error.
+  /// - onToken: called with the text generated since the last call; the
+  ///   bridge posts it straight to this isolate every streamCadenceMs.
+  /// - maxSilence: if no text/progress received for this long, we cancel and error.
+  /// - sampling: null keeps greedy decoding.
+  /// - grammar: restricts the reply to a GBNF grammar or JSON schema; the
+  ///   stream ends once the grammar admits nothing more.
+  /// - stop / stopTokens: the reply ends before the first of these strings
+  ///   (never passed to onToken) or at one of these token ids.
+  /// - onPrefill: prompt tokens in the KV cache so far / total, while the
+  ///   prompt is being processed (before the first piece).
+  ///
+  /// Several calls may run at once: the bridge batches them into one decode
+  /// per step, up to the model's nSeqMax; further calls wait for a free slot.
   Future<String> streamEval(
     String prompt, {
     required void Function(String piece) onToken,
+    void Function(int done, int total)? onPrefill,
     int maxTokens = 256,
+    SamplingParams? sampling,
+    OutputGrammar? grammar,
+    List<String> stop = const [],
+    List<int> stopTokens = const [],
     Duration maxTotalTime = const Duration(seconds: 180),
     Duration maxSilence = const Duration(seconds: 15),
   }) async {
     await _ensureReady();
 
     final rp = ReceivePort();
+    final req = _nextReq++;
     _send!.send([rp.sendPort, {
       'op': 'stream_eval',
+      'req': req,
       'prompt': prompt,
       'max': maxTokens,
+      'sampling': sampling?.toMap(),
+      'grammar': grammar?.toMap(),
+      'stop': stop,
+      'stopTokens': stopTokens,
     }]);
 
     final buf = StringBuffer();
@@ -99,6 +371,8 @@ class LlamaWorker {
     final completer = Completer<void>();
 
     // Watchdog: if no activity for maxSilence OR wall time > maxTotalTime, cancel in worker & fail.
+    // The worker isolate is never blocked in a decode, so it handles the
+    // cancel at once; the bridge ends the stream after its current step.
     Timer? watchdog;
     void _resetWatchdog() {
       watchdog?.cancel();
@@ -109,7 +383,8 @@ class LlamaWorker {
             DateTime.now().difference(started) >= maxTotalTime) {
           try {
             // Ask worker to cancel the native stream, then close our port
-            await _sendRequest({'op': 'stream_cancel'}, timeout: const Duration(seconds: 2));
+            await _sendRequest({'op': 'stream_cancel', 'req': req},
+                timeout: const Duration(seconds: 2));
           } catch (_) {}
           if (!completer.isCompleted) {
             completer.completeError(TimeoutException('stream stalled/timeout'));
@@ -125,19 +400,26 @@ class LlamaWorker {
 
     sub = rp.listen((dynamic msg) {
       lastActivity = DateTime.now();
-      if (msg is Map) {
+      if (msg is List && msg.length == 4) {
+        // from the bridge: [status, utf8 bytes, prefill done, prefill total]
+        final bytes = msg[1] as Uint8List;
+        if (msg[0] == lbStreamPrefill) {
+          final total = msg[3] as int;
+          if (total > 0) onPrefill?.call(msg[2] as int, total);
+        } else if (bytes.isNotEmpty) {
+          final s = utf8.decode(bytes, allowMalformed: true);
+          buf.write(s);
+          onToken(s);
+        }
+        _resetWatchdog();
+      } else if (msg is Map) {
         final kind = msg['kind'];
-        if (kind == 'piece') {
-          final s = (msg['text'] as String?) ?? '';
-          if (s.isNotEmpty) {
-            buf.write(s);
-            onToken(s);
-          }
-          _resetWatchdog();
-        } else if (kind == 'tick') {
-          // heartbeat – just reset watchdog
+        if (kind == 'queued') {
           _resetWatchdog();
         } else if (kind == 'end') {
+          debugPrint('[WK] prefill ${msg['prefill_tps']} tok/s, '
+              'decode ${msg['decode_tps']} tok/s'
+              '${msg['spec_accept'] != null ? ', draft accept ${msg['spec_accept']}' : ''}');
           if (!completer.isCompleted) completer.complete();
           sub.cancel();
           rp.close();
@@ -152,12 +434,17 @@ class LlamaWorker {
     });
 
     // Wait for completion or error
-    await completer.future;
-    watchdog?.cancel();
+    try {
+      await completer.future;
+    } finally {
+      watchdog?.cancel();
+    }
 
     return buf.toString();
   }
 
+  int _nextReq = 0;
+
   // ----- request/response core -----
   Future<Map<String, dynamic>> _sendRequest(Map<String, dynamic> body,
       {Duration timeout = const Duration(seconds: 15)}) async {
@@ -177,39 +464,424 @@ class LlamaWorker {
     final inbox = ReceivePort();
     host.send(inbox.sendPort);
 
-    bool loaded = false;
-    bool streaming = false; // guard against multiple overlapping streams
+    Pointer<LbModel> model = nullptr;
+    Pointer<LbCtx> ctx = nullptr;
+    Pointer<LbLoadJob> loadJob = nullptr; // while 'load' waits on the native thread
+    bool loaded() => ctx != nullptr;
+    int shiftKeep = 1, shiftDiscard = 0; // reapplied to each new context
+    bool lookupOn = false;
+    int lookupDraftMax = 0;
+    int prefixBudget = 64 << 20, prefixMinTokens = 0;
+    final loras = <String, int>{}; // adapter path -> id on the loaded model
+
+    LoadParams? loadParams; // of the loaded model, for the embedding context
+
+    // Embedding context on the loaded model plus the index it feeds. The
+    // index stays open until the model changes; the context only exists
+    // while indexing or search runs (freed after embedKeep unused), and is
+    // sized from loadParams so it never outgrows the chat context.
+    Pointer<LbCtx> embedCtx = nullptr;
+    Timer? embedRelease;
+    const embedKeep = Duration(seconds: 30);
+    Pointer<LbIndex> index = nullptr;
+    String? indexPath;
+    // `index_add` entries not embedded yet. They are embedded a few at a
+    // time and only once no stream has been open or waiting for a moment,
+    // so indexing never sits in front of a reply on this isolate.
+    final indexQueue = <List>[];
+    Timer? indexTimer;
+    const indexChunk = 4;
+    const indexIdle = Duration(milliseconds: 500);
+
+    // Streams waiting for a free KV sequence, and those open in the bridge
+    // (keyed by request). The bridge generates on its own thread and posts
+    // text straight to each stream's reply port; `events` only hears about
+    // streams that ended, which frees their sequence for the next waiting one.
+    final waiting = <_WorkerStream>[];
+    final open = <int, _WorkerStream>{};
+    final events = ReceivePort();
+    // Sequence of the last finished stream: what saveState snapshots and
+    // loadState restores into, so a resumed chat lands where it will be reused.
+    int lastSeq = 0;
+
+    SamplingParams? _samplingOf(Map<String, dynamic> body) {
+      final m = body['sampling'];
+      return m is Map ? SamplingParams.fromMap(m) : null;
+    }
+
+    OutputGrammar? _grammarOf(Map<String, dynamic> body) {
+      final m = body['grammar'];
+      return m is Map ? OutputGrammar.fromMap(m) : null;
+    }
+
+    List<String> _stopOf(Map<String, dynamic> body) =>
+        (body['stop'] as List?)?.cast<String>() ?? const [];
+    List<int> _stopTokensOf(Map<String, dynamic> body) =>
+        (body['stopTokens'] as List?)?.cast<int>() ?? const [];
+
+    void releaseEmbedder() {
+      embedRelease?.cancel();
+      embedRelease = null;
+      if (embedCtx != nullptr) { ffiCtxFree(embedCtx); embedCtx = nullptr; }
+    }
+
+    void closeIndex() {
+      indexTimer?.cancel();
+      indexTimer = null;
+      indexQueue.clear();
+      if (index != nullptr) { ffiIndexClose(index); index = nullptr; }
+      releaseEmbedder();
+    }
+
+    // The embedding context, created if needed; null without a model. One
+    // sequence of at most 512 tokens (texts are cut to fit), never more
+    // than the chat context, with its KV types and threads.
+    Pointer<LbCtx>? embedder() {
+      if (!loaded()) return null;
+      if (embedCtx == nullptr) {
+        final lp = loadParams ?? const LoadParams();
+        final n = min(lp.nCtx ?? 512, 512);
+        final (rc, c) = ffiCtxCreate(model,
+            params: LoadParams(
+                nCtx: n,
+                nBatch: n,
+                nThreads: lp.nThreads,
+                nThreadsBatch: lp.nThreadsBatch,
+                flashAttn: lp.flashAttn,
+                typeK: lp.typeK,
+                typeV: lp.typeV,
+                nSeqMax: 1,
+                pooling: EmbeddingPooling.mean));
+        if (rc != 0) return null;
+        embedCtx = c;
+      }
+      embedRelease?.cancel();
+      embedRelease = Timer(embedKeep, releaseEmbedder);
+      return embedCtx;
+    }
+
+    // Opens the index if needed; false without a model.
+    bool ensureIndex() {
+      if (index != nullptr) return true;
+      if (indexPath == null) return false;
+      final e = embedder();
+      if (e == null) return false;
+      final dim = ffiCtxEmbedDim(e);
+      final tag = ffiCtxModelId(e);
+      var (rc, x) = ffiIndexOpen(indexPath!, dim, tag);
+      if (rc == -3) {
+        // vectors of another model: start over
+        try { File(indexPath!).deleteSync(); } catch (_) {}
+        (rc, x) = ffiIndexOpen(indexPath!, dim, tag);
+      }
+      if (rc != 0) return false;
+      index = x;
+      return true;
+    }
+
+    bool streaming() => open.isNotEmpty || waiting.isNotEmpty;
+
+    // Embeds the next chunk of indexQueue when no stream is around, then
+    // yields to the inbox before the next one. A failed chunk stays queued
+    // until the next trigger (new entries or a stream ending).
+    void drainIndex() {
+      indexTimer = null;
+      if (indexQueue.isEmpty || streaming() || !ensureIndex()) return;
+      final e = embedder();
+      if (e == null) return;
+      final part = indexQueue.sublist(0, min(indexChunk, indexQueue.length));
+      final vecs = ffiCtxEmbedBatch(e, [for (final x in part) x[2] as String]);
+      if (vecs == null) return;
+      final rc = ffiIndexAdd(index, [for (final x in part) x[0] as int],
+          [for (final x in part) x[1] as int], vecs);
+      if (rc != 0) return;
+      indexQueue.removeRange(0, part.length);
+      if (indexQueue.isNotEmpty) indexTimer = Timer(Duration.zero, drainIndex);
+    }
+
+    // (Re)starts the idle wait before draining.
+    void scheduleIndex() {
+      indexTimer?.cancel();
+      indexTimer = indexQueue.isEmpty ? null : Timer(indexIdle, drainIndex);
+    }
+
+    void closeHandles() {
+      closeIndex();
+      if (ctx != nullptr) { ffiCtxFree(ctx); ctx = nullptr; }
+      if (model != nullptr) { ffiModelClose(model); model = nullptr; }
+      loras.clear();
+      loadParams = null;
+      lastSeq = 0;
+    }
+
+    // Opens waiting streams while the bridge has free sequences.
+    void admit() {
+      while (loaded() && waiting.isNotEmpty) {
+        final w = waiting.first;
+        final (rc, id) = ffiCtxStreamOpen(ctx, w.prompt, w.max,
+            sampling: w.sampling,
+            grammar: w.grammar,
+            stop: w.stop,
+            stopTokens: w.stopTokens);
+        if (rc == -6) return; // all sequences busy: wait for a close
+        waiting.removeAt(0);
+        if (rc != 0) {
+          w.reply.send({
+            'error': switch (rc) {
+              -5 => 'Prompt is longer than the context.',
+              -7 => 'Invalid request: ${(w.grammar == null ? null : ffiGrammarError(w.grammar!)) ?? 'bad params'}',
+              _ => 'stream open rc=$rc',
+            },
+          });
+          continue;
+        }
+        w.id = id;
+        open[w.req] = w;
+        ffiCtxStreamAttach(ctx, id, w.reply);
+      }
+    }
+
+    // [id, status] from the bridge once a stream has posted its last text.
+    events.listen((dynamic msg) {
+      if (msg is! List || !loaded()) return;
+      final id = msg[0] as int;
+      final status = msg[1] as int;
+      _WorkerStream? w;
+      for (final o in open.values) {
+        if (o.id == id) { w = o; break; }
+      }
+      if (w == null) return;
+      final p = ffiCtxStreamPoll(ctx, id);
+      final spec = ffiCtxStreamSpecStats(ctx, id);
+      ffiCtxStreamClose(ctx, id);
+      open.remove(w.req);
+      lastSeq = id % lbMaxStreams;
+      w.reply.send(switch (status) {
+        lbStreamDone => {
+            'kind': 'end',
+            'prefill_tps': p?.prefillTokPerSec ?? 0.0,
+            'decode_tps': p?.decodeTokPerSec ?? 0.0,
+            if (spec != null && spec.steps > 0) 'spec_accept': spec.acceptRate,
+          },
+        lbStreamCancelled => {'error': 'cancelled'},
+        _ => {'error': 'stream failed'},
+      });
+      admit();
+      if (!streaming()) scheduleIndex();
+    });
 
     Future<Map<String, dynamic>> _handle(Map<String, dynamic> body) async {
       final op = body['op'] as String? ?? '';
+      final busy = open.isNotEmpty || waiting.isNotEmpty;
       try {
         switch (op) {
           case 'load': {
+            if (busy || loadJob != nullptr) return {'ok': false, 'rc': -1};
             final path = body['path'] as String? ?? '';
             debugPrint('[WK] load: $path');
-            final rc = ffiLoadModelAtPath(path);
-            loaded = (rc == 0) && ffiIsLoaded();
-            return {'ok': loaded, 'rc': rc};
+            // The old model stays in the bridge's model cache (budget
+            // permitting), so reloading it later is a lookup.
+            closeHandles();
+            ffiModelsSetBudget(body['model_budget'] as int? ?? -1);
+            final pm = body['params'];
+            final lp = pm is Map ? LoadParams.fromMap(pm) : null;
+            // The weights load on a native thread; this isolate keeps serving
+            // messages (load_cancel) meanwhile and relays progress.
+            final updates = ReceivePort();
+            final (jrc, job) = ffiModelOpenAsync(path, params: lp, progress: updates.sendPort);
+            if (jrc != 0) {
+              updates.close();
+              return {'ok': false, 'rc': jrc};
+            }
+            loadJob = job;
+            final relay = body['progress'] as SendPort?;
+            await for (final dynamic u in updates) {
+              if (u is! List) continue;
+              relay?.send(u[1] as int);
+              if (u[0] != lbLoadRunning) break;
+            }
+            loadJob = nullptr;
+            final (rc, m) = ffiLoadJobFinish(job);
+            if (rc != 0) return {'ok': false, 'rc': rc};
+            ffiModelSetPrefixCache(m, prefixBudget, minTokens: prefixMinTokens);
+            final (crc, c) = ffiCtxCreate(m, params: lp);
+            if (crc != 0) {
+              ffiModelClose(m);
+              return {'ok': false, 'rc': crc};
+            }
+            final arc = ffiCtxAsyncStart(c, events.sendPort,
+                cadenceMs: body['cadence'] as int? ?? 32);
+            if (arc != 0) {
+              ffiCtxFree(c);
+              ffiModelClose(m);
+              return {'ok': false, 'rc': arc};
+            }
+            model = m;
+            ctx = c;
+            loadParams = lp;
+            ffiCtxSetContextShift(ctx, shiftKeep, shiftDiscard);
+            if (lookupOn) ffiCtxSetLookup(ctx, nDraftMax: lookupDraftMax);
+            final draftPath = body['draft'] as String?;
+            if (draftPath != null) {
+              // the context keeps its own reference to the draft
+              final (drc, dm) = ffiModelOpen(draftPath, params: lp);
+              final src = drc == 0 ? ffiCtxSetDraft(ctx, dm) : drc;
+              if (drc == 0) ffiModelClose(dm);
+              debugPrint('[WK] draft ${src == 0 ? 'attached' : 'not used (rc=$src)'}: $draftPath');
+            }
+            return {'ok': true, 'rc': 0};
+          }
+          case 'load_cancel': {
+            if (loadJob != nullptr) ffiLoadJobCancel(loadJob);
+            return {'ok': true};
+          }
+          case 'prefetch': {
+            return {'rc': ffiModelPrefetch(body['path'] as String?)};
+          }
+          case 'model_cache': {
+            return {'rc': ffiModelsSetBudget(body['budget'] as int? ?? -1)};
+          }
+          case 'model_list': {
+            final (models, budget) = ffiModelsList();
+            return {'models': [for (final m in models) m.toMap()], 'budget': budget};
+          }
+          case 'model_pin': {
+            if (model == nullptr) return {'ok': false};
+            return {'ok': ffiModelPin(model, body['pin'] as bool? ?? true) == 0};
           }
           case 'eval': {
-            if (!loaded || !ffiIsLoaded()) return {'text': 'Model not loaded.'};
+            if (!loaded()) return {'text': 'Model not loaded.'};
+            if (busy) return {'text': 'Busy: streams are open.'};
             final prompt = body['prompt'] as String? ?? '';
             final max = body['max'] as int? ?? 64;
-            final out = ffiEval(prompt, max);
+            final out = ffiCtxEval(ctx, prompt, max,
+                sampling: _samplingOf(body),
+                grammar: _grammarOf(body),
+                stop: _stopOf(body),
+                stopTokens: _stopTokensOf(body));
             return {'text': out};
           }
           case 'clear': {
-            if (loaded) { ffiClearHistory(); }
+            // Only idle sequences are cleared while streams are open.
+            if (loaded()) { ffiCtxClearHistory(ctx); }
+            lastSeq = 0;
             return {'ok': true};
           }
+          case 'lora_set': {
+            if (!loaded() || busy) return {'rc': -1};
+            final path = body['path'] as String? ?? '';
+            final scale = (body['scale'] as num? ?? 1.0).toDouble();
+            var id = loras[path];
+            if (id == null) {
+              if (scale == 0) return {'rc': 0};
+              final (rc, x) = ffiModelLoraLoad(model, path);
+              if (rc != 0) return {'rc': rc};
+              id = loras[path] = x;
+            }
+            final rc = ffiCtxLoraSet(ctx, id, scale);
+            if (rc == 0) lastSeq = 0; // the KV was cleared
+            return {'rc': rc};
+          }
+          case 'lora_clear': {
+            if (!loaded() || busy) return {'rc': -1};
+            final rc = ffiCtxLoraClear(ctx);
+            if (rc == 0) lastSeq = 0;
+            return {'rc': rc};
+          }
+          case 'lora_unload': {
+            final id = loras[body['path'] as String? ?? ''];
+            if (!loaded() || id == null) return {'rc': -1};
+            final rc = ffiModelLoraUnload(model, id);
+            if (rc == 0) loras.remove(body['path']);
+            return {'rc': rc};
+          }
+          case 'ctx_shift': {
+            shiftKeep = body['keep'] as int? ?? 1;
+            shiftDiscard = body['discard'] as int? ?? 0;
+            if (loaded()) ffiCtxSetContextShift(ctx, shiftKeep, shiftDiscard);
+            return {'ok': true};
+          }
+          case 'lookup': {
+            lookupOn = body['enabled'] as bool? ?? true;
+            lookupDraftMax = body['n_draft_max'] as int? ?? 0;
+            // applied now when idle, otherwise from the next load
+            if (loaded() && !busy) {
+              ffiCtxSetLookup(ctx, enabled: lookupOn, nDraftMax: lookupDraftMax);
+            }
+            return {'ok': true};
+          }
+          case 'prefix_cache': {
+            prefixBudget = body['budget'] as int? ?? 0;
+            prefixMinTokens = body['min_tokens'] as int? ?? 0;
+            if (loaded()) ffiModelSetPrefixCache(model, prefixBudget, minTokens: prefixMinTokens);
+            return {'ok': true};
+          }
+          case 'prefix_stats': {
+            if (!loaded()) return {'stats': null};
+            return {'stats': ffiModelPrefixStats(model)?.toMap()};
+          }
+          case 'autotune': {
+            if (!loaded() || busy) return {'tuning': null};
+            final t = ffiCtxAutotune(ctx, body['path'] as String? ?? '',
+                force: body['force'] as bool? ?? false);
+            return {'tuning': t?.toMap()};
+          }
+          case 'stats': {
+            if (!loaded()) return {'stats': null};
+            final st = ffiCtxGetStats(ctx);
+            if (body['reset'] as bool? ?? false) ffiCtxStatsReset(ctx);
+            return {'stats': st?.toMap()};
+          }
+          case 'index_open': {
+            final path = body['path'] as String? ?? '';
+            if (path != indexPath) { closeIndex(); indexPath = path; }
+            if (!ensureIndex()) return {'count': -1};
+            return {'count': ffiIndexCount(index)};
+          }
+          case 'index_add': {
+            if (!ensureIndex()) return {'ok': false};
+            indexQueue.addAll((body['entries'] as List).cast<List>());
+            scheduleIndex();
+            return {'ok': true};
+          }
+          case 'index_remove': {
+            if (!ensureIndex()) return {'removed': 0};
+            final group = body['group'] as int;
+            indexQueue.removeWhere((e) => e[0] == group);
+            return {'removed': ffiIndexRemoveGroup(index, group)};
+          }
+          case 'search': {
+            final e = ensureIndex() ? embedder() : null;
+            if (e == null) return {'hits': null};
+            final q = ffiCtxEmbedBatch(e, [body['query'] as String? ?? '']);
+            if (q == null) return {'hits': null};
+            final hits = ffiIndexSearch(index, q.first, body['k'] as int? ?? 10);
+            return {'hits': [for (final h in hits) [h.group, h.key, h.score]]};
+          }
+          case 'state_save': {
+            if (!loaded()) return {'rc': -1};
+            return {'rc': ffiCtxStateSave(ctx, lastSeq, body['path'] as String? ?? '')};
+          }
+          case 'state_load': {
+            if (!loaded()) return {'rc': -1};
+            return {'rc': ffiCtxStateLoad(ctx, lastSeq, body['path'] as String? ?? '')};
+          }
           case 'stop': {
-            if (loaded) { try { ffiFree(); } catch (_) {} }
+            if (loadJob != nullptr) ffiLoadJobCancel(loadJob);
+            for (final w in waiting) { w.reply.send({'error': 'cancelled'}); }
+            waiting.clear();
+            for (final w in open.values) { ffiCtxStreamClose(ctx, w.id); }
+            open.clear();
+            try { closeHandles(); } catch (_) {}
             return {'ok': true};
           }
           case 'stream_cancel': {
-            if (streaming) {
-              try { ffiStreamCancel(); } catch (_) {}
-              streaming = false;
+            final req = body['req'] as int?;
+            final w = open[req];
+            if (w != null) {
+              ffiCtxStreamStop(ctx, w.id); // reported and closed via `events`
+            } else {
+              waiting.removeWhere((q) => q.req == req);
             }
             return {'ok': true};
           }
@@ -234,56 +906,47 @@ class LlamaWorker {
         }
 
         // --- streaming path ---
-        try {
-          if (streaming) {
-            reply.send({'error': 'another stream in progress'});
-            return;
-          }
-          if (!loaded || !ffiIsLoaded()) {
-            reply.send({'error': 'Model not loaded'});
-            return;
-          }
-          streaming = true;
-
-          final prompt = body['prompt'] as String? ?? '';
-          final max = body['max'] as int? ?? 256;
-
-          final rc = ffiStreamBegin(prompt, max);
-          if (rc != 0) {
-            streaming = false;
-            reply.send({'error': 'stream begin rc=$rc'});
-            return;
-          }
-
-          int idleIters = 0;
-          const idleHeartbeatEvery = 4; // send a tick every few empties
-
-          while (ffiStreamIsRunning()) {
-            final s = ffiStreamNext(); // null=error, ""=no piece/finished, else piece
-            if (s == null) {
-              streaming = false;
-              reply.send({'error': 'stream next error'});
-              return;
-            }
-            if (s.isNotEmpty) {
-              idleIters = 0;
-              reply.send({'kind': 'piece', 'text': s});
-            } else {
-              idleIters++;
-              if (idleIters % idleHeartbeatEvery == 0) {
-                reply.send({'kind': 'tick'});
-              }
-            }
-            // no sleep: llama_decode blocks per token already
-          }
-
-          streaming = false;
-          reply.send({'kind': 'end'});
-        } catch (e) {
-          streaming = false;
-          reply.send({'error': e.toString()});
+        if (!loaded()) {
+          reply.send({'error': 'Model not loaded'});
+          return;
         }
+        waiting.add(_WorkerStream(
+          reply: reply,
+          req: body['req'] as int? ?? -1,
+          prompt: body['prompt'] as String? ?? '',
+          max: body['max'] as int? ?? 256,
+          sampling: _samplingOf(body),
+          grammar: _grammarOf(body),
+          stop: _stopOf(body),
+          stopTokens: _stopTokensOf(body),
+        ));
+        reply.send({'kind': 'queued'});
+        admit();
       }
     });
   }
 }
+
+/// A streamEval request inside the worker isolate.
+class _WorkerStream {
+  final SendPort reply;
+  final int req;
+  final String prompt;
+  final int max;
+  final SamplingParams? sampling;
+  final OutputGrammar? grammar;
+  final List<String> stop;
+  final List<int> stopTokens;
+  int id = -1; // bridge stream id once admitted
+
+  _WorkerStream({
+    required this.reply,
+    required this.req,
+    required this.prompt,
+    required this.max,
+    this.sampling,
+    this.grammar,
+    this.stop = const [],
+    this.stopTokens = const [],
+  });
+}
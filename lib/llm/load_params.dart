@@ -0,0 +1,75 @@
+// lib/llm/load_params.dart
+
+/// KV cache element type; mirrors `lb_kv_type` in llama_bridge.cpp.
+enum KvCacheType { f16, q8_0, q4_0 }
+
+/// How an embedding context pools token vectors; mirrors `lb_pooling`.
+/// Anything but [none] makes a context that only serves embeddings.
+enum EmbeddingPooling { none, mean, cls, last }
+
+/// Model/context settings applied at load time; mirrors the native
+/// `lb_load_params` (android/app/src/main/cpp/llama_bridge.cpp).
+///
+/// `null` fields keep the llama.cpp defaults. A quantized [typeV] needs
+/// flash attention, which is switched on automatically unless [flashAttn]
+/// is explicitly `false`.
+class LoadParams {
+  final int? nCtx;
+  final int? nBatch;
+  final int? nUbatch; // capped at nBatch
+  final int? nThreads;
+  final int? nThreadsBatch; // defaults to nThreads
+  final bool? flashAttn;
+  final KvCacheType typeK;
+  final KvCacheType typeV;
+  final bool useMmap;
+  final bool useMlock;
+  final int? nSeqMax; // concurrent streams; each gets nCtx / nSeqMax tokens
+  final EmbeddingPooling pooling;
+
+  const LoadParams({
+    this.nCtx,
+    this.nBatch,
+    this.nUbatch,
+    this.nThreads,
+    this.nThreadsBatch,
+    this.flashAttn,
+    this.typeK = KvCacheType.f16,
+    this.typeV = KvCacheType.f16,
+    this.useMmap = true,
+    this.useMlock = false,
+    this.nSeqMax,
+    this.pooling = EmbeddingPooling.none,
+  });
+
+  // Isolate messages stay plain maps, like the rest of LlamaWorker's protocol.
+  Map<String, dynamic> toMap() => {
+        'nCtx': nCtx,
+        'nBatch': nBatch,
+        'nUbatch': nUbatch,
+        'nThreads': nThreads,
+        'nThreadsBatch': nThreadsBatch,
+        'flashAttn': flashAttn,
+        'typeK': typeK.index,
+        'typeV': typeV.index,
+        'useMmap': useMmap,
+        'useMlock': useMlock,
+        'nSeqMax': nSeqMax,
+        'pooling': pooling.index,
+      };
+
+  factory LoadParams.fromMap(Map<dynamic, dynamic> m) => LoadParams(
+        nCtx: m['nCtx'] as int?,
+        nBatch: m['nBatch'] as int?,
+        nUbatch: m['nUbatch'] as int?,
+        nThreads: m['nThreads'] as int?,
+        nThreadsBatch: m['nThreadsBatch'] as int?,
+        flashAttn: m['flashAttn'] as bool?,
+        typeK: KvCacheType.values[m['typeK'] as int? ?? 0],
+        typeV: KvCacheType.values[m['typeV'] as int? ?? 0],
+        useMmap: m['useMmap'] as bool? ?? true,
+        useMlock: m['useMlock'] as bool? ?? false,
+        nSeqMax: m['nSeqMax'] as int?,
+        pooling: EmbeddingPooling.values[m['pooling'] as int? ?? 0],
+      );
+}
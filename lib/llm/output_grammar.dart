@@ -0,0 +1,39 @@
+// lib/llm/output_grammar.dart
+
+/// Index matches the native `lb_grammar_kind`.
+enum OutputGrammarKind { none, gbnf, jsonSchema }
+
+/// Constrains what one generation request may produce; mirrors the grammar
+/// fields of the native `lb_request_params`
+/// (android/app/src/main/cpp/llama_bridge.cpp).
+///
+/// [OutputGrammar.gbnf] takes a grammar in llama.cpp's GBNF dialect;
+/// [OutputGrammar.jsonSchema] a JSON schema, so the reply is JSON it accepts
+/// (tool calls, fixed formats). A constrained reply ends when the grammar
+/// admits no further text (or earlier, at a stop string).
+class OutputGrammar {
+  final OutputGrammarKind kind;
+  final String text;
+  final String? root; // GBNF start rule; null: "root"
+
+  const OutputGrammar.gbnf(this.text, {this.root}) : kind = OutputGrammarKind.gbnf;
+
+  const OutputGrammar.jsonSchema(this.text)
+      : kind = OutputGrammarKind.jsonSchema,
+        root = null;
+
+  const OutputGrammar._(this.kind, this.text, this.root);
+
+  // Isolate messages stay plain maps, like the rest of LlamaWorker's protocol.
+  Map<String, dynamic> toMap() => {
+        'kind': kind.index,
+        'text': text,
+        'root': root,
+      };
+
+  factory OutputGrammar.fromMap(Map<dynamic, dynamic> m) => OutputGrammar._(
+        OutputGrammarKind.values[m['kind'] as int? ?? 0],
+        m['text'] as String? ?? '',
+        m['root'] as String?,
+      );
+}
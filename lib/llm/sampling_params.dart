@@ -0,0 +1,58 @@
+// lib/llm/sampling_params.dart
+
+/// Sampling settings for one generation request; mirrors the native
+/// `lb_sampling_params` (android/app/src/main/cpp/lb_sampling.h).
+///
+/// Stages run penalties -> top-k -> top-p -> min-p -> temperature.
+/// `temperature <= 0` means greedy argmax; a fixed [seed] makes sampled
+/// output reproducible, `null` picks a random seed per request.
+class SamplingParams {
+  final double temperature;
+  final int topK; // <= 0: disabled
+  final double topP; // >= 1: disabled
+  final double minP; // <= 0: disabled
+  final double repeatPenalty; // 1: disabled
+  final double frequencyPenalty;
+  final double presencePenalty;
+  final int repeatLastN; // -1: whole context
+  final int? seed;
+
+  const SamplingParams({
+    this.temperature = 0.8,
+    this.topK = 40,
+    this.topP = 0.95,
+    this.minP = 0.05,
+    this.repeatPenalty = 1.0,
+    this.frequencyPenalty = 0.0,
+    this.presencePenalty = 0.0,
+    this.repeatLastN = 64,
+    this.seed,
+  });
+
+  static const SamplingParams greedy = SamplingParams(temperature: 0);
+
+  // Isolate messages stay plain maps, like the rest of LlamaWorker's protocol.
+  Map<String, dynamic> toMap() => {
+        'temperature': temperature,
+        'topK': topK,
+        'topP': topP,
+        'minP': minP,
+        'repeatPenalty': repeatPenalty,
+        'frequencyPenalty': frequencyPenalty,
+        'presencePenalty': presencePenalty,
+        'repeatLastN': repeatLastN,
+        'seed': seed,
+      };
+
+  factory SamplingParams.fromMap(Map<dynamic, dynamic> m) => SamplingParams(
+        temperature: (m['temperature'] as num?)?.toDouble() ?? 0.8,
+        topK: m['topK'] as int? ?? 40,
+        topP: (m['topP'] as num?)?.toDouble() ?? 0.95,
+        minP: (m['minP'] as num?)?.toDouble() ?? 0.05,
+        repeatPenalty: (m['repeatPenalty'] as num?)?.toDouble() ?? 1.0,
+        frequencyPenalty: (m['frequencyPenalty'] as num?)?.toDouble() ?? 0.0,
+        presencePenalty: (m['presencePenalty'] as num?)?.toDouble() ?? 0.0,
+        repeatLastN: m['repeatLastN'] as int? ?? 64,
+        seed: m['seed'] as int?,
+      );
+}
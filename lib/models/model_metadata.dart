@@ -1,3 +1,5 @@
+import '../llm/load_params.dart';
+
 class ModelMetadata {
   final String id;
   final String name;          // DISPLAY NAME (may include '/')
@@ -6,6 +8,8 @@ class ModelMetadata {
   final String downloadUrl;
   final String hfUrl;
   final bool isDownloaded;
+  final LoadParams? loadParams; // null: llama.cpp defaults
+  final String? draftModelId;   // smaller model with the same vocabulary, for speculative decoding
 
   const ModelMetadata({
     required this.id,
@@ -15,6 +19,8 @@ class ModelMetadata {
     required this.downloadUrl,
     required this.hfUrl,
     required this.isDownloaded,
+    this.loadParams,
+    this.draftModelId,
   });
 
   ModelMetadata copyWith({
@@ -25,6 +31,8 @@ class ModelMetadata {
     String? downloadUrl,
     String? hfUrl,
     bool? isDownloaded,
+    LoadParams? loadParams,
+    String? draftModelId,
   }) {
     return ModelMetadata(
       id: id ?? this.id,
@@ -34,6 +42,8 @@ class ModelMetadata {
       downloadUrl: downloadUrl ?? this.downloadUrl,
       hfUrl: hfUrl ?? this.hfUrl,
       isDownloaded: isDownloaded ?? this.isDownloaded,
+      loadParams: loadParams ?? this.loadParams,
+      draftModelId: draftModelId ?? this.draftModelId,
     );
   }
 }
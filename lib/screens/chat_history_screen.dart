@@ -1,8 +1,10 @@
 // screens/chat_history_screen.dart
 import 'package:flutter/material.dart';
+import '../services/chat_search.dart';
 import '../services/chat_storage.dart';
 import '../models/chat_message.dart';
 import '../widgets/message_bubble.dart';
+import 'chat_screen.dart';
 
 class ChatHistoryScreen extends StatefulWidget {
   const ChatHistoryScreen({super.key});
@@ -47,7 +49,16 @@ class _ChatHistoryScreenState extends State<ChatHistoryScreen> {
   Widget build(BuildContext context) {
     final theme = Theme.of(context);
     return Scaffold(
-      appBar: AppBar(title: const Text('Chat History')),
+      appBar: AppBar(
+        title: const Text('Chat History'),
+        actions: [
+          IconButton(
+            icon: const Icon(Icons.search),
+            tooltip: 'Search chats',
+            onPressed: () => showSearch(context: context, delegate: _ChatSearchDelegate()),
+          ),
+        ],
+      ),
       body: RefreshIndicator(
         onRefresh: _refresh,
         child: FutureBuilder<List<ChatSessionMeta>>(
@@ -132,6 +143,68 @@ class _ChatHistoryScreenState extends State<ChatHistoryScreen> {
     }
 }
 
+// Searches message contents by meaning (see ChatSearch). Runs on submit
+// only: each query is embedded by the loaded model.
+class _ChatSearchDelegate extends SearchDelegate<void> {
+  @override
+  List<Widget> buildActions(BuildContext context) => [
+        if (query.isNotEmpty)
+          IconButton(icon: const Icon(Icons.clear), onPressed: () => query = ''),
+      ];
+
+  @override
+  Widget buildLeading(BuildContext context) => IconButton(
+        icon: const Icon(Icons.arrow_back),
+        onPressed: () => close(context, null),
+      );
+
+  @override
+  Widget buildSuggestions(BuildContext context) => _hint(
+      ChatSearch.available
+          ? 'Search all chats by meaning'
+          : 'Load a model in a chat to search history');
+
+  @override
+  Widget buildResults(BuildContext context) {
+    if (!ChatSearch.available) return buildSuggestions(context);
+    return FutureBuilder<List<ChatSearchHit>>(
+      future: ChatSearch.search(query),
+      builder: (context, snap) {
+        if (snap.connectionState == ConnectionState.waiting) {
+          return const Center(child: CircularProgressIndicator());
+        }
+        if (snap.hasError) return _hint('Search failed: ${snap.error}');
+        final hits = snap.data ?? [];
+        if (hits.isEmpty) return _hint('No matches');
+        return ListView.builder(
+          itemCount: hits.length,
+          itemBuilder: (context, i) {
+            final h = hits[i];
+            return ListTile(
+              title: Text(
+                h.text.replaceAll('\n', ' '),
+                maxLines: 2,
+                overflow: TextOverflow.ellipsis,
+              ),
+              subtitle: Text('${h.sessionId} · ${(h.score * 100).round()}%'),
+              onTap: () => Navigator.of(context).push(MaterialPageRoute(
+                builder: (_) => ChatSessionView(sessionId: h.sessionId),
+              )),
+            );
+          },
+        );
+      },
+    );
+  }
+
+  Widget _hint(String text) => Center(
+        child: Padding(
+          padding: const EdgeInsets.all(24),
+          child: Text(text, textAlign: TextAlign.center),
+        ),
+      );
+}
+
 class ChatSessionView extends StatefulWidget {
   final String sessionId;
   const ChatSessionView({super.key, required this.sessionId});
@@ -149,10 +222,30 @@ class _ChatSessionViewState extends State<ChatSessionView> {
     _future = ChatStorage.loadSession(widget.sessionId);
   }
 
+  // Reopens the session in a live chat; its saved model state (if any and
+  // still valid) is restored instead of re-reading the whole transcript.
+  void _continue() {
+    Navigator.of(context).pushReplacement(MaterialPageRoute(
+      builder: (_) => Scaffold(
+        appBar: AppBar(title: Text('Session: ${widget.sessionId}')),
+        body: ChatScreen(sessionId: widget.sessionId),
+      ),
+    ));
+  }
+
   @override
   Widget build(BuildContext context) {
     return Scaffold(
-      appBar: AppBar(title: Text('Session: ${widget.sessionId}')),
+      appBar: AppBar(
+        title: Text('Session: ${widget.sessionId}'),
+        actions: [
+          IconButton(
+            icon: const Icon(Icons.play_arrow),
+            tooltip: 'Continue chat',
+            onPressed: _continue,
+          ),
+        ],
+      ),
       body: FutureBuilder<List<ChatMessage>>(
         future: _future,
         builder: (context, snap) {
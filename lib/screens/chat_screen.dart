@@ -1,4 +1,5 @@
 // lib/screens/chat_screen.dart
+import 'dart:async';
 import 'dart:io';
 import 'dart:math';
 import 'package:flutter/material.dart';
@@ -8,6 +9,7 @@ import 'package:provider/provider.dart';
 import '../llm/llama_worker.dart';
 import '../models/chat_message.dart';
 import '../models/model_metadata.dart';
+import '../services/chat_search.dart';
 import '../services/chat_storage.dart';
 import '../services/file_naming.dart'; // toGgufFileName
 import '../state/model_provider.dart';
@@ -15,7 +17,10 @@ import '../widgets/input_bar.dart';
 import '../widgets/message_bubble.dart';
 
 class ChatScreen extends StatefulWidget {
-  const ChatScreen({super.key});
+  /// Resume this stored session instead of starting a new one.
+  final String? sessionId;
+
+  const ChatScreen({super.key, this.sessionId});
 
   @override
   State<ChatScreen> createState() => _ChatScreenState();
@@ -25,11 +30,21 @@ class _ChatScreenState extends State<ChatScreen> {
   final List<ChatMessage> _messages = [];
   String? _loadedModel; // DISPLAY name
   bool _isLoadingModel = false;
+  double? _loadProgress; // fraction of the weights read while loading
   bool _isThinking = false;
+  double? _prefillProgress; // prompt processing progress, null when not prefilling
   late final LlamaWorker _worker;
 
   int _adaptiveMax = 128; // adaptive cap for streaming
 
+  // Transcript sent as the prompt is trimmed to whole turns under this size.
+  // It may exceed the context: the bridge shifts out the oldest turns and
+  // keeps extending the cache, so this only bounds re-prefill after a restart.
+  static const int _promptCharBudget = 8000;
+
+  // Set when resuming a session: restore its KV snapshot after model load.
+  bool _restorePending = false;
+
   String _sessionId = _newSessionId();
   static String _newSessionId() =>
       's_${DateTime.now().millisecondsSinceEpoch}_${Random().nextInt(9999)}';
@@ -39,11 +54,21 @@ class _ChatScreenState extends State<ChatScreen> {
     super.initState();
     _worker = LlamaWorker();
     _safeStart();
+    final resume = widget.sessionId;
+    if (resume != null) {
+      _sessionId = resume;
+      _restorePending = true;
+      ChatStorage.loadSession(resume).then((msgs) {
+        if (!mounted) return;
+        setState(() => _messages.insertAll(0, msgs.reversed));
+      });
+    }
   }
 
   Future<void> _safeStart() async {
     try {
       await _worker.start();
+      await _worker.setPromptLookup();
     } catch (e) {
       if (!mounted) return;
       ScaffoldMessenger.of(context).showSnackBar(
@@ -54,6 +79,7 @@ class _ChatScreenState extends State<ChatScreen> {
 
   @override
   void dispose() {
+    ChatSearch.detach(_worker);
     _worker.stop();
     super.dispose();
   }
@@ -63,6 +89,7 @@ class _ChatScreenState extends State<ChatScreen> {
       _messages.clear();
       _sessionId = _newSessionId();
       _isThinking = false;
+      _restorePending = false;
     });
     try { await _worker.clearHistory(); } catch (_) {}
     if (mounted) {
@@ -89,7 +116,10 @@ class _ChatScreenState extends State<ChatScreen> {
 
   // 2) Load model if needed (build absolute path using the *sanitized file name*)
   if (_loadedModel != modelName) {
-    setState(() => _isLoadingModel = true);
+    setState(() {
+      _isLoadingModel = true;
+      _loadProgress = null;
+    });
     bool ok = false;
     String? err;
 
@@ -103,8 +133,17 @@ class _ChatScreenState extends State<ChatScreen> {
 
       ok = await _worker.loadModelAtPath(
         fullPath,
+        params: selectedModel.loadParams,
+        draftPath: _draftPathFor(selectedModel, dir.path),
+        onProgress: (f) {
+          if (mounted) setState(() => _loadProgress = f);
+        },
         timeout: const Duration(seconds: 90),
       );
+      if (ok) {
+        await _tuneThreads(dir.path, safeFile);
+        unawaited(ChatSearch.attach(_worker));
+      }
     } catch (e) {
       err = e.toString();
     } finally {
@@ -129,6 +168,20 @@ class _ChatScreenState extends State<ChatScreen> {
     _loadedModel = modelName;
   }
 
+  // Resuming: a valid snapshot makes the transcript prefill a no-op. Stale or
+  // mismatched snapshots are dropped; the next save rebuilds them.
+  if (_restorePending) {
+    _restorePending = false;
+    try {
+      final path = await ChatStorage.statePathForSession(_sessionId);
+      final rc = await _worker.loadState(path);
+      debugPrint('[CHAT] state restore rc=$rc');
+      if (rc == -3 || rc == -4) await ChatStorage.deleteState(_sessionId);
+    } catch (e) {
+      debugPrint('[CHAT] state restore failed: $e');
+    }
+  }
+
   // 3) Create a live placeholder and stream tokens into it
   final placeholderId = 'pending_${DateTime.now().microsecondsSinceEpoch}';
   var liveText = '🤖 ';
@@ -146,12 +199,18 @@ class _ChatScreenState extends State<ChatScreen> {
   try {
     // 4) Stream eval with watchdog (won’t hang the UI)
     await _worker.streamEval(
-      prompt,
+      _buildPrompt(),
       maxTokens: _adaptiveMax,                       // adaptive cap you track in state
+      stop: const ['\nUser:'],                       // the model starting the next turn
       maxTotalTime: const Duration(seconds: 180),    // hard cap
       maxSilence: const Duration(seconds: 15),       // cancel if no activity for 15s
+      onPrefill: (done, total) {
+        if (!mounted) return;
+        setState(() => _prefillProgress = total > 0 ? done / total : null);
+      },
       onToken: (piece) {
         tokenPieces++;
+        _prefillProgress = null;
         liveText += piece;
 
         // Update the placeholder bubble quickly
@@ -174,6 +233,7 @@ class _ChatScreenState extends State<ChatScreen> {
 
     setState(() {
       _isThinking = false;
+      _prefillProgress = null;
       final idx = _messages.indexWhere((m) => m.id == placeholderId);
       if (idx >= 0) {
         _messages.removeAt(idx);
@@ -183,15 +243,18 @@ class _ChatScreenState extends State<ChatScreen> {
       }
     });
     await ChatStorage.saveMessage(_sessionId, botMsg);
+    _saveState();
 
     // 6) Adapt future maxTokens toward recent length (+headroom)
     final target = (0.7 * _adaptiveMax + 0.3 * (tokenPieces + 32)).toInt();
     _adaptiveMax = target.clamp(64, 512);
     debugPrint('[CHAT] adaptiveMax -> $_adaptiveMax (pieces=$tokenPieces, dt=${DateTime.now().difference(start).inSeconds}s)');
+    _logStats();
   } catch (e) {
     // Stream failed or timed out — replace placeholder with error
     setState(() {
       _isThinking = false;
+      _prefillProgress = null;
       final idx = _messages.indexWhere((m) => m.id == placeholderId);
       if (idx >= 0) _messages.removeAt(idx);
       _messages.insert(
@@ -206,6 +269,92 @@ class _ChatScreenState extends State<ChatScreen> {
   }
 }
 
+  // Per-reply performance counters in the debug log (reset after each read).
+  Future<void> _logStats() async {
+    try {
+      final st = await _worker.stats(reset: true);
+      if (st != null) debugPrint('[CHAT] stats: $st');
+      final pc = await _worker.prefixCacheStats();
+      if (pc != null) debugPrint('[CHAT] $pc');
+    } catch (e) {
+      debugPrint('[CHAT] stats failed: $e');
+    }
+  }
+
+  // Conversation so far (oldest first) as a plain User/Assistant transcript,
+  // ending with an open assistant turn. Replies are appended exactly as they
+  // were generated so the next prompt extends the tokens already in KV.
+  String _buildPrompt() {
+    final turns = <String>[];
+    int size = 0;
+    for (final m in _messages) { // newest first
+      if (m.id.startsWith('pending_') || m.text.startsWith('❌')) continue;
+      final String turn;
+      if (m.type == MessageType.user) {
+        turn = 'User: ${m.text.replaceFirst('🧑 ', '')}\n';
+      } else {
+        turn = 'Assistant:${m.text.replaceFirst('🤖 ', '')}\n';
+      }
+      if (turns.isNotEmpty && size + turn.length > _promptCharBudget) break;
+      turns.add(turn);
+      size += turn.length;
+    }
+    return '${turns.reversed.join()}Assistant:';
+  }
+
+  // Warms the page cache with the picked model's file while the user is
+  // still typing, so the load on send reads from memory. A model the bridge
+  // still holds resident needs none: switching back to it is a lookup.
+  Future<void> _prefetchModel(ModelMetadata model) async {
+    if (model.name == _loadedModel) return;
+    try {
+      final dir = await getApplicationDocumentsDirectory();
+      final path = '${dir.path}/${toGgufFileName(model.name)}';
+      final resident = await _worker.residentModels();
+      if (resident.any((m) => m.path == path)) return;
+      await _worker.prefetchModel(path);
+    } catch (e) {
+      debugPrint('[CHAT] prefetch failed: $e');
+    }
+  }
+
+  // Speculative decoding: the model's draft, when it is downloaded too.
+  String? _draftPathFor(ModelMetadata model, String docsDir) {
+    final id = model.draftModelId;
+    if (id == null) return null;
+    for (final m in context.read<ModelProvider>().models) {
+      if (m.id == id && m.isDownloaded) return '$docsDir/${toGgufFileName(m.name)}';
+    }
+    return null;
+  }
+
+  // Thread counts / core placement per (model, device). Probes once, then
+  // reuses the profile on later loads.
+  Future<void> _tuneThreads(String docsDir, String modelFile) async {
+    try {
+      final tuneDir = Directory('$docsDir/tuning');
+      if (!await tuneDir.exists()) await tuneDir.create(recursive: true);
+      final t = await _worker.autotune('${tuneDir.path}/$modelFile.tune');
+      if (t != null) {
+        debugPrint('[CHAT] threads: decode ${t.nThreads} '
+            '(${t.decodeTokPerSec.toStringAsFixed(1)} tok/s), '
+            'prefill ${t.nThreadsBatch}${t.fromCache ? ' [profile]' : ''}');
+      }
+    } catch (e) {
+      debugPrint('[CHAT] autotune failed: $e');
+    }
+  }
+
+  Future<void> _saveState() async {
+    try {
+      final path = await ChatStorage.statePathForSession(_sessionId);
+      final rc = await _worker.saveState(path);
+      if (rc != 0) debugPrint('[CHAT] state save rc=$rc');
+    } catch (e) {
+      debugPrint('[CHAT] state save failed: $e');
+    }
+  }
+
 
   @override
   Widget build(BuildContext context) {
@@ -244,7 +393,9 @@ class _ChatScreenState extends State<ChatScreen> {
                 border: Border.all(color: Colors.amber.shade300),
                 borderRadius: BorderRadius.circular(8),
               ),
-              child: const Text('⏳ Loading model...'),
+              child: Text(_loadProgress == null
+                  ? '⏳ Loading model...'
+                  : '⏳ Loading model... ${(_loadProgress! * 100).round()}%'),
             ),
 
           Expanded(
@@ -256,14 +407,15 @@ class _ChatScreenState extends State<ChatScreen> {
           ),
 
           if (_isThinking)
-            const Padding(
-              padding: EdgeInsets.only(bottom: 4),
-              child: _TypingIndicator(),
+            Padding(
+              padding: const EdgeInsets.only(bottom: 4),
+              child: _TypingIndicator(prefill: _prefillProgress),
             ),
 
           InputBar(
             onSend: _handleSend,
             downloadedModels: downloadedModels,
+            onModelSelected: _prefetchModel,
           ),
         ],
       ),
@@ -272,16 +424,20 @@ class _ChatScreenState extends State<ChatScreen> {
 }
 
 class _TypingIndicator extends StatelessWidget {
-  const _TypingIndicator();
+  /// Fraction of the prompt processed, or null once tokens are streaming.
+  final double? prefill;
+
+  const _TypingIndicator({this.prefill});
 
   @override
   Widget build(BuildContext context) {
+    final p = prefill;
     return Row(
-      children: const [
-        SizedBox(width: 12),
-        CircularProgressIndicator(strokeWidth: 2),
-        SizedBox(width: 8),
-        Text('Generating…'),
+      children: [
+        const SizedBox(width: 12),
+        CircularProgressIndicator(strokeWidth: 2, value: p),
+        const SizedBox(width: 8),
+        Text(p == null ? 'Generating…' : 'Reading prompt… ${(p * 100).round()}%'),
       ],
     );
   }
@@ -0,0 +1,138 @@
+// services/chat_search.dart
+import 'dart:async';
+import 'dart:math';
+import '../llm/llama_worker.dart';
+import '../models/chat_message.dart';
+import 'chat_storage.dart';
+
+/// Semantic search over saved chats. Every saved message is embedded by the
+/// loaded model and added to a native vector index next to the transcripts,
+/// so a query embeds only itself. Works while a chat screen has a model
+/// loaded ([attach]); messages saved before that are indexed on attach.
+class ChatSearch {
+  static LlamaWorker? _worker;
+  static final List<List<Object>> _pending = []; // [group, key, text]
+  static Future<void> _queue = Future.value();
+  static bool _flushing = false;
+  static const int _batch = 64;
+
+  static bool get available => _worker != null;
+
+  /// Index group of a session: a stable 63-bit FNV-1a hash of its id.
+  static int groupOf(String sessionId) {
+    var h = 0xcbf29ce484222325;
+    for (final c in sessionId.codeUnits) {
+      h ^= c;
+      h *= 0x100000001b3;
+    }
+    return h & 0x7fffffffffffffff;
+  }
+
+  /// Starts indexing with [worker]'s model. A new (or rebuilt, after a model
+  /// change) index is backfilled from every stored session.
+  static Future<void> attach(LlamaWorker worker) async {
+    _worker = worker;
+    final count = await worker.openIndex(await ChatStorage.indexPath());
+    if (count < 0) {
+      _worker = null;
+      return;
+    }
+    if (count == 0) {
+      for (final meta in await ChatStorage.listSessions()) {
+        final msgs = await ChatStorage.loadSession(meta.id);
+        for (var i = 0; i < msgs.length; i++) {
+          _pending.add([groupOf(meta.id), i, msgs[i].text]);
+        }
+      }
+    }
+    _flush();
+  }
+
+  static void detach(LlamaWorker worker) {
+    if (identical(_worker, worker)) _worker = null;
+  }
+
+  /// Called by [ChatStorage.saveMessage] with the message's position in
+  /// its session.
+  static void onMessageSaved(String sessionId, int index, ChatMessage m) {
+    _pending.add([groupOf(sessionId), index, m.text]);
+    _flush();
+  }
+
+  static void onSessionDeleted(String sessionId) {
+    final w = _worker;
+    final g = groupOf(sessionId);
+    _pending.removeWhere((e) => e[0] == g);
+    if (w != null) _run(() => w.unindexGroup(g));
+  }
+
+  /// Best matches for [query] across all sessions; empty when no model is
+  /// attached.
+  static Future<List<ChatSearchHit>> search(String query, {int k = 20}) async {
+    final w = _worker;
+    if (w == null || query.trim().isEmpty) return const [];
+    final hits = await w.search(query, k: k);
+    if (hits.isEmpty) return const [];
+
+    final sessions = {
+      for (final m in await ChatStorage.listSessions()) groupOf(m.id): m.id,
+    };
+    final transcripts = <String, List<ChatMessage>>{};
+    final out = <ChatSearchHit>[];
+    for (final h in hits) {
+      final id = sessions[h.group];
+      if (id == null) continue; // session deleted since
+      final msgs = transcripts[id] ??= await ChatStorage.loadSession(id);
+      if (h.key >= msgs.length) continue;
+      out.add(ChatSearchHit(
+        sessionId: id,
+        messageIndex: h.key,
+        text: msgs[h.key].text,
+        score: h.score,
+      ));
+    }
+    return out;
+  }
+
+  // Hands pending entries to the worker in order, [_batch] per message; the
+  // worker embeds them only while it has no stream to serve. Entries stay
+  // pending while no model is attached or after a failure.
+  static void _flush() {
+    final w = _worker;
+    if (w == null || _pending.isEmpty || _flushing) return;
+    _flushing = true;
+    final n = min(_pending.length, _batch);
+    final batch = _pending.sublist(0, n);
+    _pending.removeRange(0, n);
+    _run(() async {
+      var ok = false;
+      try {
+        ok = await w.indexTexts(batch);
+      } catch (_) {}
+      _flushing = false;
+      if (!ok) {
+        _pending.insertAll(0, batch);
+        return;
+      }
+      _flush();
+    });
+  }
+
+  static void _run(Future<void> Function() op) {
+    _queue = _queue.then((_) => op()).catchError((_) {});
+  }
+}
+
+class ChatSearchHit {
+  final String sessionId;
+  final int messageIndex;
+  final String text;
+  final double score;
+
+  ChatSearchHit({
+    required this.sessionId,
+    required this.messageIndex,
+    required this.text,
+    required this.score,
+  });
+}
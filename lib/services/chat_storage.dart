@@ -3,6 +3,7 @@ import 'dart:convert';
 import 'dart:io';
 import 'package:path_provider/path_provider.dart';
 import '../models/chat_message.dart';
+import 'chat_search.dart';
 
 class ChatStorage {
   static Future<String> _baseDir() async {
@@ -18,6 +19,24 @@ class ChatStorage {
     return File('$dir/$sessionId.json');
   }
 
+  /// Model state snapshot (KV cache) for a session, kept next to its
+  /// transcript. Written and validated by the native bridge.
+  static Future<String> statePathForSession(String sessionId) async {
+    final dir = await _baseDir();
+    return '$dir/$sessionId.kv';
+  }
+
+  /// Vector index of all saved messages (see [ChatSearch]).
+  static Future<String> indexPath() async {
+    final dir = await _baseDir();
+    return '$dir/messages.lbvi';
+  }
+
+  static Future<void> deleteState(String sessionId) async {
+    final f = File(await statePathForSession(sessionId));
+    if (await f.exists()) await f.delete();
+  }
+
   static Future<void> saveMessage(String sessionId, ChatMessage m) async {
     final f = await _fileForSession(sessionId);
     List<Map<String, dynamic>> list = [];
@@ -34,6 +53,7 @@ class ChatStorage {
       'ts': DateTime.now().toIso8601String(),
     });
     await f.writeAsString(jsonEncode(list));
+    ChatSearch.onMessageSaved(sessionId, list.length - 1, m);
   }
 
   static Future<List<ChatMessage>> loadSession(String sessionId) async {
@@ -102,6 +122,8 @@ class ChatStorage {
     if (await f.exists()) {
       await f.delete();
     }
+    await deleteState(sessionId);
+    ChatSearch.onSessionDeleted(sessionId);
   }
 }
 
@@ -2,6 +2,7 @@ import 'dart:io';
 import 'package:flutter/material.dart';
 import 'package:path_provider/path_provider.dart';
 
+import '../llm/load_params.dart';
 import '../models/model_metadata.dart';
 import '../services/file_naming.dart'; // toGgufFileName, legacyUnderscoreVariant
 
@@ -17,6 +18,8 @@ class ModelProvider with ChangeNotifier {
           'https://huggingface.co/unsloth/gemma-3-1b-it-GGUF/resolve/main/gemma-3-1b-it-UD-IQ1_M.gguf?download=true',
       hfUrl: 'https://huggingface.co/unsloth/gemma-3-1b-it-GGUF',
       isDownloaded: false,
+      // IQ1_M is for low-RAM phones: keep the KV cache small too.
+      loadParams: LoadParams(nCtx: 1024, nBatch: 256),
     ),
      ModelMetadata(
       id: 'TheBloke/TinyLlama-1.1B-Chat-v1.0-GGUF',
@@ -39,6 +42,14 @@ class ModelProvider with ChangeNotifier {
       hfUrl:
           'https://huggingface.co/microsoft/Phi-3-mini-4k-instruct-gguf/tree/main',
       isDownloaded: false,
+      // 3.8B with 32 full-attention layers: q8_0 KV halves cache memory.
+      loadParams: LoadParams(
+        nCtx: 2048,
+        typeK: KvCacheType.q8_0,
+        typeV: KvCacheType.q8_0,
+      ),
+      // Phi-3 extends the Llama 2 tokenizer, so TinyLlama can draft for it.
+      draftModelId: 'TheBloke/TinyLlama-1.1B-Chat-v1.0-GGUF',
     ),
   ];
 
@@ -5,10 +5,15 @@ class InputBar extends StatefulWidget {
   final Function(String, ModelMetadata) onSend;
   final List<ModelMetadata> downloadedModels;
 
+  /// Called when a model becomes the selection (including the initial one),
+  /// before anything is sent with it.
+  final void Function(ModelMetadata)? onModelSelected;
+
   const InputBar({
     super.key,
     required this.onSend,
     required this.downloadedModels,
+    this.onModelSelected,
   });
 
   @override
@@ -41,6 +46,7 @@ class _InputBarState extends State<InputBar> {
     super.initState();
     if (widget.downloadedModels.isNotEmpty) {
       _selectedModel = widget.downloadedModels.first;
+      widget.onModelSelected?.call(_selectedModel!);
     }
   }
 
@@ -50,6 +56,7 @@ class _InputBarState extends State<InputBar> {
     // If the list changed and current selection is no longer valid, reselect
     if (_selectedModel == null && widget.downloadedModels.isNotEmpty) {
       setState(() => _selectedModel = widget.downloadedModels.first);
+      widget.onModelSelected?.call(_selectedModel!);
     } else if (_selectedModel != null &&
         !widget.downloadedModels.contains(_selectedModel)) {
       setState(() {
@@ -57,6 +64,7 @@ class _InputBarState extends State<InputBar> {
             ? widget.downloadedModels.first
             : null;
       });
+      if (_selectedModel != null) widget.onModelSelected?.call(_selectedModel!);
     }
   }
 
@@ -92,6 +100,7 @@ class _InputBarState extends State<InputBar> {
               onChanged: hasModels
                   ? (value) {
                       setState(() => _selectedModel = value);
+                      if (value != null) widget.onModelSelected?.call(value);
                     }
                   : null,
               underline: const SizedBox.shrink(),